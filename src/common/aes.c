@@ -520,3 +520,63 @@ aes_set_iv(aes_cnt_cipher_t *cipher, const char *iv)
 
 #endif
 
+/** How much keystream do we generate at a time in aes_crypt_inplace_multi()?
+ * Enough for eight relay cell payloads, so that the AES implementation can
+ * keep its pipeline full across payload boundaries. */
+#define AES_KEYSTREAM_CHUNK 4096
+
+/** Helper: XOR <b>len</b> bytes of keystream from <b>ks</b> into
+ * <b>data</b>. */
+static INLINE void
+aes_xor_keystream(char *data, const uint8_t *ks, size_t len)
+{
+  while (len >= 8) {
+    uint64_t d, k;
+    memcpy(&d, data, 8);
+    memcpy(&k, ks, 8);
+    d ^= k;
+    memcpy(data, &d, 8);
+    data += 8;
+    ks += 8;
+    len -= 8;
+  }
+  while (len--)
+    *data++ ^= *ks++;
+}
+
+/** Encrypt the <b>n</b> buffers <b>bufs</b>[0] through <b>bufs</b>[n-1], each
+ * <b>len</b> bytes long, in place, with the same result as calling
+ * aes_crypt_inplace() on each of them in turn.
+ *
+ * Rather than making one short trip into the AES code per buffer, we
+ * generate the keystream for as many buffers as fit in AES_KEYSTREAM_CHUNK
+ * bytes at once, and XOR it in afterwards.  The large requests let the
+ * counter-mode implementation encrypt many blocks in parallel (8 at a time
+ * with AES-NI) instead of starting over on every odd-sized buffer.
+ */
+void
+aes_crypt_inplace_multi(aes_cnt_cipher_t *cipher, char **bufs, size_t len,
+                        int n)
+{
+  uint8_t ks[AES_KEYSTREAM_CHUNK];
+  int i = 0;
+
+  tor_assert(n >= 0);
+  if (len == 0 || len > AES_KEYSTREAM_CHUNK) {
+    for (i = 0; i < n; ++i)
+      aes_crypt_inplace(cipher, bufs[i], len);
+    return;
+  }
+
+  while (i < n) {
+    int j, batch = (int)(AES_KEYSTREAM_CHUNK / len);
+    if (batch > n - i)
+      batch = n - i;
+    memset(ks, 0, batch * len);
+    aes_crypt_inplace(cipher, (char*)ks, batch * len);
+    for (j = 0; j < batch; ++j)
+      aes_xor_keystream(bufs[i+j], ks + j*len, len);
+    i += batch;
+  }
+  memwipe(ks, 0, sizeof(ks));
+}
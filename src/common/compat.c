@@ -111,6 +111,9 @@
 #ifdef HAVE_SYS_FILE_H
 #include <sys/file.h>
 #endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #ifdef TOR_UNIT_TESTS
 #if !defined(HAVE_USLEEP) && defined(HAVE_SYS_SELECT_H)
 /* as fallback implementation for tor_sleep_msec */
@@ -1519,6 +1522,171 @@ tor_ersatz_socketpair(int family, int type, int protocol, tor_socket_t fd[2])
 }
 #endif
 
+/* ===== Alert sockets */
+
+#ifdef HAVE_EVENTFD
+/** Helper: alert_fn for an eventfd. */
+static int
+eventfd_alert(tor_socket_t fd)
+{
+  uint64_t u = 1;
+  ssize_t r = write(fd, (void*)&u, sizeof(u));
+  if (r < 0 && errno != EAGAIN)
+    return -1;
+  return 0;
+}
+
+/** Helper: drain_fn for an eventfd. */
+static int
+eventfd_drain(tor_socket_t fd)
+{
+  uint64_t u = 0;
+  ssize_t r = read(fd, (void*)&u, sizeof(u));
+  if (r < 0 && errno != EAGAIN)
+    return -1;
+  return 0;
+}
+#endif
+
+#if defined(HAVE_PIPE) && !defined(_WIN32)
+/** Helper: alert_fn for a pipe. */
+static int
+pipe_alert(tor_socket_t fd)
+{
+  ssize_t r = write(fd, "x", 1);
+  if (r < 0 && errno != EAGAIN)
+    return -1;
+  return 0;
+}
+
+/** Helper: drain_fn for a pipe. */
+static int
+pipe_drain(tor_socket_t fd)
+{
+  char buf[32];
+  ssize_t r;
+  while ((r = read(fd, buf, sizeof(buf))) > 0)
+    ;
+  if (r == 0 || errno != EAGAIN)
+    return -1;
+  return 0;
+}
+#endif
+
+/** Helper: alert_fn for a socketpair. */
+static int
+sock_alert(tor_socket_t fd)
+{
+  ssize_t r = send(fd, "x", 1, 0);
+  if (r < 0 && !ERRNO_IS_EAGAIN(tor_socket_errno(fd)))
+    return -1;
+  return 0;
+}
+
+/** Helper: drain_fn for a socketpair. */
+static int
+sock_drain(tor_socket_t fd)
+{
+  char buf[32];
+  ssize_t r;
+  while ((r = recv(fd, buf, sizeof(buf), 0)) > 0)
+    ;
+  if (r == 0 || !ERRNO_IS_EAGAIN(tor_socket_errno(fd)))
+    return -1;
+  return 0;
+}
+
+#if defined(HAVE_EVENTFD) || (defined(HAVE_PIPE) && !defined(_WIN32))
+/** Helper: make the non-socket descriptor <b>fd</b> nonblocking and
+ * close-on-exec.  Return 0 on success, -1 on failure. */
+static int
+alert_fd_prepare(int fd)
+{
+  if (set_socket_nonblocking(fd) < 0)
+    return -1;
+#ifdef FD_CLOEXEC
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+    return -1;
+#endif
+  return 0;
+}
+#endif
+
+/** Allocate a new set of alert sockets into <b>socks_out</b>, trying an
+ * eventfd, then a pipe, then a socketpair, and skipping any mechanism
+ * excluded by the ASOCKS_* bits in <b>flags</b>.  Both descriptors are
+ * nonblocking.  Return 0 on success, -1 on failure. */
+int
+alert_sockets_create(alert_sockets_t *socks_out, uint32_t flags)
+{
+  tor_socket_t socks[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+
+#ifdef HAVE_EVENTFD
+  if (!(flags & ASOCKS_NOEVENTFD)) {
+    socks[0] = eventfd(0, 0);
+    if (socks[0] >= 0) {
+      if (alert_fd_prepare(socks[0]) < 0) {
+        close(socks[0]);
+      } else {
+        socks_out->read_fd = socks_out->write_fd = socks[0];
+        socks_out->alert_fn = eventfd_alert;
+        socks_out->drain_fn = eventfd_drain;
+        return 0;
+      }
+    }
+  }
+#endif
+
+#if defined(HAVE_PIPE) && !defined(_WIN32)
+  if (!(flags & ASOCKS_NOPIPE) && pipe(socks) == 0) {
+    if (alert_fd_prepare(socks[0]) < 0 ||
+        alert_fd_prepare(socks[1]) < 0) {
+      close(socks[0]);
+      close(socks[1]);
+    } else {
+      socks_out->read_fd = socks[0];
+      socks_out->write_fd = socks[1];
+      socks_out->alert_fn = pipe_alert;
+      socks_out->drain_fn = pipe_drain;
+      return 0;
+    }
+  }
+#endif
+
+  if (!(flags & ASOCKS_NOSOCKETPAIR) &&
+      tor_socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == 0) {
+    if (set_socket_nonblocking(socks[0]) < 0 ||
+        set_socket_nonblocking(socks[1]) < 0) {
+      tor_close_socket(socks[0]);
+      tor_close_socket(socks[1]);
+      return -1;
+    }
+    socks_out->read_fd = socks[0];
+    socks_out->write_fd = socks[1];
+    socks_out->alert_fn = sock_alert;
+    socks_out->drain_fn = sock_drain;
+    return 0;
+  }
+
+  return -1;
+}
+
+/** Close the descriptors held in <b>socks</b>, but do not free it. */
+void
+alert_sockets_close(alert_sockets_t *socks)
+{
+  if (socks->alert_fn == sock_alert) {
+    /* socketpairs are counted by the socket accounting code. */
+    tor_close_socket(socks->read_fd);
+    tor_close_socket(socks->write_fd);
+  } else {
+    close(socks->read_fd);
+    if (socks->write_fd != socks->read_fd)
+      close(socks->write_fd);
+  }
+  socks->read_fd = socks->write_fd = TOR_INVALID_SOCKET;
+}
+
 /** Number of extra file descriptors to keep in reserve beyond those that we
  * tell Tor it's allowed to use. */
 #define ULIMIT_BUFFER 32 /* keep 32 extra fd's beyond ConnLimit_ */
@@ -3051,7 +3219,6 @@ tor_mutex_free(tor_mutex_t *m)
 
 /* Conditions. */
 #ifdef USE_PTHREADS
-#if 0
 /** Cross-platform condition implementation. */
 struct tor_cond_t {
   pthread_cond_t cond;
@@ -3099,7 +3266,6 @@ tor_cond_signal_all(tor_cond_t *cond)
 {
   pthread_cond_broadcast(&cond->cond);
 }
-#endif
 /** Set up common structures for use by threading. */
 void
 tor_threads_init(void)
@@ -3114,7 +3280,6 @@ tor_threads_init(void)
   }
 }
 #elif defined(USE_WIN32_THREADS)
-#if 0
 static DWORD cond_event_tls_index;
 struct tor_cond_t {
   CRITICAL_SECTION mutex;
@@ -3197,13 +3362,10 @@ tor_cond_signal_all(tor_cond_t *cond)
   smartlist_clear(cond->events);
   LeaveCriticalSection(&cond->mutex);
 }
-#endif
 void
 tor_threads_init(void)
 {
-#if 0
   cond_event_tls_index = TlsAlloc();
-#endif
   set_main_thread();
 }
 #endif
@@ -688,14 +688,40 @@ void tor_threads_init(void);
 void set_main_thread(void);
 int in_main_thread(void);
 
-#if 0
 typedef struct tor_cond_t tor_cond_t;
 tor_cond_t *tor_cond_new(void);
 void tor_cond_free(tor_cond_t *cond);
 int tor_cond_wait(tor_cond_t *cond, tor_mutex_t *mutex);
 void tor_cond_signal_one(tor_cond_t *cond);
 void tor_cond_signal_all(tor_cond_t *cond);
-#endif
+
+/** A pair of descriptors that one thread can use to wake up another thread's
+ * event loop.  Any thread may call <b>alert_fn</b> on <b>write_fd</b>; the
+ * woken thread watches <b>read_fd</b> for readability and then calls
+ * <b>drain_fn</b> on it.  Depending on the platform, this is an eventfd, a
+ * pipe, or a socketpair. */
+typedef struct alert_sockets_s {
+  /** The descriptor that becomes readable when we've been alerted. */
+  tor_socket_t read_fd;
+  /** The descriptor to write to in order to send an alert. */
+  tor_socket_t write_fd;
+  /** Function to send an alert on <b>write_fd</b>. Returns 0 on success,
+   * -1 on failure. */
+  int (*alert_fn)(tor_socket_t write_fd);
+  /** Function to clear all pending alerts from <b>read_fd</b>. Returns 0
+   * on success, -1 on failure. */
+  int (*drain_fn)(tor_socket_t read_fd);
+} alert_sockets_t;
+
+/** Flag for alert_sockets_create(): never use an eventfd. */
+#define ASOCKS_NOEVENTFD    (1u<<0)
+/** Flag for alert_sockets_create(): never use a pipe. */
+#define ASOCKS_NOPIPE       (1u<<1)
+/** Flag for alert_sockets_create(): never use a socketpair. */
+#define ASOCKS_NOSOCKETPAIR (1u<<2)
+
+int alert_sockets_create(alert_sockets_t *socks_out, uint32_t flags);
+void alert_sockets_close(alert_sockets_t *socks);
 
 /** Macros for MIN/MAX.  Never use these when the arguments could have
  * side-effects.
@@ -0,0 +1,342 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file compat_uring.c
+ * \brief A small wrapper around the Linux io_uring interface, so that we
+ * can hand the kernel a batch of socket operations with a single system
+ * call.
+ *
+ * We only need a couple of operations, so we talk to the kernel directly
+ * rather than depending on liburing.  On any other platform, or if the
+ * kernel won't give us a ring, tor_uring_new() returns NULL and callers
+ * fall back to doing their own system calls.
+ **/
+
+#include "orconfig.h"
+#include "compat_uring.h"
+#include "util.h"
+#include "torlog.h"
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+  defined(__ATOMIC_ACQUIRE)
+#define TOR_URING_WORKS
+#endif
+#endif
+
+#ifdef TOR_URING_WORKS
+
+struct tor_uring_t {
+  /** The file descriptor for the ring. */
+  int fd;
+  /** How many operations can we queue at once? */
+  unsigned n_entries;
+
+  /** Mapping of the submission queue ring. */
+  void *sq_map;
+  size_t sq_map_len;
+  /** Pointers into the submission queue ring: the kernel's head, our tail,
+   * the index mask, and the array of indices into <b>sqes</b>. */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  /** The submission queue entries themselves. */
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  /** The tail of the submission queue, counting the entries that we have
+   * prepared but not yet told the kernel about. */
+  unsigned sq_local_tail;
+  /** How many prepared entries has the kernel not yet consumed? */
+  unsigned n_unsubmitted;
+
+  /** Mapping of the completion queue ring. */
+  void *cq_map;
+  size_t cq_map_len;
+  /** Pointers into the completion queue ring: our head, the kernel's tail,
+   * and the index mask. */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  /** The completion queue entries. */
+  struct io_uring_cqe *cqes;
+};
+
+/** Return a new ring that can hold <b>n_entries</b> operations at once, or
+ * NULL if we can't get one from the kernel. */
+tor_uring_t *
+tor_uring_new(unsigned n_entries)
+{
+  struct io_uring_params p;
+  tor_uring_t *ring;
+  char *sq, *cq;
+  int fd;
+
+  memset(&p, 0, sizeof(p));
+  fd = (int) syscall(__NR_io_uring_setup, n_entries, &p);
+  if (fd < 0) {
+    log_info(LD_NET, "Unable to set up an io_uring: %s", strerror(errno));
+    return NULL;
+  }
+
+  ring = tor_malloc_zero(sizeof(tor_uring_t));
+  ring->fd = fd;
+  ring->n_entries = p.sq_entries;
+  ring->sq_map = ring->cq_map = ring->sqes = MAP_FAILED;
+
+  ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  if (ring->sq_map == MAP_FAILED || ring->sqes == MAP_FAILED ||
+      ring->cq_map == MAP_FAILED) {
+    log_warn(LD_NET, "Unable to map an io_uring: %s", strerror(errno));
+    tor_uring_free(ring);
+    return NULL;
+  }
+
+  sq = ring->sq_map;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring->sq_local_tail = *ring->sq_tail;
+
+  cq = ring->cq_map;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return ring;
+}
+
+/** Release all storage and kernel resources held by <b>ring</b>.  Closing
+ * the ring makes the kernel cancel any operations that it still holds, but
+ * it may finish cancelling them after we return: don't free or reuse memory
+ * that such operations refer to. */
+void
+tor_uring_free(tor_uring_t *ring)
+{
+  if (!ring)
+    return;
+  if (ring->sq_map != MAP_FAILED)
+    munmap(ring->sq_map, ring->sq_map_len);
+  if (ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_map != MAP_FAILED)
+    munmap(ring->cq_map, ring->cq_map_len);
+  close(ring->fd);
+  tor_free(ring);
+}
+
+/** Return the number of operations that <b>ring</b> can hold at once. */
+unsigned
+tor_uring_get_n_entries(const tor_uring_t *ring)
+{
+  return ring->n_entries;
+}
+
+/** Queue a <b>opcode</b> operation of <b>msg</b> with <b>flags</b> on the
+ * socket <b>s</b>, carrying <b>user_data</b>.  Return 0 on success, or -1 if
+ * the ring is full. */
+static int
+tor_uring_prep_msg(tor_uring_t *ring, uint8_t opcode, tor_socket_t s,
+                   const struct msghdr *msg, int flags, uint64_t user_data)
+{
+  const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+
+  if (ring->sq_local_tail - head >= ring->n_entries)
+    return -1;
+
+  idx = ring->sq_local_tail & *ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = s;
+  sqe->addr = (uint64_t)(uintptr_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = (uint32_t)flags;
+  sqe->user_data = user_data;
+  ring->sq_array[idx] = idx;
+  ++ring->sq_local_tail;
+  ++ring->n_unsubmitted;
+  return 0;
+}
+
+/** Queue a sendmsg() of <b>msg</b> with <b>flags</b> on the socket
+ * <b>s</b>.  The kernel won't look at <b>msg</b>, or at the data it points
+ * to, until tor_uring_submit_and_wait() is called; don't change or free
+ * either of them until the operation has completed.  Its completion will
+ * carry <b>user_data</b>.  Return 0 on success, or -1 if the ring is full.
+ */
+int
+tor_uring_prep_sendmsg(tor_uring_t *ring, tor_socket_t s,
+                       const struct msghdr *msg, int flags,
+                       uint64_t user_data)
+{
+  return tor_uring_prep_msg(ring, IORING_OP_SENDMSG, s, msg, flags,
+                            user_data);
+}
+
+/** As tor_uring_prep_sendmsg(), but queue a recvmsg() into the buffers that
+ * <b>msg</b> describes.  Don't touch those buffers until the operation has
+ * completed. */
+int
+tor_uring_prep_recvmsg(tor_uring_t *ring, tor_socket_t s,
+                       struct msghdr *msg, int flags,
+                       uint64_t user_data)
+{
+  return tor_uring_prep_msg(ring, IORING_OP_RECVMSG, s, msg, flags,
+                            user_data);
+}
+
+/** Hand every operation that we have queued on <b>ring</b> to the kernel,
+ * and wait until at least <b>n_wait</b> completions are ready.  Return 0 on
+ * success, and -1 on failure.  An interrupted wait counts as success: check
+ * for completions, and call this again if you need more. */
+int
+tor_uring_submit_and_wait(tor_uring_t *ring, unsigned n_wait)
+{
+  int r;
+
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  r = (int) syscall(__NR_io_uring_enter, ring->fd, ring->n_unsubmitted,
+                    n_wait, n_wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (r < 0) {
+    if (errno == EINTR)
+      return 0;
+    log_warn(LD_NET, "io_uring_enter() failed: %s", strerror(errno));
+    return -1;
+  }
+  ring->n_unsubmitted -= (unsigned)r;
+  return 0;
+}
+
+/** Take back every operation that we've queued on <b>ring</b> but that the
+ * kernel hasn't taken yet, so that it never will; return how many there
+ * were.  The kernel takes operations in the order that we queued them, so
+ * these are the most recently queued ones.  Operations that the kernel has
+ * already taken will still complete. */
+unsigned
+tor_uring_cancel_unsubmitted(tor_uring_t *ring)
+{
+  const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  const unsigned n = ring->sq_local_tail - head;
+
+  ring->sq_local_tail = head;
+  ring->n_unsubmitted = 0;
+  __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+/** If an operation on <b>ring</b> has completed, take it off the ring, set
+ * *<b>user_data_out</b> to the value we queued it with and
+ * *<b>result_out</b> to its result, and return 1.  The result is what the
+ * system call would have returned, except that errors are reported as a
+ * negative errno value.  Return 0 if there is no completion ready. */
+int
+tor_uring_get_completion(tor_uring_t *ring, uint64_t *user_data_out,
+                         int *result_out)
+{
+  const unsigned head = *ring->cq_head;
+  const struct io_uring_cqe *cqe;
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+  cqe = &ring->cqes[head & *ring->cq_mask];
+  *user_data_out = cqe->user_data;
+  *result_out = cqe->res;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+#else
+
+tor_uring_t *
+tor_uring_new(unsigned n_entries)
+{
+  (void) n_entries;
+  return NULL;
+}
+
+void
+tor_uring_free(tor_uring_t *ring)
+{
+  tor_assert(!ring);
+}
+
+unsigned
+tor_uring_get_n_entries(const tor_uring_t *ring)
+{
+  (void) ring;
+  tor_assert(0);
+  return 0;
+}
+
+int
+tor_uring_prep_sendmsg(tor_uring_t *ring, tor_socket_t s,
+                       const struct msghdr *msg, int flags,
+                       uint64_t user_data)
+{
+  (void) ring;
+  (void) s;
+  (void) msg;
+  (void) flags;
+  (void) user_data;
+  tor_assert(0);
+  return -1;
+}
+
+int
+tor_uring_prep_recvmsg(tor_uring_t *ring, tor_socket_t s,
+                       struct msghdr *msg, int flags,
+                       uint64_t user_data)
+{
+  (void) ring;
+  (void) s;
+  (void) msg;
+  (void) flags;
+  (void) user_data;
+  tor_assert(0);
+  return -1;
+}
+
+int
+tor_uring_submit_and_wait(tor_uring_t *ring, unsigned n_wait)
+{
+  (void) ring;
+  (void) n_wait;
+  tor_assert(0);
+  return -1;
+}
+
+unsigned
+tor_uring_cancel_unsubmitted(tor_uring_t *ring)
+{
+  (void) ring;
+  tor_assert(0);
+  return 0;
+}
+
+int
+tor_uring_get_completion(tor_uring_t *ring, uint64_t *user_data_out,
+                         int *result_out)
+{
+  (void) ring;
+  (void) user_data_out;
+  (void) result_out;
+  tor_assert(0);
+  return 0;
+}
+
+#endif
+
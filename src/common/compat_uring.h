@@ -0,0 +1,43 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file compat_uring.h
+ * \brief Header for compat_uring.c.
+ **/
+
+#ifndef TOR_COMPAT_URING_H
+#define TOR_COMPAT_URING_H
+
+#include "orconfig.h"
+#include "torint.h"
+#include "compat.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_UIO_H)
+/** Defined if this platform might let us queue socket operations on an
+ * io_uring.  Whether the running kernel allows it is another matter: see
+ * tor_uring_new(). */
+#define USE_IO_URING
+#endif
+
+struct msghdr;
+
+/** A queue of socket operations that we hand to the kernel in batches. */
+typedef struct tor_uring_t tor_uring_t;
+
+tor_uring_t *tor_uring_new(unsigned n_entries);
+void tor_uring_free(tor_uring_t *ring);
+unsigned tor_uring_get_n_entries(const tor_uring_t *ring);
+int tor_uring_prep_sendmsg(tor_uring_t *ring, tor_socket_t s,
+                           const struct msghdr *msg, int flags,
+                           uint64_t user_data);
+int tor_uring_prep_recvmsg(tor_uring_t *ring, tor_socket_t s,
+                           struct msghdr *msg, int flags,
+                           uint64_t user_data);
+int tor_uring_submit_and_wait(tor_uring_t *ring, unsigned n_wait);
+unsigned tor_uring_cancel_unsubmitted(tor_uring_t *ring);
+int tor_uring_get_completion(tor_uring_t *ring, uint64_t *user_data_out,
+                             int *result_out);
+
+#endif
+
@@ -615,7 +615,7 @@ bitarray_clear(bitarray_t *b, int bit)
 /** Return true iff <b>bit</b>th bit in <b>b</b> is nonzero.  NOTE: does
  * not necessarily return 1 on true. */
 static INLINE unsigned int
-bitarray_is_set(bitarray_t *b, int bit)
+bitarray_is_set(const bitarray_t *b, int bit)
 {
   return b[bit >> BITARRAY_SHIFT] & (1u << (bit & BITARRAY_MASK));
 }
@@ -53,6 +53,7 @@
 #include "crypto.h"
 #include "../common/torlog.h"
 #include "aes.h"
+#include "crypto_sha1_multi.h"
 #include "../common/util.h"
 #include "container.h"
 #include "compat.h"
@@ -1454,6 +1455,24 @@ crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *buf, size_t len)
   return 0;
 }
 
+/** Encrypt the <b>n</b> buffers in <b>bufs</b>, each <b>len</b> bytes long,
+ * in place and in order, using the cipher in <b>env</b>.  This gives the
+ * same result as calling crypto_cipher_crypt_inplace() on each buffer, but
+ * generates the keystream for several buffers at a time.  On success, return
+ * 0.  On failure, return -1.
+ */
+int
+crypto_cipher_crypt_inplace_multi(crypto_cipher_t *env, char **bufs,
+                                  size_t len, int n)
+{
+  tor_assert(env);
+  tor_assert(bufs || n == 0);
+  tor_assert(n >= 0);
+  tor_assert(len < SIZE_T_CEILING);
+  aes_crypt_inplace_multi(env->cipher, bufs, len, n);
+  return 0;
+}
+
 /** Encrypt <b>fromlen</b> bytes (at least 1) from <b>from</b> with the key in
  * <b>key</b> to the buffer in <b>to</b> of length
  * <b>tolen</b>. <b>tolen</b> must be at least <b>fromlen</b> plus
@@ -1717,6 +1736,225 @@ crypto_digest_assign(crypto_digest_t *into,
   memcpy(into,from,sizeof(crypto_digest_t));
 }
 
+/** How many bytes at a time do the combined cipher-and-digest functions
+ * crypt and hash?  Small enough that each piece is still in L1 cache when
+ * the second operation reaches it. */
+#define CRYPT_DIGEST_STRIDE 128
+
+/** Helper: crypt <b>len</b> bytes of <b>buf</b> in place with <b>env</b>,
+ * adding the plaintext to <b>digest</b> as we go.  If <b>encrypting</b>,
+ * <b>buf</b> holds plaintext now, so hash each piece before crypting it;
+ * otherwise hash it after. */
+static void
+crypt_and_digest_inplace(crypto_cipher_t *env, crypto_digest_t *digest,
+                         char *buf, size_t len, int encrypting)
+{
+  while (len) {
+    size_t n = len < CRYPT_DIGEST_STRIDE ? len : CRYPT_DIGEST_STRIDE;
+    if (encrypting)
+      crypto_digest_add_bytes(digest, buf, n);
+    aes_crypt_inplace(env->cipher, buf, n);
+    if (!encrypting)
+      crypto_digest_add_bytes(digest, buf, n);
+    buf += n;
+    len -= n;
+  }
+}
+
+/** Crypt <b>len</b> bytes of <b>buf</b> in place using the cipher in
+ * <b>env</b>, and add the plaintext to <b>digest</b> in the same pass over
+ * the data.  If <b>encrypting</b> is true, <b>buf</b> holds plaintext on
+ * input; otherwise it holds ciphertext.  On success, return 0.  On failure,
+ * return -1.
+ */
+int
+crypto_cipher_crypt_digest_inplace(crypto_cipher_t *env,
+                                   crypto_digest_t *digest,
+                                   char *buf, size_t len, int encrypting)
+{
+  tor_assert(env);
+  tor_assert(digest);
+  tor_assert(buf);
+  tor_assert(len < SIZE_T_CEILING);
+  crypt_and_digest_inplace(env, digest, buf, len, encrypting);
+  return 0;
+}
+
+/** Decrypt <b>len</b> bytes of <b>buf</b> in place using the cipher in
+ * <b>env</b>.  In the same pass, compute the digest that <b>digest</b> would
+ * have after adding the <b>prefix_len</b> bytes at <b>prefix</b> and then
+ * the decrypted bytes.  If the first <b>expected_len</b> bytes of that
+ * digest match <b>expected</b>, move <b>digest</b> to that state and return
+ * 1.  Otherwise leave <b>digest</b> unchanged and return 0.
+ *
+ * The candidate state lives on the stack, so a failed check costs no
+ * allocation and nothing needs to be restored afterwards.
+ */
+int
+crypto_cipher_decrypt_digest_check(crypto_cipher_t *env,
+                                   crypto_digest_t *digest,
+                                   const char *prefix, size_t prefix_len,
+                                   char *buf, size_t len,
+                                   const char *expected, size_t expected_len)
+{
+  crypto_digest_t candidate;
+  char computed[DIGEST256_LEN];
+  int matched;
+  tor_assert(env);
+  tor_assert(digest);
+  tor_assert(buf);
+  tor_assert(expected);
+  tor_assert(len < SIZE_T_CEILING);
+  tor_assert(expected_len <= DIGEST256_LEN);
+
+  memcpy(&candidate, digest, sizeof(crypto_digest_t));
+  if (prefix_len)
+    crypto_digest_add_bytes(&candidate, prefix, prefix_len);
+  crypt_and_digest_inplace(env, &candidate, buf, len, 0);
+  crypto_digest_get_digest(&candidate, computed, expected_len);
+
+  matched = tor_memeq(computed, expected, expected_len);
+  if (matched)
+    memcpy(digest, &candidate, sizeof(crypto_digest_t));
+
+  memwipe(&candidate, 0, sizeof(candidate));
+  memwipe(computed, 0, sizeof(computed));
+  return matched;
+}
+
+/** Copy the state of the OpenSSL SHA1 computation <b>ctx</b> into
+ * <b>st</b>. */
+static void
+sha1_ctx_to_multi_state(sha1_multi_state_t *st, const SHA_CTX *ctx)
+{
+  st->h[0] = ctx->h0;
+  st->h[1] = ctx->h1;
+  st->h[2] = ctx->h2;
+  st->h[3] = ctx->h3;
+  st->h[4] = ctx->h4;
+  /* OpenSSL counts bits; we count bytes. */
+  st->n_bytes = ((((uint64_t)ctx->Nh) << 32) | ctx->Nl) >> 3;
+  /* OpenSSL keeps the partial block as bytes, in order. */
+  st->buf_len = ctx->num;
+  memcpy(st->buf, ctx->data, ctx->num);
+}
+
+/** Copy the state of the SHA1 computation <b>st</b> back into the OpenSSL
+ * state <b>ctx</b>. */
+static void
+sha1_multi_state_to_ctx(SHA_CTX *ctx, const sha1_multi_state_t *st)
+{
+  const uint64_t n_bits = st->n_bytes << 3;
+  ctx->h0 = st->h[0];
+  ctx->h1 = st->h[1];
+  ctx->h2 = st->h[2];
+  ctx->h3 = st->h[3];
+  ctx->h4 = st->h[4];
+  ctx->Nl = (SHA_LONG)(n_bits & 0xffffffff);
+  ctx->Nh = (SHA_LONG)(n_bits >> 32);
+  ctx->num = (unsigned int)st->buf_len;
+  memcpy(ctx->data, st->buf, st->buf_len);
+}
+
+/** Helper for crypto_digest_add_bytes_multi(): add the <b>len</b> bytes at
+ * <b>data</b>[i] to the SHA1 digest <b>digests</b>[i], for every i <
+ * <b>n</b>, updating them side by side. */
+static void
+crypto_digest_add_bytes_sha1_lanes(crypto_digest_t **digests,
+                                   const uint8_t **data, size_t len, int n)
+{
+  sha1_multi_state_t states[SHA1_MULTI_MAX_LANES];
+  sha1_multi_state_t *state_ptrs[SHA1_MULTI_MAX_LANES];
+  int i;
+
+  tor_assert(n <= SHA1_MULTI_MAX_LANES);
+  for (i = 0; i < n; ++i) {
+    sha1_ctx_to_multi_state(&states[i], &digests[i]->d.sha1);
+    state_ptrs[i] = &states[i];
+  }
+  sha1_multi_update(state_ptrs, data, len, n);
+  for (i = 0; i < n; ++i)
+    sha1_multi_state_to_ctx(&digests[i]->d.sha1, &states[i]);
+  memwipe(states, 0, sizeof(states));
+}
+
+/** Add the <b>len</b> bytes at <b>data</b>[i] to <b>digests</b>[i], for every
+ * i < <b>n</b>.  This has the same effect as calling crypto_digest_add_bytes()
+ * on each, but where the CPU allows it, several SHA-1 digests are updated
+ * side by side.  Digests keep OpenSSL's state between calls; we only move it
+ * into our own layout for the length of the batch.  The digests must all be
+ * different objects.
+ */
+void
+crypto_digest_add_bytes_multi(crypto_digest_t **digests, const char **data,
+                              size_t len, int n)
+{
+  crypto_digest_t *sha1_digests[SHA1_MULTI_MAX_LANES];
+  const uint8_t *ptrs[SHA1_MULTI_MAX_LANES];
+  const int n_lanes = sha1_multi_get_n_lanes();
+  int i, n_sha1 = 0;
+
+  tor_assert(digests || n == 0);
+  tor_assert(data || n == 0);
+  for (i = 0; i < n; ++i) {
+    tor_assert(digests[i]);
+    tor_assert(data[i]);
+    if (n_lanes <= 1 || digests[i]->algorithm != DIGEST_SHA1) {
+      crypto_digest_add_bytes(digests[i], data[i], len);
+      continue;
+    }
+    sha1_digests[n_sha1] = digests[i];
+    ptrs[n_sha1] = (const uint8_t *)data[i];
+    if (++n_sha1 == SHA1_MULTI_MAX_LANES) {
+      crypto_digest_add_bytes_sha1_lanes(sha1_digests, ptrs, len, n_sha1);
+      n_sha1 = 0;
+    }
+  }
+  if (n_sha1 == 1)
+    crypto_digest_add_bytes(sha1_digests[0], (const char *)ptrs[0], len);
+  else if (n_sha1)
+    crypto_digest_add_bytes_sha1_lanes(sha1_digests, ptrs, len, n_sha1);
+}
+
+/** For every i < <b>n</b>, compute the digest that <b>digests</b>[i] would
+ * have after adding the <b>len</b> bytes at <b>data</b>[i].  If its first
+ * <b>expected_len</b> bytes match <b>expected</b>[i], move
+ * <b>digests</b>[i] to that state and set <b>matched_out</b>[i] to 1.
+ * Otherwise leave <b>digests</b>[i] unchanged and set <b>matched_out</b>[i]
+ * to 0.  The digests must all be different objects.
+ */
+void
+crypto_digest_check_multi(crypto_digest_t **digests, const char **data,
+                          size_t len, const char **expected,
+                          size_t expected_len, int *matched_out, int n)
+{
+  crypto_digest_t candidates[SHA1_MULTI_MAX_LANES];
+  crypto_digest_t *candidate_ptrs[SHA1_MULTI_MAX_LANES];
+  char computed[DIGEST256_LEN];
+  int i, j, batch;
+
+  tor_assert(expected_len <= DIGEST256_LEN);
+  tor_assert(matched_out || n == 0);
+
+  for (i = 0; i < n; i += batch) {
+    batch = MIN(n - i, SHA1_MULTI_MAX_LANES);
+    for (j = 0; j < batch; ++j) {
+      memcpy(&candidates[j], digests[i+j], sizeof(crypto_digest_t));
+      candidate_ptrs[j] = &candidates[j];
+    }
+    crypto_digest_add_bytes_multi(candidate_ptrs, data+i, len, batch);
+    for (j = 0; j < batch; ++j) {
+      crypto_digest_get_digest(&candidates[j], computed, expected_len);
+      matched_out[i+j] = tor_memeq(computed, expected[i+j], expected_len);
+      if (matched_out[i+j])
+        memcpy(digests[i+j], &candidates[j], sizeof(crypto_digest_t));
+    }
+  }
+
+  memwipe(candidates, 0, sizeof(candidates));
+  memwipe(computed, 0, sizeof(computed));
+}
+
 /** Given a list of strings in <b>lst</b>, set the <b>len_out</b>-byte digest
  * at <b>digest_out</b> to the hash of the concatenation of those strings,
  * plus the optional string <b>append</b>, computed with the algorithm
@@ -193,6 +193,8 @@ int crypto_cipher_encrypt(crypto_cipher_t *env, char *to,
 int crypto_cipher_decrypt(crypto_cipher_t *env, char *to,
                           const char *from, size_t fromlen);
 int crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *d, size_t len);
+int crypto_cipher_crypt_inplace_multi(crypto_cipher_t *env, char **bufs,
+                                      size_t len, int n);
 
 int crypto_cipher_encrypt_with_iv(const char *key,
                                   char *to, size_t tolen,
@@ -222,6 +224,22 @@ void crypto_digest_get_digest(crypto_digest_t *digest,
 crypto_digest_t *crypto_digest_dup(const crypto_digest_t *digest);
 void crypto_digest_assign(crypto_digest_t *into,
                           const crypto_digest_t *from);
+void crypto_digest_add_bytes_multi(crypto_digest_t **digests,
+                                   const char **data, size_t len, int n);
+void crypto_digest_check_multi(crypto_digest_t **digests, const char **data,
+                               size_t len, const char **expected,
+                               size_t expected_len, int *matched_out, int n);
+
+/* Symmetric crypto and a running digest in a single pass. */
+int crypto_cipher_crypt_digest_inplace(crypto_cipher_t *env,
+                                       crypto_digest_t *digest,
+                                       char *buf, size_t len, int encrypting);
+int crypto_cipher_decrypt_digest_check(crypto_cipher_t *env,
+                                       crypto_digest_t *digest,
+                                       const char *prefix, size_t prefix_len,
+                                       char *buf, size_t len,
+                                       const char *expected,
+                                       size_t expected_len);
 void crypto_hmac_sha256(char *hmac_out,
                         const char *key, size_t key_len,
                         const char *msg, size_t msg_len);
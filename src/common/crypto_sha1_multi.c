@@ -0,0 +1,362 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file crypto_sha1_multi.c
+ * \brief Update several independent SHA-1 states at once.
+ *
+ * A single SHA-1 computation is a long chain of dependent operations, but
+ * the running digests of different circuits have nothing to do with one
+ * another.  So when we have a payload to add to each of several digests,
+ * we can run them in the lanes of a SIMD register: four lanes with SSE2, or
+ * eight with AVX2.
+ *
+ * OpenSSL doesn't let us at the chaining values inside a SHA_CTX, so the
+ * digests we update this way keep their state in a sha1_multi_state_t of
+ * our own, and we do the padding and the partial blocks ourselves too.
+ **/
+
+#include "orconfig.h"
+#include <string.h>
+#include "crypto.h"
+#include "crypto_sha1_multi.h"
+#include "util.h"
+#include "torlog.h"
+
+/* We need GCC-style vector types, and a way to ask the CPU what it
+ * supports. */
+#if (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))) && \
+  ((defined(__clang__) &&                                               \
+    (__clang_major__ > 3 ||                                             \
+     (__clang_major__ == 3 && __clang_minor__ >= 8))) ||                \
+   (!defined(__clang__) && defined(__GNUC__) &&                         \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define SHA1_MULTI_SIMD
+#include <cpuid.h>
+#endif
+
+/** How many lanes does sha1_multi_update() use?  -1 if we haven't decided
+ * yet. */
+static int sha1_multi_n_lanes = -1;
+
+/** Return the largest number of lanes this CPU can run. */
+static int
+sha1_multi_max_n_lanes(void)
+{
+#ifdef SHA1_MULTI_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return 8;
+  return 4;
+#else
+  return 1;
+#endif
+}
+
+/** Return the number of lanes we should use by default on this CPU. */
+static int
+sha1_multi_default_n_lanes(void)
+{
+#ifdef SHA1_MULTI_SIMD
+  unsigned int eax, ebx = 0, ecx, edx;
+  if (__get_cpuid_max(0, NULL) >= 7) {
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  }
+  if (ebx & (1u<<29)) {
+    /* This CPU has the SHA extensions, and OpenSSL's one-at-a-time code
+     * that uses them beats anything we can do in parallel. */
+    return 1;
+  }
+  /* With only four lanes, OpenSSL's vectorized one-at-a-time code is
+   * about as fast, so we only go parallel with AVX2. */
+  if (sha1_multi_max_n_lanes() == 8)
+    return 8;
+#endif
+  return 1;
+}
+
+/** Return the number of SHA-1 states that sha1_multi_update() processes side
+ * by side.  1 means that it just updates them one at a time, in which case
+ * crypto_digest_new() leaves SHA-1 to OpenSSL. */
+int
+sha1_multi_get_n_lanes(void)
+{
+  if (sha1_multi_n_lanes < 0)
+    sha1_multi_n_lanes = sha1_multi_default_n_lanes();
+  return sha1_multi_n_lanes;
+}
+
+/** Make sha1_multi_update() use <b>n_lanes</b> lanes, or fewer if this CPU
+ * can't run that many.  If <b>n_lanes</b> is negative, go back to the
+ * default for this CPU.  Used for testing and benchmarking. */
+void
+sha1_multi_set_n_lanes(int n_lanes)
+{
+  int max = sha1_multi_max_n_lanes();
+  if (n_lanes < 0)
+    sha1_multi_n_lanes = sha1_multi_default_n_lanes();
+  else if (n_lanes >= 8 && max >= 8)
+    sha1_multi_n_lanes = 8;
+  else if (n_lanes >= 4 && max >= 4)
+    sha1_multi_n_lanes = 4;
+  else
+    sha1_multi_n_lanes = 1;
+}
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/** Helper: load a big-endian 32-bit word from <b>p</b>. */
+static INLINE uint32_t
+load_be32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/** One round of SHA-1, number <b>t</b>, with round function <b>f</b> and
+ * constant <b>k</b>, on the vectors a..e and the message schedule w. */
+#define SHA1_MULTI_ROUND(t, f, k) STMT_BEGIN                            \
+    if ((t) >= 16)                                                      \
+      w[(t)&15] = ROL32(w[((t)-3)&15] ^ w[((t)-8)&15] ^                 \
+                        w[((t)-14)&15] ^ w[(t)&15], 1);                 \
+    tmp = ROL32(a, 5) + (f) + e + (k) + w[(t)&15];                      \
+    e = d; d = c; c = ROL32(b, 30); b = a; a = tmp;                     \
+  STMT_END
+
+/** Define a function <b>name</b> that runs the SHA-1 compression function
+ * on <b>n_blocks</b> consecutive 64-byte blocks for each of <b>N_LANES</b>
+ * states at once, using the vector type <b>vec_t</b>.  <b>state</b>[i][j]
+ * is word i of lane j's state; <b>blocks</b>[j] is lane j's input. */
+#define SHA1_MULTI_COMPRESS_FN(name, vec_t, N_LANES, ATTR)              \
+  ATTR static void                                                      \
+  name(uint32_t state[5][N_LANES], const uint8_t **blocks,              \
+       size_t n_blocks)                                                 \
+  {                                                                     \
+    vec_t h[5], w[16], a, b, c, d, e, tmp;                              \
+    uint32_t words[N_LANES];                                            \
+    size_t blk;                                                         \
+    int i, t;                                                           \
+    for (i = 0; i < 5; ++i)                                             \
+      memcpy(&h[i], state[i], sizeof(vec_t));                           \
+    for (blk = 0; blk < n_blocks; ++blk) {                              \
+      for (t = 0; t < 16; ++t) {                                        \
+        for (i = 0; i < N_LANES; ++i)                                   \
+          words[i] = load_be32(blocks[i] + blk*64 + t*4);               \
+        memcpy(&w[t], words, sizeof(vec_t));                            \
+      }                                                                 \
+      a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];                 \
+      for (t = 0; t < 20; ++t) {                                        \
+        SHA1_MULTI_ROUND(t, (b & c) | (~b & d), 0x5a827999);            \
+      }                                                                 \
+      for ( ; t < 40; ++t) {                                            \
+        SHA1_MULTI_ROUND(t, b ^ c ^ d, 0x6ed9eba1);                     \
+      }                                                                 \
+      for ( ; t < 60; ++t) {                                            \
+        SHA1_MULTI_ROUND(t, (b & c) | (b & d) | (c & d), 0x8f1bbcdc);   \
+      }                                                                 \
+      for ( ; t < 80; ++t) {                                            \
+        SHA1_MULTI_ROUND(t, b ^ c ^ d, 0xca62c1d6);                     \
+      }                                                                 \
+      h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;            \
+    }                                                                   \
+    for (i = 0; i < 5; ++i)                                             \
+      memcpy(state[i], &h[i], sizeof(vec_t));                           \
+  }
+
+SHA1_MULTI_COMPRESS_FN(sha1_compress_x1, uint32_t, 1, )
+
+/** Helper: run the compression function on the <b>n_blocks</b> 64-byte
+ * blocks at <b>blocks</b>, for the single state <b>st</b>. */
+static void
+sha1_compress_one(sha1_multi_state_t *st, const uint8_t *blocks,
+                  size_t n_blocks)
+{
+  uint32_t state[5][1];
+  int i;
+  for (i = 0; i < 5; ++i)
+    state[i][0] = st->h[i];
+  sha1_compress_x1(state, &blocks, n_blocks);
+  for (i = 0; i < 5; ++i)
+    st->h[i] = state[i][0];
+  memwipe(state, 0, sizeof(state));
+}
+
+/** Set <b>st</b> to the state of a SHA-1 digest that has hashed nothing. */
+void
+sha1_multi_state_init(sha1_multi_state_t *st)
+{
+  memset(st, 0, sizeof(*st));
+  st->h[0] = 0x67452301;
+  st->h[1] = 0xefcdab89;
+  st->h[2] = 0x98badcfe;
+  st->h[3] = 0x10325476;
+  st->h[4] = 0xc3d2e1f0;
+}
+
+/** Add the <b>len</b> bytes at <b>data</b> to the single SHA-1 state
+ * <b>st</b>. */
+void
+sha1_multi_state_update(sha1_multi_state_t *st, const uint8_t *data,
+                        size_t len)
+{
+  st->n_bytes += len;
+  if (st->buf_len) {
+    size_t fill = MIN(len, SHA1_MULTI_BLOCK_LEN - st->buf_len);
+    memcpy(st->buf + st->buf_len, data, fill);
+    st->buf_len += fill;
+    data += fill;
+    len -= fill;
+    if (st->buf_len < SHA1_MULTI_BLOCK_LEN)
+      return;
+    sha1_compress_one(st, st->buf, 1);
+    st->buf_len = 0;
+  }
+  if (len >= SHA1_MULTI_BLOCK_LEN) {
+    size_t n_blocks = len / SHA1_MULTI_BLOCK_LEN;
+    sha1_compress_one(st, data, n_blocks);
+    data += n_blocks * SHA1_MULTI_BLOCK_LEN;
+    len -= n_blocks * SHA1_MULTI_BLOCK_LEN;
+  }
+  if (len) {
+    memcpy(st->buf, data, len);
+    st->buf_len = len;
+  }
+}
+
+/** Finish the SHA-1 computation in <b>st</b>, and write the DIGEST_LEN-byte
+ * result to <b>out</b>.  This leaves <b>st</b> unusable. */
+void
+sha1_multi_state_final(sha1_multi_state_t *st, uint8_t *out)
+{
+  uint8_t pad[SHA1_MULTI_BLOCK_LEN + 8];
+  uint64_t n_bits = st->n_bytes * 8;
+  size_t pad_len;
+  int i;
+
+  /* A 1 bit, then zeros up to 8 bytes short of a block boundary, then the
+   * length in bits. */
+  memset(pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  if (st->buf_len < SHA1_MULTI_BLOCK_LEN - 8)
+    pad_len = SHA1_MULTI_BLOCK_LEN - 8 - st->buf_len;
+  else
+    pad_len = 2 * SHA1_MULTI_BLOCK_LEN - 8 - st->buf_len;
+  for (i = 0; i < 8; ++i)
+    pad[pad_len + i] = (uint8_t)(n_bits >> (56 - 8 * i));
+  sha1_multi_state_update(st, pad, pad_len + 8);
+  tor_assert(st->buf_len == 0);
+
+  for (i = 0; i < 5; ++i) {
+    out[4*i] = (uint8_t)(st->h[i] >> 24);
+    out[4*i+1] = (uint8_t)(st->h[i] >> 16);
+    out[4*i+2] = (uint8_t)(st->h[i] >> 8);
+    out[4*i+3] = (uint8_t)st->h[i];
+  }
+}
+
+#ifdef SHA1_MULTI_SIMD
+
+typedef uint32_t sha1_v4_t __attribute__((vector_size(16)));
+typedef uint32_t sha1_v8_t __attribute__((vector_size(32)));
+
+SHA1_MULTI_COMPRESS_FN(sha1_compress_x4, sha1_v4_t, 4, )
+SHA1_MULTI_COMPRESS_FN(sha1_compress_x8, sha1_v8_t, 8,
+                       __attribute__((target("avx2"))))
+
+/** Helper: add the <b>len</b> bytes at <b>data</b>[i] to <b>sts</b>[i], for
+ * each i < <b>n</b>, where <b>n</b> \<= <b>n_lanes</b>. */
+static void
+sha1_multi_update_group(sha1_multi_state_t **sts, const uint8_t **data,
+                        size_t len, int n, int n_lanes)
+{
+  const uint8_t *ptrs[SHA1_MULTI_MAX_LANES];
+  size_t remaining[SHA1_MULTI_MAX_LANES];
+  uint32_t state[5][SHA1_MULTI_MAX_LANES];
+  size_t n_blocks = SIZE_MAX;
+  int i, k;
+
+  for (i = 0; i < n; ++i) {
+    sha1_multi_state_t *st = sts[i];
+    const uint8_t *p = data[i];
+    size_t r = len;
+    if (st->buf_len) {
+      /* Finish off the partial block this state is holding first. */
+      size_t fill = MIN(r, SHA1_MULTI_BLOCK_LEN - st->buf_len);
+      sha1_multi_state_update(st, p, fill);
+      p += fill;
+      r -= fill;
+    }
+    ptrs[i] = p;
+    remaining[i] = r;
+    n_blocks = MIN(n_blocks, r / SHA1_MULTI_BLOCK_LEN);
+  }
+
+  if (n_blocks) {
+    if (n_lanes == 8) {
+      uint32_t (*st)[8] = (uint32_t (*)[8]) state;
+      for (i = 0; i < 8; ++i) {
+        /* Unused lanes just redo lane 0's work. */
+        for (k = 0; k < 5; ++k)
+          st[k][i] = sts[i < n ? i : 0]->h[k];
+        if (i >= n)
+          ptrs[i] = ptrs[0];
+      }
+      sha1_compress_x8(st, ptrs, n_blocks);
+      for (i = 0; i < n; ++i) {
+        for (k = 0; k < 5; ++k)
+          sts[i]->h[k] = st[k][i];
+      }
+    } else {
+      uint32_t (*st)[4] = (uint32_t (*)[4]) state;
+      for (i = 0; i < 4; ++i) {
+        for (k = 0; k < 5; ++k)
+          st[k][i] = sts[i < n ? i : 0]->h[k];
+        if (i >= n)
+          ptrs[i] = ptrs[0];
+      }
+      sha1_compress_x4(st, ptrs, n_blocks);
+      for (i = 0; i < n; ++i) {
+        for (k = 0; k < 5; ++k)
+          sts[i]->h[k] = st[k][i];
+      }
+    }
+    for (i = 0; i < n; ++i) {
+      sts[i]->n_bytes += n_blocks * SHA1_MULTI_BLOCK_LEN;
+      ptrs[i] += n_blocks * SHA1_MULTI_BLOCK_LEN;
+      remaining[i] -= n_blocks * SHA1_MULTI_BLOCK_LEN;
+    }
+  }
+
+  /* Whatever is left over is less than a block or two per lane. */
+  for (i = 0; i < n; ++i) {
+    if (remaining[i])
+      sha1_multi_state_update(sts[i], ptrs[i], remaining[i]);
+  }
+  memwipe(state, 0, sizeof(state));
+}
+
+#endif
+
+/** Add the <b>len</b> bytes at <b>data</b>[i] to the SHA-1 state
+ * <b>sts</b>[i], for every i < <b>n</b>, with the same result as calling
+ * sha1_multi_state_update() on each.  The states must all be different. */
+void
+sha1_multi_update(sha1_multi_state_t **sts, const uint8_t **data, size_t len,
+                  int n)
+{
+  int i = 0;
+#ifdef SHA1_MULTI_SIMD
+  int n_lanes = sha1_multi_get_n_lanes();
+  if (n_lanes > 1) {
+    /* Fewer than two states in a group isn't worth the SIMD setup. */
+    for ( ; n - i >= 2; i += n_lanes) {
+      sha1_multi_update_group(sts + i, data + i, len,
+                              MIN(n_lanes, n - i), n_lanes);
+    }
+    if (i >= n)
+      return;
+  }
+#endif
+  for ( ; i < n; ++i)
+    sha1_multi_state_update(sts[i], data[i], len);
+}
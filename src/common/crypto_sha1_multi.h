@@ -0,0 +1,44 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file crypto_sha1_multi.h
+ * \brief Headers for crypto_sha1_multi.c
+ **/
+
+#ifndef TOR_CRYPTO_SHA1_MULTI_H
+#define TOR_CRYPTO_SHA1_MULTI_H
+
+#include "torint.h"
+
+/** The size of a SHA-1 input block, in bytes. */
+#define SHA1_MULTI_BLOCK_LEN 64
+
+/** The state of a SHA-1 computation that sha1_multi_update() can work on.
+ * It's laid out however we like, unlike OpenSSL's SHA_CTX. */
+typedef struct sha1_multi_state_t {
+  /** The chaining values. */
+  uint32_t h[5];
+  /** How many bytes we've hashed so far. */
+  uint64_t n_bytes;
+  /** The partial block that we haven't compressed yet. */
+  uint8_t buf[SHA1_MULTI_BLOCK_LEN];
+  /** How many bytes of <b>buf</b> are in use. */
+  size_t buf_len;
+} sha1_multi_state_t;
+
+/** The largest number of SHA-1 states that sha1_multi_update() can ever
+ * process side by side. */
+#define SHA1_MULTI_MAX_LANES 8
+
+int sha1_multi_get_n_lanes(void);
+void sha1_multi_set_n_lanes(int n_lanes);
+void sha1_multi_state_init(sha1_multi_state_t *st);
+void sha1_multi_state_update(sha1_multi_state_t *st, const uint8_t *data,
+                             size_t len);
+void sha1_multi_state_final(sha1_multi_state_t *st, uint8_t *out);
+void sha1_multi_update(sha1_multi_state_t **sts, const uint8_t **data,
+                       size_t len, int n);
+
+#endif
+
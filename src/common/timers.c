@@ -0,0 +1,260 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file timers.c
+ * \brief Implements a hierarchical timer wheel: a set of timers that we can
+ * advance in time proportional to the number of timers that become due,
+ * rather than to the number of timers that exist.
+ *
+ * The wheel has TIMER_WHEEL_N_LEVELS levels of TIMER_WHEEL_N_SLOTS slots
+ * each.  A timer that is due within TIMER_WHEEL_N_SLOTS ticks goes into the
+ * level-0 slot for its exact tick; one that is due later goes into a
+ * coarser slot at a higher level.  Whenever the wheel's clock reaches the
+ * start of a coarse slot's range, we "cascade" that slot, moving each of
+ * its timers down into a finer level.  Each timer is therefore touched at
+ * most TIMER_WHEEL_N_LEVELS times between when it is scheduled and when it
+ * fires, no matter how many other timers there are.
+ *
+ * The wheel doesn't care what a tick is; its users decide that.
+ **/
+
+#include "orconfig.h"
+#include "compat.h"
+#include "util.h"
+#include "timers.h"
+#include "torlog.h"
+
+/** How many bits of a deadline select the slot at each level? */
+#define TIMER_WHEEL_LEVEL_BITS 6
+/** How many slots are there at each level? */
+#define TIMER_WHEEL_N_SLOTS (1<<TIMER_WHEEL_LEVEL_BITS)
+/** Mask to get a slot number from a shifted deadline. */
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_N_SLOTS-1)
+/** How many levels does the wheel have? */
+#define TIMER_WHEEL_N_LEVELS 4
+/** How many ticks ahead can the wheel hold a timer at its own slot?  Timers
+ * that are due later than this are parked at the end of the top level, and
+ * put back where they belong once they cascade. */
+#define TIMER_WHEEL_SPAN \
+  (U64_LITERAL(1) << (TIMER_WHEEL_LEVEL_BITS*TIMER_WHEEL_N_LEVELS))
+
+/** A list of timers that share a slot. */
+TOR_LIST_HEAD(wheel_slot_s, wheel_timer_t);
+
+struct timer_wheel_t {
+  /** The last tick that we have processed.  Every timer on the wheel is due
+   * after this tick. */
+  uint64_t now;
+  /** How many timers are on the wheel? */
+  int n_timers;
+  /** The slots of the wheel, indexed by level and then by slot number. */
+  struct wheel_slot_s slots[TIMER_WHEEL_N_LEVELS][TIMER_WHEEL_N_SLOTS];
+};
+
+/** Return a new timer wheel whose clock starts at <b>now</b>. */
+timer_wheel_t *
+timer_wheel_new(uint64_t now)
+{
+  timer_wheel_t *wheel = tor_malloc_zero(sizeof(timer_wheel_t));
+  int level, slot;
+  wheel->now = now;
+  for (level = 0; level < TIMER_WHEEL_N_LEVELS; ++level) {
+    for (slot = 0; slot < TIMER_WHEEL_N_SLOTS; ++slot)
+      TOR_LIST_INIT(&wheel->slots[level][slot]);
+  }
+  return wheel;
+}
+
+/** Release all storage held by <b>wheel</b>.  Timers that are still
+ * scheduled on it are not touched, since they may already have been freed
+ * along with the objects that hold them: don't use them afterwards without
+ * zeroing them first. */
+void
+timer_wheel_free(timer_wheel_t *wheel)
+{
+  if (!wheel)
+    return;
+  tor_free(wheel);
+}
+
+/** Put <b>timer</b>, which must be due no earlier than the wheel's current
+ * tick, in the slot where it belongs. */
+static void
+timer_wheel_insert(timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+  uint64_t when = timer->deadline;
+  uint64_t diff;
+  int level, slot;
+
+  tor_assert(when >= wheel->now);
+  diff = when - wheel->now;
+  if (diff >= TIMER_WHEEL_SPAN) {
+    diff = TIMER_WHEEL_SPAN - 1;
+    when = wheel->now + diff;
+  }
+
+  for (level = 0; level < TIMER_WHEEL_N_LEVELS - 1; ++level) {
+    if (diff < (U64_LITERAL(1) << (TIMER_WHEEL_LEVEL_BITS*(level+1))))
+      break;
+  }
+  slot = (int)((when >> (TIMER_WHEEL_LEVEL_BITS*level)) &
+               TIMER_WHEEL_SLOT_MASK);
+  TOR_LIST_INSERT_HEAD(&wheel->slots[level][slot], timer, node);
+}
+
+/** Move every timer in <b>slot</b> onto the list <b>out</b>. */
+static void
+timer_wheel_take_slot(struct wheel_slot_s *slot, struct wheel_slot_s *out)
+{
+  wheel_timer_t *timer;
+  while ((timer = TOR_LIST_FIRST(slot))) {
+    TOR_LIST_REMOVE(timer, node);
+    TOR_LIST_INSERT_HEAD(out, timer, node);
+  }
+}
+
+/** Schedule <b>timer</b> on <b>wheel</b>, to fire at the tick
+ * <b>deadline</b>.  If the timer was already scheduled, it is moved.  A
+ * deadline that is not after the wheel's current tick is treated as the
+ * next tick. */
+void
+timer_wheel_schedule(timer_wheel_t *wheel, wheel_timer_t *timer,
+                     uint64_t deadline)
+{
+  tor_assert(wheel);
+  tor_assert(timer);
+
+  if (timer->is_scheduled)
+    timer_wheel_cancel(wheel, timer);
+
+  if (deadline <= wheel->now)
+    deadline = wheel->now + 1;
+  timer->deadline = deadline;
+  timer_wheel_insert(wheel, timer);
+  timer->is_scheduled = 1;
+  ++wheel->n_timers;
+}
+
+/** Remove <b>timer</b> from <b>wheel</b>, if it is scheduled there. */
+void
+timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+  tor_assert(wheel);
+  tor_assert(timer);
+
+  if (!timer->is_scheduled)
+    return;
+  TOR_LIST_REMOVE(timer, node);
+  timer->is_scheduled = 0;
+  --wheel->n_timers;
+}
+
+/** Helper: move the clock of <b>wheel</b> straight to <b>now</b>, putting
+ * each timer back where it belongs for the new clock, or onto <b>due</b> if
+ * it is due by then.  If the clock is going backwards, every timer keeps the
+ * same distance from the clock that it had before.
+ *
+ * This costs time proportional to the number of timers, so we only do it
+ * when stepping one tick at a time would cost more, as it does after a long
+ * sleep. */
+static void
+timer_wheel_rebase(timer_wheel_t *wheel, uint64_t now,
+                   struct wheel_slot_s *due)
+{
+  struct wheel_slot_s all;
+  wheel_timer_t *timer;
+  const uint64_t then = wheel->now;
+  int level, slot;
+
+  TOR_LIST_INIT(&all);
+  for (level = 0; level < TIMER_WHEEL_N_LEVELS; ++level) {
+    for (slot = 0; slot < TIMER_WHEEL_N_SLOTS; ++slot)
+      timer_wheel_take_slot(&wheel->slots[level][slot], &all);
+  }
+
+  wheel->now = now;
+  while ((timer = TOR_LIST_FIRST(&all))) {
+    TOR_LIST_REMOVE(timer, node);
+    if (now < then)
+      timer->deadline = now + (timer->deadline - then);
+    if (timer->deadline <= now)
+      TOR_LIST_INSERT_HEAD(due, timer, node);
+    else
+      timer_wheel_insert(wheel, timer);
+  }
+}
+
+/** Advance the clock of <b>wheel</b> to <b>now</b>, and invoke <b>cb</b>
+ * (with <b>arg</b>) on every timer that is due by then.  Callbacks are made
+ * once the clock has reached <b>now</b>, so a timer that a callback
+ * schedules for <b>now</b> or earlier will fire on the next tick.  Return
+ * the number of timers that fired. */
+int
+timer_wheel_advance(timer_wheel_t *wheel, uint64_t now,
+                    timer_wheel_cb_t cb, void *arg)
+{
+  struct wheel_slot_s due;
+  wheel_timer_t *timer;
+  int n_fired = 0;
+
+  tor_assert(wheel);
+  tor_assert(cb);
+
+  TOR_LIST_INIT(&due);
+  if (now == wheel->now)
+    return 0;
+
+  if (now < wheel->now ||
+      now - wheel->now > (uint64_t)wheel->n_timers + TIMER_WHEEL_N_SLOTS) {
+    timer_wheel_rebase(wheel, now, &due);
+  } else {
+    while (wheel->now < now) {
+      const uint64_t tick = ++wheel->now;
+      int level;
+      for (level = TIMER_WHEEL_N_LEVELS - 1; level > 0; --level) {
+        const int shift = TIMER_WHEEL_LEVEL_BITS*level;
+        struct wheel_slot_s cascade;
+        if (tick & ((U64_LITERAL(1) << shift) - 1))
+          continue;
+        TOR_LIST_INIT(&cascade);
+        timer_wheel_take_slot(
+            &wheel->slots[level][(tick >> shift) & TIMER_WHEEL_SLOT_MASK],
+            &cascade);
+        while ((timer = TOR_LIST_FIRST(&cascade))) {
+          TOR_LIST_REMOVE(timer, node);
+          timer_wheel_insert(wheel, timer);
+        }
+      }
+      timer_wheel_take_slot(
+          &wheel->slots[0][tick & TIMER_WHEEL_SLOT_MASK], &due);
+    }
+  }
+
+  /* A callback may schedule or cancel any timer, including the ones still
+   * on <b>due</b>, so take each one off before we call it. */
+  while ((timer = TOR_LIST_FIRST(&due))) {
+    TOR_LIST_REMOVE(timer, node);
+    timer->is_scheduled = 0;
+    --wheel->n_timers;
+    ++n_fired;
+    cb(timer, arg);
+  }
+
+  return n_fired;
+}
+
+/** Return the last tick that <b>wheel</b> has processed. */
+uint64_t
+timer_wheel_get_now(const timer_wheel_t *wheel)
+{
+  return wheel->now;
+}
+
+/** Return the number of timers scheduled on <b>wheel</b>. */
+int
+timer_wheel_get_n_timers(const timer_wheel_t *wheel)
+{
+  return wheel->n_timers;
+}
+
@@ -0,0 +1,53 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file timers.h
+ * \brief Header for timers.c.
+ **/
+
+#ifndef TOR_TIMERS_H
+#define TOR_TIMERS_H
+
+#include "compat.h"
+#include "tor_queue.h"
+
+/** A set of timers, each due at some tick, that we can advance cheaply. */
+typedef struct timer_wheel_t timer_wheel_t;
+
+/** A single timer that can be scheduled on a timer_wheel_t.  Embed one of
+ * these in whatever object needs to hear about its deadline, and zero it
+ * before first use. */
+typedef struct wheel_timer_t {
+  /** Links for the wheel slot that holds this timer. */
+  TOR_LIST_ENTRY(wheel_timer_t) node;
+  /** The tick at which this timer is due. */
+  uint64_t deadline;
+  /** True iff this timer is currently on a wheel. */
+  unsigned int is_scheduled : 1;
+} wheel_timer_t;
+
+/** A function to call for each timer that becomes due.  The timer is no
+ * longer scheduled when this is called, so the function may schedule it
+ * again, or free the object that holds it. */
+typedef void (*timer_wheel_cb_t)(wheel_timer_t *timer, void *arg);
+
+timer_wheel_t *timer_wheel_new(uint64_t now);
+void timer_wheel_free(timer_wheel_t *wheel);
+void timer_wheel_schedule(timer_wheel_t *wheel, wheel_timer_t *timer,
+                          uint64_t deadline);
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+int timer_wheel_advance(timer_wheel_t *wheel, uint64_t now,
+                        timer_wheel_cb_t cb, void *arg);
+uint64_t timer_wheel_get_now(const timer_wheel_t *wheel);
+int timer_wheel_get_n_timers(const timer_wheel_t *wheel);
+
+/** Return true iff <b>timer</b> is scheduled on a wheel. */
+static INLINE int
+wheel_timer_is_scheduled(const wheel_timer_t *timer)
+{
+  return timer->is_scheduled;
+}
+
+#endif
+
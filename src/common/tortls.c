@@ -36,6 +36,7 @@
 #include <openssl/asn1.h>
 #include <openssl/bio.h>
 #include <openssl/opensslv.h>
+#include <openssl/hmac.h>
 
 #ifdef USE_BUFFEREVENTS
 #include <event2/bufferevent_ssl.h>
@@ -55,6 +56,35 @@
 #error "We require OpenSSL >= 0.9.8"
 #endif
 
+/* We can hand the record layer of a finished TLS 1.2 AES-GCM connection to
+ * the Linux kernel, if the kernel headers know about it and OpenSSL is new
+ * enough to do TLS 1.2 at all. */
+#if defined(__linux__) && defined(HAVE_LINUX_TLS_H) && \
+  OPENSSL_VERSION_NUMBER >= OPENSSL_V_SERIES(1,0,1)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#if defined(TLS_TX) && defined(TLS_RX) && defined(TLS_GET_RECORD_TYPE)
+#define USE_KERNEL_TLS
+#endif
+#endif
+
+#ifdef USE_KERNEL_TLS
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+/** TLS record content types that we see once the kernel has our keys. */
+#define TLS_RECORD_TYPE_ALERT 21
+#define TLS_RECORD_TYPE_DATA 23
+/** How many bytes an AES-GCM record adds to its contents: a 5-byte header,
+ * an 8-byte explicit nonce, and a 16-byte tag. */
+#define KERNEL_TLS_RECORD_OVERHEAD 29
+#endif
+
 /* Enable the "v2" TLS handshake.
  */
 #define V2_HANDSHAKE_SERVER
@@ -118,6 +148,9 @@ typedef struct tor_tls_context_t {
   tor_cert_t *my_auth_cert;
   crypto_pk_t *link_key;
   crypto_pk_t *auth_key;
+  /** True iff connections made with this context should hand their record
+   * layer to the kernel once they are open. */
+  unsigned int use_kernel_tls:1;
 } tor_tls_context_t;
 
 /** Return values for tor_tls_classify_client_ciphers.
@@ -167,6 +200,13 @@ struct tor_tls_t {
                                   * one certificate). */
   /** True iff we should call negotiated_callback when we're done reading. */
   unsigned int got_renegotiate:1;
+  /** True iff we want to give our keys to the kernel, but OpenSSL still had
+   * buffered data the last time we tried. */
+  unsigned int kernel_tls_pending:1;
+  /** True iff the kernel encrypts the records we send. */
+  unsigned int kernel_tls_tx:1;
+  /** True iff the kernel decrypts the records we receive. */
+  unsigned int kernel_tls_rx:1;
   /** Return value from tor_tls_classify_client_ciphers, or 0 if we haven't
    * called that function yet. */
   int8_t client_cipher_list_type;
@@ -179,6 +219,15 @@ struct tor_tls_t {
    */
   unsigned long last_write_count;
   unsigned long last_read_count;
+  /** Estimated bytes read and written on the raw socket by kernel TLS since
+   * the last call to tor_tls_get_n_raw_bytes(). */
+  size_t kernel_read_count;
+  size_t kernel_write_count;
+  /** Bytes that we've asked TLS to send on this connection since the last
+   * call to tor_tls_get_n_raw_bytes().  We keep this per connection, since
+   * TLS shards call tor_tls_write() from other threads; the main thread
+   * adds it to total_bytes_written_over_tls. */
+  size_t plaintext_write_count;
   /** If set, a callback to invoke whenever the client tries to renegotiate
    * the handshake. */
   void (*negotiated_callback)(tor_tls_t *tls, void *arg);
@@ -1080,7 +1129,8 @@ tor_tls_context_incref(tor_tls_context_t *ctx)
  * the same TLS context for incoming and outgoing connections, and
  * ignore <b>client_identity</b>. If one of TOR_TLS_CTX_USE_ECDHE_P{224,256}
  * is set in <b>flags</b>, use that ECDHE group if possible; otherwise use
- * the default ECDHE group. */
+ * the default ECDHE group. If TOR_TLS_CTX_USE_KERNEL_TLS is set, let
+ * tor_tls_start_kernel_tls() give open connections' keys to the kernel. */
 int
 tor_tls_context_init(unsigned flags,
                      crypto_pk_t *client_identity,
@@ -1224,6 +1274,7 @@ tor_tls_context_new(crypto_pk_t *identity, unsigned int key_lifetime,
 
   result = tor_malloc_zero(sizeof(tor_tls_context_t));
   result->refcnt = 1;
+  result->use_kernel_tls = (flags & TOR_TLS_CTX_USE_KERNEL_TLS) ? 1 : 0;
   if (!is_client) {
     result->my_link_cert = tor_cert_new(X509_dup(cert));
     result->my_id_cert = tor_cert_new(X509_dup(idcert));
@@ -2041,6 +2092,336 @@ tor_tls_free(tor_tls_t *tls)
   tor_free(tls);
 }
 
+#ifdef USE_KERNEL_TLS
+/** Compute the TLS 1.2 PRF (RFC 5246, section 5) over <b>md</b>: fill
+ * <b>out_len</b> bytes of <b>out</b> from <b>secret</b>, <b>label</b>, and
+ * <b>seed</b>.  Return 0 on success and -1 on failure. */
+static int
+tls12_prf(const EVP_MD *md, const uint8_t *secret, size_t secret_len,
+          const char *label, const uint8_t *seed, size_t seed_len,
+          uint8_t *out, size_t out_len)
+{
+  /* A(i), followed by label and seed. */
+  uint8_t buf[EVP_MAX_MD_SIZE + 32 + 2*SSL3_RANDOM_SIZE];
+  uint8_t block[EVP_MAX_MD_SIZE];
+  const size_t label_len = strlen(label);
+  const size_t md_len = EVP_MD_size(md);
+  unsigned int len;
+  int r = -1;
+
+  tor_assert(label_len + seed_len <= sizeof(buf) - EVP_MAX_MD_SIZE);
+  memcpy(buf + md_len, label, label_len);
+  memcpy(buf + md_len + label_len, seed, seed_len);
+  /* A(1) = HMAC(secret, label + seed) */
+  if (!HMAC(md, secret, (int)secret_len, buf + md_len, label_len + seed_len,
+            buf, &len))
+    goto done;
+  while (out_len) {
+    size_t n;
+    /* HMAC(secret, A(i) + label + seed) */
+    if (!HMAC(md, secret, (int)secret_len, buf,
+              md_len + label_len + seed_len, block, &len))
+      goto done;
+    n = MIN(out_len, md_len);
+    memcpy(out, block, n);
+    out += n;
+    out_len -= n;
+    /* A(i+1) = HMAC(secret, A(i)) */
+    if (!HMAC(md, secret, (int)secret_len, buf, md_len, buf, &len))
+      goto done;
+  }
+  r = 0;
+ done:
+  memwipe(buf, 0, sizeof(buf));
+  memwipe(block, 0, sizeof(block));
+  return r;
+}
+
+/** Fill <b>info</b> with the kernel's description of one direction of an
+ * AES-GCM connection, using the <b>key_len</b>-byte <b>key</b>, the 4-byte
+ * implicit nonce <b>salt</b>, and the 8-byte record sequence number
+ * <b>seq</b>.  Return the size of the description. */
+static socklen_t
+kernel_tls_crypto_info(void *info, size_t key_len, const uint8_t *key,
+                       const uint8_t *salt, const uint8_t *seq)
+{
+  /* Like OpenSSL, we start the explicit nonce at the sequence number. */
+  if (key_len == TLS_CIPHER_AES_GCM_128_KEY_SIZE) {
+    struct tls12_crypto_info_aes_gcm_128 *ci = info;
+    memset(ci, 0, sizeof(*ci));
+    ci->info.version = TLS_1_2_VERSION;
+    ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    memcpy(ci->iv, seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+    memcpy(ci->key, key, key_len);
+    memcpy(ci->salt, salt, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+    memcpy(ci->rec_seq, seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+    return sizeof(*ci);
+  } else {
+    struct tls12_crypto_info_aes_gcm_256 *ci = info;
+    tor_assert(key_len == TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+    memset(ci, 0, sizeof(*ci));
+    ci->info.version = TLS_1_2_VERSION;
+    ci->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+    memcpy(ci->iv, seq, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+    memcpy(ci->key, key, key_len);
+    memcpy(ci->salt, salt, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+    memcpy(ci->rec_seq, seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+    return sizeof(*ci);
+  }
+}
+
+/** Try to give the record keys of the open connection <b>tls</b> to the
+ * kernel.  If OpenSSL is still holding data that it read or that it has yet
+ * to write, leave kernel_tls_pending set so that we try again later.
+ * Otherwise, on any failure, leave <b>tls</b> doing TLS in user space. */
+static void
+tor_tls_try_kernel_offload(tor_tls_t *tls)
+{
+  SSL *ssl = tls->ssl;
+  const SSL_CIPHER *cipher;
+  const EVP_MD *md;
+  size_t key_len;
+  uint8_t seed[2*SSL3_RANDOM_SIZE];
+  uint8_t key_block[2*TLS_CIPHER_AES_GCM_256_KEY_SIZE +
+                    2*TLS_CIPHER_AES_GCM_256_SALT_SIZE];
+  const uint8_t *tx_key, *rx_key, *tx_salt, *rx_salt;
+  union {
+    struct tls12_crypto_info_aes_gcm_128 aes128;
+    struct tls12_crypto_info_aes_gcm_256 aes256;
+  } info;
+  socklen_t info_len;
+
+  tor_assert(tls->state == TOR_TLS_ST_OPEN);
+  if (SSL_pending(ssl) || ssl->s3->rbuf.left || ssl->s3->wbuf.left ||
+      ssl->rstate != SSL_ST_READ_HEADER || tls->wantwrite_n) {
+    /* OpenSSL has records in flight that the kernel can't take over. */
+    tls->kernel_tls_pending = 1;
+    return;
+  }
+  tls->kernel_tls_pending = 0;
+
+  cipher = SSL_get_current_cipher(ssl);
+  if (!cipher || SSL_version(ssl) != TLS1_2_VERSION ||
+      SSL_get_current_compression(ssl)) {
+    log_info(LD_NET, "Not using kernel TLS with %s: not TLS 1.2.",
+             ADDR(tls));
+    return;
+  }
+  switch (cipher->id) {
+#ifdef TLS1_CK_ECDHE_RSA_WITH_AES_128_GCM_SHA256
+    case TLS1_CK_ECDHE_RSA_WITH_AES_128_GCM_SHA256:
+#endif
+    case TLS1_CK_DHE_RSA_WITH_AES_128_GCM_SHA256:
+      md = EVP_sha256();
+      key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+      break;
+#ifdef TLS1_CK_ECDHE_RSA_WITH_AES_256_GCM_SHA384
+    case TLS1_CK_ECDHE_RSA_WITH_AES_256_GCM_SHA384:
+#endif
+    case TLS1_CK_DHE_RSA_WITH_AES_256_GCM_SHA384:
+      md = EVP_sha384();
+      key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+      break;
+    default:
+      log_info(LD_NET, "Not using kernel TLS with %s: it can't do %s.",
+               ADDR(tls), SSL_CIPHER_get_name(cipher));
+      return;
+  }
+
+  /* key_block = PRF(master_secret, "key expansion",
+   *                 server_random + client_random)
+   * which GCM splits into client_write_key, server_write_key,
+   * client_write_IV, and server_write_IV. */
+  memcpy(seed, ssl->s3->server_random, SSL3_RANDOM_SIZE);
+  memcpy(seed + SSL3_RANDOM_SIZE, ssl->s3->client_random, SSL3_RANDOM_SIZE);
+  if (tls12_prf(md, ssl->session->master_key,
+                ssl->session->master_key_length, "key expansion",
+                seed, sizeof(seed), key_block, 2*key_len + 8) < 0) {
+    tls_log_errors(tls, LOG_INFO, LD_NET, "computing kernel TLS keys");
+    goto done;
+  }
+  if (tls->isServer) {
+    tx_key = key_block + key_len;
+    rx_key = key_block;
+    tx_salt = key_block + 2*key_len + 4;
+    rx_salt = key_block + 2*key_len;
+  } else {
+    tx_key = key_block;
+    rx_key = key_block + key_len;
+    tx_salt = key_block + 2*key_len;
+    rx_salt = key_block + 2*key_len + 4;
+  }
+
+  if (setsockopt(tls->socket, IPPROTO_TCP, TCP_ULP, "tls",
+                 sizeof("tls")) < 0) {
+    log_info(LD_NET, "Not using kernel TLS with %s: %s", ADDR(tls),
+             tor_socket_strerror(tor_socket_errno(tls->socket)));
+    goto done;
+  }
+  info_len = kernel_tls_crypto_info(&info, key_len, tx_key, tx_salt,
+                                    ssl->s3->write_sequence);
+  if (setsockopt(tls->socket, SOL_TLS, TLS_TX, &info, info_len) < 0) {
+    log_info(LD_NET, "Couldn't give our TLS send keys for %s to the "
+             "kernel: %s", ADDR(tls),
+             tor_socket_strerror(tor_socket_errno(tls->socket)));
+    goto done;
+  }
+  tls->kernel_tls_tx = 1;
+  info_len = kernel_tls_crypto_info(&info, key_len, rx_key, rx_salt,
+                                    ssl->s3->read_sequence);
+  if (setsockopt(tls->socket, SOL_TLS, TLS_RX, &info, info_len) < 0) {
+    /* Older kernels only encrypt; OpenSSL keeps decrypting. */
+    log_info(LD_NET, "Couldn't give our TLS receive keys for %s to the "
+             "kernel: %s", ADDR(tls),
+             tor_socket_strerror(tor_socket_errno(tls->socket)));
+    goto done;
+  }
+  tls->kernel_tls_rx = 1;
+  log_debug(LD_NET, "The kernel now does TLS for %s.", ADDR(tls));
+
+ done:
+  memwipe(key_block, 0, sizeof(key_block));
+  memwipe(&info, 0, sizeof(info));
+}
+
+/** Read up to <b>len</b> bytes from <b>tls</b>, whose receive keys are in
+ * the kernel, into <b>cp</b>.  Return as tor_tls_read(). */
+static int
+tor_tls_kernel_read(tor_tls_t *tls, char *cp, size_t len)
+{
+  char control[CMSG_SPACE(sizeof(unsigned char))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  int record_type = TLS_RECORD_TYPE_DATA;
+  ssize_t r;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = cp;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  r = recvmsg(tls->socket, &msg, 0);
+  if (r < 0) {
+    int e = tor_socket_errno(tls->socket);
+    if (ERRNO_IS_EAGAIN(e))
+      return TOR_TLS_WANTREAD;
+    log_info(LD_NET, "TLS error reading from %s: %s", ADDR(tls),
+             tor_socket_strerror(e));
+    return tor_errno_to_tls_error(e);
+  } else if (r == 0) {
+    log_debug(LD_NET, "read returned r=0; TLS is closed");
+    tls->state = TOR_TLS_ST_CLOSED;
+    return TOR_TLS_CLOSE;
+  }
+  tls->kernel_read_count += (size_t)r +
+    KERNEL_TLS_RECORD_OVERHEAD * CEIL_DIV(r, TOR_TLS_MAX_RECORD_PLAINTEXT);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_TLS &&
+      cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+    record_type = *(unsigned char *)CMSG_DATA(cmsg);
+  if (record_type == TLS_RECORD_TYPE_ALERT) {
+    /* Every alert after the handshake ends the connection for us: either
+     * it is a close_notify or something went wrong. */
+    log_debug(LD_NET, "Got a TLS alert from %s; TLS is closed", ADDR(tls));
+    tls->state = TOR_TLS_ST_CLOSED;
+    return TOR_TLS_CLOSE;
+  } else if (record_type != TLS_RECORD_TYPE_DATA) {
+    log_info(LD_NET, "Got an unexpected TLS record of type %d from %s "
+             "after the handshake.", record_type, ADDR(tls));
+    return TOR_TLS_ERROR_MISC;
+  }
+  return (int)r;
+}
+
+/** Write up to <b>n</b> bytes from <b>cp</b> onto <b>tls</b>, whose send
+ * keys are in the kernel.  Return as tor_tls_write(). */
+static int
+tor_tls_kernel_write(tor_tls_t *tls, const char *cp, size_t n)
+{
+  ssize_t r = send(tls->socket, cp, n, 0);
+  if (r < 0) {
+    int e = tor_socket_errno(tls->socket);
+    if (ERRNO_IS_EAGAIN(e))
+      return TOR_TLS_WANTWRITE;
+    log_info(LD_NET, "TLS error writing to %s: %s", ADDR(tls),
+             tor_socket_strerror(e));
+    return tor_errno_to_tls_error(e);
+  }
+  tls->kernel_write_count += (size_t)r +
+    KERNEL_TLS_RECORD_OVERHEAD * CEIL_DIV(r, TOR_TLS_MAX_RECORD_PLAINTEXT);
+  return (int)r;
+}
+
+/** Send a close_notify alert on <b>tls</b>, whose send keys are in the
+ * kernel. */
+static void
+tor_tls_kernel_send_close_notify(tor_tls_t *tls)
+{
+  char control[CMSG_SPACE(sizeof(unsigned char))];
+  /* A warning-level close_notify. */
+  char alert[2] = { 1, 0 };
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  iov.iov_base = alert;
+  iov.iov_len = sizeof(alert);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+  *(unsigned char *)CMSG_DATA(cmsg) = TLS_RECORD_TYPE_ALERT;
+  /* If this fails, the peer just sees the TCP connection close. */
+  (void) sendmsg(tls->socket, &msg, 0);
+}
+#endif
+
+/** Return true iff this Tor can hand TLS records to the kernel. */
+int
+tor_tls_kernel_tls_is_supported(void)
+{
+#ifdef USE_KERNEL_TLS
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/** If <b>tls</b> was made with a context that wants kernel TLS, try to give
+ * its record keys to the kernel.  Call this once <b>tls</b> is open and we
+ * know that it won't renegotiate again.  If the kernel can't take the keys,
+ * or can only take the send keys, we keep doing the rest in user space. */
+void
+tor_tls_start_kernel_tls(tor_tls_t *tls)
+{
+  tor_assert(tls);
+#ifdef USE_KERNEL_TLS
+  if (tls->context && tls->context->use_kernel_tls &&
+      tls->state == TOR_TLS_ST_OPEN && !tls->kernel_tls_tx)
+    tor_tls_try_kernel_offload(tls);
+#endif
+}
+
+/** Set *<b>send_out</b> and *<b>recv_out</b> to true iff the kernel
+ * encrypts and decrypts the records on <b>tls</b>, respectively. */
+void
+tor_tls_get_kernel_tls_status(tor_tls_t *tls, int *send_out, int *recv_out)
+{
+  tor_assert(tls);
+  *send_out = tls->kernel_tls_tx;
+  *recv_out = tls->kernel_tls_rx;
+}
+
 /** Underlying function for TLS reading.  Reads up to <b>len</b>
  * characters from <b>tls</b> into <b>cp</b>.  On success, returns the
  * number of characters read.  On failure, returns TOR_TLS_ERROR,
@@ -2054,6 +2435,10 @@ tor_tls_read(tor_tls_t *tls, char *cp, size_t len)
   tor_assert(tls->ssl);
   tor_assert(tls->state == TOR_TLS_ST_OPEN);
   tor_assert(len<INT_MAX);
+#ifdef USE_KERNEL_TLS
+  if (tls->kernel_tls_rx)
+    return tor_tls_kernel_read(tls, cp, len);
+#endif
   r = SSL_read(tls->ssl, cp, (int)len);
   if (r > 0) {
 #ifdef V2_HANDSHAKE_SERVER
@@ -2064,6 +2449,10 @@ tor_tls_read(tor_tls_t *tls, char *cp, size_t len)
         tls->negotiated_callback(tls, tls->callback_arg);
       tls->got_renegotiate = 0;
     }
+#endif
+#ifdef USE_KERNEL_TLS
+    if (tls->kernel_tls_pending)
+      tor_tls_try_kernel_offload(tls);
 #endif
     return r;
   }
@@ -2080,7 +2469,8 @@ tor_tls_read(tor_tls_t *tls, char *cp, size_t len)
 }
 
 /** Total number of bytes that we've used TLS to send.  Used to track TLS
- * overhead. */
+ * overhead.  Only tor_tls_get_n_raw_bytes() updates this, on the main
+ * thread. */
 static uint64_t total_bytes_written_over_tls = 0;
 /** Total number of bytes that TLS has put on the network for us. Used to
  * track TLS overhead. */
@@ -2101,6 +2491,14 @@ tor_tls_write(tor_tls_t *tls, const char *cp, size_t n)
   tor_assert(n < INT_MAX);
   if (n == 0)
     return 0;
+#ifdef USE_KERNEL_TLS
+  if (tls->kernel_tls_tx) {
+    r = tor_tls_kernel_write(tls, cp, n);
+    if (r > 0)
+      tls->plaintext_write_count += r;
+    return r;
+  }
+#endif
   if (tls->wantwrite_n) {
     /* if WANTWRITE last time, we must use the _same_ n as before */
     tor_assert(n >= tls->wantwrite_n);
@@ -2112,7 +2510,11 @@ tor_tls_write(tor_tls_t *tls, const char *cp, size_t n)
   r = SSL_write(tls->ssl, cp, (int)n);
   err = tor_tls_get_error(tls, r, 0, "writing", LOG_INFO, LD_NET);
   if (err == TOR_TLS_DONE) {
-    total_bytes_written_over_tls += r;
+    tls->plaintext_write_count += r;
+#ifdef USE_KERNEL_TLS
+    if (tls->kernel_tls_pending)
+      tor_tls_try_kernel_offload(tls);
+#endif
     return r;
   }
   if (err == TOR_TLS_WANTWRITE || err == TOR_TLS_WANTREAD) {
@@ -2250,6 +2652,12 @@ tor_tls_renegotiate(tor_tls_t *tls)
   /* We could do server-initiated renegotiation too, but that would be tricky.
    * Instead of "SSL_renegotiate, then SSL_do_handshake until done" */
   tor_assert(!tls->isServer);
+  if (tls->kernel_tls_tx) {
+    /* OpenSSL no longer knows where our record sequence numbers are. */
+    log_warn(LD_BUG, "Tried to renegotiate a TLS connection whose keys are "
+             "in the kernel.");
+    return TOR_TLS_ERROR_MISC;
+  }
   if (tls->state != TOR_TLS_ST_RENEGOTIATE) {
     int r = SSL_renegotiate(tls->ssl);
     if (r <= 0) {
@@ -2279,6 +2687,16 @@ tor_tls_shutdown(tor_tls_t *tls)
   tor_assert(tls);
   tor_assert(tls->ssl);
 
+#ifdef USE_KERNEL_TLS
+  if (tls->kernel_tls_tx) {
+    /* OpenSSL's keys are stale, so we can't wait for its shutdown
+     * handshake. Say goodbye through the kernel and stop. */
+    tor_tls_kernel_send_close_notify(tls);
+    tls->state = TOR_TLS_ST_CLOSED;
+    return TOR_TLS_DONE;
+  }
+#endif
+
   while (1) {
     if (tls->state == TOR_TLS_ST_SENTCLOSE) {
       /* If we've already called shutdown once to send a close message,
@@ -2578,7 +2996,8 @@ tor_tls_get_forced_write_size(tor_tls_t *tls)
 
 /** Sets n_read and n_written to the number of bytes read and written,
  * respectively, on the raw socket used by <b>tls</b> since the last time this
- * function was called on <b>tls</b>. */
+ * function was called on <b>tls</b>.  Only call this from the main thread,
+ * while no TLS shard is working on <b>tls</b>. */
 void
 tor_tls_get_n_raw_bytes(tor_tls_t *tls, size_t *n_read, size_t *n_written)
 {
@@ -2609,7 +3028,13 @@ tor_tls_get_n_raw_bytes(tor_tls_t *tls, size_t *n_read, size_t *n_written)
              "r=%lu, last_read=%lu, w=%lu, last_written=%lu",
              r, tls->last_read_count, w, tls->last_write_count);
   }
+  /* Once the kernel has our keys, OpenSSL's BIOs stop counting. */
+  *n_read += tls->kernel_read_count;
+  *n_written += tls->kernel_write_count;
+  tls->kernel_read_count = tls->kernel_write_count = 0;
   total_bytes_written_by_tls += *n_written;
+  total_bytes_written_over_tls += tls->plaintext_write_count;
+  tls->plaintext_write_count = 0;
   tls->last_read_count = r;
   tls->last_write_count = w;
 }
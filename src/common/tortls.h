@@ -51,6 +51,9 @@ typedef struct tor_cert_t tor_cert_t;
   case TOR_TLS_ERROR_IO
 
 #define TOR_TLS_IS_ERROR(rv) ((rv) < TOR_TLS_CLOSE)
+
+/** The largest amount of data that fits in a single TLS record. */
+#define TOR_TLS_MAX_RECORD_PLAINTEXT 16384
 const char *tor_tls_err_to_string(int err);
 void tor_tls_get_state_description(tor_tls_t *tls, char *buf, size_t sz);
 
@@ -59,6 +62,7 @@ void tor_tls_free_all(void);
 #define TOR_TLS_CTX_IS_PUBLIC_SERVER (1u<<0)
 #define TOR_TLS_CTX_USE_ECDHE_P256   (1u<<1)
 #define TOR_TLS_CTX_USE_ECDHE_P224   (1u<<2)
+#define TOR_TLS_CTX_USE_KERNEL_TLS   (1u<<3)
 
 int tor_tls_context_init(unsigned flags,
                          crypto_pk_t *client_identity,
@@ -95,6 +99,10 @@ void tor_tls_get_n_raw_bytes(tor_tls_t *tls,
 void tor_tls_get_buffer_sizes(tor_tls_t *tls,
                               size_t *rbuf_capacity, size_t *rbuf_bytes,
                               size_t *wbuf_capacity, size_t *wbuf_bytes);
+int tor_tls_kernel_tls_is_supported(void);
+void tor_tls_start_kernel_tls(tor_tls_t *tls);
+void tor_tls_get_kernel_tls_status(tor_tls_t *tls,
+                                   int *send_out, int *recv_out);
 
 MOCK_DECL(double, tls_get_write_overhead_ratio, (void));
 
@@ -25,6 +25,30 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && \
+  defined(HAVE_WRITEV) && !defined(_WIN32)
+/** Defined if we can move data between sockets and several chunks at once
+ * with readv() and writev(). */
+#define USE_VECTORED_IO
+#endif
+
+#ifdef USE_VECTORED_IO
+/** Largest number of chunks we'll hand to a single writev() call.  We keep
+ * the iovec array on the stack, so don't let it get too big even if the
+ * platform would allow it. */
+#if defined(IOV_MAX) && IOV_MAX < 256
+#define BUF_MAX_IOV IOV_MAX
+#else
+#define BUF_MAX_IOV 256
+#endif
+#endif
 
 //#define PARANOIA
 
@@ -64,6 +88,8 @@ static int parse_socks(const char *data, size_t datalen, socks_request_t *req,
 static int parse_socks_client(const uint8_t *data, size_t datalen,
                               int state, char **reason,
                               ssize_t *drain_out);
+static INLINE void peek_from_buf(char *string, size_t string_len,
+                                 const buf_t *buf);
 
 /* Chunk manipulation functions */
 
@@ -691,19 +717,14 @@ buf_get_total_allocation(void)
   return total_bytes_allocated_in_chunks;
 }
 
-/** Read up to <b>at_most</b> bytes from the socket <b>fd</b> into
- * <b>chunk</b> (which must be on <b>buf</b>). If we get an EOF, set
- * *<b>reached_eof</b> to 1.  Return -1 on error, 0 on eof or blocking,
- * and the number of bytes read otherwise. */
-static INLINE int
-read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
-              int *reached_eof, int *socket_error)
+/** Helper for read_to_chunk() and read_to_tail_and_spare(): handle the
+ * result <b>read_result</b> of a failed or empty read on <b>fd</b>.  Return
+ * -1 on error (setting *<b>socket_error</b>), and 0 on eof (setting
+ * *<b>reached_eof</b>) or blocking. */
+static int
+read_result_no_data(ssize_t read_result, tor_socket_t fd,
+                    int *reached_eof, int *socket_error)
 {
-  ssize_t read_result;
-  if (at_most > CHUNK_REMAINING_CAPACITY(chunk))
-    at_most = CHUNK_REMAINING_CAPACITY(chunk);
-  read_result = tor_socket_recv(fd, CHUNK_WRITE_PTR(chunk), at_most, 0);
-
   if (read_result < 0) {
     int e = tor_socket_errno(fd);
     if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
@@ -715,10 +736,28 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
       return -1;
     }
     return 0; /* would block. */
-  } else if (read_result == 0) {
+  } else {
     log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
     *reached_eof = 1;
     return 0;
+  }
+}
+
+/** Read up to <b>at_most</b> bytes from the socket <b>fd</b> into
+ * <b>chunk</b> (which must be on <b>buf</b>). If we get an EOF, set
+ * *<b>reached_eof</b> to 1.  Return -1 on error, 0 on eof or blocking,
+ * and the number of bytes read otherwise. */
+static INLINE int
+read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
+              int *reached_eof, int *socket_error)
+{
+  ssize_t read_result;
+  if (at_most > CHUNK_REMAINING_CAPACITY(chunk))
+    at_most = CHUNK_REMAINING_CAPACITY(chunk);
+  read_result = tor_socket_recv(fd, CHUNK_WRITE_PTR(chunk), at_most, 0);
+
+  if (read_result <= 0) {
+    return read_result_no_data(read_result, fd, reached_eof, socket_error);
   } else { /* actually got bytes. */
     buf->datalen += read_result;
     chunk->datalen += read_result;
@@ -729,6 +768,55 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
   }
 }
 
+#ifdef USE_VECTORED_IO
+/** Read up to <b>at_most</b> bytes from the socket <b>fd</b> into the
+ * remaining space of the tail chunk of <b>buf</b>, and then into a new
+ * chunk that we add after it, with a single readv() call.  If the new chunk
+ * gets no data, remove it again.  Set *<b>readlen_out</b> to the number of
+ * bytes we asked for.  Return values are as for read_to_chunk(). */
+static int
+read_to_tail_and_spare(buf_t *buf, tor_socket_t fd, size_t at_most,
+                       size_t *readlen_out, int *reached_eof,
+                       int *socket_error)
+{
+  chunk_t *tail = buf->tail, *spare;
+  struct iovec iov[2];
+  size_t cap = CHUNK_REMAINING_CAPACITY(tail);
+  ssize_t read_result;
+
+  tor_assert(cap < at_most);
+  spare = buf_add_chunk_with_capacity(buf, at_most - cap, 1);
+  iov[0].iov_base = CHUNK_WRITE_PTR(tail);
+  iov[0].iov_len = cap;
+  iov[1].iov_base = CHUNK_WRITE_PTR(spare);
+  iov[1].iov_len = MIN(at_most - cap, spare->memlen);
+  *readlen_out = iov[0].iov_len + iov[1].iov_len;
+
+  read_result = readv(fd, iov, 2);
+
+  if (read_result > (ssize_t)cap) {
+    tail->datalen += cap;
+    spare->datalen += read_result - cap;
+  } else {
+    if (read_result > 0)
+      tail->datalen += read_result;
+    /* Nothing went into the spare chunk; take it off the buffer. */
+    tail->next = NULL;
+    buf->tail = tail;
+    chunk_free_unchecked(spare);
+  }
+
+  if (read_result <= 0)
+    return read_result_no_data(read_result, fd, reached_eof, socket_error);
+
+  buf->datalen += read_result;
+  log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
+            (int)buf->datalen);
+  tor_assert(read_result < INT_MAX);
+  return (int)read_result;
+}
+#endif
+
 /** As read_to_chunk(), but return (negative) error code on error, blocking,
  * or TLS, and the number of bytes read otherwise. */
 static INLINE int
@@ -773,6 +861,21 @@ read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
       chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
       if (readlen > chunk->memlen)
         readlen = chunk->memlen;
+#ifdef USE_VECTORED_IO
+    } else if (CHUNK_REMAINING_CAPACITY(buf->tail) < readlen) {
+      /* The tail can't hold everything we want: fill it and a new chunk
+       * with one syscall, rather than one recv() per chunk. */
+      r = read_to_tail_and_spare(buf, s, readlen, &readlen,
+                                 reached_eof, socket_error);
+      check();
+      if (r < 0)
+        return r; /* Error */
+      tor_assert(total_read+r < INT_MAX);
+      total_read += r;
+      if ((size_t)r < readlen) /* eof, block, or no more to read. */
+        break;
+      continue;
+#endif
     } else {
       size_t cap = CHUNK_REMAINING_CAPACITY(buf->tail);
       chunk = buf->tail;
@@ -883,11 +986,68 @@ flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
-/** Helper for flush_buf_tls(): try to write <b>sz</b> bytes from chunk
- * <b>chunk</b> of buffer <b>buf</b> onto socket <b>s</b>.  (Tries to write
- * more if there is a forced pending write size.)  On success, deduct the
- * bytes written from *<b>buf_flushlen</b>.  Return the number of bytes
- * written on success, and a TOR_TLS error code on failure or blocking.
+#ifdef USE_VECTORED_IO
+/** Helper for flush_buf(): try to write <b>sz</b> bytes from the first
+ * chunks of buffer <b>buf</b> onto socket <b>s</b> with a single writev()
+ * call, using at most BUF_MAX_IOV chunks.  Set *<b>writelen_out</b> to the
+ * number of bytes we tried to write.  Otherwise, behave as flush_chunk().
+ */
+static INLINE int
+flush_chunks_vectored(tor_socket_t s, buf_t *buf, size_t sz,
+                      size_t *writelen_out, size_t *buf_flushlen)
+{
+  struct iovec iov[BUF_MAX_IOV];
+  int n_iov;
+  ssize_t write_result;
+
+  n_iov = buf_get_iovecs(buf, sz, iov, BUF_MAX_IOV, writelen_out);
+  write_result = writev(s, iov, n_iov);
+
+  if (write_result < 0) {
+    int e = tor_socket_errno(s);
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"write() would block, returning.");
+    return 0;
+  } else {
+    *buf_flushlen -= write_result;
+    buf_remove_from_front(buf, write_result);
+    tor_assert(write_result < INT_MAX);
+    return (int)write_result;
+  }
+}
+#endif
+
+/** Scratch space for gathering data from several chunks into a single TLS
+ * record.  Outbuf chunks are usually smaller than a record, so that idle
+ * connections don't hold on to much memory; we pay for a copy at flush time
+ * instead. */
+static char tls_record_buf[TOR_TLS_MAX_RECORD_PLAINTEXT];
+/** How many TLS records have we written with flush_buf_tls()? */
+static uint64_t n_tls_records_written = 0;
+/** How many bytes of data have we written in those TLS records? */
+static uint64_t n_tls_bytes_written = 0;
+
+/** Set *<b>records_out</b> and *<b>bytes_out</b> to the number of TLS
+ * records, and the number of bytes of data in them, that we've written from
+ * buffers. */
+void
+buf_get_tls_write_stats(uint64_t *records_out, uint64_t *bytes_out)
+{
+  *records_out = n_tls_records_written;
+  *bytes_out = n_tls_bytes_written;
+}
+
+/** Helper for flush_buf_tls(): try to write <b>sz</b> bytes, no more than
+ * TOR_TLS_MAX_RECORD_PLAINTEXT, from chunk <b>chunk</b> of buffer
+ * <b>buf</b> onto socket <b>s</b>, as a single TLS record.  (Tries to
+ * write more if there is a forced pending write size.)  If <b>sz</b> is
+ * more than <b>chunk</b> holds, copy that much data from the front of
+ * <b>buf</b> so that it all goes out in one record.  On success, deduct
+ * the bytes written from
+ * *<b>buf_flushlen</b>.  Return the number of bytes written on success, and
+ * a TOR_TLS error code on failure or blocking.
  */
 static INLINE int
 flush_chunk_tls(tor_tls_t *tls, buf_t *buf, chunk_t *chunk,
@@ -900,9 +1060,15 @@ flush_chunk_tls(tor_tls_t *tls, buf_t *buf, chunk_t *chunk,
   forced = tor_tls_get_forced_write_size(tls);
   if (forced > sz)
     sz = forced;
-  if (chunk) {
+  tor_assert(sz <= TOR_TLS_MAX_RECORD_PLAINTEXT);
+  if (chunk && sz <= chunk->datalen) {
     data = chunk->data;
-    tor_assert(sz <= chunk->datalen);
+  } else if (chunk) {
+    /* We set SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER, so it's fine to retry a
+     * write from here that was first tried from somewhere else. */
+    tor_assert(sz <= sizeof(tls_record_buf));
+    peek_from_buf(tls_record_buf, sz, buf);
+    data = tls_record_buf;
   } else {
     data = NULL;
     tor_assert(sz == 0);
@@ -910,6 +1076,11 @@ flush_chunk_tls(tor_tls_t *tls, buf_t *buf, chunk_t *chunk,
   r = tor_tls_write(tls, data, sz);
   if (r < 0)
     return r;
+  /* We never ask for more than one record, and the TLS library won't report
+   * part of a record as written. */
+  if (r > 0)
+    ++n_tls_records_written;
+  n_tls_bytes_written += r;
   if (*buf_flushlen > (size_t)r)
     *buf_flushlen -= r;
   else
@@ -943,12 +1114,22 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
+#ifdef USE_VECTORED_IO
+    if (buf->head->datalen < sz) {
+      /* More than one chunk to write: gather them into one writev(). */
+      r = flush_chunks_vectored(s, buf, sz, &flushlen0, buf_flushlen);
+    } else {
+      flushlen0 = sz;
+      r = flush_chunk(s, buf, buf->head, flushlen0, buf_flushlen);
+    }
+#else
     if (buf->head->datalen >= sz)
       flushlen0 = sz;
     else
       flushlen0 = buf->head->datalen;
 
     r = flush_chunk(s, buf, buf->head, flushlen0, buf_flushlen);
+#endif
     check();
     if (r < 0)
       return r;
@@ -961,6 +1142,143 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
   return (int)flushed;
 }
 
+#ifdef HAVE_SYS_UIO_H
+/** Fill in up to <b>max_iov</b> entries of <b>iov</b> to describe the first
+ * <b>sz</b> bytes of <b>buf</b>, one entry per chunk.  Set *<b>len_out</b>
+ * to the number of bytes they describe, and return the number of entries
+ * used. */
+int
+buf_get_iovecs(const buf_t *buf, size_t sz, struct iovec *iov, int max_iov,
+               size_t *len_out)
+{
+  int n_iov = 0;
+  size_t len = 0;
+  const chunk_t *chunk;
+
+  for (chunk = buf->head; chunk && len < sz && n_iov < max_iov;
+       chunk = chunk->next) {
+    size_t n = MIN(chunk->datalen, sz - len);
+    iov[n_iov].iov_base = (void *)chunk->data;
+    iov[n_iov].iov_len = n;
+    ++n_iov;
+    len += n;
+  }
+  *len_out = len;
+  return n_iov;
+}
+#endif
+
+/** We have just tried to write the front of <b>buf</b> to a socket somewhere
+ * other than flush_buf(), and gotten <b>write_result</b>: the number of
+ * bytes written, or a negative errno value.  Remove the written bytes from
+ * <b>buf</b> and from *<b>buf_flushlen</b>, and return as flush_buf() would.
+ * On error, set errno to the error we got. */
+int
+flush_buf_note_written(buf_t *buf, int write_result, size_t *buf_flushlen)
+{
+  tor_assert(buf_flushlen);
+  tor_assert(*buf_flushlen <= buf->datalen);
+
+  check();
+  if (write_result < 0) {
+    int e = -write_result;
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      errno = e;
+      return -1;
+    }
+    log_debug(LD_NET,"write() would block, returning.");
+    return 0;
+  }
+  tor_assert((size_t)write_result <= *buf_flushlen);
+  *buf_flushlen -= write_result;
+  buf_remove_from_front(buf, write_result);
+  check();
+  return write_result;
+}
+
+/** We have just written <b>n_written</b> bytes from the front of <b>buf</b>
+ * to a TLS connection, in <b>n_records</b> records, somewhere other than
+ * flush_buf_tls().  Remove those bytes from <b>buf</b> and from
+ * *<b>buf_flushlen</b>, as flush_buf_tls() would. */
+void
+flush_buf_tls_note_written(buf_t *buf, size_t n_written, size_t n_records,
+                           size_t *buf_flushlen)
+{
+  tor_assert(buf_flushlen);
+  tor_assert(n_written <= buf->datalen);
+
+  check();
+  n_tls_records_written += n_records;
+  n_tls_bytes_written += n_written;
+  if (*buf_flushlen > n_written)
+    *buf_flushlen -= n_written;
+  else
+    *buf_flushlen = 0;
+  buf_remove_from_front(buf, n_written);
+  check();
+}
+
+/** Make sure that the last chunk of <b>buf</b> has some free space, adding
+ * a chunk as read_to_buf_tls() would, and return a pointer to that space.
+ * Set *<b>len_out</b> to the number of bytes there, but no more than
+ * <b>at_most</b>.  Whatever puts data in that space must then call
+ * buf_note_read() to add it to the buffer, before anything else changes
+ * <b>buf</b>. */
+char *
+buf_get_read_space(buf_t *buf, size_t at_most, size_t *len_out)
+{
+  chunk_t *chunk;
+
+  check();
+  if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN)
+    chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
+  else
+    chunk = buf->tail;
+  *len_out = MIN(at_most, CHUNK_REMAINING_CAPACITY(chunk));
+  return CHUNK_WRITE_PTR(chunk);
+}
+
+/** We have just put <b>n</b> bytes into the space that buf_get_read_space()
+ * returned for <b>buf</b>.  Add them to the buffer. */
+void
+buf_note_read(buf_t *buf, size_t n)
+{
+  tor_assert(buf->tail);
+  tor_assert(CHUNK_REMAINING_CAPACITY(buf->tail) >= n);
+
+  buf->tail->datalen += n;
+  buf->datalen += n;
+  check();
+}
+
+/** Set up to <b>max_chunks</b> entries of <b>data_out</b> and
+ * <b>len_out</b> to describe the first <b>sz</b> bytes of <b>buf</b>, one
+ * entry per chunk.  Set *<b>total_out</b> to the number of bytes they
+ * describe, and return the number of entries used.  The data stays where
+ * it is until it's removed from the front of <b>buf</b>, even if more data
+ * is added to the end. */
+int
+buf_get_chunk_data(const buf_t *buf, size_t sz, const char **data_out,
+                   size_t *len_out, int max_chunks, size_t *total_out)
+{
+  int n_chunks = 0;
+  size_t total = 0;
+  const chunk_t *chunk;
+
+  for (chunk = buf->head; chunk && total < sz && n_chunks < max_chunks;
+       chunk = chunk->next) {
+    size_t n = MIN(chunk->datalen, sz - total);
+    if (!n)
+      continue;
+    data_out[n_chunks] = chunk->data;
+    len_out[n_chunks] = n;
+    ++n_chunks;
+    total += n;
+  }
+  *total_out = total;
+  return n_chunks;
+}
+
 /** As flush_buf(), but writes data to a TLS connection.  Can write more than
  * <b>flushlen</b> bytes.
  */
@@ -984,10 +1302,10 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
   do {
     size_t flushlen0;
     if (buf->head) {
-      if ((ssize_t)buf->head->datalen >= sz)
-        flushlen0 = sz;
-      else
-        flushlen0 = buf->head->datalen;
+      /* Write one record at a time.  Don't send a short record just
+       * because the chunk is short: flush_chunk_tls() will gather data
+       * from the next chunks to fill the record. */
+      flushlen0 = MIN(sz, TOR_TLS_MAX_RECORD_PLAINTEXT);
     } else {
       flushlen0 = 0;
     }
@@ -36,7 +36,21 @@ int read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
 int read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf);
 
 int flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen);
+#ifdef HAVE_SYS_UIO_H
+struct iovec;
+int buf_get_iovecs(const buf_t *buf, size_t sz, struct iovec *iov,
+                   int max_iov, size_t *len_out);
+#endif
+int flush_buf_note_written(buf_t *buf, int write_result,
+                           size_t *buf_flushlen);
 int flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t sz, size_t *buf_flushlen);
+void flush_buf_tls_note_written(buf_t *buf, size_t n_written, size_t n_records,
+                                size_t *buf_flushlen);
+void buf_get_tls_write_stats(uint64_t *records_out, uint64_t *bytes_out);
+char *buf_get_read_space(buf_t *buf, size_t at_most, size_t *len_out);
+void buf_note_read(buf_t *buf, size_t n);
+int buf_get_chunk_data(const buf_t *buf, size_t sz, const char **data_out,
+                       size_t *len_out, int max_chunks, size_t *total_out);
 
 int write_to_buf(const char *string, size_t string_len, buf_t *buf);
 int write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
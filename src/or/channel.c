@@ -847,6 +847,8 @@ channel_free(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  channel_free_circid_table(chan);
+
   /* We're in CLOSED or ERROR, so the cell queue is already empty */
 
   tor_free(chan);
@@ -923,6 +925,8 @@ channel_force_free(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  channel_free_circid_table(chan);
+
   /* We might still have a cell queue; kill it */
   TOR_SIMPLEQ_FOREACH_SAFE(cell, &chan->incoming_queue, next, cell_tmp) {
       cell_queue_entry_free(cell, 0);
@@ -1096,6 +1100,27 @@ channel_set_cell_handlers(channel_t *chan,
        chan->var_cell_handler)) channel_process_cells(chan);
 }
 
+/**
+ * Set the handler for runs of fixed-length cells on a channel
+ *
+ * This function sets the optional handler that channel_queue_cells() uses
+ * to hand several incoming fixed-length cells to the upper layer at once.
+ */
+
+void
+channel_set_cells_handler(channel_t *chan,
+                          channel_cells_handler_fn_ptr cells_handler)
+{
+  tor_assert(chan);
+  tor_assert(CHANNEL_CAN_HANDLE_CELLS(chan));
+
+  log_debug(LD_CHANNEL,
+           "Setting cells_handler callback for channel %p to %p",
+           chan, cells_handler);
+
+  chan->cells_handler = cells_handler;
+}
+
 /*
  * On closing channels
  *
@@ -2744,6 +2769,52 @@ channel_queue_cell(channel_t *chan, cell_t *cell)
   }
 }
 
+/**
+ * Queue a run of incoming cells
+ *
+ * This should be called by a channel_t subclass that has read several
+ * fixed-length cells at once; it behaves like calling channel_queue_cell()
+ * on each of the <b>n_cells</b> cells in <b>cells</b> in turn, but hands
+ * them to the cells_handler together when nothing is queued ahead of them.
+ */
+
+void
+channel_queue_cells(channel_t *chan, cell_t *cells, int n_cells)
+{
+  int i;
+
+  tor_assert(chan);
+  tor_assert(cells || n_cells == 0);
+  tor_assert(CHANNEL_IS_OPEN(chan));
+
+  if (!(chan->cells_handler && chan->cell_handler) ||
+      ! TOR_SIMPLEQ_EMPTY(&chan->incoming_queue)) {
+    /* Stop if one of the cells closes the channel, as the lower layer
+     * would when handing them over one at a time. */
+    for (i = 0; i < n_cells && CHANNEL_IS_OPEN(chan); ++i)
+      channel_queue_cell(chan, &cells[i]);
+    return;
+  }
+
+  if (n_cells == 0)
+    return;
+
+  /* Timestamp for receiving */
+  channel_timestamp_recv(chan);
+
+  /* Update the counters */
+  chan->n_cells_recved += n_cells;
+  chan->n_bytes_recved +=
+    (uint64_t)n_cells * get_cell_network_size(chan->wide_circ_ids);
+
+  log_debug(LD_CHANNEL,
+            "Directly handling %d incoming cells for channel %p "
+            "(global ID " U64_FORMAT ")",
+            n_cells, chan,
+            U64_PRINTF_ARG(chan->global_identifier));
+  chan->cells_handler(chan, cells, n_cells);
+}
+
 /**
  * Queue incoming variable-length cell
  *
@@ -16,6 +16,7 @@
 typedef void (*channel_listener_fn_ptr)(channel_listener_t *, channel_t *);
 typedef void (*channel_cell_handler_fn_ptr)(channel_t *, cell_t *);
 typedef void (*channel_var_cell_handler_fn_ptr)(channel_t *, var_cell_t *);
+typedef void (*channel_cells_handler_fn_ptr)(channel_t *, cell_t *, int);
 
 struct cell_queue_entry_s;
 TOR_SIMPLEQ_HEAD(chan_cell_queue, cell_queue_entry_s) incoming_queue;
@@ -101,6 +102,9 @@ struct channel_s {
   /** Registered handlers for incoming cells */
   channel_cell_handler_fn_ptr cell_handler;
   channel_var_cell_handler_fn_ptr var_cell_handler;
+  /** Optional handler for a run of fixed-length cells; if set, it must
+   * behave as if cell_handler had been called on each of them in turn. */
+  channel_cells_handler_fn_ptr cells_handler;
 
   /* Methods implemented by the lower layer */
 
@@ -188,6 +192,15 @@ struct channel_s {
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
 
+  /** Open-addressed table of this channel's entries in the circuit ID map,
+   * indexed by circuit ID; maintained by circuitlist.c. */
+  struct chan_circid_circuit_map_t **circid_table;
+  /** How many slots does circid_table have, and how many are in use? */
+  unsigned int circid_table_size, circid_table_n;
+  /** The entry most recently looked up in circid_table; used to improve
+   * performance when many cells arrive in a row for the same circuit. */
+  struct chan_circid_circuit_map_t *last_circid_ent;
+
   /**
    * True iff this channel shouldn't get any new circs attached to it,
    * because the connection is too old, or because there's a better one.
@@ -335,6 +348,8 @@ void channel_set_cell_handlers(channel_t *chan,
                                channel_cell_handler_fn_ptr cell_handler,
                                channel_var_cell_handler_fn_ptr
                                  var_cell_handler);
+void channel_set_cells_handler(channel_t *chan,
+                               channel_cells_handler_fn_ptr cells_handler);
 
 /* Clean up closed channels and channel listeners periodically; these are
  * called from run_scheduled_events() in main.c.
@@ -451,6 +466,7 @@ void channel_listener_queue_incoming(channel_listener_t *listener,
 /* Incoming cell handling */
 void channel_process_cells(channel_t *chan);
 void channel_queue_cell(channel_t *chan, cell_t *cell);
+void channel_queue_cells(channel_t *chan, cell_t *cells, int n_cells);
 void channel_queue_var_cell(channel_t *chan, var_cell_t *var_cell);
 
 /* Outgoing cell handling */
@@ -1101,6 +1101,63 @@ channel_tls_handle_cell(cell_t *cell, or_connection_t *conn)
   }
 }
 
+/**
+ * Handle several incoming cells on a channel_tls_t
+ *
+ * This is called from connection_or.c with the <b>n_cells</b> cells in
+ * <b>cells</b>, which arrived in that order on <b>conn</b> after its
+ * handshake was done.  It behaves like calling channel_tls_handle_cell() on
+ * each of them in turn, but hands each run of cells for the channel_t layer
+ * to channel_queue_cells() together.
+ */
+
+void
+channel_tls_handle_cells(cell_t *cells, int n_cells, or_connection_t *conn)
+{
+  channel_tls_t *chan;
+  int i, run_start = 0;
+
+  tor_assert(cells || n_cells == 0);
+  tor_assert(conn);
+  tor_assert(TO_CONN(conn)->state == OR_CONN_STATE_OPEN);
+
+  chan = conn->chan;
+  if (!chan) {
+    log_warn(LD_CHANNEL,
+             "Got a cell_t on an OR connection with no channel");
+    return;
+  }
+
+  for (i = 0; i < n_cells; ++i) {
+    switch (cells[i].command) {
+      case CELL_CREATE:
+      case CELL_CREATE_FAST:
+      case CELL_CREATED:
+      case CELL_CREATED_FAST:
+      case CELL_RELAY:
+      case CELL_RELAY_EARLY:
+      case CELL_DESTROY:
+      case CELL_CREATE2:
+      case CELL_CREATED2:
+        continue;
+      default:
+        break;
+    }
+    if (i > run_start) {
+      if (conn->base_.marked_for_close)
+        return;
+      channel_queue_cells(TLS_CHAN_TO_BASE(chan), cells + run_start,
+                          i - run_start);
+    }
+    channel_tls_handle_cell(&cells[i], conn);
+    run_start = i + 1;
+  }
+
+  if (n_cells > run_start && !conn->base_.marked_for_close)
+    channel_queue_cells(TLS_CHAN_TO_BASE(chan), cells + run_start,
+                        n_cells - run_start);
+}
+
 /**
  * Handle an incoming variable-length cell on a channel_tls_t
  *
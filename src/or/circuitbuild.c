@@ -1475,16 +1475,11 @@ node_handles_some_port(const node_t *node, smartlist_t *needed_ports)
   uint16_t port;
 
   for (i = 0; i < smartlist_len(needed_ports); ++i) {
-    addr_policy_result_t r;
     /* alignment issues aren't a worry for this dereference, since
        needed_ports is explicitly a smartlist of uint16_t's */
     port = *(uint16_t *)smartlist_get(needed_ports, i);
     tor_assert(port);
-    if (node)
-      r = compare_tor_addr_to_node_policy(NULL, port, node);
-    else
-      continue;
-    if (r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED)
+    if (node && node_exit_policy_might_accept_port(node, port))
       return 1;
   }
   return 0;
@@ -1524,8 +1519,9 @@ static const node_t *
 choose_good_exit_server_general(int need_uptime, int need_capacity)
 {
   int *n_supported;
+  int i, n_nodes;
   int n_pending_connections = 0;
-  smartlist_t *connections;
+  smartlist_t *connections, *pending, *pending_by_port;
   int best_support = -1;
   int n_best_support=0;
   const or_options_t *options = get_options();
@@ -1534,13 +1530,21 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
 
   connections = get_connection_array();
 
-  /* Count how many connections are waiting for a circuit to be built.
-   * We use this for log messages now, but in the future we may depend on it.
-   */
+  /* Find the connections that are waiting for a circuit to be built.  Put
+   * the ones whose choice of exit depends only on their port in
+   * pending_by_port, so we can count them using the exit port index
+   * rather than asking every node about them. */
+  pending = smartlist_new();
+  pending_by_port = smartlist_new();
   SMARTLIST_FOREACH(connections, connection_t *, conn,
   {
-    if (ap_stream_wants_exit_attention(conn))
+    if (ap_stream_wants_exit_attention(conn)) {
       ++n_pending_connections;
+      if (connection_ap_can_use_exit_by_port_only(TO_ENTRY_CONN(conn)))
+        smartlist_add(pending_by_port, conn);
+      else
+        smartlist_add(pending, conn);
+    }
   });
 //  log_fn(LOG_DEBUG, "Choosing exit node; %d connections are pending",
 //         n_pending_connections);
@@ -1552,9 +1556,10 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
    * -1 means "Don't use this router at all."
    */
   the_nodes = nodelist_get_list();
-  n_supported = tor_calloc(smartlist_len(the_nodes), sizeof(int));
+  n_nodes = smartlist_len(the_nodes);
+  n_supported = tor_calloc(n_nodes, sizeof(int));
   SMARTLIST_FOREACH_BEGIN(the_nodes, const node_t *, node) {
-    const int i = node_sl_idx;
+    i = node_sl_idx;
     if (router_digest_is_me(node->identity)) {
       n_supported[i] = -1;
 //      log_fn(LOG_DEBUG,"Skipping node %s -- it's me.", router->nickname);
@@ -1613,9 +1618,7 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
     }
     n_supported[i] = 0;
     /* iterate over connections */
-    SMARTLIST_FOREACH_BEGIN(connections, connection_t *, conn) {
-      if (!ap_stream_wants_exit_attention(conn))
-        continue; /* Skip everything but APs in CIRCUIT_WAIT */
+    SMARTLIST_FOREACH_BEGIN(pending, connection_t *, conn) {
       if (connection_ap_can_use_exit(TO_ENTRY_CONN(conn), node)) {
         ++n_supported[i];
 //        log_fn(LOG_DEBUG,"%s is supported. n_supported[%d] now %d.",
@@ -1625,6 +1628,25 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
 //               router->nickname, i);
       }
     } SMARTLIST_FOREACH_END(conn);
+  } SMARTLIST_FOREACH_END(node);
+
+  /* Now count the streams that only care about their port.  Every node we
+   * haven't ruled out is outside ExcludeExitNodes, so a node supports such
+   * a stream exactly when it might accept the stream's port. */
+  SMARTLIST_FOREACH_BEGIN(pending_by_port, connection_t *, conn) {
+    const uint16_t port = TO_ENTRY_CONN(conn)->socks_request->port;
+    const bitarray_t *accepts = nodelist_get_exit_port_bitarray(port);
+    for (i = 0; i < n_nodes; ++i) {
+      if (n_supported[i] >= 0 && bitarray_is_set(accepts, i))
+        ++n_supported[i];
+    }
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_free(pending);
+  smartlist_free(pending_by_port);
+
+  for (i = 0; i < n_nodes; ++i) {
+    if (n_supported[i] == -1)
+      continue;
     if (n_pending_connections > 0 && n_supported[i] == 0) {
       /* Leave best_support at -1 if that's where it is, so we can
        * distinguish it later. */
@@ -1641,7 +1663,7 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
        * count of equally good routers.*/
       ++n_best_support;
     }
-  } SMARTLIST_FOREACH_END(node);
+  }
   log_info(LD_CIRC,
            "Found %d servers that might support %d/%d pending connections.",
            n_best_support, best_support >= 0 ? best_support : 0,
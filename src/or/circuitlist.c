@@ -21,6 +21,7 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "main.h"
 #include "networkstatus.h"
 #include "nodelist.h"
@@ -41,6 +42,10 @@
 /** A global list of all circuits at this hop. */
 static smartlist_t *global_circuitlist = NULL;
 
+/** A global list of all origin circuits. Every element of this is also
+ * an element of global_circuitlist. */
+static smartlist_t *global_origin_circuit_list = NULL;
+
 /** A list of all the circuits in CIRCUIT_STATE_CHAN_WAIT. */
 static smartlist_t *circuits_pending_chans = NULL;
 
@@ -98,11 +103,163 @@ HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
              chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
              tor_reallocarray_, tor_free_)
 
-/** The most recently returned entry from circuit_get_by_circid_chan;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
+/* Every entry in chan_circid_map is also in its channel's circid_table,
+ * which is what we search when we know the channel: it's smaller, and it
+ * doesn't have to hash the channel pointer.  chan_circid_map owns the
+ * entries, and is still what we walk when we need all of them. */
+
+/** How many slots does a channel's circid_table start with? */
+#define CHAN_CIRCID_TABLE_MIN_SIZE 16
+
+/** Helper: return a hash of <b>circ_id</b> for a channel's circid_table.
+ * The other side picks half of the IDs on each channel, so this needs to be
+ * a keyed hash. */
+static INLINE unsigned int
+chan_circid_table_hash_(circid_t circ_id)
+{
+  uint32_t id = circ_id;
+  return (unsigned) siphash24g(&id, sizeof(id));
+}
+
+/** Helper: return the index of the slot in <b>chan</b>'s circid_table that
+ * holds the entry for <b>circ_id</b>, or of the empty slot where it would
+ * go. The table must not be empty. */
+static INLINE unsigned int
+chan_circid_table_slot(const channel_t *chan, circid_t circ_id)
+{
+  const unsigned int mask = chan->circid_table_size - 1;
+  unsigned int i = chan_circid_table_hash_(circ_id) & mask;
+  chan_circid_circuit_map_t *ent;
+  while ((ent = chan->circid_table[i]) && ent->circ_id != circ_id)
+    i = (i + 1) & mask;
+  return i;
+}
+
+/** Return the entry for <b>circ_id</b> in <b>chan</b>'s circid_table, or
+ * NULL if there is none. */
+static INLINE chan_circid_circuit_map_t *
+chan_circid_table_find(channel_t *chan, circid_t circ_id)
+{
+  chan_circid_circuit_map_t *ent = chan->last_circid_ent;
+  if (ent && ent->circ_id == circ_id)
+    return ent;
+  if (!chan->circid_table_n)
+    return NULL;
+  ent = chan->circid_table[chan_circid_table_slot(chan, circ_id)];
+  if (ent)
+    chan->last_circid_ent = ent;
+  return ent;
+}
+
+/** Add <b>ent</b>, which must not already be there, to the circid_table of
+ * its channel, growing the table if it's half full. */
+static void
+chan_circid_table_add(chan_circid_circuit_map_t *ent)
+{
+  channel_t *chan = ent->chan;
+  unsigned int i;
+
+  if ((chan->circid_table_n + 1) * 2 > chan->circid_table_size) {
+    chan_circid_circuit_map_t **old_table = chan->circid_table;
+    unsigned int old_size = chan->circid_table_size;
+    chan->circid_table_size = old_size ? old_size * 2 :
+      CHAN_CIRCID_TABLE_MIN_SIZE;
+    chan->circid_table = tor_calloc(chan->circid_table_size,
+                                    sizeof(chan_circid_circuit_map_t *));
+    for (i = 0; i < old_size; ++i) {
+      if (old_table[i]) {
+        chan->circid_table[chan_circid_table_slot(chan,
+                                                  old_table[i]->circ_id)] =
+          old_table[i];
+      }
+    }
+    tor_free(old_table);
+  }
+
+  i = chan_circid_table_slot(chan, ent->circ_id);
+  tor_assert(chan->circid_table[i] == NULL);
+  chan->circid_table[i] = ent;
+  ++chan->circid_table_n;
+}
+
+/** Remove the entry for <b>circ_id</b> from <b>chan</b>'s circid_table,
+ * and return it, or NULL if there was none. */
+static chan_circid_circuit_map_t *
+chan_circid_table_remove(channel_t *chan, circid_t circ_id)
+{
+  const unsigned int mask = chan->circid_table_size - 1;
+  chan_circid_circuit_map_t *ent;
+  unsigned int i, j, k;
+
+  if (!chan->circid_table_n)
+    return NULL;
+  i = chan_circid_table_slot(chan, circ_id);
+  ent = chan->circid_table[i];
+  if (!ent)
+    return NULL;
+  chan->circid_table[i] = NULL;
+  --chan->circid_table_n;
+  if (chan->last_circid_ent == ent)
+    chan->last_circid_ent = NULL;
+
+  /* Move back any entries later in the same run that can no longer be
+   * reached from their home slot because of the hole at i. */
+  for (j = (i + 1) & mask; chan->circid_table[j]; j = (j + 1) & mask) {
+    k = chan_circid_table_hash_(chan->circid_table[j]->circ_id) & mask;
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    chan->circid_table[i] = chan->circid_table[j];
+    chan->circid_table[j] = NULL;
+    i = j;
+  }
+  return ent;
+}
+
+/** Add <b>ent</b> to chan_circid_map and to its channel's circid_table. */
+static void
+chan_circid_map_add(chan_circid_circuit_map_t *ent)
+{
+  HT_INSERT(chan_circid_map, &chan_circid_map, ent);
+  chan_circid_table_add(ent);
+}
+
+/** Remove the entry for <b>chan</b> and <b>circ_id</b> from
+ * chan_circid_map and from <b>chan</b>'s circid_table, and return it, or
+ * NULL if there was none. */
+static chan_circid_circuit_map_t *
+chan_circid_map_remove(channel_t *chan, circid_t circ_id)
+{
+  chan_circid_circuit_map_t *ent = chan_circid_table_remove(chan, circ_id);
+  if (ent)
+    HT_REMOVE(chan_circid_map, &chan_circid_map, ent);
+  return ent;
+}
+
+/** Remove every entry left in <b>chan</b>'s circid_table from
+ * chan_circid_map, free them, and free the table.  Called when we're about
+ * to free <b>chan</b>. */
+void
+channel_free_circid_table(channel_t *chan)
+{
+  unsigned int i;
+  tor_assert(chan);
+
+  for (i = 0; i < chan->circid_table_size; ++i) {
+    chan_circid_circuit_map_t *ent = chan->circid_table[i];
+    if (!ent)
+      continue;
+    if (ent->circuit) {
+      log_warn(LD_BUG, "Freeing channel %p while circuit %p still uses "
+               "circuit ID %u on it.", chan, ent->circuit,
+               (unsigned)ent->circ_id);
+    }
+    HT_REMOVE(chan_circid_map, &chan_circid_map, ent);
+    tor_free(ent);
+  }
+  tor_free(chan->circid_table);
+  chan->circid_table_size = chan->circid_table_n = 0;
+  chan->last_circid_ent = NULL;
+}
 
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
@@ -113,7 +270,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
                                circid_t id,
                                channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
   channel_t *old_chan, **chan_ptr;
   circid_t old_id, *circid_ptr;
@@ -135,14 +291,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (id == old_id && chan == old_chan)
     return;
 
-  if (_last_circid_chan_ent &&
-      ((old_id == _last_circid_chan_ent->circ_id &&
-        old_chan == _last_circid_chan_ent->chan) ||
-       (id == _last_circid_chan_ent->circ_id &&
-        chan == _last_circid_chan_ent->chan))) {
-    _last_circid_chan_ent = NULL;
-  }
-
   if (old_chan) {
     /*
      * If we're changing channels or ID and had an old channel and a non
@@ -157,9 +305,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     }
 
     /* we may need to remove it from the conn-circid map */
-    search.circ_id = old_id;
-    search.chan = old_chan;
-    found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+    found = chan_circid_map_remove(old_chan, old_id);
     if (found) {
       tor_free(found);
       if (direction == CELL_DIRECTION_OUT) {
@@ -169,6 +315,9 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
         /* One fewer circuits use old_chan as p_chan */
         --(old_chan->num_p_circuits);
       }
+      /* The channel's idle timeout counts from when it last had this
+       * circuit. */
+      old_chan->timestamp_last_had_circuits = approx_time();
     }
   }
 
@@ -181,9 +330,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     return;
 
   /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.chan = chan;
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  found = chan_circid_table_find(chan, id);
   if (found) {
     found->circuit = circ;
     found->made_placeholder_at = 0;
@@ -192,7 +339,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     found->circ_id = id;
     found->chan = chan;
     found->circuit = circ;
-    HT_INSERT(chan_circid_map, &chan_circid_map, found);
+    chan_circid_map_add(found);
   }
 
   /*
@@ -229,14 +376,10 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
 void
 channel_mark_circid_unusable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  ent = chan_circid_table_find(chan, id);
 
   if (ent && ent->circuit) {
     /* we have a problem. */
@@ -252,7 +395,7 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
     ent->circ_id = id;
     /* leave circuit at NULL. */
     ent->made_placeholder_at = approx_time();
-    HT_INSERT(chan_circid_map, &chan_circid_map, ent);
+    chan_circid_map_add(ent);
   }
 }
 
@@ -262,22 +405,19 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
 void
 channel_mark_circid_usable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+  ent = chan_circid_table_find(chan, id);
   if (ent && ent->circuit) {
     log_warn(LD_BUG, "Tried to mark %u usable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
     return;
   }
-  if (_last_circid_chan_ent == ent)
-    _last_circid_chan_ent = NULL;
-  tor_free(ent);
+  if (ent) {
+    chan_circid_map_remove(chan, id);
+    tor_free(ent);
+  }
 }
 
 /** Called to indicate that a DESTROY is pending on <b>chan</b> with
@@ -472,6 +612,16 @@ circuit_get_global_list,(void))
   return global_circuitlist;
 }
 
+/** Return a list of all the origin circuits: a subset of
+ * circuit_get_global_list(), for the many callers that only want those. */
+smartlist_t *
+circuit_get_global_origin_circuit_list(void)
+{
+  if (NULL == global_origin_circuit_list)
+    global_origin_circuit_list = smartlist_new();
+  return global_origin_circuit_list;
+}
+
 /** Function to make circ-\>state human-readable */
 const char *
 circuit_state_to_string(int state)
@@ -711,6 +861,11 @@ origin_circuit_new(void)
 
   init_circuit_base(TO_CIRCUIT(circ));
 
+  /* Add to the origin circuit list. */
+  smartlist_add(circuit_get_global_origin_circuit_list(), circ);
+  circ->global_origin_circuit_list_idx =
+    smartlist_len(global_origin_circuit_list) - 1;
+
   circuit_build_times_update_last_circ(get_circuit_build_times_mutable());
 
   return circ;
@@ -738,6 +893,136 @@ or_circuit_new(circid_t p_circ_id, channel_t *p_chan)
   return circ;
 }
 
+/** Once an OR circuit has more than this many streams on n_streams, index
+ * them by stream ID. */
+#define N_STREAMS_MAP_THRESHOLD 32
+
+/** Value for a stream ID in a stream_id_map_t that more than one stream on
+ * the list uses. */
+#define STREAM_ID_MAP_AMBIGUOUS ((edge_connection_t *)(uintptr_t)1)
+
+/** An index of the streams on an OR circuit's n_streams list by stream ID:
+ * a two-level array, so that an adversary who picks the stream IDs can't
+ * make lookups slow.  Each slot is NULL if no stream on the list has that
+ * ID, the stream if exactly one does, and STREAM_ID_MAP_AMBIGUOUS if
+ * several do. */
+typedef struct stream_id_map_t {
+  edge_connection_t **pages[256];
+} stream_id_map_t;
+
+/** Return a pointer to the slot in <b>map</b> for <b>stream_id</b>.  If
+ * <b>create</b> is false and the slot doesn't exist yet, return NULL. */
+static edge_connection_t **
+stream_id_map_slot(stream_id_map_t *map, streamid_t stream_id, int create)
+{
+  edge_connection_t ***page = &map->pages[stream_id >> 8];
+  if (!*page) {
+    if (!create)
+      return NULL;
+    *page = tor_calloc(256, sizeof(edge_connection_t *));
+  }
+  return &(*page)[stream_id & 0xff];
+}
+
+/** Free all storage held by <b>map</b>. */
+static void
+stream_id_map_free(stream_id_map_t *map)
+{
+  int i;
+  if (!map)
+    return;
+  for (i = 0; i < 256; ++i)
+    tor_free(map->pages[i]);
+  tor_free(map);
+}
+
+/** Add <b>conn</b>, which was just put on <b>circ</b>'s n_streams, to
+ * <b>circ</b>'s n_streams_map. */
+static void
+or_circuit_n_streams_map_add(or_circuit_t *circ, edge_connection_t *conn)
+{
+  edge_connection_t **slot =
+    stream_id_map_slot(circ->n_streams_map, conn->stream_id, 1);
+  *slot = *slot ? STREAM_ID_MAP_AMBIGUOUS : conn;
+}
+
+/** Put <b>conn</b> at the head of <b>circ</b>'s n_streams list, and index
+ * it if the list is long enough. */
+void
+or_circuit_add_n_stream(or_circuit_t *circ, edge_connection_t *conn)
+{
+  tor_assert(circ);
+  tor_assert(conn);
+
+  conn->next_stream = circ->n_streams;
+  circ->n_streams = conn;
+  ++circ->n_streams_count;
+
+  if (circ->n_streams_map) {
+    or_circuit_n_streams_map_add(circ, conn);
+  } else if (circ->n_streams_count > N_STREAMS_MAP_THRESHOLD) {
+    edge_connection_t *c;
+    circ->n_streams_map = tor_malloc_zero(sizeof(stream_id_map_t));
+    for (c = circ->n_streams; c; c = c->next_stream)
+      or_circuit_n_streams_map_add(circ, c);
+  }
+}
+
+/** Called when <b>conn</b> has just been taken off <b>circ</b>'s n_streams
+ * list: forget about it. */
+void
+or_circuit_note_n_stream_removed(or_circuit_t *circ, edge_connection_t *conn)
+{
+  edge_connection_t **slot, *c;
+
+  tor_assert(circ);
+  tor_assert(conn);
+  tor_assert(circ->n_streams_count > 0);
+
+  --circ->n_streams_count;
+  if (!circ->n_streams_map)
+    return;
+  if (circ->n_streams_count < N_STREAMS_MAP_THRESHOLD / 2) {
+    stream_id_map_free(circ->n_streams_map);
+    circ->n_streams_map = NULL;
+    return;
+  }
+
+  slot = stream_id_map_slot(circ->n_streams_map, conn->stream_id, 0);
+  tor_assert(slot && *slot);
+  if (*slot != STREAM_ID_MAP_AMBIGUOUS) {
+    tor_assert(*slot == conn);
+    *slot = NULL;
+    return;
+  }
+  /* Find out which streams are still using this ID. */
+  *slot = NULL;
+  for (c = circ->n_streams; c; c = c->next_stream) {
+    if (c->stream_id == conn->stream_id)
+      *slot = *slot ? STREAM_ID_MAP_AMBIGUOUS : c;
+  }
+}
+
+/** Look up <b>stream_id</b> in <b>circ</b>'s index of n_streams.  If it
+ * has one, and at most one stream on the list has that ID, set
+ * *<b>conn_out</b> to that stream or to NULL and return 1.  Otherwise
+ * return 0; the caller has to walk the list.
+ */
+int
+or_circuit_find_n_stream(const or_circuit_t *circ, streamid_t stream_id,
+                         edge_connection_t **conn_out)
+{
+  edge_connection_t **slot;
+
+  if (!circ->n_streams_map)
+    return 0;
+  slot = stream_id_map_slot(circ->n_streams_map, stream_id, 0);
+  if (slot && *slot == STREAM_ID_MAP_AMBIGUOUS)
+    return 0;
+  *conn_out = slot ? *slot : NULL;
+  return 1;
+}
+
 /** Deallocate space associated with circ.
  */
 STATIC void
@@ -753,6 +1038,17 @@ circuit_free(circuit_t *circ)
     mem = ocirc;
     memlen = sizeof(origin_circuit_t);
     tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
+
+    if (ocirc->global_origin_circuit_list_idx != -1) {
+      int idx = ocirc->global_origin_circuit_list_idx;
+      origin_circuit_t *c2 = smartlist_get(global_origin_circuit_list, idx);
+      tor_assert(c2 == ocirc);
+      smartlist_del(global_origin_circuit_list, idx);
+      if (idx < smartlist_len(global_origin_circuit_list)) {
+        c2 = smartlist_get(global_origin_circuit_list, idx);
+        c2->global_origin_circuit_list_idx = idx;
+      }
+    }
     if (ocirc->build_state) {
         extend_info_free(ocirc->build_state->chosen_exit);
         circuit_free_cpath_node(ocirc->build_state->pending_final_cpath);
@@ -784,11 +1080,18 @@ circuit_free(circuit_t *circ)
     memlen = sizeof(or_circuit_t);
     tor_assert(circ->magic == OR_CIRCUIT_MAGIC);
 
+    /* If a cpuworker still has our handshake, make sure it won't try to
+     * tell us about the answer. */
+    if (ocirc->workqueue_entry)
+      cpuworker_cancel_circ_handshake(ocirc);
+
     crypto_cipher_free(ocirc->p_crypto);
     crypto_digest_free(ocirc->p_digest);
     crypto_cipher_free(ocirc->n_crypto);
     crypto_digest_free(ocirc->n_digest);
 
+    stream_id_map_free(ocirc->n_streams_map);
+
     circuit_clear_rend_token(ocirc);
 
     if (ocirc->rend_splice) {
@@ -879,6 +1182,9 @@ circuit_free_all(void)
   smartlist_free(lst);
   global_circuitlist = NULL;
 
+  smartlist_free(global_origin_circuit_list);
+  global_origin_circuit_list = NULL;
+
   smartlist_free(circuits_pending_chans);
   circuits_pending_chans = NULL;
 
@@ -891,6 +1197,7 @@ circuit_free_all(void)
       next = HT_NEXT_RMV(chan_circid_map, &chan_circid_map, elt);
 
       tor_assert(c->circuit == NULL);
+      chan_circid_table_remove(c->chan, c->circ_id);
       tor_free(c);
     }
   }
@@ -1021,19 +1328,9 @@ static INLINE circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
-  if (_last_circid_chan_ent &&
-      circ_id == _last_circid_chan_ent->circ_id &&
-      chan == _last_circid_chan_ent->chan) {
-    found = _last_circid_chan_ent;
-  } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-    _last_circid_chan_ent = found;
-  }
+  found = chan_circid_table_find(chan, circ_id);
   if (found && found->circuit) {
     log_debug(LD_CIRC,
               "circuit_get_by_circid_channel_impl() returning circuit %p for"
@@ -1130,14 +1427,9 @@ circuit_id_in_use_on_channel(circid_t circ_id, channel_t *chan)
 time_t
 circuit_id_when_marked_unusable_on_channel(circid_t circ_id, channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
-  memset(&search, 0, sizeof(search));
-  search.circ_id = circ_id;
-  search.chan = chan;
-
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  found = chan_circid_table_find(chan, circ_id);
 
   if (! found || found->circuit)
     return 0;
@@ -1765,6 +2057,9 @@ circuit_mark_for_close_, (circuit_t *circ, int reason, int line,
     for (conn=or_circ->n_streams; conn; conn=conn->next_stream)
       connection_edge_destroy(or_circ->p_circ_id, conn);
     or_circ->n_streams = NULL;
+    or_circ->n_streams_count = 0;
+    stream_id_map_free(or_circ->n_streams_map);
+    or_circ->n_streams_map = NULL;
 
     while (or_circ->resolving_streams) {
       conn = or_circ->resolving_streams;
@@ -1878,14 +2173,15 @@ marked_circuit_free_stream_bytes(circuit_t *c)
   }
 }
 
-/** Return the number of cells used by the circuit <b>c</b>'s cell queues. */
+/** Return the number of bytes allocated for the circuit <b>c</b>'s cell
+ * queues. */
 STATIC size_t
-n_cells_in_circ_queues(const circuit_t *c)
+circ_queues_get_allocation(const circuit_t *c)
 {
-  size_t n = c->n_chan_cells.n;
+  size_t n = cell_queue_get_allocation(&c->n_chan_cells);
   if (! CIRCUIT_IS_ORIGIN(c)) {
     circuit_t *cc = (circuit_t *) c;
-    n += TO_OR_CIRCUIT(cc)->p_chan_cells.n;
+    n += cell_queue_get_allocation(&TO_OR_CIRCUIT(cc)->p_chan_cells);
   }
   return n;
 }
@@ -1904,12 +2200,12 @@ circuit_max_queued_cell_age(const circuit_t *c, uint32_t now)
   uint32_t age = 0;
   packed_cell_t *cell;
 
-  if (NULL != (cell = TOR_SIMPLEQ_FIRST(&c->n_chan_cells.head)))
+  if (NULL != (cell = cell_queue_first(&c->n_chan_cells)))
     age = now - cell->inserted_time;
 
   if (! CIRCUIT_IS_ORIGIN(c)) {
     const or_circuit_t *orcirc = CONST_TO_OR_CIRCUIT(c);
-    if (NULL != (cell = TOR_SIMPLEQ_FIRST(&orcirc->p_chan_cells.head))) {
+    if (NULL != (cell = cell_queue_first(&orcirc->p_chan_cells))) {
       uint32_t age2 = now - cell->inserted_time;
       if (age2 > age)
         return age2;
@@ -2050,7 +2346,8 @@ circuits_handle_oom(size_t current_allocation)
              "MaxMemInQueues.)");
 
   {
-    const size_t recovered = buf_shrink_freelists(1);
+    const size_t recovered = buf_shrink_freelists(1) +
+      cell_chunk_shrink_freelists(1);
     if (recovered >= current_allocation) {
       log_warn(LD_BUG, "We somehow recovered more memory from freelists "
                "than we thought we had allocated");
@@ -2125,7 +2422,7 @@ circuits_handle_oom(size_t current_allocation)
     }
 
     /* Now, kill the circuit. */
-    n = n_cells_in_circ_queues(circ);
+    n = circ_queues_get_allocation(circ);
     if (! circ->marked_for_close) {
       circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
     }
@@ -2134,7 +2431,7 @@ circuits_handle_oom(size_t current_allocation)
 
     ++n_circuits_killed;
 
-    mem_recovered += n * packed_cell_mem_cost();
+    mem_recovered += n;
     mem_recovered += freed;
 
     if (mem_recovered >= mem_to_recover)
@@ -2148,6 +2445,7 @@ circuits_handle_oom(size_t current_allocation)
 #endif /* ENABLE_MEMPOOLS */
   buf_shrink_freelists(1); /* This is necessary to actually release buffer
                               chunks. */
+  cell_chunk_shrink_freelists(1); /* Likewise for cell chunks. */
 
   log_notice(LD_GENERAL, "Removed "U64_FORMAT" bytes by killing %d circuits; "
              "%d circuits remain alive. Also killed %d non-linked directory "
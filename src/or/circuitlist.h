@@ -15,6 +15,7 @@
 #include "testsupport.h"
 
 MOCK_DECL(smartlist_t *, circuit_get_global_list, (void));
+smartlist_t *circuit_get_global_origin_circuit_list(void);
 const char *circuit_state_to_string(int state);
 const char *circuit_purpose_to_controller_string(uint8_t purpose);
 const char *circuit_purpose_to_controller_hs_state_string(uint8_t purpose);
@@ -26,6 +27,7 @@ void circuit_set_n_circid_chan(circuit_t *circ, circid_t id,
                                channel_t *chan);
 void channel_mark_circid_unusable(channel_t *chan, circid_t id);
 void channel_mark_circid_usable(channel_t *chan, circid_t id);
+void channel_free_circid_table(channel_t *chan);
 time_t circuit_id_when_marked_unusable_on_channel(circid_t circ_id,
                                                   channel_t *chan);
 void circuit_set_state(circuit_t *circ, uint8_t state);
@@ -33,6 +35,11 @@ void circuit_close_all_marked(void);
 int32_t circuit_initial_package_window(void);
 origin_circuit_t *origin_circuit_new(void);
 or_circuit_t *or_circuit_new(circid_t p_circ_id, channel_t *p_chan);
+void or_circuit_add_n_stream(or_circuit_t *circ, edge_connection_t *conn);
+void or_circuit_note_n_stream_removed(or_circuit_t *circ,
+                                      edge_connection_t *conn);
+int or_circuit_find_n_stream(const or_circuit_t *circ, streamid_t stream_id,
+                             edge_connection_t **conn_out);
 circuit_t *circuit_get_by_circid_channel(circid_t circ_id,
                                          channel_t *chan);
 circuit_t *
@@ -77,7 +84,7 @@ MOCK_DECL(void, channel_note_destroy_not_pending,
 
 #ifdef CIRCUITLIST_PRIVATE
 STATIC void circuit_free(circuit_t *circ);
-STATIC size_t n_cells_in_circ_queues(const circuit_t *c);
+STATIC size_t circ_queues_get_allocation(const circuit_t *c);
 STATIC uint32_t circuit_max_queued_data_age(const circuit_t *c, uint32_t now);
 STATIC uint32_t circuit_max_queued_cell_age(const circuit_t *c, uint32_t now);
 STATIC uint32_t circuit_max_queued_item_age(const circuit_t *c, uint32_t now);
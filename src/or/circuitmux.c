@@ -522,16 +522,15 @@ circuitmux_detach_all_circuits(circuitmux_t *cmux, smartlist_t *detached_out)
 void
 circuitmux_mark_destroyed_circids_usable(circuitmux_t *cmux, channel_t *chan)
 {
-  packed_cell_t *cell;
   int n_bad = 0;
-  TOR_SIMPLEQ_FOREACH(cell, &cmux->destroy_cell_queue.head, next) {
+  CELL_QUEUE_FOREACH_BEGIN(&cmux->destroy_cell_queue, cell) {
     circid_t circid = 0;
     if (packed_cell_is_destroy(chan, cell, &circid)) {
       channel_mark_circid_usable(chan, circid);
     } else {
       ++n_bad;
     }
-  }
+  } CELL_QUEUE_FOREACH_END(cell);
   if (n_bad)
     log_warn(LD_BUG, "%d cell(s) on destroy queue did not look like a "
              "DESTROY cell.", n_bad);
@@ -1925,16 +1924,15 @@ circuitmux_count_queued_destroy_cells(const channel_t *chan,
 
   int64_t manual_total = 0;
   int64_t manual_total_in_map = 0;
-  packed_cell_t *cell;
 
-  TOR_SIMPLEQ_FOREACH(cell, &cmux->destroy_cell_queue.head, next) {
+  CELL_QUEUE_FOREACH_BEGIN(&cmux->destroy_cell_queue, cell) {
     circid_t id;
     ++manual_total;
 
     id = packed_cell_get_circid(cell, chan->wide_circ_ids);
     if (circuit_id_in_use_on_channel(id, (channel_t*)chan))
       ++manual_total_in_map;
-  }
+  } CELL_QUEUE_FOREACH_END(cell);
 
   if (n_destroy_cells != destroy_queue_size ||
       n_destroy_cells != manual_total ||
@@ -31,6 +31,16 @@
 /*DOCDOC*/
 #define LOG_ONEHALF -0.69314718055994529
 
+/** If the EWMA values on a circuitmux have grown by more than this factor
+ * since its reference tick, rescale them all to a later reference tick so
+ * that they can't overflow. */
+#define EWMA_MAX_SCALE 1.0e50
+
+/** The factor past which we rescale the EWMA values on a circuitmux; this
+ * is EWMA_MAX_SCALE except in tests, which set it to 1.0 to rescale on
+ * every new tick. */
+STATIC double ewma_max_scale = EWMA_MAX_SCALE;
+
 /*** EWMA structures ***/
 
 typedef struct cell_ewma_s cell_ewma_t;
@@ -73,9 +83,13 @@ struct ewma_policy_data_s {
   smartlist_t *active_circuit_pqueue;
 
   /**
-   * The tick on which the cell_ewma_ts in active_circuit_pqueue last had
-   * their ewma values rescaled.  This was formerly in channel_t, and in
-   * or_connection_t before that.
+   * The reference tick for the cell_ewma_ts in active_circuit_pqueue: their
+   * ewma values are all scaled so that a cell sent at the start of this
+   * tick has weight 1.0.  Since scaling all the values by the same factor
+   * doesn't change their order, we only move this tick (and rescale every
+   * active circuit) when the values get too large; circuits that become
+   * active are rescaled to it when they're added.  This was formerly in
+   * channel_t, and in or_connection_t before that.
    */
   unsigned int active_circuit_pqueue_last_recalibrated;
 };
@@ -153,6 +167,10 @@ static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
 static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
 static void scale_active_circuits(ewma_policy_data_t *pol,
                                   unsigned cur_tick);
+static int compare_cell_ewma_counts_across(const ewma_policy_data_t *pol1,
+                                           const cell_ewma_t *e1,
+                                           const ewma_policy_data_t *pol2,
+                                           const cell_ewma_t *e2);
 
 /*** Circuitmux policy methods ***/
 
@@ -390,7 +408,7 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   ewma_policy_data_t *pol = NULL;
   ewma_policy_circ_data_t *cdata = NULL;
   unsigned int tick;
-  double fractional_tick, ewma_increment;
+  double fractional_tick, tick_scale, ewma_increment;
   /* The current (hi-res) time */
   struct timeval now_hires;
   cell_ewma_t *cell_ewma, *tmp;
@@ -404,17 +422,24 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   pol = TO_EWMA_POL_DATA(pol_data);
   cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
 
-  /* Rescale the EWMAs if needed */
   tor_gettimeofday_cached(&now_hires);
   tick = cell_ewma_tick_from_timeval(&now_hires, &fractional_tick);
 
-  if (tick != pol->active_circuit_pqueue_last_recalibrated) {
+  /*
+   * How much is a cell sent at the start of this tick worth, relative to
+   * our reference tick?  Rescale the EWMAs only if that's gotten too big.
+   */
+  tick_scale =
+    get_scale_factor(tick, pol->active_circuit_pqueue_last_recalibrated);
+  if (tick_scale > ewma_max_scale) {
     scale_active_circuits(pol, tick);
+    tick_scale = 1.0;
   }
 
   /* How much do we adjust the cell count in cell_ewma by? */
   ewma_increment =
-    ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick);
+    ((double)(n_cells)) * tick_scale *
+    pow(ewma_scale_factor, -fractional_tick);
 
   /* Do the adjustment */
   cell_ewma = &(cdata->cell_ewma);
@@ -490,7 +515,7 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
     /* Got both of them? */
     if (ce1 != NULL && ce2 != NULL) {
       /* Pick whichever one has the better best circuit */
-      return compare_cell_ewma_counts(ce1, ce2);
+      return compare_cell_ewma_counts_across(p1, ce1, p2, ce2);
     } else {
       if (ce1 != NULL ) {
         /* We only have a circuit on cmux_1, so prefer it */
@@ -523,6 +548,28 @@ compare_cell_ewma_counts(const void *p1, const void *p2)
     return 0;
 }
 
+/** Helper: like compare_cell_ewma_counts(), but for <b>e1</b> in the
+ * priority queue of <b>pol1</b> and <b>e2</b> in that of <b>pol2</b>, which
+ * may have different reference ticks. */
+static int
+compare_cell_ewma_counts_across(const ewma_policy_data_t *pol1,
+                                const cell_ewma_t *e1,
+                                const ewma_policy_data_t *pol2,
+                                const cell_ewma_t *e2)
+{
+  /* Scale e1 to pol2's reference tick */
+  double count1 = e1->cell_count *
+    get_scale_factor(pol1->active_circuit_pqueue_last_recalibrated,
+                     pol2->active_circuit_pqueue_last_recalibrated);
+
+  if (count1 < e2->cell_count)
+    return -1;
+  else if (count1 > e2->cell_count)
+    return 1;
+  else
+    return 0;
+}
+
 /** Given a cell_ewma_t, return a pointer to the circuit containing it. */
 static circuit_t *
 cell_ewma_to_circuit(cell_ewma_t *ewma)
@@ -560,11 +607,15 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
    time we wanted to send a cell.
 
    So as a compromise, we divide time into 'ticks' (currently, 10-second
-   increments) and say that a cell sent at the start of a current tick is
-   worth 1.0, a cell sent N seconds before the start of the current tick is
-   worth F^N, and a cell sent N seconds after the start of the current tick is
-   worth F^-N.  This way we don't overflow, and we don't need to constantly
-   rescale.
+   increments) and say that a cell sent at the start of a reference tick is
+   worth 1.0, a cell sent N seconds before the start of the reference tick is
+   worth F^N, and a cell sent N seconds after the start of the reference tick
+   is worth F^-N.  Each circuitmux keeps its own reference tick, and only
+   moves it forward (rescaling all of its active circuits at once) when the
+   weight of a new cell would get too large.  Since every active circuit on
+   a circuitmux is scaled the same way, their order is the same as if we
+   rescaled them all on every tick.  This way we don't overflow, and we
+   rarely need to rescale.
  */
 
 /** Given a timeval <b>now</b>, compute the cell_ewma tick in which it occurs
@@ -663,8 +714,9 @@ scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick)
   ewma->last_adjusted_tick = cur_tick;
 }
 
-/** Adjust the cell count of every active circuit on <b>chan</b> so
- * that they are scaled with respect to <b>cur_tick</b> */
+/** Adjust the cell count of every active circuit on <b>pol</b> so
+ * that they are scaled with respect to <b>cur_tick</b>, and make
+ * <b>cur_tick</b> the new reference tick. */
 static void
 scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
 {
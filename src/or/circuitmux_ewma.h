@@ -25,5 +25,9 @@ unsigned int cell_ewma_get_tick(void);
 void cell_ewma_set_scale_factor(const or_options_t *options,
                                 const networkstatus_t *consensus);
 
+#ifdef TOR_UNIT_TESTS
+extern double ewma_max_scale;
+#endif
+
 #endif /* TOR_CIRCUITMUX_EWMA_H */
 
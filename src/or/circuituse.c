@@ -386,9 +386,10 @@ circuit_expire_building(void)
    * we want to be more lenient with timeouts, in case the
    * user has relocated and/or changed network connections.
    * See bug #3443. */
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, next_circ) {
-    if (!CIRCUIT_IS_ORIGIN(next_circ) || /* didn't originate here */
-        next_circ->marked_for_close) { /* don't mess with marked circs */
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, next_origin_circ) {
+    circuit_t *next_circ = TO_CIRCUIT(next_origin_circ);
+    if (next_circ->marked_for_close) { /* don't mess with marked circs */
       continue;
     }
 
@@ -400,7 +401,7 @@ circuit_expire_building(void)
       any_opened_circs = 1;
       break;
     }
-  } SMARTLIST_FOREACH_END(next_circ);
+  } SMARTLIST_FOREACH_END(next_origin_circ);
 
 #define SET_CUTOFF(target, msec) do {                       \
     long ms = tor_lround(msec);                             \
@@ -471,10 +472,11 @@ circuit_expire_building(void)
              MAX(get_circuit_build_close_time_ms()*2 + 1000,
                  options->SocksTimeout * 1000));
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *,victim) {
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, origin_victim) {
+    circuit_t *victim = TO_CIRCUIT(origin_victim);
     struct timeval cutoff;
-    if (!CIRCUIT_IS_ORIGIN(victim) || /* didn't originate here */
-        victim->marked_for_close)     /* don't mess with marked circs */
+    if (victim->marked_for_close)     /* don't mess with marked circs */
       continue;
 
     /* If we haven't yet started the first hop, it means we don't have
@@ -777,7 +779,7 @@ circuit_expire_building(void)
       circuit_mark_for_close(victim, END_CIRC_REASON_TIMEOUT);
 
     pathbias_count_timeout(TO_ORIGIN_CIRCUIT(victim));
-  } SMARTLIST_FOREACH_END(victim);
+  } SMARTLIST_FOREACH_END(origin_victim);
 }
 
 /** For debugging #8387: track when we last called
@@ -1198,6 +1200,7 @@ circuit_detach_stream(circuit_t *circ, edge_connection_t *conn)
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
     if (conn == or_circ->n_streams) {
       or_circ->n_streams = conn->next_stream;
+      or_circuit_note_n_stream_removed(or_circ, conn);
       return;
     }
     if (conn == or_circ->resolving_streams) {
@@ -1211,6 +1214,7 @@ circuit_detach_stream(circuit_t *circ, edge_connection_t *conn)
       ;
     if (prevconn && prevconn->next_stream) {
       prevconn->next_stream = conn->next_stream;
+      or_circuit_note_n_stream_removed(or_circ, conn);
       return;
     }
 
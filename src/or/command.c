@@ -51,6 +51,8 @@ static void command_handle_incoming_channel(channel_listener_t *listener,
 static void command_process_create_cell(cell_t *cell, channel_t *chan);
 static void command_process_created_cell(cell_t *cell, channel_t *chan);
 static void command_process_relay_cell(cell_t *cell, channel_t *chan);
+static void command_process_cells(channel_t *chan, cell_t *cells,
+                                  int n_cells);
 static void command_process_destroy_cell(cell_t *cell, channel_t *chan);
 
 /** Convert the cell <b>command</b> into a lower-case, human-readable
@@ -310,7 +312,7 @@ command_process_create_cell(cell_t *cell, channel_t *chan)
     /* hand it off to the cpuworkers, and then return. */
     if (connection_or_digest_is_known_relay(chan->identity_digest))
       rep_hist_note_circuit_handshake_requested(create_cell->handshake_type);
-    if (assign_onionskin_to_cpuworker(NULL, circ, create_cell) < 0) {
+    if (assign_onionskin_to_cpuworker(circ, create_cell) < 0) {
       log_debug(LD_GENERAL,"Failed to hand off onionskin. Closing.");
       circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
       return;
@@ -431,31 +433,23 @@ command_process_created_cell(cell_t *cell, channel_t *chan)
   }
 }
 
-/** Process a 'relay' or 'relay_early' <b>cell</b> that just arrived from
- * <b>conn</b>. Make sure it came in with a recognized circ_id. Pass it on to
- * circuit_receive_relay_cell() for actual processing.
+/** Helper for command_process_relay_cell() and command_process_cells():
+ * <b>cell</b> is a 'relay' or 'relay_early' cell that just arrived from
+ * <b>chan</b> for <b>circ</b>.  Make sure that <b>circ</b> can take it, and
+ * set *<b>direction_out</b> to the way it's going.  Return 0 if the cell
+ * should go on to circuit_receive_relay_cell(); otherwise return
+ * -<b>reason</b> for which the caller should close <b>circ</b>.
  */
-static void
-command_process_relay_cell(cell_t *cell, channel_t *chan)
+static int
+command_check_relay_cell(cell_t *cell, channel_t *chan, circuit_t *circ,
+                         cell_direction_t *direction_out)
 {
   const or_options_t *options = get_options();
-  circuit_t *circ;
-  int reason, direction;
-
-  circ = circuit_get_by_circid_channel(cell->circ_id, chan);
-
-  if (!circ) {
-    log_debug(LD_OR,
-              "unknown circuit %u on connection from %s. Dropping.",
-              (unsigned)cell->circ_id,
-              channel_get_canonical_remote_descr(chan));
-    return;
-  }
+  cell_direction_t direction;
 
   if (circ->state == CIRCUIT_STATE_ONIONSKIN_PENDING) {
     log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,"circuit in create_wait. Closing.");
-    circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
-    return;
+    return -END_CIRC_REASON_TORPROTOCOL;
   }
 
   if (CIRCUIT_IS_ORIGIN(circ)) {
@@ -489,8 +483,7 @@ command_process_relay_cell(cell_t *cell, channel_t *chan)
         log_warn(LD_OR, " upstream=%s",
                  channel_get_actual_remote_descr(circ->n_chan));
       }
-      circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
-      return;
+      return -END_CIRC_REASON_TORPROTOCOL;
     } else {
       or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
       if (or_circ->remaining_relay_early_cells == 0) {
@@ -499,27 +492,136 @@ command_process_relay_cell(cell_t *cell, channel_t *chan)
                "  Closing circuit.",
                (unsigned)cell->circ_id,
                safe_str(channel_get_canonical_remote_descr(chan)));
-        circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
-        return;
+        return -END_CIRC_REASON_TORPROTOCOL;
       }
       --or_circ->remaining_relay_early_cells;
     }
   }
 
+  /* If this is a cell in an RP circuit, count it as part of the
+     hidden service stats */
+  if (options->HiddenServiceStatistics &&
+      !CIRCUIT_IS_ORIGIN(circ) &&
+      TO_OR_CIRCUIT(circ)->circuit_carries_hs_traffic_stats) {
+    rep_hist_seen_new_rp_cell();
+  }
+
+  *direction_out = direction;
+  return 0;
+}
+
+/** Process a 'relay' or 'relay_early' <b>cell</b> that just arrived from
+ * <b>conn</b>. Make sure it came in with a recognized circ_id. Pass it on to
+ * circuit_receive_relay_cell() for actual processing.
+ */
+static void
+command_process_relay_cell(cell_t *cell, channel_t *chan)
+{
+  circuit_t *circ;
+  cell_direction_t direction;
+  int reason;
+
+  circ = circuit_get_by_circid_channel(cell->circ_id, chan);
+
+  if (!circ) {
+    log_debug(LD_OR,
+              "unknown circuit %u on connection from %s. Dropping.",
+              (unsigned)cell->circ_id,
+              channel_get_canonical_remote_descr(chan));
+    return;
+  }
+
+  if ((reason = command_check_relay_cell(cell, chan, circ, &direction)) < 0) {
+    circuit_mark_for_close(circ, -reason);
+    return;
+  }
+
   if ((reason = circuit_receive_relay_cell(cell, circ, direction)) < 0) {
     log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,"circuit_receive_relay_cell "
            "(%s) failed. Closing.",
            direction==CELL_DIRECTION_OUT?"forward":"backward");
     circuit_mark_for_close(circ, -reason);
   }
+}
 
-  /* If this is a cell in an RP circuit, count it as part of the
-     hidden service stats */
-  if (options->HiddenServiceStatistics &&
-      !CIRCUIT_IS_ORIGIN(circ) &&
-      TO_OR_CIRCUIT(circ)->circuit_carries_hs_traffic_stats) {
-    rep_hist_seen_new_rp_cell();
+/** Process the <b>n_cells</b> cells in <b>cells</b> that just arrived on
+ * <b>chan</b>, in order, as command_process_cell() would.
+ *
+ * Relay cells are checked as they come, then handed to
+ * circuit_receive_relay_cells() in runs, so that their crypto is done
+ * together.  Any other cell ends the run: the relay cells before it are
+ * handled first.  Cells for the same circuit tend to arrive close together,
+ * so we look for an earlier cell in the run with the same circuit ID before
+ * searching the circuit map.
+ */
+static void
+command_process_cells(channel_t *chan, cell_t *cells, int n_cells)
+{
+  /* Handling a cell never gets us back here, and we only run in the main
+   * thread, so this can be static rather than on the stack. */
+  static relay_crypt_item_t items[RELAY_CRYPT_MAX_CELLS];
+  int i, j, n_items = 0, reason;
+
+  tor_assert(chan);
+  tor_assert(cells || n_cells == 0);
+
+  for (i = 0; i < n_cells; ++i) {
+    cell_t *cell = &cells[i];
+    circuit_t *circ = NULL;
+    cell_direction_t direction;
+
+    /* If an earlier cell closed the channel, the cells after it would never
+     * have been delivered.  (We only close things while handling cells, and
+     * that leaves nothing in items.) */
+    if (!CHANNEL_IS_OPEN(chan))
+      return;
+
+    if (cell->command != CELL_RELAY && cell->command != CELL_RELAY_EARLY) {
+      circuit_receive_relay_cells(items, n_items);
+      n_items = 0;
+      if (!CHANNEL_IS_OPEN(chan))
+        return;
+      command_process_cell(chan, cell);
+      continue;
+    }
+
+    ++stats_n_relay_cells_processed;
+
+    for (j = n_items - 1; j >= 0; --j) {
+      if (items[j].cell->circ_id == cell->circ_id) {
+        circ = items[j].circ;
+        break;
+      }
+    }
+    if (!circ)
+      circ = circuit_get_by_circid_channel(cell->circ_id, chan);
+    if (!circ) {
+      log_debug(LD_OR,
+                "unknown circuit %u on connection from %s. Dropping.",
+                (unsigned)cell->circ_id,
+                channel_get_canonical_remote_descr(chan));
+      continue;
+    }
+
+    if ((reason = command_check_relay_cell(cell, chan, circ,
+                                           &direction)) < 0) {
+      /* Let the cells ahead of this one through before we close. */
+      circuit_receive_relay_cells(items, n_items);
+      n_items = 0;
+      circuit_mark_for_close(circ, -reason);
+      continue;
+    }
+
+    items[n_items].circ = circ;
+    items[n_items].cell = cell;
+    items[n_items].cell_direction = direction;
+    if (++n_items == RELAY_CRYPT_MAX_CELLS) {
+      circuit_receive_relay_cells(items, n_items);
+      n_items = 0;
+    }
   }
+
+  circuit_receive_relay_cells(items, n_items);
 }
 
 /** Process a 'destroy' <b>cell</b> that just arrived from
@@ -598,6 +700,7 @@ command_setup_channel(channel_t *chan)
   channel_set_cell_handlers(chan,
                             command_process_cell,
                             command_process_var_cell);
+  channel_set_cells_handler(chan, command_process_cells);
 }
 
 /** Given a listener, install the right handler to process incoming
@@ -46,6 +46,7 @@
 #include "routerset.h"
 #include "scheduler.h"
 #include "statefile.h"
+#include "tlsshard.h"
 #include "transports.h"
 #include "ext_orport.h"
 #include "torgzip.h"
@@ -198,6 +199,8 @@ static config_var_t option_vars_[] = {
   V(DataDirectory,               FILENAME, NULL),
   V(DisableNetwork,              BOOL,     "0"),
   V(DirAllowPrivateAddresses,    BOOL,     "0"),
+  V(DirBandwidthBurst,           MEMUNIT,  "0"),
+  V(DirBandwidthRate,            MEMUNIT,  "0"),
   V(TestingAuthDirTimeToLearnReachability, INTERVAL, "30 minutes"),
   V(DirListenAddress,            LINELIST, NULL),
   V(DirPolicy,                   LINELIST, NULL),
@@ -286,6 +289,8 @@ static config_var_t option_vars_[] = {
   V(Socks5ProxyUsername,         STRING,   NULL),
   V(Socks5ProxyPassword,         STRING,   NULL),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
+  V(KISTSchedRunInterval,        MSEC_INTERVAL, "10 msec"),
+  V(KISTSockBufSizeFactor,       DOUBLE,   "1.0"),
   VAR("Log",                     LINELIST, Logs,             NULL),
   V(LogMessageDomains,           BOOL,     "0"),
   V(LogTimeGranularity,          MSEC_INTERVAL, "1 second"),
@@ -299,6 +304,7 @@ static config_var_t option_vars_[] = {
   VAR("MaxMemInQueues",          MEMUNIT,   MaxMemInQueues_raw, "0"),
   OBSOLETE("MaxOnionsPending"),
   V(MaxOnionQueueDelay,          MSEC_INTERVAL, "1750 msec"),
+  V(MaxTLSRecordCoalesceDelay,   MSEC_INTERVAL, "0 msec"),
   V(MinMeasuredBWsForAuthToIgnoreAdvertised, INT, "500"),
   V(MyFamily,                    STRING,   NULL),
   V(NewCircuitPeriod,            INTERVAL, "30 seconds"),
@@ -312,6 +318,8 @@ static config_var_t option_vars_[] = {
   V(NumCPUs,                     UINT,     "0"),
   V(NumDirectoryGuards,          UINT,     "0"),
   V(NumEntryGuards,              UINT,     "0"),
+  V(NumORPortListeners,          UINT,     "1"),
+  V(NumTLSThreads,               UINT,     "0"),
   V(ORListenAddress,             LINELIST, NULL),
   VPORT(ORPort,                      LINELIST, NULL),
   V(OutboundBindAddress,         LINELIST,   NULL),
@@ -374,6 +382,7 @@ static config_var_t option_vars_[] = {
   V(SchedulerLowWaterMark__,     MEMUNIT,  "100 MB"),
   V(SchedulerHighWaterMark__,    MEMUNIT,  "101 MB"),
   V(SchedulerMaxFlushCells__,    UINT,     "1000"),
+  V(Schedulers,                  CSV,      "Vanilla"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   V(SocksListenAddress,          LINELIST, NULL),
   V(SocksPolicy,                 LINELIST, NULL),
@@ -398,6 +407,8 @@ static config_var_t option_vars_[] = {
   V(UseBridges,                  BOOL,     "0"),
   V(UseEntryGuards,              BOOL,     "1"),
   V(UseEntryGuardsAsDirGuards,   BOOL,     "1"),
+  V(UseKernelTLS,                BOOL,     "0"),
+  V(UseIOUring,                  BOOL,     "0"),
   V(UseMicrodescriptors,         AUTOBOOL, "auto"),
   V(UseNTorHandshake,            AUTOBOOL, "1"),
   V(User,                        STRING,   NULL),
@@ -517,6 +528,7 @@ static int options_transition_affects_workers(
 static int options_transition_affects_descriptor(
       const or_options_t *old_options, const or_options_t *new_options);
 static int check_nickname_list(char **lst, const char *name, char **msg);
+static int options_get_scheduler_kist(const or_options_t *options);
 static char *get_bindaddr_from_transport_listen_line(const char *line,
                                                      const char *transport);
 static int parse_dir_authority_line(const char *line,
@@ -1296,6 +1308,9 @@ options_transition_requires_fresh_tls_context(const or_options_t *old_options,
   if (!opt_streq(old_options->TLSECGroup, new_options->TLSECGroup))
     return 1;
 
+  if (old_options->UseKernelTLS != new_options->UseKernelTLS)
+    return 1;
+
   return 0;
 }
 
@@ -1545,6 +1560,9 @@ options_act(const or_options_t *old_options)
                            (uint32_t)options->SchedulerHighWaterMark__,
                            (options->SchedulerMaxFlushCells__ > 0) ?
                            options->SchedulerMaxFlushCells__ : 1000);
+  scheduler_set_kist(options_get_scheduler_kist(options),
+                     (uint32_t)options->KISTSchedRunInterval,
+                     options->KISTSockBufSizeFactor);
 
   /* Set up accounting */
   if (accounting_parse_options(options, 0)<0) {
@@ -1696,7 +1714,7 @@ options_act(const or_options_t *old_options)
         if (have_completed_a_circuit() || !any_predicted_circuits(time(NULL)))
           inform_testing_reachability();
       }
-      cpuworkers_rotate();
+      cpuworkers_rotate_keyinfo();
       if (dns_reset())
         return -1;
     } else {
@@ -2532,6 +2550,23 @@ options_validate_cb(void *old_options, void *options, void *default_options,
                           from_setconf, msg);
 }
 
+/** Return 1 if the first scheduler listed in the Schedulers option of
+ * <b>options</b> that we support on this platform is KIST, 0 if it is the
+ * vanilla scheduler, and -1 if we support none of them. */
+static int
+options_get_scheduler_kist(const or_options_t *options)
+{
+  if (!options->Schedulers)
+    return -1;
+  SMARTLIST_FOREACH_BEGIN(options->Schedulers, const char *, name) {
+    if (!strcasecmp(name, "KIST") && scheduler_can_use_kist())
+      return 1;
+    if (!strcasecmp(name, "Vanilla"))
+      return 0;
+  } SMARTLIST_FOREACH_END(name);
+  return -1;
+}
+
 /** Return 0 if every setting in <b>options</b> is reasonable, is a
  * permissible transition from <b>old_options</b>, and none of the
  * testing-only settings differ from <b>default_options</b> unless in
@@ -2701,6 +2736,27 @@ options_validate(or_options_t *old_options, or_options_t *options,
     return -1;
   }
 
+  if (options->Schedulers) {
+    SMARTLIST_FOREACH_BEGIN(options->Schedulers, const char *, name) {
+      if (strcasecmp(name, "KIST") && strcasecmp(name, "Vanilla")) {
+        tor_asprintf(msg, "Unrecognized scheduler \"%s\" in Schedulers. "
+                     "Supported schedulers are KIST and Vanilla.", name);
+        return -1;
+      }
+    } SMARTLIST_FOREACH_END(name);
+  }
+  if (options_get_scheduler_kist(options) < 0)
+    REJECT("None of the schedulers in Schedulers is supported on this "
+           "platform.");
+  if (options->KISTSchedRunInterval <= 0 ||
+      options->KISTSchedRunInterval > 100)
+    REJECT("KISTSchedRunInterval must be between 1 and 100 msec.");
+  if (options->KISTSockBufSizeFactor < 0.0)
+    REJECT("KISTSockBufSizeFactor must not be negative.");
+  if (options->MaxTLSRecordCoalesceDelay < 0 ||
+      options->MaxTLSRecordCoalesceDelay > 1000)
+    REJECT("MaxTLSRecordCoalesceDelay must be between 0 and 1000 msec.");
+
   if (options->NodeFamilies) {
     options->NodeFamilySets = smartlist_new();
     for (cl = options->NodeFamilies; cl; cl = cl->next) {
@@ -2719,6 +2775,11 @@ options_validate(or_options_t *old_options, or_options_t *options,
     tor_free(options->TLSECGroup);
   }
 
+  if (options->UseKernelTLS && !tor_tls_kernel_tls_is_supported()) {
+    COMPLAIN("UseKernelTLS is set, but this Tor was built without kernel "
+             "TLS support. Doing TLS in user space.");
+  }
+
   if (options->ExcludeNodes && options->StrictNodes) {
     COMPLAIN("You have asked to exclude certain relays from all positions "
              "in your circuits. Expect hidden services and other Tor "
@@ -3110,6 +3171,21 @@ options_validate(or_options_t *old_options, or_options_t *options,
   if (options->KeepalivePeriod < 1)
     REJECT("KeepalivePeriod option must be positive.");
 
+  if (options->NumORPortListeners < 1 || options->NumORPortListeners > 64)
+    REJECT("NumORPortListeners must be between 1 and 64.");
+#ifndef SO_REUSEPORT
+  if (options->NumORPortListeners > 1)
+    REJECT("NumORPortListeners can't be more than 1 on this platform, since "
+           "it doesn't support SO_REUSEPORT.");
+#endif
+
+  if (options->NumTLSThreads > TLS_SHARD_MAX_THREADS)
+    REJECT("NumTLSThreads must be at most 64.");
+
+  if (options->UseIOUring && options->Sandbox) {
+    REJECT("UseIOUring is not compatible with Sandbox; at most one can "
+           "be set");
+  }
   if (options->PortForwarding && options->Sandbox) {
     REJECT("PortForwarding is not compatible with Sandbox; at most one can "
            "be set");
@@ -3130,6 +3206,12 @@ options_validate(or_options_t *old_options, or_options_t *options,
   if (ensure_bandwidth_cap(&options->RelayBandwidthBurst,
                            "RelayBandwidthBurst", msg) < 0)
     return -1;
+  if (ensure_bandwidth_cap(&options->DirBandwidthRate,
+                           "DirBandwidthRate", msg) < 0)
+    return -1;
+  if (ensure_bandwidth_cap(&options->DirBandwidthBurst,
+                           "DirBandwidthBurst", msg) < 0)
+    return -1;
   if (ensure_bandwidth_cap(&options->PerConnBWRate,
                            "PerConnBWRate", msg) < 0)
     return -1;
@@ -3147,6 +3229,10 @@ options_validate(or_options_t *old_options, or_options_t *options,
     options->RelayBandwidthBurst = options->RelayBandwidthRate;
   if (options->RelayBandwidthBurst && !options->RelayBandwidthRate)
     options->RelayBandwidthRate = options->RelayBandwidthBurst;
+  if (options->DirBandwidthRate && !options->DirBandwidthBurst)
+    options->DirBandwidthBurst = options->DirBandwidthRate;
+  if (options->DirBandwidthBurst && !options->DirBandwidthRate)
+    options->DirBandwidthRate = options->DirBandwidthBurst;
 
   if (server_mode(options)) {
     if (options->BandwidthRate < ROUTER_REQUIRED_MIN_BANDWIDTH) {
@@ -3180,6 +3266,10 @@ options_validate(or_options_t *old_options, or_options_t *options,
     REJECT("RelayBandwidthBurst must be at least equal "
            "to RelayBandwidthRate.");
 
+  if (options->DirBandwidthRate > options->DirBandwidthBurst)
+    REJECT("DirBandwidthBurst must be at least equal "
+           "to DirBandwidthRate.");
+
   if (options->BandwidthRate > options->BandwidthBurst)
     REJECT("BandwidthBurst must be at least equal to BandwidthRate.");
 
@@ -3848,6 +3938,12 @@ options_transition_allowed(const or_options_t *old,
     return -1;
   }
 
+  if (old->NumORPortListeners != new_val->NumORPortListeners) {
+    *msg = tor_strdup("While Tor is running, changing NumORPortListeners "
+                      "is not allowed.");
+    return -1;
+  }
+
   if (old->DisableIOCP != new_val->DisableIOCP) {
     *msg = tor_strdup("While Tor is running, changing DisableIOCP "
                       "is not allowed.");
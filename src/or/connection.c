@@ -29,7 +29,6 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
-#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dns.h"
@@ -48,6 +47,7 @@
 #include "transports.h"
 #include "routerparse.h"
 #include "transports.h"
+#include "tlsshard.h"
 
 #ifdef USE_BUFFEREVENTS
 #include <event2/event.h>
@@ -57,20 +57,15 @@
 #include <pwd.h>
 #endif
 
-static connection_t *connection_listener_new(
-                               const struct sockaddr *listensockaddr,
-                               socklen_t listensocklen, int type,
-                               const char *address,
-                               const port_cfg_t *portcfg);
 static void connection_init(time_t now, connection_t *conn, int type,
                             int socket_family);
 static int connection_init_accepted_conn(connection_t *conn,
                           const listener_connection_t *listener);
-static int connection_handle_listener_read(connection_t *conn, int new_type);
 #ifndef USE_BUFFEREVENTS
 static int connection_bucket_should_increase(int bucket,
                                              or_connection_t *conn);
 #endif
+static void connection_forget_blocked_on_bw(connection_t *conn);
 static int connection_finished_flushing(connection_t *conn);
 static int connection_flushed_some(connection_t *conn);
 static int connection_finished_connecting(connection_t *conn);
@@ -130,7 +125,6 @@ conn_type_to_string(int type)
     case CONN_TYPE_AP: return "Socks";
     case CONN_TYPE_DIR_LISTENER: return "Directory listener";
     case CONN_TYPE_DIR: return "Directory";
-    case CONN_TYPE_CPUWORKER: return "CPU worker";
     case CONN_TYPE_CONTROL_LISTENER: return "Control listener";
     case CONN_TYPE_CONTROL: return "Control";
     case CONN_TYPE_EXT_OR: return "Extended OR";
@@ -213,12 +207,6 @@ conn_state_to_string(int type, int state)
         case DIR_CONN_STATE_SERVER_WRITING: return "writing";
       }
       break;
-    case CONN_TYPE_CPUWORKER:
-      switch (state) {
-        case CPUWORKER_STATE_IDLE: return "idle";
-        case CPUWORKER_STATE_BUSY_ONION: return "busy with onion";
-      }
-      break;
     case CONN_TYPE_CONTROL:
       switch (state) {
         case CONTROL_CONN_STATE_OPEN: return "open (protocol v1)";
@@ -248,7 +236,6 @@ connection_type_uses_bufferevent(connection_t *conn)
     case CONN_TYPE_CONTROL:
     case CONN_TYPE_OR:
     case CONN_TYPE_EXT_OR:
-    case CONN_TYPE_CPUWORKER:
       return 1;
     default:
       return 0;
@@ -511,6 +498,11 @@ connection_free_(connection_t *conn)
              (int)connection_get_outbuf_len(conn));
   }
 
+#ifndef USE_BUFFEREVENTS
+  if (conn->type == CONN_TYPE_OR)
+    tls_shards_forget_conn(TO_OR_CONN(conn));
+#endif
+
   if (!connection_is_listener(conn)) {
     buf_free(conn->inbuf);
     buf_free(conn->outbuf);
@@ -613,11 +605,14 @@ connection_free_(connection_t *conn)
   }
   if (conn->type == CONN_TYPE_OR || conn->type == CONN_TYPE_EXT_OR) {
     connection_or_remove_from_ext_or_id_map(TO_OR_CONN(conn));
+    connection_or_clear_coalescing(TO_OR_CONN(conn));
     tor_free(TO_OR_CONN(conn)->ext_or_conn_id);
     tor_free(TO_OR_CONN(conn)->ext_or_auth_correct_client_hash);
     tor_free(TO_OR_CONN(conn)->ext_or_transport);
   }
 
+  connection_forget_blocked_on_bw(conn);
+
 #ifdef USE_BUFFEREVENTS
   if (conn->type == CONN_TYPE_OR && TO_OR_CONN(conn)->bucket_cfg) {
     ev_token_bucket_cfg_free(TO_OR_CONN(conn)->bucket_cfg);
@@ -718,6 +713,10 @@ connection_close_immediate(connection_t *conn)
              (int)conn->outbuf_flushlen);
   }
 
+#ifndef USE_BUFFEREVENTS
+  if (conn->type == CONN_TYPE_OR)
+    tls_shards_wait_for_conn(TO_OR_CONN(conn));
+#endif
   connection_unregister_events(conn);
 
   if (SOCKET_OK(conn->s))
@@ -976,6 +975,26 @@ make_socket_reuseable(tor_socket_t sock)
 #endif
 }
 
+/** Let other sockets bind to the same address and port as <b>sock</b>, so
+ * that the kernel can divide the incoming connections among them.  Return 0
+ * on success, -1 on failure. */
+STATIC int
+make_socket_reuseport(tor_socket_t sock)
+{
+#ifdef SO_REUSEPORT
+  int one=1;
+
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void*) &one,
+             (socklen_t)sizeof(one)) == -1) {
+    return -1;
+  }
+  return 0;
+#else
+  (void) sock;
+  return -1;
+#endif
+}
+
 /** Max backlog to pass to listen.  We start at */
 static int listen_limit = INT_MAX;
 
@@ -1003,11 +1022,11 @@ tor_listen(tor_socket_t fd)
  * <b>address</b> is only used for logging purposes and to add the information
  * to the conn.
  */
-static connection_t *
-connection_listener_new(const struct sockaddr *listensockaddr,
-                        socklen_t socklen,
-                        int type, const char *address,
-                        const port_cfg_t *port_cfg)
+MOCK_IMPL(STATIC connection_t *,
+connection_listener_new,(const struct sockaddr *listensockaddr,
+                         socklen_t socklen,
+                         int type, const char *address,
+                         const port_cfg_t *port_cfg))
 {
   listener_connection_t *lis_conn;
   connection_t *conn = NULL;
@@ -1052,6 +1071,14 @@ connection_listener_new(const struct sockaddr *listensockaddr,
                tor_socket_strerror(errno));
     }
 
+    if (type == CONN_TYPE_OR_LISTENER && options->NumORPortListeners > 1 &&
+        make_socket_reuseport(s) < 0) {
+      log_warn(LD_NET, "Error setting SO_REUSEPORT flag on %s: %s",
+               conn_type_to_string(type),
+               tor_socket_strerror(tor_socket_errno(s)));
+      goto err;
+    }
+
 #if defined USE_TRANSPARENT && defined(IP_TRANSPARENT)
     if (options->TransProxyType_parsed == TPT_TPROXY &&
         type == CONN_TYPE_AP_TRANS_LISTENER) {
@@ -1318,11 +1345,13 @@ check_sockaddr_family_match(sa_family_t got, connection_t *listener)
   return 0;
 }
 
-/** The listener connection <b>conn</b> told poll() it wanted to read.
- * Call accept() on conn-\>s, and add the new connection if necessary.
+/** Call accept() once on the listener connection <b>conn</b>, and add the
+ * new connection if necessary.  Return 1 if we took a socket off the accept
+ * queue, whether or not we kept it; 0 if we should stop accepting for now;
+ * and -1 if we had to close the listener.
  */
-static int
-connection_handle_listener_read(connection_t *conn, int new_type)
+MOCK_IMPL(STATIC int,
+connection_accept_one,(connection_t *conn, int new_type))
 {
   tor_socket_t news; /* the new socket */
   connection_t *newconn;
@@ -1365,7 +1394,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
                tor_socket_strerror(errno));
     }
     tor_close_socket(news);
-    return 0;
+    return 1;
   }
 
   if (options->ConstrainedSockets)
@@ -1373,7 +1402,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
 
   if (check_sockaddr_family_match(remote->sa_family, conn) < 0) {
     tor_close_socket(news);
-    return 0;
+    return 1;
   }
 
   if (conn->socket_family == AF_INET || conn->socket_family == AF_INET6) {
@@ -1383,7 +1412,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
       log_info(LD_NET,
                "accept() returned a strange address; closing connection.");
       tor_close_socket(news);
-      return 0;
+      return 1;
     }
 
     tor_addr_from_sockaddr(&addr, remote, &port);
@@ -1396,7 +1425,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
                    "Denying socks connection from untrusted address %s.",
                    fmt_and_decorate_addr(&addr));
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
     if (new_type == CONN_TYPE_DIR) {
@@ -1405,7 +1434,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
         log_notice(LD_DIRSERV,"Denying dir connection from address %s.",
                    fmt_and_decorate_addr(&addr));
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
 
@@ -1452,7 +1481,26 @@ connection_handle_listener_read(connection_t *conn, int new_type)
   if (connection_init_accepted_conn(newconn, TO_LISTENER_CONN(conn)) < 0) {
     if (! newconn->marked_for_close)
       connection_mark_for_close(newconn);
-    return 0;
+    return 1;
+  }
+  return 1;
+}
+
+/** The listener connection <b>conn</b> told poll() it wanted to read.
+ * Accept the connections that are waiting on it, up to
+ * MAX_ACCEPTS_PER_LISTENER_READ of them, so that a burst of new connections
+ * neither overflows the kernel's accept queue nor keeps us from serving the
+ * connections we have.
+ */
+STATIC int
+connection_handle_listener_read(connection_t *conn, int new_type)
+{
+  int i;
+
+  for (i = 0; i < MAX_ACCEPTS_PER_LISTENER_READ; ++i) {
+    int r = connection_accept_one(conn, new_type);
+    if (r <= 0)
+      return r;
   }
   return 0;
 }
@@ -2153,13 +2201,14 @@ connection_read_proxy_handshake(connection_t *conn)
  *
  * Return 0 on success, -1 on failure.
  **/
-static int
+STATIC int
 retry_listener_ports(smartlist_t *old_conns,
                      const smartlist_t *ports,
                      smartlist_t *new_conns,
                      int control_listeners_only)
 {
   smartlist_t *launch = smartlist_new();
+  const int n_or_listeners = get_options()->NumORPortListeners;
   int r = 0;
 
   if (control_listeners_only) {
@@ -2168,13 +2217,23 @@ retry_listener_ports(smartlist_t *old_conns,
           smartlist_add(launch, p);
     });
   } else {
-    smartlist_add_all(launch, ports);
+    SMARTLIST_FOREACH_BEGIN(ports, port_cfg_t *, p) {
+      int i, n = 1;
+      /* We can't ask for more than one socket on an automatic port: they
+       * would all get different ports. */
+      if (p->type == CONN_TYPE_OR_LISTENER && !p->is_unix_addr &&
+          p->port != CFG_AUTO_PORT)
+        n = MAX(n_or_listeners, 1);
+      for (i = 0; i < n; ++i)
+        smartlist_add(launch, p);
+    } SMARTLIST_FOREACH_END(p);
   }
 
   /* Iterate through old_conns, comparing it to launch: remove from both lists
    * each pair of elements that corresponds to the same port. */
   SMARTLIST_FOREACH_BEGIN(old_conns, connection_t *, conn) {
     const port_cfg_t *found_port = NULL;
+    int found_idx = -1;
 
     /* Okay, so this is a listener.  Is it configured? */
     SMARTLIST_FOREACH_BEGIN(launch, const port_cfg_t *, wanted) {
@@ -2191,6 +2250,7 @@ retry_listener_ports(smartlist_t *old_conns,
         if (conn->socket_family == AF_UNIX &&
             !strcmp(wanted->unix_addr, conn->address)) {
           found_port = wanted;
+          found_idx = wanted_sl_idx;
           break;
         }
       } else {
@@ -2202,6 +2262,7 @@ retry_listener_ports(smartlist_t *old_conns,
         }
         if (port_matches && tor_addr_eq(&wanted->addr, &conn->addr)) {
           found_port = wanted;
+          found_idx = wanted_sl_idx;
           break;
         }
       }
@@ -2211,7 +2272,7 @@ retry_listener_ports(smartlist_t *old_conns,
       /* This listener is already running; we don't need to launch it. */
       //log_debug(LD_NET, "Already have %s on %s:%d",
       //    conn_type_to_string(found_port->type), conn->address, conn->port);
-      smartlist_remove(launch, found_port);
+      smartlist_del_keeporder(launch, found_idx);
       /* And we can remove the connection from old_conns too. */
       SMARTLIST_DEL_CURRENT(old_conns, conn);
     }
@@ -2347,7 +2408,6 @@ connection_mark_all_noncontrol_connections(void)
     if (conn->marked_for_close)
       continue;
     switch (conn->type) {
-      case CONN_TYPE_CPUWORKER:
       case CONN_TYPE_CONTROL_LISTENER:
       case CONN_TYPE_CONTROL:
         break;
@@ -2402,6 +2462,21 @@ static struct bufferevent_rate_limit_group *global_rate_limit = NULL;
 extern int global_read_bucket, global_write_bucket;
 extern int global_relayed_read_bucket, global_relayed_write_bucket;
 
+/** Token buckets for the directory answers that we serve, if
+ * DirBandwidthRate is set.  These take the place of the relayed buckets for
+ * directory connections, so that directory traffic can be shaped separately
+ * from the cells that we relay. */
+static int global_dir_read_bucket, global_dir_write_bucket;
+
+/** How many milliseconds of refilling have we done, in total?  Each OR
+ * connection remembers this value from when its buckets were last topped
+ * up, so we can catch them up when we next look at them. */
+static uint64_t bucket_clock_msec = 0;
+
+/** List of every connection that has stopped reading or writing until the
+ * bandwidth throttler gives it more tokens. */
+static smartlist_t *blocked_on_bw_conns = NULL;
+
 /** Did either global write bucket run dry last second? If so,
  * we are likely to run dry again this second, so be stingy with the
  * tokens we just put in. */
@@ -2429,6 +2504,29 @@ connection_counts_as_relayed_traffic(connection_t *conn, time_t now)
   return 0;
 }
 
+/** Set *<b>read_bucket_out</b> and *<b>write_bucket_out</b> to the global
+ * class buckets that <b>conn</b> draws from in addition to the global
+ * buckets, and return the name of that class.  Return NULL if <b>conn</b>
+ * draws from the global buckets alone. */
+static const char *
+connection_get_class_buckets(connection_t *conn, time_t now,
+                             int **read_bucket_out, int **write_bucket_out)
+{
+  if (conn->type == CONN_TYPE_DIR && DIR_CONN_IS_SERVER(conn) &&
+      get_options()->DirBandwidthRate) {
+    *read_bucket_out = &global_dir_read_bucket;
+    *write_bucket_out = &global_dir_write_bucket;
+    return "directory";
+  }
+  if (connection_counts_as_relayed_traffic(conn, now)) {
+    *read_bucket_out = &global_relayed_read_bucket;
+    *write_bucket_out = &global_relayed_write_bucket;
+    return "relayed";
+  }
+  *read_bucket_out = *write_bucket_out = NULL;
+  return NULL;
+}
+
 /** Helper function to decide how many bytes out of <b>global_bucket</b>
  * we're willing to use for this transaction. <b>base</b> is the size
  * of a cell on the network; <b>priority</b> says whether we should
@@ -2464,18 +2562,21 @@ connection_bucket_round_robin(int base, int priority,
 }
 
 /** How many bytes at most can we read onto this connection? */
-static ssize_t
+ssize_t
 connection_bucket_read_limit(connection_t *conn, time_t now)
 {
   int base = RELAY_PAYLOAD_SIZE;
   int priority = conn->type != CONN_TYPE_DIR;
   int conn_bucket = -1;
   int global_bucket = global_read_bucket;
+  int *class_read, *class_write;
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
-    if (conn->state == OR_CONN_STATE_OPEN)
+    if (conn->state == OR_CONN_STATE_OPEN) {
+      connection_bucket_catch_up(or_conn);
       conn_bucket = or_conn->read_bucket;
+    }
     base = get_cell_network_size(or_conn->wide_circ_ids);
   }
 
@@ -2484,9 +2585,9 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
     return conn_bucket>=0 ? conn_bucket : 1<<14;
   }
 
-  if (connection_counts_as_relayed_traffic(conn, now) &&
-      global_relayed_read_bucket <= global_read_bucket)
-    global_bucket = global_relayed_read_bucket;
+  if (connection_get_class_buckets(conn, now, &class_read, &class_write) &&
+      *class_read <= global_read_bucket)
+    global_bucket = *class_read;
 
   return connection_bucket_round_robin(base, priority,
                                        global_bucket, conn_bucket);
@@ -2500,6 +2601,7 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
   int priority = conn->type != CONN_TYPE_DIR;
   int conn_bucket = (int)conn->outbuf_flushlen;
   int global_bucket = global_write_bucket;
+  int *class_read, *class_write;
 
   if (!connection_is_rate_limited(conn)) {
     /* be willing to write to local conns even if our buckets are empty */
@@ -2510,22 +2612,24 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
     /* use the per-conn write limit if it's lower, but if it's less
      * than zero just use zero */
     or_connection_t *or_conn = TO_OR_CONN(conn);
-    if (conn->state == OR_CONN_STATE_OPEN)
+    if (conn->state == OR_CONN_STATE_OPEN) {
+      connection_bucket_catch_up(or_conn);
       if (or_conn->write_bucket < conn_bucket)
         conn_bucket = or_conn->write_bucket >= 0 ?
                         or_conn->write_bucket : 0;
+    }
     base = get_cell_network_size(or_conn->wide_circ_ids);
   }
 
-  if (connection_counts_as_relayed_traffic(conn, now) &&
-      global_relayed_write_bucket <= global_write_bucket)
-    global_bucket = global_relayed_write_bucket;
+  if (connection_get_class_buckets(conn, now, &class_read, &class_write) &&
+      *class_write <= global_write_bucket)
+    global_bucket = *class_write;
 
   return connection_bucket_round_robin(base, priority,
                                        global_bucket, conn_bucket);
 }
 #else
-static ssize_t
+ssize_t
 connection_bucket_read_limit(connection_t *conn, time_t now)
 {
   (void) now;
@@ -2708,6 +2812,9 @@ static void
 connection_buckets_decrement(connection_t *conn, time_t now,
                              size_t num_read, size_t num_written)
 {
+  const char *class_name;
+  int *class_read, *class_write;
+
   if (num_written >= INT_MAX || num_read >= INT_MAX) {
     log_err(LD_BUG, "Value out of range. num_read=%lu, num_written=%lu, "
              "connection type=%s, state=%s",
@@ -2724,12 +2831,17 @@ connection_buckets_decrement(connection_t *conn, time_t now,
   if (!connection_is_rate_limited(conn))
     return; /* local IPs are free */
 
+  class_name = connection_get_class_buckets(conn, now,
+                                            &class_read, &class_write);
+  if (connection_speaks_cells(conn) && conn->state == OR_CONN_STATE_OPEN)
+    connection_bucket_catch_up(TO_OR_CONN(conn));
+
   /* If one or more of our token buckets ran dry just now, note the
    * timestamp for TB_EMPTY events. */
   if (get_options()->TestingEnableTbEmptyEvent) {
     struct timeval tvnow;
     tor_gettimeofday_cached(&tvnow);
-    if (connection_counts_as_relayed_traffic(conn, now)) {
+    if (class_read == &global_relayed_read_bucket) {
       connection_buckets_note_empty_ts(&global_relayed_read_emptied,
                          global_relayed_read_bucket, num_read, &tvnow);
       connection_buckets_note_empty_ts(&global_relayed_write_emptied,
@@ -2748,9 +2860,9 @@ connection_buckets_decrement(connection_t *conn, time_t now,
     }
   }
 
-  if (connection_counts_as_relayed_traffic(conn, now)) {
-    global_relayed_read_bucket -= (int)num_read;
-    global_relayed_write_bucket -= (int)num_written;
+  if (class_name) {
+    *class_read -= (int)num_read;
+    *class_write -= (int)num_written;
   }
   global_read_bucket -= (int)num_read;
   global_write_bucket -= (int)num_written;
@@ -2765,16 +2877,18 @@ connection_buckets_decrement(connection_t *conn, time_t now,
 static void
 connection_consider_empty_read_buckets(connection_t *conn)
 {
-  const char *reason;
+  const char *reason, *class_name;
+  int *class_read, *class_write;
 
   if (!connection_is_rate_limited(conn))
     return; /* Always okay. */
 
+  class_name = connection_get_class_buckets(conn, approx_time(),
+                                            &class_read, &class_write);
   if (global_read_bucket <= 0) {
     reason = "global read bucket exhausted. Pausing.";
-  } else if (connection_counts_as_relayed_traffic(conn, approx_time()) &&
-             global_relayed_read_bucket <= 0) {
-    reason = "global relayed read bucket exhausted. Pausing.";
+  } else if (class_name && *class_read <= 0) {
+    reason = "per-class read bucket exhausted. Pausing.";
   } else if (connection_speaks_cells(conn) &&
              conn->state == OR_CONN_STATE_OPEN &&
              TO_OR_CONN(conn)->read_bucket <= 0) {
@@ -2785,6 +2899,7 @@ connection_consider_empty_read_buckets(connection_t *conn)
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
   conn->read_blocked_on_bw = 1;
   connection_stop_reading(conn);
+  connection_note_blocked_on_bw(conn);
 }
 
 /** If we have exhausted our global buckets, or the buckets for conn,
@@ -2792,16 +2907,18 @@ connection_consider_empty_read_buckets(connection_t *conn)
 static void
 connection_consider_empty_write_buckets(connection_t *conn)
 {
-  const char *reason;
+  const char *reason, *class_name;
+  int *class_read, *class_write;
 
   if (!connection_is_rate_limited(conn))
     return; /* Always okay. */
 
+  class_name = connection_get_class_buckets(conn, approx_time(),
+                                            &class_read, &class_write);
   if (global_write_bucket <= 0) {
     reason = "global write bucket exhausted. Pausing.";
-  } else if (connection_counts_as_relayed_traffic(conn, approx_time()) &&
-             global_relayed_write_bucket <= 0) {
-    reason = "global relayed write bucket exhausted. Pausing.";
+  } else if (class_name && *class_write <= 0) {
+    reason = "per-class write bucket exhausted. Pausing.";
   } else if (connection_speaks_cells(conn) &&
              conn->state == OR_CONN_STATE_OPEN &&
              TO_OR_CONN(conn)->write_bucket <= 0) {
@@ -2812,6 +2929,7 @@ connection_consider_empty_write_buckets(connection_t *conn)
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
   conn->write_blocked_on_bw = 1;
   connection_stop_writing(conn);
+  connection_note_blocked_on_bw(conn);
 }
 
 /** Initialize the global read bucket to options-\>BandwidthBurst. */
@@ -2829,6 +2947,8 @@ connection_bucket_init(void)
     global_relayed_read_bucket = (int)options->BandwidthBurst;
     global_relayed_write_bucket = (int)options->BandwidthBurst;
   }
+  global_dir_read_bucket = (int)options->DirBandwidthBurst;
+  global_dir_write_bucket = (int)options->DirBandwidthBurst;
 }
 
 /** Refill a single <b>bucket</b> called <b>name</b> with bandwidth rate per
@@ -2865,14 +2985,12 @@ void
 connection_bucket_refill(int milliseconds_elapsed, time_t now)
 {
   const or_options_t *options = get_options();
-  smartlist_t *conns = get_connection_array();
   int bandwidthrate, bandwidthburst, relayrate, relayburst;
 
   int prev_global_read = global_read_bucket;
   int prev_global_write = global_write_bucket;
   int prev_relay_read = global_relayed_read_bucket;
   int prev_relay_write = global_relayed_write_bucket;
-  struct timeval tvnow; /*< Only used if TB_EMPTY events are enabled. */
 
   bandwidthrate = (int)options->BandwidthRate;
   bandwidthburst = (int)options->BandwidthBurst;
@@ -2886,6 +3004,7 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
   }
 
   tor_assert(milliseconds_elapsed >= 0);
+  bucket_clock_msec += milliseconds_elapsed;
 
   write_buckets_empty_last_second =
     global_relayed_write_bucket <= 0 || global_write_bucket <= 0;
@@ -2907,10 +3026,23 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
                                   relayrate, relayburst,
                                   milliseconds_elapsed,
                                   "global_relayed_write_bucket");
+  if (options->DirBandwidthRate) {
+    connection_bucket_refill_helper(&global_dir_read_bucket,
+                                    (int)options->DirBandwidthRate,
+                                    (int)options->DirBandwidthBurst,
+                                    milliseconds_elapsed,
+                                    "global_dir_read_bucket");
+    connection_bucket_refill_helper(&global_dir_write_bucket,
+                                    (int)options->DirBandwidthRate,
+                                    (int)options->DirBandwidthBurst,
+                                    milliseconds_elapsed,
+                                    "global_dir_write_bucket");
+  }
 
   /* If buckets were empty before and have now been refilled, tell any
    * interested controllers. */
   if (get_options()->TestingEnableTbEmptyEvent) {
+    struct timeval tvnow;
     uint32_t global_read_empty_time, global_write_empty_time,
              relay_read_empty_time, relay_write_empty_time;
     tor_gettimeofday_cached(&tvnow);
@@ -2934,57 +3066,23 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
                            relay_write_empty_time, milliseconds_elapsed);
   }
 
-  /* refill the per-connection buckets */
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (connection_speaks_cells(conn)) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      int orbandwidthrate = or_conn->bandwidthrate;
-      int orbandwidthburst = or_conn->bandwidthburst;
-
-      int prev_conn_read = or_conn->read_bucket;
-      int prev_conn_write = or_conn->write_bucket;
-
-      if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->read_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->read_bucket");
-      }
-      if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->write_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->write_bucket");
-      }
+  /* Wake up the connections that were waiting for these tokens.  Every
+   * other connection's own buckets get topped up when we next look at
+   * them, so we don't need to visit it here. */
+  if (!blocked_on_bw_conns)
+    return;
+  SMARTLIST_FOREACH_BEGIN(blocked_on_bw_conns, connection_t *, conn) {
+    int *class_read, *class_write;
+    const char *class_name;
 
-      /* If buckets were empty before and have now been refilled, tell any
-       * interested controllers. */
-      if (get_options()->TestingEnableTbEmptyEvent) {
-        char *bucket;
-        uint32_t conn_read_empty_time, conn_write_empty_time;
-        tor_asprintf(&bucket, "ORCONN ID="U64_FORMAT,
-                     U64_PRINTF_ARG(or_conn->base_.global_identifier));
-        conn_read_empty_time = bucket_millis_empty(prev_conn_read,
-                               or_conn->read_emptied_time,
-                               or_conn->read_bucket,
-                               milliseconds_elapsed, &tvnow);
-        conn_write_empty_time = bucket_millis_empty(prev_conn_write,
-                                or_conn->write_emptied_time,
-                                or_conn->write_bucket,
-                                milliseconds_elapsed, &tvnow);
-        control_event_tb_empty(bucket, conn_read_empty_time,
-                               conn_write_empty_time,
-                               milliseconds_elapsed);
-        tor_free(bucket);
-      }
-    }
+    if (connection_speaks_cells(conn))
+      connection_bucket_catch_up(TO_OR_CONN(conn));
+    class_name = connection_get_class_buckets(conn, now,
+                                              &class_read, &class_write);
 
     if (conn->read_blocked_on_bw == 1 /* marked to turn reading back on now */
         && global_read_bucket > 0 /* and we're allowed to read */
-        && (!connection_counts_as_relayed_traffic(conn, now) ||
-            global_relayed_read_bucket > 0) /* even if we're relayed traffic */
+        && (!class_name || *class_read > 0) /* even in our traffic class */
         && (!connection_speaks_cells(conn) ||
             conn->state != OR_CONN_STATE_OPEN ||
             TO_OR_CONN(conn)->read_bucket > 0)) {
@@ -2997,8 +3095,7 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
 
     if (conn->write_blocked_on_bw == 1
         && global_write_bucket > 0 /* and we're allowed to write */
-        && (!connection_counts_as_relayed_traffic(conn, now) ||
-            global_relayed_write_bucket > 0) /* even if it's relayed traffic */
+        && (!class_name || *class_write > 0) /* even in our traffic class */
         && (!connection_speaks_cells(conn) ||
             conn->state != OR_CONN_STATE_OPEN ||
             TO_OR_CONN(conn)->write_bucket > 0)) {
@@ -3007,9 +3104,95 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
       conn->write_blocked_on_bw = 0;
       connection_start_writing(conn);
     }
+
+    if (!conn->read_blocked_on_bw && !conn->write_blocked_on_bw) {
+      conn->on_blocked_on_bw_list = 0;
+      SMARTLIST_DEL_CURRENT(blocked_on_bw_conns, conn);
+    }
   } SMARTLIST_FOREACH_END(conn);
 }
 
+/** Add the tokens that <b>or_conn</b> has earned since we last looked at its
+ * buckets, as if we had topped them up on every refill since then. */
+void
+connection_bucket_catch_up(or_connection_t *or_conn)
+{
+  const or_options_t *options = get_options();
+  int milliseconds_elapsed;
+  int prev_conn_read = or_conn->read_bucket;
+  int prev_conn_write = or_conn->write_bucket;
+
+  if (or_conn->buckets_last_refilled >= bucket_clock_msec)
+    return;
+  if (bucket_clock_msec - or_conn->buckets_last_refilled > INT_MAX)
+    milliseconds_elapsed = INT_MAX;
+  else
+    milliseconds_elapsed =
+      (int)(bucket_clock_msec - or_conn->buckets_last_refilled);
+  or_conn->buckets_last_refilled = bucket_clock_msec;
+
+  if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
+    connection_bucket_refill_helper(&or_conn->read_bucket,
+                                    or_conn->bandwidthrate,
+                                    or_conn->bandwidthburst,
+                                    milliseconds_elapsed,
+                                    "or_conn->read_bucket");
+  }
+  if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
+    connection_bucket_refill_helper(&or_conn->write_bucket,
+                                    or_conn->bandwidthrate,
+                                    or_conn->bandwidthburst,
+                                    milliseconds_elapsed,
+                                    "or_conn->write_bucket");
+  }
+
+  /* If buckets were empty before and have now been refilled, tell any
+   * interested controllers. */
+  if (options->TestingEnableTbEmptyEvent) {
+    struct timeval tvnow;
+    char *bucket;
+    uint32_t conn_read_empty_time, conn_write_empty_time;
+    tor_gettimeofday_cached(&tvnow);
+    tor_asprintf(&bucket, "ORCONN ID="U64_FORMAT,
+                 U64_PRINTF_ARG(or_conn->base_.global_identifier));
+    conn_read_empty_time = bucket_millis_empty(prev_conn_read,
+                           or_conn->read_emptied_time,
+                           or_conn->read_bucket,
+                           milliseconds_elapsed, &tvnow);
+    conn_write_empty_time = bucket_millis_empty(prev_conn_write,
+                            or_conn->write_emptied_time,
+                            or_conn->write_bucket,
+                            milliseconds_elapsed, &tvnow);
+    control_event_tb_empty(bucket, conn_read_empty_time,
+                           conn_write_empty_time,
+                           milliseconds_elapsed);
+    tor_free(bucket);
+  }
+}
+
+/** <b>conn</b> has just stopped reading or writing until we have more
+ * tokens for it: remember to wake it up on a later refill. */
+void
+connection_note_blocked_on_bw(connection_t *conn)
+{
+  if (conn->on_blocked_on_bw_list)
+    return;
+  if (!blocked_on_bw_conns)
+    blocked_on_bw_conns = smartlist_new();
+  smartlist_add(blocked_on_bw_conns, conn);
+  conn->on_blocked_on_bw_list = 1;
+}
+
+/** Stop remembering that <b>conn</b> is waiting for tokens. */
+static void
+connection_forget_blocked_on_bw(connection_t *conn)
+{
+  if (!conn->on_blocked_on_bw_list)
+    return;
+  smartlist_remove(blocked_on_bw_conns, conn);
+  conn->on_blocked_on_bw_list = 0;
+}
+
 /** Is the <b>bucket</b> for connection <b>conn</b> low enough that we
  * should add another pile of tokens to it?
  */
@@ -3045,6 +3228,17 @@ connection_bucket_refill(int seconds_elapsed, time_t now)
   /* Libevent does this for us. */
 }
 void
+connection_note_blocked_on_bw(connection_t *conn)
+{
+  (void) conn;
+  /* Libevent wakes up rate-limited connections for us. */
+}
+static void
+connection_forget_blocked_on_bw(connection_t *conn)
+{
+  (void) conn;
+}
+void
 connection_bucket_init(void)
 {
   const or_options_t *options = get_options();
@@ -3238,6 +3432,10 @@ connection_handle_read(connection_t *conn)
   int res;
 
   tor_gettimeofday_cache_clear();
+#ifndef USE_BUFFEREVENTS
+  if (conn->type == CONN_TYPE_OR)
+    tls_shards_wait_for_conn(TO_OR_CONN(conn));
+#endif
   res = connection_handle_read_impl(conn);
   return res;
 }
@@ -3266,7 +3464,8 @@ connection_read_to_buf(connection_t *conn, ssize_t *max_to_read,
     at_most = connection_bucket_read_limit(conn, approx_time());
   }
 
-  slack_in_buf = buf_slack(conn->inbuf);
+  /* A batched read has already been put on the inbuf, so don't split it. */
+  slack_in_buf = conn->has_batched_read_result ? 0 : buf_slack(conn->inbuf);
  again:
   if ((size_t)at_most > slack_in_buf && slack_in_buf >= 1024) {
     more_to_read = at_most - slack_in_buf;
@@ -3294,7 +3493,15 @@ connection_read_to_buf(connection_t *conn, ssize_t *max_to_read,
 
     initial_size = buf_datalen(conn->inbuf);
     /* else open, or closing */
-    result = read_to_buf_tls(or_conn->tls, at_most, conn->inbuf);
+    if (or_conn->has_tls_shard_read_result) {
+      /* A TLS shard has already done this read for us, and put what it got
+       * on the inbuf. */
+      or_conn->has_tls_shard_read_result = 0;
+      result = or_conn->tls_shard_read_result;
+      initial_size -= or_conn->tls_shard_n_read;
+    } else {
+      result = read_to_buf_tls(or_conn->tls, at_most, conn->inbuf);
+    }
     if (TOR_TLS_IS_ERROR(result) || result == TOR_TLS_CLOSE)
       or_conn->tls_error = result;
     else
@@ -3372,9 +3579,27 @@ connection_read_to_buf(connection_t *conn, ssize_t *max_to_read,
   } else {
     /* !connection_speaks_cells, !conn->linked_conn. */
     int reached_eof = 0;
-    CONN_LOG_PROTECT(conn,
-        result = read_to_buf(conn->s, at_most, conn->inbuf, &reached_eof,
-                             socket_error));
+    if (conn->has_batched_read_result) {
+      /* The kernel has already done this read for us, as part of a batch,
+       * and we've already put what it got on the inbuf. */
+      const int r = conn->batched_read_result;
+      conn->has_batched_read_result = 0;
+      if (r > 0) {
+        result = r;
+      } else if (r == 0) {
+        reached_eof = 1;
+        result = 0;
+      } else if (ERRNO_IS_EAGAIN(-r)) {
+        result = 0;
+      } else {
+        *socket_error = -r;
+        result = -1;
+      }
+    } else {
+      CONN_LOG_PROTECT(conn,
+          result = read_to_buf(conn->s, at_most, conn->inbuf, &reached_eof,
+                               socket_error));
+    }
     if (reached_eof)
       conn->inbuf_reached_eof = 1;
 
@@ -3784,15 +4009,36 @@ connection_handle_write_impl(connection_t *conn, int force)
     }
 
     /* else open, or closing */
+    if (!force && !or_conn->has_tls_shard_write_result &&
+        connection_or_should_coalesce_outbuf(or_conn)) {
+      /* Wait for more cells, so they can share a TLS record. */
+      connection_stop_writing(conn);
+      return 0;
+    }
     initial_size = buf_datalen(conn->outbuf);
-    result = flush_buf_tls(or_conn->tls, conn->outbuf,
-                           max_to_write, &conn->outbuf_flushlen);
+    if (or_conn->has_tls_shard_write_result) {
+      /* A TLS shard has already done this write for us, and taken what it
+       * wrote off the outbuf. */
+      or_conn->has_tls_shard_write_result = 0;
+      result = or_conn->tls_shard_write_result;
+      initial_size += or_conn->tls_shard_n_written;
+    } else {
+      result = flush_buf_tls(or_conn->tls, conn->outbuf,
+                             max_to_write, &conn->outbuf_flushlen);
+    }
+    if (result >= TOR_TLS_MAX_RECORD_PLAINTEXT) {
+      /* We've sent at least a whole record, so whatever we were waiting to
+       * coalesce has gone out; start over with what's left. */
+      connection_or_clear_coalescing(or_conn);
+    }
 
     /* If we just flushed the last bytes, tell the channel on the
      * or_conn to check if it needs to geoip_change_dirreq_state() */
     /* XXXX move this to flushed_some or finished_flushing -NM */
     if (buf_datalen(conn->outbuf) == 0 && or_conn->chan)
       channel_notify_flushed(TLS_CHAN_TO_BASE(or_conn->chan));
+    if (buf_datalen(conn->outbuf) == 0)
+      or_conn->timestamp_lastempty = now;
 
     switch (result) {
       CASE_TOR_TLS_ERROR_ANY:
@@ -3823,6 +4069,7 @@ connection_handle_write_impl(connection_t *conn, int force)
         if (!connection_is_reading(conn)) {
           connection_stop_writing(conn);
           conn->write_blocked_on_bw = 1;
+          connection_note_blocked_on_bw(conn);
           /* we'll start reading again when we get more tokens in our
            * read bucket; then we'll start writing again too.
            */
@@ -3847,9 +4094,19 @@ connection_handle_write_impl(connection_t *conn, int force)
      * or something. */
     result = (int)(initial_size-buf_datalen(conn->outbuf));
   } else {
-    CONN_LOG_PROTECT(conn,
-             result = flush_buf(conn->s, conn->outbuf,
-                                max_to_write, &conn->outbuf_flushlen));
+    if (conn->has_batched_write_result) {
+      /* The kernel has already done this write for us, as part of a
+       * batch. */
+      conn->has_batched_write_result = 0;
+      CONN_LOG_PROTECT(conn,
+               result = flush_buf_note_written(conn->outbuf,
+                                               conn->batched_write_result,
+                                               &conn->outbuf_flushlen));
+    } else {
+      CONN_LOG_PROTECT(conn,
+               result = flush_buf(conn->s, conn->outbuf,
+                                  max_to_write, &conn->outbuf_flushlen));
+    }
     if (result < 0) {
       if (CONN_IS_EDGE(conn))
         connection_edge_end_errno(TO_EDGE_CONN(conn));
@@ -3943,6 +4200,10 @@ connection_handle_write(connection_t *conn, int force)
 {
     int res;
     tor_gettimeofday_cache_clear();
+#ifndef USE_BUFFEREVENTS
+    if (conn->type == CONN_TYPE_OR)
+      tls_shards_wait_for_conn(TO_OR_CONN(conn));
+#endif
     conn->in_connection_handle_write = 1;
     res = connection_handle_write_impl(conn, force);
     conn->in_connection_handle_write = 0;
@@ -4440,8 +4701,6 @@ connection_process_inbuf(connection_t *conn, int package_partial)
                                            package_partial);
     case CONN_TYPE_DIR:
       return connection_dir_process_inbuf(TO_DIR_CONN(conn));
-    case CONN_TYPE_CPUWORKER:
-      return connection_cpu_process_inbuf(conn);
     case CONN_TYPE_CONTROL:
       return connection_control_process_inbuf(TO_CONTROL_CONN(conn));
     default:
@@ -4501,8 +4760,6 @@ connection_finished_flushing(connection_t *conn)
       return connection_edge_finished_flushing(TO_EDGE_CONN(conn));
     case CONN_TYPE_DIR:
       return connection_dir_finished_flushing(TO_DIR_CONN(conn));
-    case CONN_TYPE_CPUWORKER:
-      return connection_cpu_finished_flushing(conn);
     case CONN_TYPE_CONTROL:
       return connection_control_finished_flushing(TO_CONTROL_CONN(conn));
     default:
@@ -4558,8 +4815,6 @@ connection_reached_eof(connection_t *conn)
       return connection_edge_reached_eof(TO_EDGE_CONN(conn));
     case CONN_TYPE_DIR:
       return connection_dir_reached_eof(TO_DIR_CONN(conn));
-    case CONN_TYPE_CPUWORKER:
-      return connection_cpu_reached_eof(conn);
     case CONN_TYPE_CONTROL:
       return connection_control_reached_eof(TO_CONTROL_CONN(conn));
     default:
@@ -4765,10 +5020,6 @@ assert_connection_ok(connection_t *conn, time_t now)
       tor_assert(conn->purpose >= DIR_PURPOSE_MIN_);
       tor_assert(conn->purpose <= DIR_PURPOSE_MAX_);
       break;
-    case CONN_TYPE_CPUWORKER:
-      tor_assert(conn->state >= CPUWORKER_STATE_MIN_);
-      tor_assert(conn->state <= CPUWORKER_STATE_MAX_);
-      break;
     case CONN_TYPE_CONTROL:
       tor_assert(conn->state >= CONTROL_CONN_STATE_MIN_);
       tor_assert(conn->state <= CONTROL_CONN_STATE_MAX_);
@@ -4891,6 +5142,7 @@ connection_free_all(void)
   /* Unlink everything from the identity map. */
   connection_or_clear_identity_map();
   connection_or_clear_ext_or_id_map();
+  connection_or_coalesce_free_all();
 
   /* Clear out our list of broken connections */
   clear_broken_connection_map(0);
@@ -4909,6 +5161,9 @@ connection_free_all(void)
 #ifdef USE_BUFFEREVENTS
   if (global_rate_limit)
     bufferevent_rate_limit_group_free(global_rate_limit);
+#else
+  smartlist_free(blocked_on_bw_conns);
+  blocked_on_bw_conns = NULL;
 #endif
 }
 
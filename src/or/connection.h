@@ -110,10 +110,15 @@ int retry_all_listeners(smartlist_t *replaced_conns,
 void connection_mark_all_noncontrol_listeners(void);
 void connection_mark_all_noncontrol_connections(void);
 
+ssize_t connection_bucket_read_limit(connection_t *conn, time_t now);
 ssize_t connection_bucket_write_limit(connection_t *conn, time_t now);
 int global_write_bucket_low(connection_t *conn, size_t attempt, int priority);
 void connection_bucket_init(void);
 void connection_bucket_refill(int seconds_elapsed, time_t now);
+#ifndef USE_BUFFEREVENTS
+void connection_bucket_catch_up(or_connection_t *or_conn);
+#endif
+void connection_note_blocked_on_bw(connection_t *conn);
 
 int connection_handle_read(connection_t *conn);
 
@@ -219,6 +224,22 @@ void connection_enable_rate_limiting(connection_t *conn);
 #ifdef CONNECTION_PRIVATE
 STATIC void connection_free_(connection_t *conn);
 
+/** The most connections that we accept from one listener each time it
+ * becomes readable. */
+#define MAX_ACCEPTS_PER_LISTENER_READ 64
+
+STATIC int make_socket_reuseport(tor_socket_t sock);
+MOCK_DECL(STATIC connection_t *, connection_listener_new,
+          (const struct sockaddr *listensockaddr, socklen_t socklen,
+           int type, const char *address, const port_cfg_t *port_cfg));
+MOCK_DECL(STATIC int, connection_accept_one,
+          (connection_t *conn, int new_type));
+STATIC int connection_handle_listener_read(connection_t *conn, int new_type);
+STATIC int retry_listener_ports(smartlist_t *old_conns,
+                                const smartlist_t *ports,
+                                smartlist_t *new_conns,
+                                int control_listeners_only);
+
 /* Used only by connection.c and test*.c */
 uint32_t bucket_millis_empty(int tokens_before, uint32_t last_empty_time,
                              int tokens_after, int milliseconds_elapsed,
@@ -2872,8 +2872,7 @@ connection_exit_connect_dir(edge_connection_t *exitconn)
   }
 
   /* link exitconn to circ, now that we know we can use it. */
-  exitconn->next_stream = circ->n_streams;
-  circ->n_streams = exitconn;
+  or_circuit_add_n_stream(circ, exitconn);
 
   if (connection_add(TO_CONN(dirconn))<0) {
     connection_edge_end(exitconn, END_STREAM_REASON_RESOURCELIMIT);
@@ -2974,6 +2973,32 @@ connection_ap_can_use_exit(const entry_connection_t *conn, const node_t *exit)
   return 1;
 }
 
+/** Return true iff connection_ap_can_use_exit() decides whether an exit
+ * suits <b>conn</b> using only that exit's policy for the stream's port
+ * (and ExcludeExitNodes).  For such streams, callers can use
+ * nodelist_get_exit_port_bitarray() instead of asking about every node. */
+int
+connection_ap_can_use_exit_by_port_only(const entry_connection_t *conn)
+{
+  tor_addr_t addr;
+
+  tor_assert(conn);
+  tor_assert(conn->socks_request);
+
+  if (conn->chosen_exit_name || conn->use_begindir)
+    return 0;
+  if (conn->socks_request->command != SOCKS_COMMAND_CONNECT ||
+      !conn->socks_request->port)
+    return 0;
+  if (0 == tor_addr_parse(&addr, conn->socks_request->address))
+    return 0;
+  /* An IPv6-only stream checks the exits' IPv6 policies; everything else
+   * checks the same IPv4 policy as an unknown address would. */
+  if (!conn->ipv4_traffic_ok && conn->ipv6_traffic_ok)
+    return 0;
+  return 1;
+}
+
 /** If address is of the form "y.onion" with a well-formed handle y:
  *     Put a NUL after y, lower-case it, and return ONION_HOSTNAME.
  *
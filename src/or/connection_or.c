@@ -44,6 +44,12 @@
 #include <event2/bufferevent_ssl.h>
 #endif
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 static int connection_tls_finish_handshake(or_connection_t *conn);
 static int connection_or_launch_v3_or_handshake(or_connection_t *conn);
 static int connection_or_process_cells_from_inbuf(or_connection_t *conn);
@@ -418,8 +424,8 @@ connection_or_get_num_circuits(or_connection_t *conn)
  * in the buffer <b>dest</b>. See tor-spec.txt for details about the
  * wire format.
  *
- * Note that this function doesn't touch <b>dst</b>-\>next: the caller
- * should set it or clear it as appropriate.
+ * Note that this function only touches <b>dst</b>-\>body: the caller
+ * should set the rest of <b>dst</b> as appropriate.
  */
 void
 cell_pack(packed_cell_t *dst, const cell_t *src, int wide_circ_ids)
@@ -621,6 +627,105 @@ connection_or_num_cells_writeable(or_connection_t *conn)
   return n;
 }
 
+/** OR connections whose writes we are holding back in the hope of filling
+ * a whole TLS record. */
+static smartlist_t *coalescing_conns = NULL;
+/** Timer to let the connections in coalescing_conns write again. */
+static struct event *coalesce_ev = NULL;
+
+/** Callback for coalesce_ev: stop holding back the writes of every
+ * connection in coalescing_conns. */
+static void
+connection_or_coalesce_timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+  (void)fd;
+  (void)what;
+  (void)arg;
+
+  if (!coalescing_conns)
+    return;
+  SMARTLIST_FOREACH_BEGIN(coalescing_conns, or_connection_t *, conn) {
+    conn->coalescing_outbuf = 0;
+    conn->coalesce_delay_expired = 1;
+    if (!conn->base_.marked_for_close)
+      connection_start_writing(TO_CONN(conn));
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_clear(coalescing_conns);
+}
+
+/** Return true iff we should hold off on writing the outbuf of the open OR
+ * connection <b>conn</b> for now, because it holds less than a full TLS
+ * record and the oldest data on it has waited less than
+ * MaxTLSRecordCoalesceDelay.  If so, arrange to let it write once that
+ * delay is up. */
+int
+connection_or_should_coalesce_outbuf(or_connection_t *conn)
+{
+  const or_options_t *options = get_options();
+  connection_t *c = TO_CONN(conn);
+  struct timeval now, tv;
+  uint32_t now_msec, age_msec;
+
+  if (conn->coalesce_delay_expired) {
+    conn->coalesce_delay_expired = 0;
+    return 0;
+  }
+  if (options->MaxTLSRecordCoalesceDelay <= 0 ||
+      c->marked_for_close ||
+      c->outbuf_flushlen >= TOR_TLS_MAX_RECORD_PLAINTEXT ||
+      c->outbuf_flushlen == 0 ||
+      tor_tls_get_forced_write_size(conn->tls))
+    return 0;
+  if (conn->coalescing_outbuf)
+    return 1; /* Already waiting. */
+
+  tor_gettimeofday_cached_monotonic(&now);
+  now_msec = (uint32_t)tv_to_msec(&now);
+  age_msec = buf_get_oldest_chunk_timestamp(c->outbuf, now_msec);
+  if (age_msec >= (uint32_t)options->MaxTLSRecordCoalesceDelay)
+    return 0;
+
+  if (!coalescing_conns)
+    coalescing_conns = smartlist_new();
+  if (!coalesce_ev)
+    coalesce_ev = tor_event_new(tor_libevent_get_base(), -1, 0,
+                                connection_or_coalesce_timeout_cb, NULL);
+  smartlist_add(coalescing_conns, conn);
+  conn->coalescing_outbuf = 1;
+  if (!event_pending(coalesce_ev, EV_TIMEOUT, NULL)) {
+    /* If the timer is already pending, it will fire sooner than this
+     * connection needs; that's fine. */
+    uint32_t delay_msec = options->MaxTLSRecordCoalesceDelay - age_msec;
+    tv.tv_sec = delay_msec / 1000;
+    tv.tv_usec = (delay_msec % 1000) * 1000;
+    event_add(coalesce_ev, &tv);
+  }
+  return 1;
+}
+
+/** Stop tracking <b>conn</b> as a connection whose writes we are holding
+ * back.  Called when <b>conn</b> is freed, and when it has flushed a whole
+ * record. */
+void
+connection_or_clear_coalescing(or_connection_t *conn)
+{
+  if (conn->coalescing_outbuf && coalescing_conns)
+    smartlist_remove(coalescing_conns, conn);
+  conn->coalescing_outbuf = 0;
+}
+
+/** Release all storage held for holding back OR connection writes. */
+void
+connection_or_coalesce_free_all(void)
+{
+  smartlist_free(coalescing_conns);
+  coalescing_conns = NULL;
+  if (coalesce_ev) {
+    tor_event_free(coalesce_ev);
+    coalesce_ev = NULL;
+  }
+}
+
 /** Connection <b>conn</b> has finished writing and has no bytes left on
  * its outbuf.
  *
@@ -781,6 +886,11 @@ connection_or_update_token_buckets_helper(or_connection_t *conn, int reset,
                                 (int)options->BandwidthBurst, 1, INT32_MAX);
   }
 
+#ifndef USE_BUFFEREVENTS
+  /* Give the buckets the tokens they earned under the old limits before we
+   * apply the new ones. */
+  connection_bucket_catch_up(conn);
+#endif
   conn->bandwidthrate = rate;
   conn->bandwidthburst = burst;
 #ifdef USE_BUFFEREVENTS
@@ -868,6 +978,8 @@ connection_or_set_canonical(or_connection_t *or_conn,
 
   or_conn->is_canonical = !! is_canonical; /* force to a 1-bit boolean */
   or_conn->idle_timeout = timeout_base + crypto_rand_int(timeout_base / 2);
+  /* The new timeout may be shorter than the one we were waiting for. */
+  connection_schedule_housekeeping(TO_CONN(or_conn), approx_time());
 }
 
 /** If we don't necessarily know the router we're connecting to, but we
@@ -952,6 +1064,8 @@ connection_or_mark_bad_for_new_circs(or_connection_t *or_conn)
 
   if (or_conn->chan)
     channel_mark_bad_for_new_circs(TLS_CHAN_TO_BASE(or_conn->chan));
+  /* If it has no circuits, run_connection_housekeeping() will close it. */
+  connection_schedule_housekeeping(TO_CONN(or_conn), approx_time());
 }
 
 /** How old do we let a connection to an OR get before deciding it's
@@ -1978,7 +2092,13 @@ connection_or_set_state_open(or_connection_t *conn)
     connection_watch_events(TO_CONN(conn), READ_EVENT|WRITE_EVENT);
   }) ELSE_IF_NO_BUFFEREVENT {
     connection_start_reading(TO_CONN(conn));
+    /* Now that the link handshake is done, nobody will renegotiate, so the
+     * kernel can take over our TLS records. */
+    if (conn->tls)
+      tor_tls_start_kernel_tls(conn->tls);
   }
+  /* Open connections have idle timeouts that non-open ones don't. */
+  connection_schedule_housekeeping(TO_CONN(conn), approx_time());
 
   return 0;
 }
@@ -2046,17 +2166,29 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   }
 }
 
+/** Space for the cells that connection_or_process_cells_from_inbuf() hands
+ * to channel_tls_handle_cells() all at once.  This is too big for the stack,
+ * and we only process cells from the main thread, one connection at a
+ * time. */
+static cell_t inbuf_cell_batch[RELAY_CRYPT_MAX_CELLS];
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
  * and hand it to command_process_cell().
  *
+ * Once the handshake is done, we pull off up to RELAY_CRYPT_MAX_CELLS
+ * fixed-length cells before handing them to channel_tls_handle_cells() all
+ * at once, so that the cells for each circuit can be crypted together.
+ *
  * Always return 0.
  */
 static int
 connection_or_process_cells_from_inbuf(or_connection_t *conn)
 {
   var_cell_t *var_cell;
+  cell_t *cells = inbuf_cell_batch;
+  int n_cells = 0;
 
   while (1) {
     log_debug(LD_OR,
@@ -2065,6 +2197,10 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
               conn->base_.s,(int)connection_get_inbuf_len(TO_CONN(conn)),
               tor_tls_get_pending_bytes(conn->tls));
     if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
+      if (n_cells) {
+        channel_tls_handle_cells(cells, n_cells, conn);
+        n_cells = 0;
+      }
       if (!var_cell)
         return 0; /* not yet. */
 
@@ -2079,10 +2215,13 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
       const int wide_circ_ids = conn->wide_circ_ids;
       size_t cell_network_size = get_cell_network_size(conn->wide_circ_ids);
       char buf[CELL_MAX_NETWORK_SIZE];
-      cell_t cell;
+      cell_t *cell = &cells[n_cells];
       if (connection_get_inbuf_len(TO_CONN(conn))
-          < cell_network_size) /* whole response available? */
+          < cell_network_size) { /* whole response available? */
+        if (n_cells)
+          channel_tls_handle_cells(cells, n_cells, conn);
         return 0; /* not yet */
+      }
 
       /* Touch the channel's active timestamp if there is one */
       if (conn->chan)
@@ -2093,9 +2232,15 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
 
       /* retrieve cell info from buf (create the host-order struct from the
        * network-order string) */
-      cell_unpack(&cell, buf, wide_circ_ids);
-
-      channel_tls_handle_cell(&cell, conn);
+      cell_unpack(cell, buf, wide_circ_ids);
+
+      if (conn->base_.state != OR_CONN_STATE_OPEN) {
+        /* Handshake cells can change how we read the rest. */
+        channel_tls_handle_cell(cell, conn);
+      } else if (++n_cells == RELAY_CRYPT_MAX_CELLS) {
+        channel_tls_handle_cells(cells, n_cells, conn);
+        n_cells = 0;
+      }
     }
   }
 }
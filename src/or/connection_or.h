@@ -26,6 +26,9 @@ int connection_or_reached_eof(or_connection_t *conn);
 int connection_or_process_inbuf(or_connection_t *conn);
 ssize_t connection_or_num_cells_writeable(or_connection_t *conn);
 int connection_or_flushed_some(or_connection_t *conn);
+int connection_or_should_coalesce_outbuf(or_connection_t *conn);
+void connection_or_clear_coalescing(or_connection_t *conn);
+void connection_or_coalesce_free_all(void);
 int connection_or_finished_flushing(or_connection_t *conn);
 int connection_or_finished_connecting(or_connection_t *conn);
 void connection_or_about_to_close(or_connection_t *conn);
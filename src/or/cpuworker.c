@@ -5,84 +5,154 @@
 
 /**
  * \file cpuworker.c
- * \brief Implements a farm of 'CPU worker' processes to perform
- * CPU-intensive tasks in another thread or process, to not
- * interrupt the main thread.
+ * \brief Uses the workqueue/threadpool code to farm CPU-intensive activities
+ * out to worker threads.
  *
  * Right now, we only use this for processing onionskins.
  **/
 #include "or.h"
-#include "buffers.h"
 #include "channel.h"
-#include "channeltls.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
 #include "config.h"
-#include "connection.h"
 #include "connection_or.h"
 #include "cpuworker.h"
 #include "main.h"
 #include "onion.h"
 #include "rephist.h"
 #include "router.h"
+#include "workqueue.h"
 
-/** The maximum number of cpuworker processes we will keep around. */
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+/** The maximum number of cpuworker threads we will keep around. */
 #define MAX_CPUWORKERS 16
-/** The minimum number of cpuworker processes we will keep around. */
+/** The minimum number of cpuworker threads we will keep around. */
 #define MIN_CPUWORKERS 1
+/** How many onionskins we let sit on the shared work queue for each worker
+ * thread before we start holding them back on the onion queue in onion.c,
+ * where they can be prioritized and culled. */
+#define CPUWORKER_TASKS_PER_THREAD 64
+/** The largest number of onionskins that we hand to a worker thread as a
+ * single job. */
+#define MAX_ONIONSKINS_PER_JOB 8
+
+static void queue_pending_tasks(void);
+
+/** The thread pool that runs our onionskin handshakes. */
+static threadpool_t *threadpool = NULL;
+/** The reply queue on which <b>threadpool</b> reports finished handshakes. */
+static replyqueue_t *replyqueue = NULL;
+/** Event that fires when <b>replyqueue</b> has answers for us. */
+static struct event *reply_event = NULL;
+
+/** Weak RNG used to decide which handshakes to time. */
+static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
 
-/** The tag specifies which circuit this onionskin was from. */
-#define TAG_LEN 12
-
-/** How many cpuworkers we have running right now. */
-static int num_cpuworkers=0;
-/** How many of the running cpuworkers have an assigned task right now. */
-static int num_cpuworkers_busy=0;
-/** We need to spawn new cpuworkers whenever we rotate the onion keys
- * on platforms where execution contexts==processes.  This variable stores
- * the last time we got a key rotation event. */
-static time_t last_rotation_time=0;
+/** How many onionskins have we handed to the thread pool that it has not yet
+ * answered? */
+static int total_pending_tasks = 0;
+/** How many onionskins can the thread pool hold before we start queueing
+ * them in onion.c instead? */
+static int max_pending_tasks = CPUWORKER_TASKS_PER_THREAD;
 
-static void cpuworker_main(void *data) ATTR_NORETURN;
-static int spawn_cpuworker(void);
-static void spawn_enough_cpuworkers(void);
-static void process_pending_task(connection_t *cpuworker);
+/** Return the number of worker threads we should run. */
+static int
+get_num_cpuworkers(void)
+{
+  int n = get_num_cpus(get_options());
+  if (n < MIN_CPUWORKERS)
+    n = MIN_CPUWORKERS;
+  if (n > MAX_CPUWORKERS)
+    n = MAX_CPUWORKERS;
+  return n;
+}
 
-/** Initialize the cpuworker subsystem.
- */
-void
-cpu_init(void)
+/** Callback: the reply queue's alert socket is readable, so one or more
+ * workers have finished some handshakes.  Handle all of them. */
+static void
+replyqueue_process_cb(evutil_socket_t sock, short events, void *arg)
 {
-  cpuworkers_rotate();
+  replyqueue_t *rq = arg;
+  (void) sock;
+  (void) events;
+  replyqueue_process(rq);
 }
 
-/** Called when we're done sending a request to a cpuworker. */
-int
-connection_cpu_finished_flushing(connection_t *conn)
+/** Per-thread state for a cpuworker: a copy of the keys it needs to
+ * answer onionskins. */
+typedef struct worker_state_s {
+  /** Which key generation this state corresponds to. */
+  int generation;
+  /** The onion keys to use when answering handshakes. */
+  server_onion_keys_t *onion_keys;
+} worker_state_t;
+
+/** Allocate and return a worker_state_t holding copies of our current
+ * onion keys.  Call only from the main thread. */
+static void *
+worker_state_new(void *arg)
 {
-  tor_assert(conn);
-  tor_assert(conn->type == CONN_TYPE_CPUWORKER);
-  return 0;
+  worker_state_t *ws;
+  (void)arg;
+  ws = tor_malloc_zero(sizeof(worker_state_t));
+  ws->onion_keys = server_onion_keys_new();
+  return ws;
 }
 
-/** Pack global_id and circ_id; set *tag to the result. (See note on
- * cpuworker_main for wire format.) */
+/** Release all storage held by the worker_state_t <b>arg</b>. */
 static void
-tag_pack(uint8_t *tag, uint64_t chan_id, circid_t circ_id)
+worker_state_free(void *arg)
 {
-  /*XXXX RETHINK THIS WHOLE MESS !!!! !NM NM NM NM*/
-  /*XXXX DOUBLEPLUSTHIS!!!! AS AS AS AS*/
-  set_uint64(tag, chan_id);
-  set_uint32(tag+8, circ_id);
+  worker_state_t *ws = arg;
+  if (!ws)
+    return;
+  server_onion_keys_free(ws->onion_keys);
+  tor_free(ws);
 }
 
-/** Unpack <b>tag</b> into addr, port, and circ_id.
+/** Initialize the cpuworker subsystem: launch the worker threads, and start
+ * listening for their replies.
  */
-static void
-tag_unpack(const uint8_t *tag, uint64_t *chan_id, circid_t *circ_id)
+void
+cpu_init(void)
 {
-  *chan_id = get_uint64(tag);
-  *circ_id = get_uint32(tag+8);
+  int n_threads;
+
+  if (!replyqueue) {
+    replyqueue = replyqueue_new(0);
+    if (!replyqueue) {
+      log_err(LD_GENERAL, "Unable to create a reply queue for cpuworkers.");
+      tor_assert(0);
+    }
+  }
+  if (!reply_event) {
+    reply_event = tor_event_new(tor_libevent_get_base(),
+                                replyqueue_get_socket(replyqueue),
+                                EV_READ|EV_PERSIST,
+                                replyqueue_process_cb,
+                                replyqueue);
+    event_add(reply_event, NULL);
+  }
+  if (!threadpool) {
+    n_threads = get_num_cpuworkers();
+    threadpool = threadpool_new(n_threads,
+                                replyqueue,
+                                worker_state_new,
+                                worker_state_free,
+                                NULL);
+    if (!threadpool) {
+      log_err(LD_GENERAL, "Unable to launch cpuworker threads.");
+      tor_assert(0);
+    }
+    max_pending_tasks =
+      threadpool_get_n_threads(threadpool) * CPUWORKER_TASKS_PER_THREAD;
+    crypto_seed_weak_rng(&request_sample_rng);
+  }
 }
 
 /** Magic numbers to make sure our cpuworker_requests don't grow any
@@ -94,10 +164,6 @@ tag_unpack(const uint8_t *tag, uint64_t *chan_id, circid_t *circ_id)
 typedef struct cpuworker_request_t {
   /** Magic number; must be CPUWORKER_REQUEST_MAGIC. */
   uint32_t magic;
-  /** Opaque tag to identify the job */
-  uint8_t tag[TAG_LEN];
-  /** Task code. Must be one of CPUWORKER_TASK_* */
-  uint8_t task;
 
   /** Flag: Are we timing this request? */
   unsigned timed : 1;
@@ -114,8 +180,7 @@ typedef struct cpuworker_request_t {
 typedef struct cpuworker_reply_t {
   /** Magic number; must be CPUWORKER_REPLY_MAGIC. */
   uint32_t magic;
-  /** Opaque tag to identify the job; matches the request's tag.*/
-  uint8_t tag[TAG_LEN];
+
   /** True iff we got a successful request. */
   uint8_t success;
 
@@ -142,42 +207,70 @@ typedef struct cpuworker_reply_t {
   uint8_t rend_auth_material[DIGEST_LEN];
 } cpuworker_reply_t;
 
-/** Called when the onion key has changed and we need to spawn new
- * cpuworkers.  Close all currently idle cpuworkers, and mark the last
- * rotation time as now.
- */
-void
-cpuworkers_rotate(void)
+/** One onionskin in a cpuworker_job_t, and the circuit it came from.  The
+ * worker thread turns the request into a reply in place. */
+typedef struct cpuworker_job_item_t {
+  /** The circuit waiting for this handshake, or NULL if the circuit has
+   * been freed since we queued the job.  Only the main thread looks at
+   * this field. */
+  or_circuit_t *circ;
+  union {
+    cpuworker_request_t request;
+    cpuworker_reply_t reply;
+  } u;
+} cpuworker_job_item_t;
+
+/** A unit of work for the thread pool: a batch of onionskins that a single
+ * worker answers in one go, and whose replies all reach the main thread
+ * together. */
+typedef struct cpuworker_job_u {
+  /** How many circuits in <b>items</b> are still waiting for this job? */
+  int n_live;
+  /** Number of elements in <b>items</b>. */
+  int n_items;
+  cpuworker_job_item_t items[FLEXIBLE_ARRAY_MEMBER];
+} cpuworker_job_t;
+
+/** Return the number of bytes to allocate for a cpuworker_job_t holding
+ * <b>n</b> onionskins. */
+#define CPUWORKER_JOB_LEN(n) \
+  (STRUCT_OFFSET(cpuworker_job_t, items) + (n)*sizeof(cpuworker_job_item_t))
+
+/** Worker thread function: replace the onion keys in the worker state
+ * <b>worker_state_</b> with the ones in <b>work_</b>. */
+static int
+update_state_threadfn(void *state_, void *work_)
 {
-  connection_t *cpuworker;
-  while ((cpuworker = connection_get_by_type_state(CONN_TYPE_CPUWORKER,
-                                                   CPUWORKER_STATE_IDLE))) {
-    connection_mark_for_close(cpuworker);
-    --num_cpuworkers;
-  }
-  last_rotation_time = time(NULL);
-  if (server_mode(get_options()))
-    spawn_enough_cpuworkers();
+  worker_state_t *state = state_;
+  worker_state_t *update = work_;
+  server_onion_keys_free(state->onion_keys);
+  state->onion_keys = update->onion_keys;
+  update->onion_keys = NULL;
+  worker_state_free(update);
+  ++state->generation;
+  return WQ_RPL_REPLY;
 }
 
-/** If the cpuworker closes the connection,
- * mark it as closed and spawn a new one as needed. */
-int
-connection_cpu_reached_eof(connection_t *conn)
+/** Called when the onion key has changed so update all CPU worker(s) with
+ * new function pointers with which a new state will be generated.
+ */
+void
+cpuworkers_rotate_keyinfo(void)
 {
-  log_warn(LD_GENERAL,"Read eof. CPU worker died unexpectedly.");
-  if (conn->state != CPUWORKER_STATE_IDLE) {
-    /* the circ associated with this cpuworker will have to wait until
-     * it gets culled in run_connection_housekeeping(), since we have
-     * no way to find out which circ it was. */
-    log_warn(LD_GENERAL,"...and it left a circuit queued; abandoning circ.");
-    num_cpuworkers_busy--;
+  if (!threadpool) {
+    /* If we're a server that has just started up, we may not have any
+     * workers yet; launch them now that we have keys. */
+    if (server_mode(get_options()))
+      cpu_init();
+    return;
+  }
+  if (threadpool_queue_update(threadpool,
+                              worker_state_new,
+                              update_state_threadfn,
+                              worker_state_free,
+                              NULL)) {
+    log_warn(LD_OR, "Failed to queue key update for worker threads.");
   }
-  num_cpuworkers--;
-  spawn_enough_cpuworkers(); /* try to regrow. hope we don't end up
-                                spinning. */
-  connection_mark_for_close(conn);
-  return 0;
 }
 
 /** Indexed by handshake type: how many onionskins have we processed and
@@ -192,13 +285,15 @@ static uint64_t onionskins_usec_internal[MAX_ONION_HANDSHAKE_TYPE+1];
  * cpuworkers to give us answers for that kind of onionskin?
  */
 static uint64_t onionskins_usec_roundtrip[MAX_ONION_HANDSHAKE_TYPE+1];
+/** Indexed by handshake type, corresponding to onionskins counted in
+ * onionskins_n_processed: what is the total size of the batches that those
+ * onionskins were answered in? */
+static uint64_t onionskins_batch_total[MAX_ONION_HANDSHAKE_TYPE+1];
 
 /** If any onionskin takes longer than this, we clip them to this
  * time. (microseconds) */
 #define MAX_BELIEVABLE_ONIONSKIN_DELAY (2*1000*1000)
 
-static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
-
 /** Return true iff we'd like to measure a handshake of type
  * <b>onionskin_type</b>. Call only from the main thread. */
 static int
@@ -273,6 +368,7 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
 {
   uint32_t overhead;
   double relative_overhead;
+  double batch_size;
   int r;
 
   r = get_overhead_for_onionskins(&overhead,  &relative_overhead,
@@ -280,434 +376,390 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
   if (!overhead || r<0)
     return;
 
+  batch_size = U64_TO_DBL(onionskins_batch_total[onionskin_type]) /
+    onionskins_n_processed[onionskin_type];
+
   log_fn(severity, LD_OR,
          "%s onionskins have averaged %u usec overhead (%.2f%%) in "
-         "cpuworker code ",
-         onionskin_type_name, (unsigned)overhead, relative_overhead*100);
+         "cpuworker code, in batches of %.2f onionskins on average.",
+         onionskin_type_name, (unsigned)overhead, relative_overhead*100,
+         batch_size);
 }
 
-/** Called when we get data from a cpuworker.  If the answer is not complete,
- * wait for a complete answer. If the answer is complete,
- * process it as appropriate.
- */
-int
-connection_cpu_process_inbuf(connection_t *conn)
+/** Record the timing information in the reply <b>rpl</b>, which was
+ * answered as part of a batch of <b>batch_size</b> onionskins. */
+static void
+cpuworker_note_reply_timing(const cpuworker_reply_t *rpl, int batch_size)
 {
-  uint64_t chan_id;
-  circid_t circ_id;
-  channel_t *p_chan = NULL;
-  circuit_t *circ;
-
-  tor_assert(conn);
-  tor_assert(conn->type == CONN_TYPE_CPUWORKER);
+  struct timeval tv_end, tv_diff;
+  int64_t usec_roundtrip;
 
-  if (!connection_get_inbuf_len(conn))
-    return 0;
+  if (!rpl->timed || !rpl->success ||
+      rpl->handshake_type > MAX_ONION_HANDSHAKE_TYPE)
+    return;
 
-  if (conn->state == CPUWORKER_STATE_BUSY_ONION) {
-    cpuworker_reply_t rpl;
-    if (connection_get_inbuf_len(conn) < sizeof(cpuworker_reply_t))
-      return 0; /* not yet */
-    tor_assert(connection_get_inbuf_len(conn) == sizeof(cpuworker_reply_t));
-
-    connection_fetch_from_buf((void*)&rpl,sizeof(cpuworker_reply_t),conn);
-
-    tor_assert(rpl.magic == CPUWORKER_REPLY_MAGIC);
-
-    if (rpl.timed && rpl.success &&
-        rpl.handshake_type <= MAX_ONION_HANDSHAKE_TYPE) {
-      /* Time how long this request took. The handshake_type check should be
-         needless, but let's leave it in to be safe. */
-      struct timeval tv_end, tv_diff;
-      int64_t usec_roundtrip;
-      tor_gettimeofday(&tv_end);
-      timersub(&tv_end, &rpl.started_at, &tv_diff);
-      usec_roundtrip = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
-      if (usec_roundtrip >= 0 &&
-          usec_roundtrip < MAX_BELIEVABLE_ONIONSKIN_DELAY) {
-        ++onionskins_n_processed[rpl.handshake_type];
-        onionskins_usec_internal[rpl.handshake_type] += rpl.n_usec;
-        onionskins_usec_roundtrip[rpl.handshake_type] += usec_roundtrip;
-        if (onionskins_n_processed[rpl.handshake_type] >= 500000) {
-          /* Scale down every 500000 handshakes.  On a busy server, that's
-           * less impressive than it sounds. */
-          onionskins_n_processed[rpl.handshake_type] /= 2;
-          onionskins_usec_internal[rpl.handshake_type] /= 2;
-          onionskins_usec_roundtrip[rpl.handshake_type] /= 2;
-        }
-      }
+  /* Time how long this request took. The handshake_type check should be
+     needless, but let's leave it in to be safe. */
+  tor_gettimeofday(&tv_end);
+  timersub(&tv_end, &rpl->started_at, &tv_diff);
+  usec_roundtrip = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
+  if (usec_roundtrip >= 0 &&
+      usec_roundtrip < MAX_BELIEVABLE_ONIONSKIN_DELAY) {
+    ++onionskins_n_processed[rpl->handshake_type];
+    onionskins_usec_internal[rpl->handshake_type] += rpl->n_usec;
+    onionskins_usec_roundtrip[rpl->handshake_type] += usec_roundtrip;
+    onionskins_batch_total[rpl->handshake_type] += batch_size;
+    if (onionskins_n_processed[rpl->handshake_type] >= 500000) {
+      /* Scale down every 500000 handshakes.  On a busy server, that's
+       * less impressive than it sounds. */
+      onionskins_n_processed[rpl->handshake_type] /= 2;
+      onionskins_usec_internal[rpl->handshake_type] /= 2;
+      onionskins_usec_roundtrip[rpl->handshake_type] /= 2;
+      onionskins_batch_total[rpl->handshake_type] /= 2;
     }
-    /* parse out the circ it was talking about */
-    tag_unpack(rpl.tag, &chan_id, &circ_id);
-    circ = NULL;
+  }
+}
+
+/** Handle the reply to one onionskin, <b>item</b>, from a batch of
+ * <b>batch_size</b> onionskins. */
+static void
+cpuworker_handle_reply_item(cpuworker_job_item_t *item, int batch_size)
+{
+  cpuworker_reply_t *rpl = &item->u.reply;
+  or_circuit_t *circ = item->circ;
+
+  tor_assert(rpl->magic == CPUWORKER_REPLY_MAGIC);
+
+  cpuworker_note_reply_timing(rpl, batch_size);
+
+  log_debug(LD_OR,
+            "Unpacking cpuworker reply, circ=%p, success=%d",
+            circ, rpl->success);
+
+  if (circ)
+    circ->workqueue_entry = NULL;
+
+  if (rpl->success == 0) {
     log_debug(LD_OR,
-              "Unpacking cpuworker reply, chan_id is " U64_FORMAT
-              ", circ_id is %u",
-              U64_PRINTF_ARG(chan_id), (unsigned)circ_id);
-    p_chan = channel_find_by_global_id(chan_id);
-
-    if (p_chan)
-      circ = circuit_get_by_circid_channel(circ_id, p_chan);
-
-    if (rpl.success == 0) {
-      log_debug(LD_OR,
-                "decoding onionskin failed. "
-                "(Old key or bad software.) Closing.");
-      if (circ)
-        circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
-      goto done_processing;
-    }
-    if (!circ) {
-      /* This happens because somebody sends us a destroy cell and the
-       * circuit goes away, while the cpuworker is working. This is also
-       * why our tag doesn't include a pointer to the circ, because we'd
-       * never know if it's still valid.
-       */
-      log_debug(LD_OR,"processed onion for a circ that's gone. Dropping.");
-      goto done_processing;
-    }
-    tor_assert(! CIRCUIT_IS_ORIGIN(circ));
-    if (onionskin_answer(TO_OR_CIRCUIT(circ),
-                         &rpl.created_cell,
-                         (const char*)rpl.keys,
-                         rpl.rend_auth_material) < 0) {
-      log_warn(LD_OR,"onionskin_answer failed. Closing.");
-      circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
-      goto done_processing;
-    }
-    log_debug(LD_OR,"onionskin_answer succeeded. Yay.");
-  } else {
-    tor_assert(0); /* don't ask me to do handshakes yet */
+              "decoding onionskin failed. "
+              "(Old key or bad software.) Closing.");
+    if (circ)
+      circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_TORPROTOCOL);
+    return;
+  }
+  if (!circ) {
+    /* This happens because somebody sends us a destroy cell and the
+     * circuit goes away, while the cpuworker is working. */
+    log_debug(LD_OR,"processed onion for a circ that's gone. Dropping.");
+    return;
+  }
+  if (circ->base_.marked_for_close) {
+    log_debug(LD_OR,"processed onion for a circ that's closing. Dropping.");
+    return;
   }
 
- done_processing:
-  conn->state = CPUWORKER_STATE_IDLE;
-  num_cpuworkers_busy--;
-  if (conn->timestamp_created < last_rotation_time) {
-    connection_mark_for_close(conn);
-    num_cpuworkers--;
-    spawn_enough_cpuworkers();
-  } else {
-    process_pending_task(conn);
+  if (onionskin_answer(circ,
+                       &rpl->created_cell,
+                       (const char*)rpl->keys,
+                       rpl->rend_auth_material) < 0) {
+    log_warn(LD_OR,"onionskin_answer failed. Closing.");
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
+    return;
   }
-  return 0;
+  log_debug(LD_OR,"onionskin_answer succeeded. Yay.");
 }
 
-/** Implement a cpuworker.  'data' is an fdarray as returned by socketpair.
- * Read and writes from fdarray[1].  Reads requests, writes answers.
- *
- *   Request format:
- *          cpuworker_request_t.
- *   Response format:
- *          cpuworker_reply_t
- */
+/** Handle a batch of replies from the worker threads. */
 static void
-cpuworker_main(void *data)
+cpuworker_onion_handshake_replyfn(void *work_)
 {
-  /* For talking to the parent thread/process */
-  tor_socket_t *fdarray = data;
-  tor_socket_t fd;
+  cpuworker_job_t *job = work_;
+  int i;
 
-  /* variables for onion processing */
-  server_onion_keys_t onion_keys;
-  cpuworker_request_t req;
-  cpuworker_reply_t rpl;
+  tor_assert(total_pending_tasks >= job->n_items);
+  total_pending_tasks -= job->n_items;
 
-  fd = fdarray[1]; /* this side is ours */
-  tor_free(data);
+  log_debug(LD_OR, "Unpacking cpuworker reply %p with %d onionskins",
+            job, job->n_items);
 
-  setup_server_onion_keys(&onion_keys);
+  for (i = 0; i < job->n_items; ++i)
+    cpuworker_handle_reply_item(&job->items[i], job->n_items);
 
-  for (;;) {
-    if (read_all(fd, (void *)&req, sizeof(req), 1) != sizeof(req)) {
-      log_info(LD_OR, "read request failed. Exiting.");
-      goto end;
-    }
-    tor_assert(req.magic == CPUWORKER_REQUEST_MAGIC);
-
-    memset(&rpl, 0, sizeof(rpl));
-
-    if (req.task == CPUWORKER_TASK_ONION) {
-      const create_cell_t *cc = &req.create_cell;
-      created_cell_t *cell_out = &rpl.created_cell;
-      struct timeval tv_start = {0,0}, tv_end;
-      int n;
-      rpl.timed = req.timed;
-      rpl.started_at = req.started_at;
-      rpl.handshake_type = cc->handshake_type;
-      if (req.timed)
-        tor_gettimeofday(&tv_start);
-      n = onion_skin_server_handshake(cc->handshake_type,
-                                      cc->onionskin, cc->handshake_len,
-                                      &onion_keys,
-                                      cell_out->reply,
-                                      rpl.keys, CPATH_KEY_MATERIAL_LEN,
-                                      rpl.rend_auth_material);
-      if (n < 0) {
-        /* failure */
-        log_debug(LD_OR,"onion_skin_server_handshake failed.");
-        memset(&rpl, 0, sizeof(rpl));
-        memcpy(rpl.tag, req.tag, TAG_LEN);
-        rpl.success = 0;
-      } else {
-        /* success */
-        log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
-        memcpy(rpl.tag, req.tag, TAG_LEN);
-        cell_out->handshake_len = n;
-        switch (cc->cell_type) {
-        case CELL_CREATE:
-          cell_out->cell_type = CELL_CREATED; break;
-        case CELL_CREATE2:
-          cell_out->cell_type = CELL_CREATED2; break;
-        case CELL_CREATE_FAST:
-          cell_out->cell_type = CELL_CREATED_FAST; break;
-        default:
-          tor_assert(0);
-          goto end;
-        }
-        rpl.success = 1;
-      }
-      rpl.magic = CPUWORKER_REPLY_MAGIC;
-      if (req.timed) {
-        struct timeval tv_diff;
-        int64_t usec;
-        tor_gettimeofday(&tv_end);
-        timersub(&tv_end, &tv_start, &tv_diff);
-        usec = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
-        if (usec < 0 || usec > MAX_BELIEVABLE_ONIONSKIN_DELAY)
-          rpl.n_usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
-        else
-          rpl.n_usec = (uint32_t) usec;
-      }
-      if (write_all(fd, (void*)&rpl, sizeof(rpl), 1) != sizeof(rpl)) {
-        log_err(LD_BUG,"writing response buf failed. Exiting.");
-        goto end;
-      }
-      log_debug(LD_OR,"finished writing response.");
-    } else if (req.task == CPUWORKER_TASK_SHUTDOWN) {
-      log_info(LD_OR,"Clean shutdown: exiting");
-      goto end;
+  memwipe(job, 0, CPUWORKER_JOB_LEN(job->n_items));
+  tor_free(job);
+  queue_pending_tasks();
+}
+
+/** Answer the onionskin in <b>req</b> using <b>onion_keys</b>, and store
+ * the answer in <b>rpl</b>. Return 0 on success, -1 if the request was
+ * malformed in a way that indicates a bug. */
+static int
+cpuworker_answer_onionskin(const server_onion_keys_t *onion_keys,
+                           const cpuworker_request_t *req,
+                           cpuworker_reply_t *rpl)
+{
+  const create_cell_t *cc = &req->create_cell;
+  created_cell_t *cell_out = &rpl->created_cell;
+  struct timeval tv_start = {0,0}, tv_end;
+  int n;
+
+  tor_assert(req->magic == CPUWORKER_REQUEST_MAGIC);
+  memset(rpl, 0, sizeof(*rpl));
+
+  rpl->timed = req->timed;
+  rpl->started_at = req->started_at;
+  rpl->handshake_type = cc->handshake_type;
+  if (req->timed)
+    tor_gettimeofday(&tv_start);
+  n = onion_skin_server_handshake(cc->handshake_type,
+                                  cc->onionskin, cc->handshake_len,
+                                  onion_keys,
+                                  cell_out->reply,
+                                  rpl->keys, CPATH_KEY_MATERIAL_LEN,
+                                  rpl->rend_auth_material);
+  if (n < 0) {
+    /* failure */
+    log_debug(LD_OR,"onion_skin_server_handshake failed.");
+    memset(rpl, 0, sizeof(*rpl));
+    rpl->success = 0;
+  } else {
+    /* success */
+    log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
+    cell_out->handshake_len = n;
+    switch (cc->cell_type) {
+    case CELL_CREATE:
+      cell_out->cell_type = CELL_CREATED; break;
+    case CELL_CREATE2:
+      cell_out->cell_type = CELL_CREATED2; break;
+    case CELL_CREATE_FAST:
+      cell_out->cell_type = CELL_CREATED_FAST; break;
+    default:
+      tor_assert(0);
+      return -1;
     }
-    memwipe(&req, 0, sizeof(req));
-    memwipe(&rpl, 0, sizeof(req));
+    rpl->success = 1;
   }
- end:
-  memwipe(&req, 0, sizeof(req));
-  memwipe(&rpl, 0, sizeof(req));
-  release_server_onion_keys(&onion_keys);
-  tor_close_socket(fd);
-  crypto_thread_cleanup();
-  spawn_exit();
+  rpl->magic = CPUWORKER_REPLY_MAGIC;
+  if (req->timed) {
+    struct timeval tv_diff;
+    int64_t usec;
+    tor_gettimeofday(&tv_end);
+    timersub(&tv_end, &tv_start, &tv_diff);
+    usec = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
+    if (usec < 0 || usec > MAX_BELIEVABLE_ONIONSKIN_DELAY)
+      rpl->n_usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
+    else
+      rpl->n_usec = (uint32_t) usec;
+  }
+  return 0;
 }
 
-/** Launch a new cpuworker. Return 0 if we're happy, -1 if we failed.
- */
+/** Implementation function for onion handshake requests: answer every
+ * onionskin in the batch. */
 static int
-spawn_cpuworker(void)
+cpuworker_onion_handshake_threadfn(void *state_, void *work_)
 {
-  tor_socket_t *fdarray;
-  tor_socket_t fd;
-  connection_t *conn;
-  int err;
-
-  fdarray = tor_calloc(2, sizeof(tor_socket_t));
-  if ((err = tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fdarray)) < 0) {
-    log_warn(LD_NET, "Couldn't construct socketpair for cpuworker: %s",
-             tor_socket_strerror(-err));
-    tor_free(fdarray);
-    return -1;
+  worker_state_t *state = state_;
+  cpuworker_job_t *job = work_;
+  const server_onion_keys_t *onion_keys = state->onion_keys;
+  cpuworker_request_t req;
+  cpuworker_reply_t rpl;
+  int i, result = WQ_RPL_REPLY;
+
+  for (i = 0; i < job->n_items; ++i) {
+    cpuworker_job_item_t *item = &job->items[i];
+    memcpy(&req, &item->u.request, sizeof(req));
+    if (cpuworker_answer_onionskin(onion_keys, &req, &rpl) < 0)
+      result = WQ_RPL_SHUTDOWN;
+    memcpy(&item->u.reply, &rpl, sizeof(rpl));
   }
 
-  tor_assert(SOCKET_OK(fdarray[0]));
-  tor_assert(SOCKET_OK(fdarray[1]));
+  memwipe(&req, 0, sizeof(req));
+  memwipe(&rpl, 0, sizeof(rpl));
+  return result;
+}
 
-  fd = fdarray[0];
-  if (spawn_func(cpuworker_main, (void*)fdarray) < 0) {
-    tor_close_socket(fdarray[0]);
-    tor_close_socket(fdarray[1]);
-    tor_free(fdarray);
-    return -1;
-  }
-  log_debug(LD_OR,"just spawned a cpu worker.");
+/** Give the <b>n</b> onionskins in <b>onionskins</b>, from the circuits in
+ * <b>circs</b>, to the thread pool as a single job.  Takes ownership of the
+ * onionskins.  Return 0 on success, -1 on failure. */
+static int
+cpuworker_queue_job(or_circuit_t **circs, create_cell_t **onionskins, int n)
+{
+  workqueue_entry_t *queue_entry;
+  cpuworker_job_t *job;
+  int i;
 
-  conn = connection_new(CONN_TYPE_CPUWORKER, AF_UNIX);
+  tor_assert(n >= 1 && n <= MAX_ONIONSKINS_PER_JOB);
 
-  /* set up conn so it's got all the data we need to remember */
-  conn->s = fd;
-  conn->address = tor_strdup("localhost");
-  tor_addr_make_unspec(&conn->addr);
+  job = tor_malloc_zero(CPUWORKER_JOB_LEN(n));
+  job->n_items = job->n_live = n;
 
-  if (set_socket_nonblocking(fd) == -1) {
-    connection_free(conn); /* this closes fd */
-    return -1;
+  for (i = 0; i < n; ++i) {
+    or_circuit_t *circ = circs[i];
+    create_cell_t *onionskin = onionskins[i];
+    cpuworker_request_t *req = &job->items[i].u.request;
+
+    if (connection_or_digest_is_known_relay(circ->p_chan->identity_digest))
+      rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+    job->items[i].circ = circ;
+    req->magic = CPUWORKER_REQUEST_MAGIC;
+    req->timed = should_time_request(onionskin->handshake_type);
+    memcpy(&req->create_cell, onionskin, sizeof(create_cell_t));
+    memwipe(onionskin, 0, sizeof(create_cell_t));
+    tor_free(onionskin);
+    if (req->timed)
+      tor_gettimeofday(&req->started_at);
   }
 
-  if (connection_add(conn) < 0) { /* no space, forget it */
-    log_warn(LD_NET,"connection_add for cpuworker failed. Giving up.");
-    connection_free(conn); /* this closes fd */
+  total_pending_tasks += n;
+  queue_entry = threadpool_queue_work(threadpool,
+                                      cpuworker_onion_handshake_threadfn,
+                                      cpuworker_onion_handshake_replyfn,
+                                      job);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    total_pending_tasks -= n;
+    memwipe(job, 0, CPUWORKER_JOB_LEN(n));
+    tor_free(job);
     return -1;
   }
+  log_debug(LD_OR, "Queued task %p with %d onionskins (qe=%p)",
+            job, n, queue_entry);
 
-  conn->state = CPUWORKER_STATE_IDLE;
-  connection_start_reading(conn);
+  for (i = 0; i < n; ++i)
+    circs[i]->workqueue_entry = queue_entry;
 
-  return 0; /* success */
+  return 0;
 }
 
-/** If we have too few or too many active cpuworkers, try to spawn new ones
- * or kill idle ones.
- */
-static void
-spawn_enough_cpuworkers(void)
+/** Return how many onionskins we should put in the next job, given that
+ * there are <b>n_waiting</b> onionskins ready to go.  We make jobs large
+ * enough to save wakeups when we're backlogged, but small enough that
+ * every worker thread still gets a share of the backlog. */
+static int
+cpuworker_choose_batch_size(int n_waiting)
 {
-  int num_cpuworkers_needed = get_num_cpus(get_options());
-  int reseed = 0;
-
-  if (num_cpuworkers_needed < MIN_CPUWORKERS)
-    num_cpuworkers_needed = MIN_CPUWORKERS;
-  if (num_cpuworkers_needed > MAX_CPUWORKERS)
-    num_cpuworkers_needed = MAX_CPUWORKERS;
-
-  while (num_cpuworkers < num_cpuworkers_needed) {
-    if (spawn_cpuworker() < 0) {
-      log_warn(LD_GENERAL,"Cpuworker spawn failed. Will try again later.");
-      return;
-    }
-    num_cpuworkers++;
-    reseed++;
-  }
-
-  if (reseed)
-    crypto_seed_weak_rng(&request_sample_rng);
+  int n_threads = threadpool_get_n_threads(threadpool);
+  int batch = CEIL_DIV(n_waiting, n_threads);
+  if (batch > MAX_ONIONSKINS_PER_JOB)
+    batch = MAX_ONIONSKINS_PER_JOB;
+  if (batch > max_pending_tasks - total_pending_tasks)
+    batch = max_pending_tasks - total_pending_tasks;
+  if (batch < 1)
+    batch = 1;
+  return batch;
 }
 
-/** Take a pending task from the queue and assign it to 'cpuworker'. */
+/** Take pending tasks from the queue and assign them to cpuworkers, several
+ * at a time. */
 static void
-process_pending_task(connection_t *cpuworker)
+queue_pending_tasks(void)
 {
+  or_circuit_t *circs[MAX_ONIONSKINS_PER_JOB];
+  create_cell_t *onionskins[MAX_ONIONSKINS_PER_JOB];
   or_circuit_t *circ;
   create_cell_t *onionskin = NULL;
+  int n, batch;
+
+  while (total_pending_tasks < max_pending_tasks) {
+    batch = cpuworker_choose_batch_size(
+                          onion_num_pending(ONION_HANDSHAKE_TYPE_TAP) +
+                          onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+    n = 0;
+    while (n < batch && (circ = onion_next_task(&onionskin))) {
+      if (!circ->p_chan) {
+        log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+        tor_free(onionskin);
+        continue;
+      }
+      circs[n] = circ;
+      onionskins[n] = onionskin;
+      ++n;
+    }
 
-  tor_assert(cpuworker);
-
-  /* for now only process onion tasks */
-
-  circ = onion_next_task(&onionskin);
-  if (!circ)
-    return;
-  if (assign_onionskin_to_cpuworker(cpuworker, circ, onionskin))
-    log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
-}
-
-/** How long should we let a cpuworker stay busy before we give
- * up on it and decide that we have a bug or infinite loop?
- * This value is high because some servers with low memory/cpu
- * sometimes spend an hour or more swapping, and Tor starves. */
-#define CPUWORKER_BUSY_TIMEOUT (60*60*12)
+    if (n == 0)
+      return;
 
-/** We have a bug that I can't find. Sometimes, very rarely, cpuworkers get
- * stuck in the 'busy' state, even though the cpuworker process thinks of
- * itself as idle. I don't know why. But here's a workaround to kill any
- * cpuworker that's been busy for more than CPUWORKER_BUSY_TIMEOUT.
- */
-static void
-cull_wedged_cpuworkers(void)
-{
-  time_t now = time(NULL);
-  smartlist_t *conns = get_connection_array();
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (!conn->marked_for_close &&
-        conn->type == CONN_TYPE_CPUWORKER &&
-        conn->state == CPUWORKER_STATE_BUSY_ONION &&
-        conn->timestamp_lastwritten + CPUWORKER_BUSY_TIMEOUT < now) {
-      log_notice(LD_BUG,
-                 "closing wedged cpuworker. Can somebody find the bug?");
-      num_cpuworkers_busy--;
-      num_cpuworkers--;
-      connection_mark_for_close(conn);
+    if (cpuworker_queue_job(circs, onionskins, n) < 0) {
+      log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+      return;
     }
-  } SMARTLIST_FOREACH_END(conn);
+  }
 }
 
 /** Try to tell a cpuworker to perform the public key operations necessary to
  * respond to <b>onionskin</b> for the circuit <b>circ</b>.
  *
- * If <b>cpuworker</b> is defined, assert that he's idle, and use him. Else,
- * look for an idle cpuworker and use him. If none idle, queue task onto the
- * pending onion list and return.  Return 0 if we successfully assign the
- * task, or -1 on failure.
+ * If the thread pool already has as much work as we're willing to give it,
+ * queue the task onto the pending onion list and return.  Return 0 if we
+ * successfully assign the task, or -1 on failure.
  */
 int
-assign_onionskin_to_cpuworker(connection_t *cpuworker,
-                              or_circuit_t *circ,
+assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  cpuworker_request_t req;
-  time_t now = approx_time();
-  static time_t last_culled_cpuworkers = 0;
-  int should_time;
-
-  /* Checking for wedged cpuworkers requires a linear search over all
-   * connections, so let's do it only once a minute.
-   */
-#define CULL_CPUWORKERS_INTERVAL 60
-
-  if (last_culled_cpuworkers + CULL_CPUWORKERS_INTERVAL <= now) {
-    cull_wedged_cpuworkers();
-    spawn_enough_cpuworkers();
-    last_culled_cpuworkers = now;
+  if (!threadpool) {
+    log_info(LD_OR, "No cpuworkers running; can't answer onionskin.");
+    tor_free(onionskin);
+    return -1;
   }
 
-  if (1) {
-    if (num_cpuworkers_busy == num_cpuworkers) {
-      log_debug(LD_OR,"No idle cpuworkers. Queuing.");
-      if (onion_pending_add(circ, onionskin) < 0) {
-        tor_free(onionskin);
-        return -1;
-      }
-      return 0;
-    }
-
-    if (!cpuworker)
-      cpuworker = connection_get_by_type_state(CONN_TYPE_CPUWORKER,
-                                               CPUWORKER_STATE_IDLE);
-
-    tor_assert(cpuworker);
+  if (!circ->p_chan) {
+    log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+    tor_free(onionskin);
+    return -1;
+  }
 
-    if (!circ->p_chan) {
-      log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+  if (total_pending_tasks >= max_pending_tasks) {
+    log_debug(LD_OR,"No idle cpuworkers. Queuing.");
+    if (onion_pending_add(circ, onionskin) < 0) {
       tor_free(onionskin);
       return -1;
     }
+    return 0;
+  }
 
-    if (connection_or_digest_is_known_relay(circ->p_chan->identity_digest))
-      rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
-
-    should_time = should_time_request(onionskin->handshake_type);
-    memset(&req, 0, sizeof(req));
-    req.magic = CPUWORKER_REQUEST_MAGIC;
-    tag_pack(req.tag, circ->p_chan->global_identifier,
-             circ->p_circ_id);
-    req.timed = should_time;
-
-    cpuworker->state = CPUWORKER_STATE_BUSY_ONION;
-    /* touch the lastwritten timestamp, since that's how we check to
-     * see how long it's been since we asked the question, and sometimes
-     * we check before the first call to connection_handle_write(). */
-    cpuworker->timestamp_lastwritten = now;
-    num_cpuworkers_busy++;
-
-    req.task = CPUWORKER_TASK_ONION;
-    memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
+  /* Nothing is waiting ahead of this onionskin, so don't hold it back to
+   * fill a batch. */
+  return cpuworker_queue_job(&circ, &onionskin, 1);
+}
 
-    tor_free(onionskin);
+/** If <b>circ</b> has a pending handshake that hasn't been processed yet,
+ * remove it from the worker queue.  If a worker is already answering it,
+ * detach <b>circ</b> from the job so that the answer gets dropped. */
+void
+cpuworker_cancel_circ_handshake(or_circuit_t *circ)
+{
+  cpuworker_job_t *job;
+  int i;
+  if (circ->workqueue_entry == NULL)
+    return;
 
-    if (should_time)
-      tor_gettimeofday(&req.started_at);
+  job = workqueue_entry_get_arg(circ->workqueue_entry);
+  if (job->n_live == 1) {
+    /* We're the only circuit that still wants this job: try to cancel it
+     * outright. */
+    cpuworker_job_t *cancelled = workqueue_entry_cancel(circ->workqueue_entry);
+    if (cancelled) {
+      tor_assert(cancelled == job);
+      tor_assert(total_pending_tasks >= job->n_items);
+      total_pending_tasks -= job->n_items;
+      memwipe(job, 0xe0, CPUWORKER_JOB_LEN(job->n_items));
+      tor_free(job);
+      circ->workqueue_entry = NULL;
+      return;
+    }
+  }
 
-    connection_write_to_buf((void*)&req, sizeof(req), cpuworker);
-    memwipe(&req, 0, sizeof(req));
+  /* Only the main thread ever looks at the circ fields of a job, so we can
+   * safely clear ours even while a worker is processing the job. */
+  for (i = 0; i < job->n_items; ++i) {
+    if (job->items[i].circ == circ) {
+      job->items[i].circ = NULL;
+      --job->n_live;
+    }
   }
-  return 0;
+  circ->workqueue_entry = NULL;
 }
 
@@ -743,8 +743,7 @@ dns_resolve(edge_connection_t *exitconn)
       } else {
         /* Add to the n_streams list; the calling function will send back a
          * connected cell. */
-        exitconn->next_stream = oncirc->n_streams;
-        oncirc->n_streams = exitconn;
+        or_circuit_add_n_stream(oncirc, exitconn);
       }
       break;
     case 0:
@@ -1332,9 +1331,8 @@ inform_pending_connections(cached_resolve_t *resolve)
         /* unlink pend->conn from resolving_streams, */
         circuit_detach_stream(circ, pend->conn);
         /* and link it to n_streams */
-        pend->conn->next_stream = TO_OR_CIRCUIT(circ)->n_streams;
         pend->conn->on_circuit = circ;
-        TO_OR_CIRCUIT(circ)->n_streams = pend->conn;
+        or_circuit_add_n_stream(TO_OR_CIRCUIT(circ), pend->conn);
 
         connection_exit_connect(pend->conn);
       } else {
@@ -20,6 +20,7 @@
 
 static void clear_geoip_db(void);
 static void init_geoip_countries(void);
+static void geoip_clear_family(sa_family_t family);
 
 /** An entry from the GeoIP IPv4 file: maps an IPv4 range to a country. */
 typedef struct geoip_ipv4_entry_t {
@@ -41,6 +42,27 @@ typedef struct geoip_country_t {
   uint32_t n_v3_ns_requests;
 } geoip_country_t;
 
+/** A GeoIP database for one address family, loaded from a binary file that
+ * we mmap rather than parse.  See geoip_write_binary_file() for the format.
+ */
+typedef struct geoip_binary_db_t {
+  /** The mmapped file. */
+  tor_mmap_t *map;
+  /** How many entries are in the file? */
+  int n_entries;
+  /** How many bytes are in each address: 4 for IPv4 or 16 for IPv6. */
+  int addr_len;
+  /** Pointers into <b>map</b>: the lowest and highest address in each
+   * entry's range, in network order, and each entry's index into
+   * <b>countries</b>, as a 2-byte integer in network order. */
+  const uint8_t *ip_low, *ip_high, *country;
+  /** How many countries the file lists. */
+  int n_countries;
+  /** Map from the file's country indices to indices into geoip_countries.
+   */
+  intptr_t *countries;
+} geoip_binary_db_t;
+
 /** A list of geoip_country_t */
 static smartlist_t *geoip_countries = NULL;
 /** A map from lowercased country codes to their position in geoip_countries.
@@ -50,6 +72,9 @@ static strmap_t *country_idxplus1_by_lc_code = NULL;
 /** Lists of all known geoip_ipv4_entry_t and geoip_ipv6_entry_t, sorted
  * by their respective ip_low. */
 static smartlist_t *geoip_ipv4_entries = NULL, *geoip_ipv6_entries = NULL;
+/** The binary GeoIP databases we're using instead of geoip_ipv4_entries and
+ * geoip_ipv6_entries, if any. */
+static geoip_binary_db_t *geoip_ipv4_db = NULL, *geoip_ipv6_db = NULL;
 
 /** SHA1 digest of the GeoIP files to include in extra-info descriptors. */
 static char geoip_digest[DIGEST_LEN];
@@ -72,20 +97,14 @@ geoip_get_country,(const char *country))
   return (country_t)idx;
 }
 
-/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
- * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
-static void
-geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
-                const char *country)
+/** Return the index of the 2-letter country code <b>country</b> in
+ * geoip_countries, adding it if it isn't there yet. */
+static intptr_t
+geoip_get_or_add_country(const char *country)
 {
   intptr_t idx;
   void *idxplus1_;
 
-  if (tor_addr_family(low) != tor_addr_family(high))
-    return;
-  if (tor_addr_compare(high, low, CMP_EXACT) < 0)
-    return;
-
   idxplus1_ = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
   if (!idxplus1_) {
@@ -102,6 +121,23 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     geoip_country_t *c = smartlist_get(geoip_countries, idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
+  return idx;
+}
+
+/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
+ * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
+static void
+geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
+                const char *country)
+{
+  intptr_t idx;
+
+  if (tor_addr_family(low) != tor_addr_family(high))
+    return;
+  if (tor_addr_compare(high, low, CMP_EXACT) < 0)
+    return;
+
+  idx = geoip_get_or_add_country(country);
 
   if (tor_addr_family(low) == AF_INET) {
     geoip_ipv4_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv4_entry_t));
@@ -130,11 +166,15 @@ geoip_parse_entry(const char *line, sa_family_t family)
   if (!geoip_countries)
     init_geoip_countries();
   if (family == AF_INET) {
-    if (!geoip_ipv4_entries)
+    if (!geoip_ipv4_entries) {
+      geoip_clear_family(family);
       geoip_ipv4_entries = smartlist_new();
+    }
   } else if (family == AF_INET6) {
-    if (!geoip_ipv6_entries)
+    if (!geoip_ipv6_entries) {
+      geoip_clear_family(family);
       geoip_ipv6_entries = smartlist_new();
+    }
   } else {
     log_warn(LD_GENERAL, "Unsupported family: %d", family);
     return -1;
@@ -245,6 +285,240 @@ geoip_ipv6_compare_key_to_entry_(const void *_key, const void **_member)
     return 0;
 }
 
+/** Magic string at the start of every binary GeoIP file. */
+#define GEOIP_BINARY_MAGIC "TORGEOIP"
+/** The version of the binary GeoIP format that we read and write. */
+#define GEOIP_BINARY_VERSION 1
+/** Length of the header of a binary GeoIP file: magic, version, family,
+ * source digest, number of countries, number of entries. */
+#define GEOIP_BINARY_HEADER_LEN (8 + 4 + 4 + DIGEST_LEN + 4 + 4)
+
+/** Release all storage held by the binary GeoIP database <b>db</b>. */
+static void
+geoip_binary_db_free(geoip_binary_db_t *db)
+{
+  if (!db)
+    return;
+  if (db->map)
+    tor_munmap_file(db->map);
+  tor_free(db->countries);
+  tor_free(db);
+}
+
+/** Write the GeoIP entries we have loaded for <b>family</b> to
+ * <b>fname</b> in our binary format, noting that they came from a text file
+ * whose SHA1 digest is <b>digest</b>.  Return 0 on success, -1 on failure.
+ *
+ * All integers are in network order.  The file holds:
+ *   - the 8 bytes "TORGEOIP", a 4-byte format version (1), and a 4-byte
+ *     address family (4 or 6);
+ *   - the DIGEST_LEN-byte digest of the text file;
+ *   - a 4-byte count of countries N_C and a 4-byte count of entries N_E;
+ *   - N_C 2-byte country codes;
+ *   - N_E lowest addresses, then N_E highest addresses, each 4 or 16 bytes;
+ *   - N_E 2-byte indices into the country codes.
+ * The entries are sorted by their lowest address, so that a lookup is a
+ * binary search over one flat array, straight out of the mmapped file.
+ */
+STATIC int
+geoip_write_binary_file(sa_family_t family, const char *fname,
+                        const char *digest)
+{
+  const smartlist_t *entries;
+  size_t addr_len, len;
+  int n_entries, n_countries, r;
+  char *buf, *cp;
+
+  tor_assert(family == AF_INET || family == AF_INET6);
+  entries = (family == AF_INET) ? geoip_ipv4_entries : geoip_ipv6_entries;
+  if (!entries || !geoip_countries)
+    return -1;
+  addr_len = (family == AF_INET) ? 4 : 16;
+  n_entries = smartlist_len(entries);
+  n_countries = smartlist_len(geoip_countries);
+  if (n_countries > UINT16_MAX)
+    return -1;
+
+  len = GEOIP_BINARY_HEADER_LEN + 2*n_countries +
+    n_entries * (2*addr_len + 2);
+  cp = buf = tor_malloc_zero(len);
+  memcpy(cp, GEOIP_BINARY_MAGIC, 8);
+  set_uint32(cp+8, htonl(GEOIP_BINARY_VERSION));
+  set_uint32(cp+12, htonl(family == AF_INET ? 4 : 6));
+  memcpy(cp+16, digest, DIGEST_LEN);
+  set_uint32(cp+16+DIGEST_LEN, htonl(n_countries));
+  set_uint32(cp+20+DIGEST_LEN, htonl(n_entries));
+  cp += GEOIP_BINARY_HEADER_LEN;
+  SMARTLIST_FOREACH(geoip_countries, geoip_country_t *, c, {
+    memcpy(cp, c->countrycode, 2);
+    cp += 2;
+  });
+  if (family == AF_INET) {
+    SMARTLIST_FOREACH_BEGIN(entries, geoip_ipv4_entry_t *, e) {
+      set_uint32(cp + 4*e_sl_idx, htonl(e->ip_low));
+      set_uint32(cp + 4*(n_entries+e_sl_idx), htonl(e->ip_high));
+      set_uint16(cp + 8*n_entries + 2*e_sl_idx, htons((uint16_t)e->country));
+    } SMARTLIST_FOREACH_END(e);
+  } else {
+    SMARTLIST_FOREACH_BEGIN(entries, geoip_ipv6_entry_t *, e) {
+      memcpy(cp + 16*e_sl_idx, e->ip_low.s6_addr, 16);
+      memcpy(cp + 16*(n_entries+e_sl_idx), e->ip_high.s6_addr, 16);
+      set_uint16(cp + 32*n_entries + 2*e_sl_idx,
+                 htons((uint16_t)e->country));
+    } SMARTLIST_FOREACH_END(e);
+  }
+
+  r = write_bytes_to_file(fname, buf, len, 1);
+  tor_free(buf);
+  return r;
+}
+
+/** Try to load a binary GeoIP database for <b>family</b> from <b>fname</b>,
+ * which must have been generated from a text file whose SHA1 digest is
+ * <b>digest</b>.  On success, replace any GeoIP entries for <b>family</b>
+ * and return 0.  If the file is missing, malformed, or stale, change
+ * nothing and return -1. */
+STATIC int
+geoip_load_binary_file(sa_family_t family, const char *fname,
+                       const char *digest)
+{
+  geoip_binary_db_t *db;
+  tor_mmap_t *map;
+  const uint8_t *cp;
+  size_t addr_len;
+  uint32_t n_countries, n_entries;
+  int i;
+
+  tor_assert(family == AF_INET || family == AF_INET6);
+  addr_len = (family == AF_INET) ? 4 : 16;
+
+  if (!(map = tor_mmap_file(fname)))
+    return -1;
+  db = tor_malloc_zero(sizeof(geoip_binary_db_t));
+  db->map = map;
+  cp = (const uint8_t *)map->data;
+
+  if (map->size < GEOIP_BINARY_HEADER_LEN ||
+      fast_memneq(cp, GEOIP_BINARY_MAGIC, 8) ||
+      ntohl(get_uint32(cp+8)) != GEOIP_BINARY_VERSION ||
+      ntohl(get_uint32(cp+12)) != (family == AF_INET ? 4u : 6u)) {
+    log_info(LD_GENERAL, "%s is not a binary GEOIP %s file.", fname,
+             family == AF_INET ? "IPv4" : "IPv6");
+    goto err;
+  }
+  if (tor_memneq(cp+16, digest, DIGEST_LEN)) {
+    log_info(LD_GENERAL, "Binary GEOIP file %s is out of date.", fname);
+    goto err;
+  }
+  n_countries = ntohl(get_uint32(cp+16+DIGEST_LEN));
+  n_entries = ntohl(get_uint32(cp+20+DIGEST_LEN));
+  if (n_countries > UINT16_MAX || n_entries > INT_MAX / (2*addr_len + 2) ||
+      map->size != GEOIP_BINARY_HEADER_LEN + 2*n_countries +
+                   n_entries * (2*addr_len + 2)) {
+    log_info(LD_GENERAL, "Binary GEOIP file %s has the wrong length.",
+             fname);
+    goto err;
+  }
+  cp += GEOIP_BINARY_HEADER_LEN;
+  db->n_countries = n_countries;
+  db->n_entries = n_entries;
+  db->addr_len = (int)addr_len;
+  db->ip_low = cp + 2*n_countries;
+  db->ip_high = db->ip_low + addr_len*n_entries;
+  db->country = db->ip_high + addr_len*n_entries;
+
+  /* Make sure every entry is well-formed and in order, so that lookups can
+   * trust the file. */
+  for (i = 0; i < db->n_entries; ++i) {
+    const uint8_t *low = db->ip_low + addr_len*i;
+    if (fast_memcmp(low, db->ip_high + addr_len*i, addr_len) > 0 ||
+        (i && fast_memcmp(low - addr_len, low, addr_len) > 0) ||
+        ntohs(get_uint16(db->country + 2*i)) >= n_countries) {
+      log_info(LD_GENERAL, "Binary GEOIP file %s has a bad entry.", fname);
+      goto err;
+    }
+  }
+  for (i = 0; i < db->n_countries; ++i) {
+    if (!TOR_ISPRINT(cp[2*i]) || !TOR_ISPRINT(cp[2*i+1])) {
+      log_info(LD_GENERAL, "Binary GEOIP file %s has a bad country code.",
+               fname);
+      goto err;
+    }
+  }
+
+  if (!geoip_countries)
+    init_geoip_countries();
+  db->countries = tor_calloc(n_countries ? n_countries : 1,
+                             sizeof(intptr_t));
+  for (i = 0; i < db->n_countries; ++i) {
+    char country[3];
+    memcpy(country, cp + 2*i, 2);
+    country[2] = '\0';
+    db->countries[i] = geoip_get_or_add_country(country);
+  }
+
+  geoip_clear_family(family);
+  if (family == AF_INET)
+    geoip_ipv4_db = db;
+  else
+    geoip_ipv6_db = db;
+  return 0;
+
+ err:
+  geoip_binary_db_free(db);
+  return -1;
+}
+
+/** Return the country index for <b>addr</b> in the binary GeoIP database
+ * <b>db</b>, or 0 if no entry covers it.  <b>addr</b> is in network order,
+ * and as long as the addresses in <b>db</b>. */
+static int
+geoip_binary_db_lookup(const geoip_binary_db_t *db, const uint8_t *addr)
+{
+  const size_t addr_len = db->addr_len;
+  int lo = 0, hi = db->n_entries;
+
+  /* Find the first entry whose lowest address is above addr; the one
+   * before it is the only one that might contain addr. */
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (fast_memcmp(db->ip_low + addr_len*mid, addr, addr_len) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0 ||
+      fast_memcmp(db->ip_high + addr_len*(lo-1), addr, addr_len) < 0)
+    return 0;
+  return (int)db->countries[ntohs(get_uint16(db->country + 2*(lo-1)))];
+}
+
+/** Release the GeoIP entries we have for <b>family</b>, whether they came
+ * from a text file or a binary one. */
+static void
+geoip_clear_family(sa_family_t family)
+{
+  if (family == AF_INET) {
+    if (geoip_ipv4_entries) {
+      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
+                        tor_free(e));
+      smartlist_free(geoip_ipv4_entries);
+      geoip_ipv4_entries = NULL;
+    }
+    geoip_binary_db_free(geoip_ipv4_db);
+    geoip_ipv4_db = NULL;
+  } else { /* AF_INET6 */
+    if (geoip_ipv6_entries) {
+      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
+                        tor_free(e));
+      smartlist_free(geoip_ipv6_entries);
+      geoip_ipv6_entries = NULL;
+    }
+    geoip_binary_db_free(geoip_ipv6_db);
+    geoip_ipv6_db = NULL;
+  }
+}
+
 /** Return 1 if we should collect geoip stats on bridge users, and
  * include them in our extrainfo descriptor. Else return 0. */
 int
@@ -288,6 +562,10 @@ init_geoip_countries(void)
  *
  * It also recognizes, and skips over, blank lines and lines that start
  * with '#' (comments).
+ *
+ * Parsing a full GeoIP file takes a while, so once we have, we save the
+ * result in a binary cache file in our data directory.  Next time, if the
+ * cache matches the text file's digest, we mmap it instead of parsing.
  */
 int
 geoip_load_file(sa_family_t family, const char *filename)
@@ -297,6 +575,9 @@ geoip_load_file(sa_family_t family, const char *filename)
   const or_options_t *options = get_options();
   int severity = options_need_geoip_info(options, &msg) ? LOG_WARN : LOG_INFO;
   crypto_digest_t *geoip_digest_env = NULL;
+  char file_digest[DIGEST_LEN];
+  char *cache_fname = NULL;
+  size_t n;
 
   tor_assert(family == AF_INET || family == AF_INET6);
 
@@ -308,51 +589,69 @@ geoip_load_file(sa_family_t family, const char *filename)
   if (!geoip_countries)
     init_geoip_countries();
 
-  if (family == AF_INET) {
-    if (geoip_ipv4_entries) {
-      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv4_entries);
+  /* Remember the file digest so that we can include it in our extra-info
+   * descriptors, and so we can tell whether our binary cache is current. */
+  geoip_digest_env = crypto_digest_new();
+  do {
+    char buf[4096];
+    n = fread(buf, 1, sizeof(buf), f);
+    crypto_digest_add_bytes(geoip_digest_env, buf, n);
+  } while (n);
+  crypto_digest_get_digest(geoip_digest_env, file_digest, DIGEST_LEN);
+  crypto_digest_free(geoip_digest_env);
+
+  if (options->DataDirectory) {
+    cache_fname = get_datadir_fname(family == AF_INET ? "cached-geoip" :
+                                    "cached-geoip6");
+    if (geoip_load_binary_file(family, cache_fname, file_digest) == 0) {
+      log_notice(LD_GENERAL, "Loaded GEOIP %s file %s from %s.",
+                 (family == AF_INET) ? "IPv4" : "IPv6", filename,
+                 cache_fname);
+      fclose(f);
+      goto done;
     }
+  }
+
+  geoip_clear_family(family);
+  if (family == AF_INET)
     geoip_ipv4_entries = smartlist_new();
-  } else { /* AF_INET6 */
-    if (geoip_ipv6_entries) {
-      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv6_entries);
-    }
+  else
     geoip_ipv6_entries = smartlist_new();
-  }
-  geoip_digest_env = crypto_digest_new();
 
   log_notice(LD_GENERAL, "Parsing GEOIP %s file %s.",
              (family == AF_INET) ? "IPv4" : "IPv6", filename);
+  rewind(f);
   while (!feof(f)) {
     char buf[512];
     if (fgets(buf, (int)sizeof(buf), f) == NULL)
       break;
-    crypto_digest_add_bytes(geoip_digest_env, buf, strlen(buf));
     /* FFFF track full country name. */
     geoip_parse_entry(buf, family);
   }
   /*XXXX abort and return -1 if no entries/illformed?*/
   fclose(f);
 
-  /* Sort list and remember file digests so that we can include it in
-   * our extra-info descriptors. */
-  if (family == AF_INET) {
+  if (family == AF_INET)
     smartlist_sort(geoip_ipv4_entries, geoip_ipv4_compare_entries_);
+  else
+    smartlist_sort(geoip_ipv6_entries, geoip_ipv6_compare_entries_);
+
+  if (cache_fname &&
+      geoip_write_binary_file(family, cache_fname, file_digest) < 0)
+    log_info(LD_GENERAL, "Couldn't write binary GEOIP file %s.", cache_fname);
+
+ done:
+  if (family == AF_INET) {
     /* Okay, now we need to maybe change our mind about what is in
      * which country. We do this for IPv4 only since that's what we
      * store in node->country. */
     refresh_all_country_info();
-    crypto_digest_get_digest(geoip_digest_env, geoip_digest, DIGEST_LEN);
+    memcpy(geoip_digest, file_digest, DIGEST_LEN);
   } else {
     /* AF_INET6 */
-    smartlist_sort(geoip_ipv6_entries, geoip_ipv6_compare_entries_);
-    crypto_digest_get_digest(geoip_digest_env, geoip6_digest, DIGEST_LEN);
+    memcpy(geoip6_digest, file_digest, DIGEST_LEN);
   }
-  crypto_digest_free(geoip_digest_env);
+  tor_free(cache_fname);
 
   return 0;
 }
@@ -367,6 +666,11 @@ STATIC int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
   geoip_ipv4_entry_t *ent;
+  if (geoip_ipv4_db) {
+    uint8_t addr[4];
+    set_uint32(addr, htonl(ipaddr));
+    return geoip_binary_db_lookup(geoip_ipv4_db, addr);
+  }
   if (!geoip_ipv4_entries)
     return -1;
   ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
@@ -384,6 +688,8 @@ geoip_get_country_by_ipv6(const struct in6_addr *addr)
 {
   geoip_ipv6_entry_t *ent;
 
+  if (geoip_ipv6_db)
+    return geoip_binary_db_lookup(geoip_ipv6_db, addr->s6_addr);
   if (!geoip_ipv6_entries)
     return -1;
   ent = smartlist_bsearch(geoip_ipv6_entries, addr,
@@ -437,9 +743,9 @@ geoip_is_loaded,(sa_family_t family))
   if (geoip_countries == NULL)
     return 0;
   if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
+    return geoip_ipv4_entries != NULL || geoip_ipv4_db != NULL;
   else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+    return geoip_ipv6_entries != NULL || geoip_ipv6_db != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -1642,20 +1948,10 @@ clear_geoip_db(void)
   }
 
   strmap_free(country_idxplus1_by_lc_code, NULL);
-  if (geoip_ipv4_entries) {
-    SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv4_entries);
-  }
-  if (geoip_ipv6_entries) {
-    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv6_entries);
-  }
+  geoip_clear_family(AF_INET);
+  geoip_clear_family(AF_INET6);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
-  geoip_ipv4_entries = NULL;
-  geoip_ipv6_entries = NULL;
 }
 
 /** Release all storage held in this file. */
@@ -21,6 +21,7 @@
 #include "circuitlist.h"
 #include "circuituse.h"
 #include "command.h"
+#include "compat_uring.h"
 #include "config.h"
 #include "confparse.h"
 #include "connection.h"
@@ -56,6 +57,7 @@
 #include "scheduler.h"
 #include "statefile.h"
 #include "status.h"
+#include "tlsshard.h"
 #include "util_process.h"
 #include "ext_orport.h"
 #ifdef USE_DMALLOC
@@ -75,6 +77,11 @@
 #include <event2/bufferevent.h>
 #endif
 
+#ifdef USE_IO_URING
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
 #ifdef HAVE_SYSTEMD
 #include <systemd/sd-daemon.h>
 #endif
@@ -89,6 +96,7 @@ static void conn_read_callback(evutil_socket_t fd, short event, void *_conn);
 static void conn_write_callback(evutil_socket_t fd, short event, void *_conn);
 static void second_elapsed_callback(periodic_timer_t *timer, void *args);
 static int conn_close_if_marked(int i);
+static time_t run_connection_housekeeping(connection_t *conn, time_t now);
 static void connection_start_reading_from_linked_conn(connection_t *conn);
 static int connection_should_read_from_linked_conn(connection_t *conn);
 
@@ -144,6 +152,45 @@ static smartlist_t *closeable_connection_lst = NULL;
 /** List of linked connections that are currently reading data into their
  * inbuf from their partner's outbuf. */
 static smartlist_t *active_linked_connection_lst = NULL;
+/** Timer wheel, counting in seconds, that holds the next time that each
+ * connection in connection_array needs run_connection_housekeeping(). */
+static timer_wheel_t *housekeeping_wheel = NULL;
+/** Were we hibernating the last time we did connection housekeeping? */
+static int hibernating_at_last_housekeeping = 0;
+#ifdef USE_IO_URING
+/** How many reads or writes do we hand the kernel with each
+ * io_uring_enter()? */
+#define IO_BATCH_SIZE 64
+/** How many chunks of an outbuf do we put in a single batched write? */
+#define WRITE_BATCH_MAX_IOV 16
+/** The io_uring that we use for batched reads and writes, if UseIOUring is
+ * set. */
+static tor_uring_t *io_batch_ring = NULL;
+/** True iff the kernel wouldn't give us a working io_uring: don't try
+ * again. */
+static int io_batch_ring_failed = 0;
+/** Connections that became readable during this pass of the event loop, and
+ * whose reads we'll do together in read_batch_callback(). */
+static smartlist_t *read_batch_conns = NULL;
+/** Event that we activate to run read_batch_callback() once Libevent has
+ * run the callbacks for every other socket that became ready. */
+static struct event *read_batch_event = NULL;
+/** Connections that became writable during this pass of the event loop, and
+ * whose writes we'll do together in write_batch_callback(). */
+static smartlist_t *write_batch_conns = NULL;
+/** Event that we activate to run write_batch_callback() once Libevent has
+ * run the callbacks for every other socket that became ready. */
+static struct event *write_batch_event = NULL;
+#endif
+#ifndef USE_BUFFEREVENTS
+/** Open OR connections that became readable or writable during this pass
+ * of the event loop, and whose TLS reads and writes we'll hand to the TLS
+ * shards together in tls_shard_batch_callback(). */
+static smartlist_t *tls_shard_batch_conns = NULL;
+/** Event that we activate to run tls_shard_batch_callback() once Libevent
+ * has run the callbacks for every other socket that became ready. */
+static struct event *tls_shard_batch_event = NULL;
+#endif
 /** Flag: Set to true iff we entered the current libevent main loop via
  * <b>loop_once</b>. If so, there's no need to trigger a loopexit in order
  * to handle linked connections. */
@@ -337,6 +384,8 @@ connection_add_impl(connection_t *conn, int is_connecting)
     /* XXXX CHECK FOR NULL RETURN! */
   }
 
+  connection_schedule_housekeeping(conn, approx_time());
+
   log_debug(LD_NET,"new conn type %s, socket %d, address %s, n_conns %d.",
             conn_type_to_string(conn->type), (int)conn->s, conn->address,
             smartlist_len(connection_array));
@@ -390,6 +439,24 @@ connection_remove(connection_t *conn)
   tor_assert(conn->conn_array_index >= 0);
   current_index = conn->conn_array_index;
   connection_unregister_events(conn); /* This is redundant, but cheap. */
+  if (housekeeping_wheel)
+    timer_wheel_cancel(housekeeping_wheel, &conn->housekeeping_timer);
+#ifdef USE_IO_URING
+  if (conn->in_read_batch) {
+    smartlist_remove(read_batch_conns, conn);
+    conn->in_read_batch = 0;
+  }
+  if (conn->in_write_batch) {
+    smartlist_remove(write_batch_conns, conn);
+    conn->in_write_batch = 0;
+  }
+#endif
+#ifndef USE_BUFFEREVENTS
+  if (conn->type == CONN_TYPE_OR && TO_OR_CONN(conn)->in_tls_shard_batch) {
+    smartlist_remove(tls_shard_batch_conns, conn);
+    TO_OR_CONN(conn)->in_tls_shard_batch = 0;
+  }
+#endif
   if (current_index == smartlist_len(connection_array)-1) { /* at the end */
     smartlist_del(connection_array, current_index);
     return 0;
@@ -480,6 +547,27 @@ connection_is_on_closeable_list(connection_t *conn)
   return smartlist_contains(closeable_connection_lst, conn);
 }
 
+/** Make sure that run_connection_housekeeping() looks at <b>conn</b> no
+ * later than <b>when</b>.  Does nothing if <b>conn</b> is not in the
+ * connection array. */
+void
+connection_schedule_housekeeping(connection_t *conn, time_t when)
+{
+  const int idx = conn->conn_array_index;
+  wheel_timer_t *timer = &conn->housekeeping_timer;
+
+  if (!connection_array || idx < 0 ||
+      idx >= smartlist_len(connection_array) ||
+      smartlist_get(connection_array, idx) != conn)
+    return;
+
+  if (!housekeeping_wheel)
+    housekeeping_wheel = timer_wheel_new(approx_time());
+  if (wheel_timer_is_scheduled(timer) && timer->deadline <= (uint64_t)when)
+    return;
+  timer_wheel_schedule(housekeeping_wheel, timer, (uint64_t)when);
+}
+
 /** Return true iff conn is in the current poll array. */
 int
 connection_in_array(connection_t *conn)
@@ -551,6 +639,10 @@ connection_is_reading(connection_t *conn)
   IF_HAS_BUFFEREVENT(conn,
     return (bufferevent_get_enabled(conn->bufev) & EV_READ) != 0;
   );
+#ifndef USE_BUFFEREVENTS
+  if (conn->type == CONN_TYPE_OR && TO_OR_CONN(conn)->tls_shard_suspended)
+    return TO_OR_CONN(conn)->tls_shard_reading;
+#endif
   return conn->reading_from_linked_conn ||
     (conn->read_event && event_pending(conn->read_event, EV_READ, NULL));
 }
@@ -565,6 +657,12 @@ connection_stop_reading,(connection_t *conn))
       bufferevent_disable(conn->bufev, EV_READ);
       return;
   });
+#ifndef USE_BUFFEREVENTS
+  if (conn->type == CONN_TYPE_OR && TO_OR_CONN(conn)->tls_shard_suspended) {
+    TO_OR_CONN(conn)->tls_shard_reading = 0;
+    return;
+  }
+#endif
 
   tor_assert(conn->read_event);
 
@@ -590,6 +688,12 @@ connection_start_reading,(connection_t *conn))
       bufferevent_enable(conn->bufev, EV_READ);
       return;
   });
+#ifndef USE_BUFFEREVENTS
+  if (conn->type == CONN_TYPE_OR && TO_OR_CONN(conn)->tls_shard_suspended) {
+    TO_OR_CONN(conn)->tls_shard_reading = 1;
+    return;
+  }
+#endif
 
   tor_assert(conn->read_event);
 
@@ -615,6 +719,10 @@ connection_is_writing(connection_t *conn)
   IF_HAS_BUFFEREVENT(conn,
     return (bufferevent_get_enabled(conn->bufev) & EV_WRITE) != 0;
   );
+#ifndef USE_BUFFEREVENTS
+  if (conn->type == CONN_TYPE_OR && TO_OR_CONN(conn)->tls_shard_suspended)
+    return TO_OR_CONN(conn)->tls_shard_writing;
+#endif
 
   return conn->writing_to_linked_conn ||
     (conn->write_event && event_pending(conn->write_event, EV_WRITE, NULL));
@@ -630,6 +738,12 @@ connection_stop_writing,(connection_t *conn))
       bufferevent_disable(conn->bufev, EV_WRITE);
       return;
   });
+#ifndef USE_BUFFEREVENTS
+  if (conn->type == CONN_TYPE_OR && TO_OR_CONN(conn)->tls_shard_suspended) {
+    TO_OR_CONN(conn)->tls_shard_writing = 0;
+    return;
+  }
+#endif
 
   tor_assert(conn->write_event);
 
@@ -656,6 +770,12 @@ connection_start_writing,(connection_t *conn))
       bufferevent_enable(conn->bufev, EV_WRITE);
       return;
   });
+#ifndef USE_BUFFEREVENTS
+  if (conn->type == CONN_TYPE_OR && TO_OR_CONN(conn)->tls_shard_suspended) {
+    TO_OR_CONN(conn)->tls_shard_writing = 1;
+    return;
+  }
+#endif
 
   tor_assert(conn->write_event);
 
@@ -751,19 +871,11 @@ close_closeable_connections(void)
   }
 }
 
-/** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
- * some data to read. */
+/** Try to read from <b>conn</b>, now that its socket is readable; if that
+ * fails, close it. */
 static void
-conn_read_callback(evutil_socket_t fd, short event, void *_conn)
+conn_handle_readable(connection_t *conn)
 {
-  connection_t *conn = _conn;
-  (void)fd;
-  (void)event;
-
-  log_debug(LD_NET,"socket %d wants to read.",(int)conn->s);
-
-  /* assert_connection_ok(conn, time(NULL)); */
-
   if (connection_handle_read(conn) < 0) {
     if (!conn->marked_for_close) {
 #ifndef _WIN32
@@ -778,25 +890,13 @@ conn_read_callback(evutil_socket_t fd, short event, void *_conn)
     }
   }
   assert_connection_ok(conn, time(NULL));
-
-  if (smartlist_len(closeable_connection_lst))
-    close_closeable_connections();
 }
 
-/** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
- * some data to write. */
+/** Try to write to <b>conn</b>, now that its socket is writable; if that
+ * fails, close it. */
 static void
-conn_write_callback(evutil_socket_t fd, short events, void *_conn)
+conn_handle_writable(connection_t *conn)
 {
-  connection_t *conn = _conn;
-  (void)fd;
-  (void)events;
-
-  LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "socket %d wants to write.",
-                     (int)conn->s));
-
-  /* assert_connection_ok(conn, time(NULL)); */
-
   if (connection_handle_write(conn, 0) < 0) {
     if (!conn->marked_for_close) {
       /* this connection is broken. remove it. */
@@ -816,6 +916,416 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
     }
   }
   assert_connection_ok(conn, time(NULL));
+}
+
+#ifdef USE_IO_URING
+/** Hand the kernel the <b>n_queued</b> reads (if <b>is_read</b>) or writes
+ * that we've queued on io_batch_ring, for the connections at the indices
+ * <b>queued</b> of <b>conns</b>, in the order we queued them.  Wait for
+ * them all, and give each connection its result.
+ *
+ * If the ring fails, take back the operations that the kernel hasn't
+ * taken, and leave those connections without a result, so that their
+ * handlers do the work themselves.  The kernel may still be working on the
+ * operations that it took, in the connections' buffers, so wait for those
+ * too.  If we can't even do that, close the ring, and close those
+ * connections with an error; since the kernel may still touch their
+ * buffers, we leave the buffers behind rather than freeing them. */
+static void
+io_batch_run(smartlist_t *conns, const int *queued, unsigned n_queued,
+             int is_read)
+{
+  unsigned n_done = 0, j;
+  int ring_failed = 0;
+  uint64_t idx;
+  int result;
+
+  while (n_done < n_queued) {
+    if (tor_uring_get_completion(io_batch_ring, &idx, &result)) {
+      connection_t *conn = smartlist_get(conns, (int)idx);
+      if (is_read) {
+        /* Put the bytes on the inbuf now, before any other connection's
+         * handler gets a chance to change this one's inbuf. */
+        if (result > 0)
+          buf_note_read(conn->inbuf, result);
+        conn->batched_read_result = result;
+        conn->has_batched_read_result = 1;
+      } else {
+        conn->batched_write_result = result;
+        conn->has_batched_write_result = 1;
+      }
+      ++n_done;
+    } else if (tor_uring_submit_and_wait(io_batch_ring,
+                                         n_queued - n_done) < 0) {
+      if (ring_failed)
+        break;
+      log_warn(LD_NET, "Batched %s failed; reading from and writing to "
+               "each connection separately from now on.",
+               is_read ? "reads" : "writes");
+      ring_failed = io_batch_ring_failed = 1;
+      /* Only the operations that the kernel took can still complete: they
+       * are the ones we queued first. */
+      n_queued -= tor_uring_cancel_unsubmitted(io_batch_ring);
+    }
+  }
+
+  if (n_done == n_queued)
+    return;
+
+  log_warn(LD_NET, "Couldn't wait for %u batched %s; closing those "
+           "connections.", n_queued - n_done, is_read ? "reads" : "writes");
+  tor_uring_free(io_batch_ring);
+  io_batch_ring = NULL;
+  for (j = 0; j < n_queued; ++j) {
+    connection_t *conn = smartlist_get(conns, queued[j]);
+    if (is_read && !conn->has_batched_read_result) {
+      conn->inbuf = buf_new();
+      conn->batched_read_result = -EIO;
+      conn->has_batched_read_result = 1;
+    } else if (!is_read && !conn->has_batched_write_result) {
+      conn->outbuf = buf_new();
+      conn->outbuf_flushlen = 0;
+      conn->batched_write_result = -EIO;
+      conn->has_batched_write_result = 1;
+    }
+  }
+}
+
+/** Libevent callback: write to every connection in write_batch_conns,
+ * handing the kernel up to IO_BATCH_SIZE of the writes at a time, and
+ * then let connection_handle_write() account for what each write did. */
+static void
+write_batch_callback(evutil_socket_t fd, short events, void *arg)
+{
+  static struct msghdr msgs[IO_BATCH_SIZE];
+  static struct iovec iovs[IO_BATCH_SIZE][WRITE_BATCH_MAX_IOV];
+  const time_t now = approx_time();
+  int start, i;
+  (void)fd;
+  (void)events;
+  (void)arg;
+
+  for (start = 0; start < smartlist_len(write_batch_conns);
+       start += IO_BATCH_SIZE) {
+    const int end = MIN(start + IO_BATCH_SIZE,
+                        smartlist_len(write_batch_conns));
+    int queued[IO_BATCH_SIZE];
+    unsigned n_queued = 0;
+
+    for (i = start; i < end && !io_batch_ring_failed; ++i) {
+      connection_t *conn = smartlist_get(write_batch_conns, i);
+      struct msghdr *msg = &msgs[i - start];
+      ssize_t max_to_write;
+      size_t len;
+
+      if (conn->marked_for_close || !SOCKET_OK(conn->s))
+        continue;
+      max_to_write = connection_bucket_write_limit(conn, now);
+      if (max_to_write <= 0)
+        continue;
+      memset(msg, 0, sizeof(*msg));
+      msg->msg_iov = iovs[i - start];
+      msg->msg_iovlen = buf_get_iovecs(conn->outbuf, max_to_write,
+                                       msg->msg_iov, WRITE_BATCH_MAX_IOV,
+                                       &len);
+      if (!len)
+        continue;
+      /* With MSG_DONTWAIT, the kernel does each write as soon as we submit
+       * it, and reports EAGAIN rather than waiting for the socket. */
+      if (tor_uring_prep_sendmsg(io_batch_ring, conn->s, msg,
+                                 MSG_DONTWAIT|MSG_NOSIGNAL, (uint64_t)i) < 0)
+        continue;
+      queued[n_queued++] = i;
+    }
+    if (n_queued)
+      io_batch_run(write_batch_conns, queued, n_queued, 0);
+
+    for (i = start; i < end; ++i) {
+      connection_t *conn = smartlist_get(write_batch_conns, i);
+      conn->in_write_batch = 0;
+      conn_handle_writable(conn);
+      conn->has_batched_write_result = 0;
+    }
+  }
+  smartlist_clear(write_batch_conns);
+
+  if (smartlist_len(closeable_connection_lst))
+    close_closeable_connections();
+}
+
+/** Return true iff we can hand the kernel the reads and writes for
+ * <b>conn</b> as part of a batch: that is, iff they go straight to its
+ * socket.  Create the io_uring for the batches if we haven't yet. */
+static int
+conn_can_use_io_batch(connection_t *conn)
+{
+  if (!get_options()->UseIOUring || io_batch_ring_failed)
+    return 0;
+  /* TLS reads and writes go through our TLS library, and listeners accept
+   * rather than read. */
+  if (connection_speaks_cells(conn) || conn->linked ||
+      connection_is_listener(conn) ||
+      !SOCKET_OK(conn->s) || conn->marked_for_close ||
+      connection_state_is_connecting(conn))
+    return 0;
+
+  if (!io_batch_ring) {
+    io_batch_ring = tor_uring_new(IO_BATCH_SIZE);
+    if (!io_batch_ring) {
+      log_notice(LD_NET, "UseIOUring is set, but we couldn't get an "
+                 "io_uring from the kernel. Reading from and writing to "
+                 "each connection separately.");
+      io_batch_ring_failed = 1;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/** Libevent callback: read from every connection in read_batch_conns,
+ * handing the kernel up to IO_BATCH_SIZE of the reads at a time, straight
+ * into the free space at the end of each inbuf.  Then let
+ * connection_handle_read() deal with what each read got. */
+static void
+read_batch_callback(evutil_socket_t fd, short events, void *arg)
+{
+  static struct msghdr msgs[IO_BATCH_SIZE];
+  static struct iovec iovs[IO_BATCH_SIZE];
+  const time_t now = approx_time();
+  int start, i;
+  (void)fd;
+  (void)events;
+  (void)arg;
+
+  for (start = 0; start < smartlist_len(read_batch_conns);
+       start += IO_BATCH_SIZE) {
+    const int end = MIN(start + IO_BATCH_SIZE,
+                        smartlist_len(read_batch_conns));
+    int queued[IO_BATCH_SIZE];
+    unsigned n_queued = 0;
+
+    for (i = start; i < end && !io_batch_ring_failed; ++i) {
+      connection_t *conn = smartlist_get(read_batch_conns, i);
+      struct msghdr *msg = &msgs[i - start];
+      struct iovec *iov = &iovs[i - start];
+      ssize_t max_to_read;
+      size_t len;
+
+      if (conn->marked_for_close || !SOCKET_OK(conn->s) ||
+          !connection_is_reading(conn))
+        continue;
+      max_to_read = connection_bucket_read_limit(conn, now);
+      if (max_to_read <= 0)
+        continue;
+      memset(msg, 0, sizeof(*msg));
+      iov->iov_base = buf_get_read_space(conn->inbuf, max_to_read, &len);
+      iov->iov_len = len;
+      msg->msg_iov = iov;
+      msg->msg_iovlen = 1;
+      if (tor_uring_prep_recvmsg(io_batch_ring, conn->s, msg,
+                                 MSG_DONTWAIT, (uint64_t)i) < 0)
+        continue;
+      queued[n_queued++] = i;
+    }
+    if (n_queued)
+      io_batch_run(read_batch_conns, queued, n_queued, 1);
+
+    for (i = start; i < end; ++i) {
+      connection_t *conn = smartlist_get(read_batch_conns, i);
+      conn->in_read_batch = 0;
+      /* If the connection stopped reading while it waited for the batch,
+       * Libevent wouldn't have told us about it either. */
+      if (conn->has_batched_read_result || connection_is_reading(conn))
+        conn_handle_readable(conn);
+      conn->has_batched_read_result = 0;
+    }
+  }
+  smartlist_clear(read_batch_conns);
+
+  if (smartlist_len(closeable_connection_lst))
+    close_closeable_connections();
+}
+
+/** If we should do the next read from <b>conn</b> as part of a batch, make
+ * sure that it's in read_batch_conns, and return 1.  Otherwise return 0. */
+static int
+conn_add_to_read_batch(connection_t *conn)
+{
+  if (!conn_can_use_io_batch(conn))
+    return 0;
+  if (conn->in_read_batch)
+    return 1;
+
+  if (!read_batch_conns)
+    read_batch_conns = smartlist_new();
+  if (!read_batch_event)
+    read_batch_event = tor_event_new(tor_libevent_get_base(), -1, 0,
+                                     read_batch_callback, NULL);
+  if (!smartlist_len(read_batch_conns))
+    event_active(read_batch_event, EV_TIMEOUT, 1);
+  smartlist_add(read_batch_conns, conn);
+  conn->in_read_batch = 1;
+  return 1;
+}
+
+/** If we should do the next write to <b>conn</b> as part of a batch, make
+ * sure that it's in write_batch_conns, and return 1.  Otherwise return 0. */
+static int
+conn_add_to_write_batch(connection_t *conn)
+{
+  if (!conn_can_use_io_batch(conn))
+    return 0;
+  if (conn->in_write_batch)
+    return 1;
+
+  if (!write_batch_conns)
+    write_batch_conns = smartlist_new();
+  if (!write_batch_event)
+    write_batch_event = tor_event_new(tor_libevent_get_base(), -1, 0,
+                                      write_batch_callback, NULL);
+  if (!smartlist_len(write_batch_conns))
+    event_active(write_batch_event, EV_TIMEOUT, 1);
+  smartlist_add(write_batch_conns, conn);
+  conn->in_write_batch = 1;
+  return 1;
+}
+#endif
+
+#ifndef USE_BUFFEREVENTS
+/** Called once a TLS shard has done the reads and writes that
+ * <b>conn</b> wanted: let connection_handle_write() and
+ * connection_handle_read() deal with what it got. */
+static void
+tls_shard_reply_callback(connection_t *conn)
+{
+  or_connection_t *or_conn = TO_OR_CONN(conn);
+  const int wants_read = or_conn->tls_shard_wants_read;
+  const int wants_write = or_conn->tls_shard_wants_write;
+
+  or_conn->tls_shard_wants_read = or_conn->tls_shard_wants_write = 0;
+  /* Write first, so that a flush from inside the read handler can't use
+   * up the result of the shard's write. */
+  if (wants_write && !conn->marked_for_close)
+    conn_handle_writable(conn);
+  if (wants_read && !conn->marked_for_close)
+    conn_handle_readable(conn);
+  or_conn->has_tls_shard_read_result = 0;
+  or_conn->has_tls_shard_write_result = 0;
+
+  if (smartlist_len(closeable_connection_lst))
+    close_closeable_connections();
+}
+
+/** Libevent callback: hand the TLS reads and writes for every connection in
+ * tls_shard_batch_conns to the TLS shards. */
+static void
+tls_shard_batch_callback(evutil_socket_t fd, short events, void *arg)
+{
+  smartlist_t *conns = tls_shard_batch_conns;
+  (void)fd;
+  (void)events;
+  (void)arg;
+
+  /* Connections that become ready while we handle this batch go into the
+   * next one. */
+  tls_shard_batch_conns = smartlist_new();
+  SMARTLIST_FOREACH(conns, connection_t *, conn,
+                    TO_OR_CONN(conn)->in_tls_shard_batch = 0);
+  tls_shards_run_batch(conns, tls_shard_reply_callback);
+  smartlist_free(conns);
+}
+
+/** If the TLS shards should do the next read from (if <b>for_read</b>) or
+ * write to (otherwise) <b>conn</b>, make sure that it's in
+ * tls_shard_batch_conns, and return 1.  Otherwise return 0. */
+static int
+conn_add_to_tls_shard_batch(connection_t *conn, int for_read)
+{
+  or_connection_t *or_conn;
+
+  if (!get_options()->NumTLSThreads)
+    return 0;
+  /* Handshakes and renegotiations can call back into the rest of Tor, so
+   * they stay on the main thread. */
+  if (conn->type != CONN_TYPE_OR || conn->state != OR_CONN_STATE_OPEN ||
+      conn->marked_for_close || !SOCKET_OK(conn->s))
+    return 0;
+  or_conn = TO_OR_CONN(conn);
+  if (!or_conn->tls)
+    return 0;
+
+  if (for_read)
+    or_conn->tls_shard_wants_read = 1;
+  else
+    or_conn->tls_shard_wants_write = 1;
+  if (or_conn->in_tls_shard_batch)
+    return 1;
+
+  if (!tls_shard_batch_conns)
+    tls_shard_batch_conns = smartlist_new();
+  if (!tls_shard_batch_event)
+    tls_shard_batch_event = tor_event_new(tor_libevent_get_base(), -1, 0,
+                                          tls_shard_batch_callback, NULL);
+  if (!smartlist_len(tls_shard_batch_conns))
+    event_active(tls_shard_batch_event, EV_TIMEOUT, 1);
+  smartlist_add(tls_shard_batch_conns, conn);
+  or_conn->in_tls_shard_batch = 1;
+  return 1;
+}
+#endif
+
+/** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
+ * some data to read. */
+static void
+conn_read_callback(evutil_socket_t fd, short event, void *_conn)
+{
+  connection_t *conn = _conn;
+  (void)fd;
+  (void)event;
+
+  log_debug(LD_NET,"socket %d wants to read.",(int)conn->s);
+
+  /* assert_connection_ok(conn, time(NULL)); */
+
+#ifndef USE_BUFFEREVENTS
+  if (conn_add_to_tls_shard_batch(conn, 1))
+    return;
+#endif
+#ifdef USE_IO_URING
+  if (conn_add_to_read_batch(conn))
+    return;
+#endif
+
+  conn_handle_readable(conn);
+
+  if (smartlist_len(closeable_connection_lst))
+    close_closeable_connections();
+}
+
+/** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
+ * some data to write. */
+static void
+conn_write_callback(evutil_socket_t fd, short events, void *_conn)
+{
+  connection_t *conn = _conn;
+  (void)fd;
+  (void)events;
+
+  LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "socket %d wants to write.",
+                     (int)conn->s));
+
+  /* assert_connection_ok(conn, time(NULL)); */
+
+#ifndef USE_BUFFEREVENTS
+  if (conn_add_to_tls_shard_batch(conn, 0))
+    return;
+#endif
+#ifdef USE_IO_URING
+  if (conn_add_to_write_batch(conn))
+    return;
+#endif
+
+  conn_handle_writable(conn);
 
   if (smartlist_len(closeable_connection_lst))
     close_closeable_connections();
@@ -867,6 +1377,14 @@ conn_close_if_marked(int i)
   if (conn->proxy_state == PROXY_INFANT)
     log_failed_proxy_connection(conn);
 
+#ifndef USE_BUFFEREVENTS
+  if (conn->type == CONN_TYPE_OR && TO_OR_CONN(conn)->tls_shard_job) {
+    /* A TLS shard is still using this connection.  We'll close it after
+     * its reply. */
+    return 0;
+  }
+#endif
+
   IF_HAS_BUFFEREVENT(conn, goto unlink);
   if ((SOCKET_OK(conn->s) || conn->linked_conn) &&
       connection_wants_to_flush(conn)) {
@@ -924,6 +1442,7 @@ conn_close_if_marked(int i)
         if (connection_is_writing(conn)) {
           conn->write_blocked_on_bw = 1;
           connection_stop_writing(conn);
+          connection_note_blocked_on_bw(conn);
         }
         if (connection_is_reading(conn)) {
           /* XXXX024 We should make this code unreachable; if a connection is
@@ -946,6 +1465,7 @@ conn_close_if_marked(int i)
 #endif
           conn->read_blocked_on_bw = 1;
           connection_stop_reading(conn);
+          connection_note_blocked_on_bw(conn);
         }
       }
       return 0;
@@ -1034,17 +1554,25 @@ directory_info_has_arrived(time_t now, int from_cache)
 }
 
 /** Perform regular maintenance tasks for a single connection.  This
- * function gets run once per second per connection by run_scheduled_events.
+ * function gets run by run_scheduled_events whenever the housekeeping timer
+ * of <b>conn</b> is due.
+ *
+ * Return the next time at which we need to look at <b>conn</b> again, or 0
+ * if we never need to.  The time we return is computed from the
+ * connection's timestamps, which only ever move forward; so if we look at
+ * the connection too early, we just find nothing to do and pick a later
+ * time.  Anything else that could make a connection expire sooner has to
+ * call connection_schedule_housekeeping().
  */
-static void
-run_connection_housekeeping(int i, time_t now)
+static time_t
+run_connection_housekeeping(connection_t *conn, time_t now)
 {
   cell_t cell;
-  connection_t *conn = smartlist_get(connection_array, i);
   const or_options_t *options = get_options();
   or_connection_t *or_conn;
   channel_t *chan = NULL;
   int have_any_circuits;
+  time_t next;
   int past_keepalive =
     now >= conn->timestamp_lastwritten + options->KeepalivePeriod;
 
@@ -1054,18 +1582,16 @@ run_connection_housekeeping(int i, time_t now)
 
   if (conn->marked_for_close) {
     /* nothing to do here */
-    return;
+    return 0;
   }
 
   /* Expire any directory connections that haven't been active (sent
    * if a server or received if a client) for 5 min */
-  if (conn->type == CONN_TYPE_DIR &&
-      ((DIR_CONN_IS_SERVER(conn) &&
-        conn->timestamp_lastwritten
-            + options->TestingDirConnectionMaxStall < now) ||
-       (!DIR_CONN_IS_SERVER(conn) &&
-        conn->timestamp_lastread
-            + options->TestingDirConnectionMaxStall < now))) {
+  if (conn->type == CONN_TYPE_DIR) {
+    const time_t last_active = DIR_CONN_IS_SERVER(conn) ?
+      conn->timestamp_lastwritten : conn->timestamp_lastread;
+    if (last_active + options->TestingDirConnectionMaxStall >= now)
+      return last_active + options->TestingDirConnectionMaxStall + 1;
     log_info(LD_DIR,"Expiring wedged directory conn (fd %d, purpose %d)",
              (int)conn->s, conn->purpose);
     /* This check is temporary; it's to let us know whether we should consider
@@ -1078,11 +1604,11 @@ run_connection_housekeeping(int i, time_t now)
     } else {
       connection_mark_for_close(conn);
     }
-    return;
+    return now + 1;
   }
 
   if (!connection_speaks_cells(conn))
-    return; /* we're all done here, the rest is just for OR conns */
+    return 0; /* we're all done here, the rest is just for OR conns */
 
   /* If we haven't written to an OR connection for a while, then either nuke
      the connection or send a keepalive, depending. */
@@ -1116,13 +1642,17 @@ run_connection_housekeeping(int i, time_t now)
                                    END_OR_CONN_REASON_TIMEOUT,
                                    "Tor gave up on the connection");
     connection_or_close_normally(TO_OR_CONN(conn), 1);
+    return 0;
   } else if (!connection_state_is_open(conn)) {
     if (past_keepalive) {
       /* We never managed to actually get this connection open and happy. */
       log_info(LD_OR,"Expiring non-open OR connection to fd %d (%s:%d).",
                (int)conn->s,conn->address, conn->port);
       connection_or_close_normally(TO_OR_CONN(conn), 0);
+      return 0;
     }
+    /* connection_or_set_state_open() reschedules us if it opens. */
+    return conn->timestamp_lastwritten + options->KeepalivePeriod;
   } else if (we_are_hibernating() &&
              ! have_any_circuits &&
              !connection_get_outbuf_len(conn)) {
@@ -1159,6 +1689,44 @@ run_connection_housekeeping(int i, time_t now)
     cell.command = CELL_PADDING;
     connection_or_write_cell_to_buf(&cell, or_conn);
   }
+
+  if (conn->marked_for_close)
+    return 0;
+
+  /* While we're hibernating or this connection is bad for new circuits,
+   * we close it as soon as its last circuit is gone, so keep checking. */
+  if (we_are_hibernating() || channel_is_bad_for_new_circs(chan))
+    return now + 1;
+
+  if (past_keepalive) {
+    /* Either we just queued a keepalive or we're still waiting to flush;
+     * either way, the keepalive and stuck checks need another look soon. */
+    next = now + 1;
+  } else {
+    next = conn->timestamp_lastwritten + options->KeepalivePeriod;
+  }
+  if (have_any_circuits) {
+    /* If the circuits go away, timestamp_last_had_circuits can't be
+     * earlier than now. */
+    next = MIN(next, now + or_conn->idle_timeout);
+  } else {
+    next = MIN(next, chan->timestamp_last_had_circuits +
+                     or_conn->idle_timeout);
+  }
+  return MAX(next, now + 1);
+}
+
+/** Timer wheel callback: run connection housekeeping on the connection
+ * whose timer is <b>timer</b>, and schedule its next run.  <b>arg</b>
+ * points to the current time. */
+static void
+connection_housekeeping_cb(wheel_timer_t *timer, void *arg)
+{
+  connection_t *conn = SUBTYPE_P(timer, connection_t, housekeeping_timer);
+  const time_t now = *(const time_t *)arg;
+  time_t next = run_connection_housekeeping(conn, now);
+  if (next)
+    connection_schedule_housekeeping(conn, next);
 }
 
 /** Honor a NEWNYM request: make future requests unlinkable to past
@@ -1233,7 +1801,6 @@ run_scheduled_events(time_t now)
   const or_options_t *options = get_options();
 
   int is_server = server_mode(options);
-  int i;
   int have_dir_info;
 
   /* 0. See if we've been asked to shut down and our timeout has
@@ -1254,14 +1821,14 @@ run_scheduled_events(time_t now)
   flush_pending_log_callbacks();
 
   /* 1a. Every MIN_ONION_KEY_LIFETIME seconds, rotate the onion keys,
-   *  shut down and restart all cpuworkers, and update the directory if
+   *  give the new keys to all cpuworkers, and update the directory if
    *  necessary.
    */
   if (is_server &&
       get_onion_key_set_at()+MIN_ONION_KEY_LIFETIME < now) {
     log_info(LD_GENERAL,"Rotating onion key.");
     rotate_onion_key();
-    cpuworkers_rotate();
+    cpuworkers_rotate_keyinfo();
     if (router_rebuild_descriptor(1)<0) {
       log_info(LD_CONFIG, "Couldn't rebuild router descriptor");
     }
@@ -1558,11 +2125,18 @@ run_scheduled_events(time_t now)
   if (now % 10 == 5)
     circuit_expire_old_circuits_serverside(now);
 
-  /* 5. We do housekeeping for each connection... */
+  /* 5. We do housekeeping for each connection that needs it now... */
   connection_or_set_bad_connections(NULL, 0);
-  for (i=0;i<smartlist_len(connection_array);i++) {
-    run_connection_housekeeping(i, now);
-  }
+  if (we_are_hibernating() && !hibernating_at_last_housekeeping) {
+    /* Idle OR connections get closed right away while we hibernate. */
+    SMARTLIST_FOREACH(connection_array, connection_t *, conn,
+                      connection_schedule_housekeeping(conn, now));
+  }
+  hibernating_at_last_housekeeping = we_are_hibernating();
+  if (!housekeeping_wheel)
+    housekeeping_wheel = timer_wheel_new(now - 1);
+  timer_wheel_advance(housekeeping_wheel, (uint64_t)now,
+                      connection_housekeeping_cb, &now);
   if (time_to_shrink_memory < now) {
     SMARTLIST_FOREACH(connection_array, connection_t *, conn, {
         if (conn->outbuf)
@@ -1574,6 +2148,7 @@ run_scheduled_events(time_t now)
     clean_cell_pool();
 #endif /* ENABLE_MEMPOOL */
     buf_shrink_freelists(0);
+    cell_chunk_shrink_freelists(0);
 /** How often do we check buffers and pools for empty space that can be
  * deallocated? */
 #define MEM_SHRINK_INTERVAL (60)
@@ -1948,9 +2523,8 @@ do_hup(void)
    * force a retry there. */
 
   if (server_mode(options)) {
-    /* Restart cpuworker and dnsworker processes, so they get up-to-date
-     * configuration options. */
-    cpuworkers_rotate();
+    /* Make stuff get rescanned, reloaded, etc. */
+    cpuworkers_rotate_keyinfo();
     dns_reset();
   }
   return 0;
@@ -2251,6 +2825,7 @@ dumpstats(int severity)
   time_t now = time(NULL);
   time_t elapsed;
   size_t rbuf_cap, wbuf_cap, rbuf_len, wbuf_len;
+  int ktls_send, ktls_recv;
 
   tor_log(severity, LD_GENERAL, "Dumping stats:");
 
@@ -2280,6 +2855,9 @@ dumpstats(int severity)
           (int)(now - conn->timestamp_lastwritten));
       if (conn->type == CONN_TYPE_OR) {
         or_connection_t *or_conn = TO_OR_CONN(conn);
+#ifndef USE_BUFFEREVENTS
+        tls_shards_wait_for_conn(or_conn);
+#endif
         if (or_conn->tls) {
           tor_tls_get_buffer_sizes(or_conn->tls, &rbuf_cap, &rbuf_len,
                                    &wbuf_cap, &wbuf_len);
@@ -2287,6 +2865,12 @@ dumpstats(int severity)
               "Conn %d: %d/%d bytes used on OpenSSL read buffer; "
               "%d/%d bytes used on write buffer.",
               i, (int)rbuf_len, (int)rbuf_cap, (int)wbuf_len, (int)wbuf_cap);
+          tor_tls_get_kernel_tls_status(or_conn->tls, &ktls_send, &ktls_recv);
+          if (ktls_send || ktls_recv)
+            tor_log(severity, LD_GENERAL,
+                "Conn %d: the kernel does TLS for %s.", i,
+                (ktls_send && ktls_recv) ? "sending and receiving" :
+                "sending only");
         }
       }
     }
@@ -2321,6 +2905,17 @@ dumpstats(int severity)
         100*(U64_TO_DBL(stats_n_data_bytes_received) /
              U64_TO_DBL(stats_n_data_cells_received*RELAY_PAYLOAD_SIZE)) );
 
+  {
+    uint64_t n_records, n_bytes;
+    buf_get_tls_write_stats(&n_records, &n_bytes);
+    if (n_records)
+      tor_log(severity, LD_NET,
+          "TLS records written: "U64_FORMAT" records, "U64_FORMAT" bytes "
+          "(average %d bytes/record)",
+          U64_PRINTF_ARG(n_records), U64_PRINTF_ARG(n_bytes),
+          (int)(n_bytes / n_records));
+  }
+
   cpuworker_log_onionskin_overhead(severity, ONION_HANDSHAKE_TYPE_TAP, "TAP");
   cpuworker_log_onionskin_overhead(severity, ONION_HANDSHAKE_TYPE_NTOR,"ntor");
 
@@ -2632,6 +3227,7 @@ tor_free_all(int postfork)
   connection_free_all();
   scheduler_free_all();
   buf_shrink_freelists(1);
+  cell_chunk_shrink_freelists(1);
   memarea_clear_freelist();
   nodelist_free_all();
   microdesc_free_all();
@@ -2656,6 +3252,34 @@ tor_free_all(int postfork)
   /* stuff in main.c */
 
   smartlist_free(connection_array);
+  timer_wheel_free(housekeeping_wheel);
+  housekeeping_wheel = NULL;
+#ifdef USE_IO_URING
+  smartlist_free(read_batch_conns);
+  read_batch_conns = NULL;
+  if (read_batch_event) {
+    tor_event_free(read_batch_event);
+    read_batch_event = NULL;
+  }
+  smartlist_free(write_batch_conns);
+  write_batch_conns = NULL;
+  if (write_batch_event) {
+    tor_event_free(write_batch_event);
+    write_batch_event = NULL;
+  }
+  tor_uring_free(io_batch_ring);
+  io_batch_ring = NULL;
+  io_batch_ring_failed = 0;
+#endif
+#ifndef USE_BUFFEREVENTS
+  smartlist_free(tls_shard_batch_conns);
+  tls_shard_batch_conns = NULL;
+  if (tls_shard_batch_event) {
+    tor_event_free(tls_shard_batch_event);
+    tls_shard_batch_event = NULL;
+  }
+#endif
+  hibernating_at_last_housekeeping = 0;
   smartlist_free(closeable_connection_lst);
   smartlist_free(active_linked_connection_lst);
   periodic_timer_free(second_timer);
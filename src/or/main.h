@@ -21,6 +21,7 @@ int connection_add_impl(connection_t *conn, int is_connecting);
 #define connection_add_connecting(conn) connection_add_impl((conn), 1)
 int connection_remove(connection_t *conn);
 void connection_unregister_events(connection_t *conn);
+void connection_schedule_housekeeping(connection_t *conn, time_t when);
 int connection_in_array(connection_t *conn);
 void add_connection_to_closeable_list(connection_t *conn);
 int connection_is_on_closeable_list(connection_t *conn);
@@ -721,6 +721,7 @@ microdesc_free_(microdesc_t *md, const char *fname, int lineno)
         }
       });
     if (found) {
+      nodelist_clear_node_indexes();
       log_warn(LD_BUG, "microdesc_free() called from %s:%d, but md was still "
                "referenced %d node(s); held_by_nodes == %u, ht_badness == %d",
                fname, lineno, found, md->held_by_nodes, ht_badness);
@@ -23,6 +23,7 @@
 #include <string.h>
 
 static void nodelist_drop_node(node_t *node, int remove_from_ht);
+static int node_get_nodelist_idx(const node_t *node);
 static void node_free(node_t *node);
 
 /** count_usable_descriptors counts descriptors with these flag(s)
@@ -128,6 +129,7 @@ node_get_or_create(const char *identity_digest)
 
   smartlist_add(the_nodelist->nodes, node);
   node->nodelist_idx = smartlist_len(the_nodelist->nodes) - 1;
+  nodelist_clear_node_indexes();
 
   node->country = -1;
 
@@ -170,6 +172,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  nodelist_clear_node_indexes();
 
   if (node->country == -1)
     node_set_country(node);
@@ -210,6 +213,7 @@ nodelist_add_microdesc(microdesc_t *md)
       node->md->held_by_nodes--;
     node->md = md;
     md->held_by_nodes++;
+    nodelist_clear_node_indexes();
   }
   return node;
 }
@@ -227,6 +231,8 @@ nodelist_set_consensus(networkstatus_t *ns)
   int client = !server_mode(options);
 
   init_nodelist();
+  router_clear_bw_tables();
+  nodelist_clear_node_indexes();
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
@@ -306,6 +312,7 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
   if (node && node->md == md) {
     node->md = NULL;
     md->held_by_nodes--;
+    nodelist_clear_node_indexes();
   }
 }
 
@@ -316,6 +323,7 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    nodelist_clear_node_indexes();
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
@@ -337,6 +345,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
 
   idx = node->nodelist_idx;
   tor_assert(idx >= 0);
+  nodelist_clear_node_indexes();
 
   tor_assert(node == smartlist_get(the_nodelist->nodes, idx));
   smartlist_del(the_nodelist->nodes, idx);
@@ -395,6 +404,7 @@ nodelist_purge(void)
       /* An md is only useful if there is an rs. */
       node->md->held_by_nodes--;
       node->md = NULL;
+      nodelist_clear_node_indexes();
     }
 
     if (node_is_usable(node)) {
@@ -415,6 +425,8 @@ nodelist_free_all(void)
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
+  router_clear_bw_tables();
+  nodelist_clear_node_indexes();
   HT_CLEAR(nodelist_map, &the_nodelist->nodes_by_id);
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
     node->nodelist_idx = -1;
@@ -736,6 +748,105 @@ node_exit_policy_rejects_all(const node_t *node)
     return 1;
 }
 
+/** How many ports do we keep in the exit port index at once? */
+#define EXIT_PORT_INDEX_MAX_PORTS 32
+
+/** An entry in the exit port index: which nodes might exit to a port. */
+typedef struct exit_port_index_ent_t {
+  /** The port. */
+  uint16_t port;
+  /** How many nodes were in the nodelist when we built this entry? */
+  int n_nodes;
+  /** Bit <i>i</i> is set iff the node at index <i>i</i> of the nodelist
+   * might accept connections to <b>port</b> at an unknown address. */
+  bitarray_t *nodes;
+} exit_port_index_ent_t;
+
+/** A list of exit_port_index_ent_t, oldest first, for the ports that we've
+ * asked about since the nodes' exit policies or positions last changed. */
+static smartlist_t *exit_port_index = NULL;
+
+/** Forget everything in the exit port index.  Call this whenever a node's
+ * exit policy, or its position in the nodelist, might have changed. */
+void
+nodelist_clear_exit_port_index(void)
+{
+  if (!exit_port_index)
+    return;
+  SMARTLIST_FOREACH(exit_port_index, exit_port_index_ent_t *, ent, {
+    bitarray_free(ent->nodes);
+    tor_free(ent);
+  });
+  smartlist_free(exit_port_index);
+  exit_port_index = NULL;
+}
+
+/** Return true iff the exit policy of <b>node</b> might accept connections
+ * to <b>port</b> at an unknown address. */
+static int
+node_exit_policy_might_accept_port_impl(const node_t *node, uint16_t port)
+{
+  addr_policy_result_t r = compare_tor_addr_to_node_policy(NULL, port, node);
+  return r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED;
+}
+
+/** Return a bitarray with the bit for each node's index in the nodelist set
+ * iff that node might accept connections to <b>port</b> at an unknown
+ * address.  The bitarray covers every node in the nodelist; it stays valid
+ * until the next call to this function, or until the nodelist changes.
+ *
+ * We build the bitarray the first time someone asks about a port, and
+ * remember it for the most recent EXIT_PORT_INDEX_MAX_PORTS ports, so that
+ * picking an exit for a port doesn't mean looking at every node's policy.
+ */
+const bitarray_t *
+nodelist_get_exit_port_bitarray(uint16_t port)
+{
+  exit_port_index_ent_t *ent;
+  const smartlist_t *nodes = nodelist_get_list();
+
+  tor_assert(port);
+
+  if (!exit_port_index)
+    exit_port_index = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(exit_port_index, exit_port_index_ent_t *, e) {
+    if (e->port == port) {
+      tor_assert(e->n_nodes == smartlist_len(nodes));
+      return e->nodes;
+    }
+  } SMARTLIST_FOREACH_END(e);
+
+  if (smartlist_len(exit_port_index) >= EXIT_PORT_INDEX_MAX_PORTS) {
+    ent = smartlist_get(exit_port_index, 0);
+    smartlist_del_keeporder(exit_port_index, 0);
+    bitarray_free(ent->nodes);
+    tor_free(ent);
+  }
+
+  ent = tor_malloc_zero(sizeof(exit_port_index_ent_t));
+  ent->port = port;
+  ent->n_nodes = smartlist_len(nodes);
+  ent->nodes = bitarray_init_zero(ent->n_nodes);
+  SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
+    if (node_exit_policy_might_accept_port_impl(node, port))
+      bitarray_set(ent->nodes, node_sl_idx);
+  } SMARTLIST_FOREACH_END(node);
+  smartlist_add(exit_port_index, ent);
+
+  return ent->nodes;
+}
+
+/** Return true iff the exit policy of <b>node</b> might accept connections
+ * to <b>port</b> at an unknown address. */
+int
+node_exit_policy_might_accept_port(const node_t *node, uint16_t port)
+{
+  const int idx = node_get_nodelist_idx(node);
+  if (idx < 0)
+    return node_exit_policy_might_accept_port_impl(node, port);
+  return bitarray_is_set(nodelist_get_exit_port_bitarray(port), idx) != 0;
+}
+
 /** Return true iff the exit policy for <b>node</b> is such that we can treat
  * rejecting an address of type <b>family</b> unexpectedly as a sign of that
  * node's failure. */
@@ -1056,6 +1167,192 @@ node_in_nickname_smartlist(const smartlist_t *lst, const node_t *node)
   return 0;
 }
 
+/** Return the index of <b>node</b> in the list returned by
+ * nodelist_get_list(), or -1 if it isn't there. */
+static int
+node_get_nodelist_idx(const node_t *node)
+{
+  const smartlist_t *nodes = nodelist_get_list();
+  const int idx = node->nodelist_idx;
+  if (idx < 0 || idx >= smartlist_len(nodes) ||
+      smartlist_get(nodes, idx) != node)
+    return -1;
+  return idx;
+}
+
+/** The declared families of all the nodes in the nodelist, resolved into
+ * nodelist indices.  The family of the node at index <i>i</i> is the sorted
+ * array members[offsets[i]] through members[offsets[i+1]-1]: the indices of
+ * the other nodes that it declares as family, and that declare it back. */
+typedef struct node_family_graph_t {
+  /** How many nodes were in the nodelist when we built this graph? */
+  int n_nodes;
+  /** Where each node's family starts in <b>members</b>; n_nodes+1 long. */
+  int *offsets;
+  /** The families of all the nodes, one after another. */
+  int *members;
+} node_family_graph_t;
+
+/** The family graph for the current nodelist, or NULL if we haven't built
+ * it since the nodelist last changed. */
+static node_family_graph_t *node_family_graph = NULL;
+
+/** Release all storage held by <b>graph</b>. */
+static void
+node_family_graph_free(node_family_graph_t *graph)
+{
+  if (!graph)
+    return;
+  tor_free(graph->offsets);
+  tor_free(graph->members);
+  tor_free(graph);
+}
+
+/** Forget everything we've computed about the nodes in the nodelist.  Call
+ * this whenever a node's descriptor, names, or position in the nodelist
+ * might have changed. */
+void
+nodelist_clear_node_indexes(void)
+{
+  nodelist_clear_exit_port_index();
+  node_family_graph_free(node_family_graph);
+  node_family_graph = NULL;
+}
+
+/** Add to <b>out</b> every node that node_nickname_matches() <b>name</b>.
+ * <b>by_nickname</b> maps lowercased nicknames to lists of the nodes with
+ * those nicknames. */
+static void
+nodes_matching_family_name(smartlist_t *out, const char *name,
+                           const strmap_t *by_nickname)
+{
+  char digest[DIGEST_LEN];
+  char nn_char = '\0';
+  char nn_buf[MAX_NICKNAME_LEN+1];
+  const node_t *node;
+
+  if (hex_digest_nickname_decode(name, digest, &nn_char, nn_buf) == 0 &&
+      (node = node_get_by_id(digest)) &&
+      node_nickname_matches(node, name))
+    smartlist_add(out, (void*)node);
+  if (name[0] != '$') {
+    const smartlist_t *same_nickname = strmap_get_lc(by_nickname, name);
+    if (same_nickname)
+      smartlist_add_all(out, same_nickname);
+  }
+}
+
+/** Sorting helper: compare two nodes by their position in the nodelist. */
+static int
+compare_nodes_by_nodelist_idx_(const void **a_, const void **b_)
+{
+  const node_t *a = *a_, *b = *b_;
+  if (a->nodelist_idx < b->nodelist_idx)
+    return -1;
+  else if (a->nodelist_idx > b->nodelist_idx)
+    return 1;
+  else
+    return 0;
+}
+
+/** Resolve the declared families of every node in the nodelist, and return
+ * a new node_family_graph_t holding the result. */
+static node_family_graph_t *
+node_family_graph_new(void)
+{
+  const smartlist_t *nodes = nodelist_get_list();
+  node_family_graph_t *graph = tor_malloc_zero(sizeof(node_family_graph_t));
+  strmap_t *by_nickname = strmap_new();
+  smartlist_t *matches = smartlist_new(), *family = smartlist_new();
+  int n_members = 0, n_allocated = 16;
+
+  graph->n_nodes = smartlist_len(nodes);
+  graph->offsets = tor_calloc(graph->n_nodes + 1, sizeof(int));
+  graph->members = tor_calloc(n_allocated, sizeof(int));
+
+  /* Declared families can name nodes by nickname; find those quickly. */
+  SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
+    const char *nickname = node_get_nickname(node);
+    smartlist_t *same_nickname;
+    if (!nickname)
+      continue;
+    same_nickname = strmap_get_lc(by_nickname, nickname);
+    if (!same_nickname) {
+      same_nickname = smartlist_new();
+      strmap_set_lc(by_nickname, nickname, same_nickname);
+    }
+    smartlist_add(same_nickname, (void*)node);
+  } SMARTLIST_FOREACH_END(node);
+
+  SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
+    const smartlist_t *declared_family = node_get_declared_family(node);
+    graph->offsets[node_sl_idx] = n_members;
+    if (!declared_family)
+      continue;
+
+    SMARTLIST_FOREACH(declared_family, const char *, name,
+                      nodes_matching_family_name(matches, name, by_nickname));
+    /* Only keep the nodes that declare this node back. */
+    SMARTLIST_FOREACH_BEGIN(matches, const node_t *, node2) {
+      if (node2 != node && node_get_nodelist_idx(node2) >= 0 &&
+          node_in_nickname_smartlist(node_get_declared_family(node2), node))
+        smartlist_add(family, (void*)node2);
+    } SMARTLIST_FOREACH_END(node2);
+    smartlist_clear(matches);
+    smartlist_sort(family, compare_nodes_by_nodelist_idx_);
+    smartlist_uniq(family, compare_nodes_by_nodelist_idx_, NULL);
+
+    if (n_members + smartlist_len(family) > n_allocated) {
+      n_allocated = MAX(n_allocated * 2, n_members + smartlist_len(family));
+      graph->members = tor_reallocarray(graph->members, n_allocated,
+                                        sizeof(int));
+    }
+    SMARTLIST_FOREACH(family, const node_t *, node2,
+                      graph->members[n_members++] = node2->nodelist_idx);
+    smartlist_clear(family);
+  } SMARTLIST_FOREACH_END(node);
+  graph->offsets[graph->n_nodes] = n_members;
+
+  STRMAP_FOREACH(by_nickname, nickname, smartlist_t *, same_nickname) {
+    smartlist_free(same_nickname);
+  } STRMAP_FOREACH_END;
+  strmap_free(by_nickname, NULL);
+  smartlist_free(matches);
+  smartlist_free(family);
+  return graph;
+}
+
+/** Return the family graph for the current nodelist, building it if the
+ * nodelist has changed since we last did. */
+static const node_family_graph_t *
+nodelist_get_family_graph(void)
+{
+  if (!node_family_graph)
+    node_family_graph = node_family_graph_new();
+  tor_assert(node_family_graph->n_nodes ==
+             smartlist_len(nodelist_get_list()));
+  return node_family_graph;
+}
+
+/** Return true iff the nodes at nodelist indices <b>idx1</b> and
+ * <b>idx2</b> both declare each other as family. */
+static int
+node_family_graph_contains(const node_family_graph_t *graph,
+                           int idx1, int idx2)
+{
+  int lo = graph->offsets[idx1], hi = graph->offsets[idx1+1];
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (graph->members[mid] == idx2)
+      return 1;
+    else if (graph->members[mid] < idx2)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return 0;
+}
+
 /** Return true iff r1 and r2 are in the same family, but not the same
  * router. */
 int
@@ -1074,13 +1371,21 @@ nodes_in_same_family(const node_t *node1, const node_t *node2)
 
   /* Are they in the same family because the agree they are? */
   {
-    const smartlist_t *f1, *f2;
-    f1 = node_get_declared_family(node1);
-    f2 = node_get_declared_family(node2);
-    if (f1 && f2 &&
-        node_in_nickname_smartlist(f1, node2) &&
-        node_in_nickname_smartlist(f2, node1))
-      return 1;
+    const int idx1 = node_get_nodelist_idx(node1);
+    const int idx2 = node_get_nodelist_idx(node2);
+    if (idx1 >= 0 && idx2 >= 0 && idx1 != idx2) {
+      if (node_family_graph_contains(nodelist_get_family_graph(),
+                                     idx1, idx2))
+        return 1;
+    } else {
+      const smartlist_t *f1, *f2;
+      f1 = node_get_declared_family(node1);
+      f2 = node_get_declared_family(node2);
+      if (f1 && f2 &&
+          node_in_nickname_smartlist(f1, node2) &&
+          node_in_nickname_smartlist(f2, node1))
+        return 1;
+    }
   }
 
   /* Are they in the same option because the user says they are? */
@@ -1110,6 +1415,7 @@ nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
   const smartlist_t *all_nodes = nodelist_get_list();
   const smartlist_t *declared_family;
   const or_options_t *options = get_options();
+  int idx;
 
   tor_assert(node);
 
@@ -1137,7 +1443,12 @@ nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
 
   /* Now, add all nodes in the declared_family of this node, if they
    * also declare this node to be in their family. */
-  if (declared_family) {
+  if ((idx = node_get_nodelist_idx(node)) >= 0) {
+    const node_family_graph_t *graph = nodelist_get_family_graph();
+    int i;
+    for (i = graph->offsets[idx]; i < graph->offsets[idx+1]; ++i)
+      smartlist_add(sl, smartlist_get(all_nodes, graph->members[i]));
+  } else if (declared_family) {
     /* Add every r such that router declares familyness with node, and node
      * declares familyhood with router. */
     SMARTLIST_FOREACH_BEGIN(declared_family, const char *, name) {
@@ -45,6 +45,10 @@ int node_get_purpose(const node_t *node);
   (node_get_purpose((node)) == ROUTER_PURPOSE_BRIDGE)
 int node_is_me(const node_t *node);
 int node_exit_policy_rejects_all(const node_t *node);
+void nodelist_clear_exit_port_index(void);
+void nodelist_clear_node_indexes(void);
+const bitarray_t *nodelist_get_exit_port_bitarray(uint16_t port);
+int node_exit_policy_might_accept_port(const node_t *node, uint16_t port);
 int node_exit_policy_is_exact(const node_t *node, sa_family_t family);
 smartlist_t *node_get_all_orports(const node_t *node);
 int node_allows_single_hop_exits(const node_t *node);
@@ -10,7 +10,12 @@
  * and parse and create the CREATE cell and its allies.
  **/
 
+#define ONION_PRIVATE
+
+#include <math.h>
+
 #include "or.h"
+#include "channel.h"
 #include "circuitlist.h"
 #include "config.h"
 #include "cpuworker.h"
@@ -27,17 +32,56 @@
  * to process a waiting onion handshake. */
 typedef struct onion_queue_t {
   TOR_TAILQ_ENTRY(onion_queue_t) next;
+  /** Links to the other entries in the same flow. */
+  TOR_TAILQ_ENTRY(onion_queue_t) next_in_flow;
   or_circuit_t *circ;
   uint16_t handshake_type;
   create_cell_t *onionskin;
-  time_t when_added;
+  /** The flow that this entry belongs to. */
+  struct onion_flow_t *flow;
+  /** When did we add this entry to the queue, in msec? */
+  uint64_t when_added_msec;
 } onion_queue_t;
 
+/** A flow holds the queued create requests of a single handshake type that
+ * arrived on a single inbound channel.  We take turns among the flows of
+ * each handshake type, so that one busy channel can't monopolize the
+ * cpuworkers, and we run CoDel on each flow separately so that we shed the
+ * requests that have been waiting too long to be answered in time.
+ *
+ * A flow exists exactly as long as it has entries. */
+typedef struct onion_flow_t {
+  HT_ENTRY(onion_flow_t) node;
+  /** Global identifier of the inbound channel, or 0 if there is none. */
+  uint64_t chan_id;
+  /** One of the ONION_HANDSHAKE_TYPE_* values. */
+  uint16_t handshake_type;
+  /** Links to the other flows of the same handshake type. */
+  TOR_TAILQ_ENTRY(onion_flow_t) next_flow;
+  /** The entries in this flow, oldest first. */
+  TOR_TAILQ_HEAD(, onion_queue_t) entries;
+  /** Number of entries in <b>entries</b>. */
+  int n_entries;
+
+  /** CoDel state: if nonzero, the time at which the sojourn time of this
+   * flow will have been above target for a whole interval. */
+  uint64_t first_above_msec;
+  /** CoDel state: when should we next drop an entry while dropping? */
+  uint64_t drop_next_msec;
+  /** CoDel state: how many entries we've dropped in this dropping state. */
+  unsigned int drop_count;
+  /** CoDel state: value of drop_count when we last left the dropping
+   * state. */
+  unsigned int last_drop_count;
+  /** CoDel state: true iff we are currently dropping entries. */
+  unsigned int dropping : 1;
+} onion_flow_t;
+
 /** 5 seconds on the onion queue til we just send back a destroy */
 #define ONIONQUEUE_WAIT_CUTOFF 5
 
-/** Array of queues of circuits waiting for CPU workers. An element is NULL
- * if that queue is empty.*/
+/** Array of queues of circuits waiting for CPU workers, in the order that
+ * they arrived. An element is NULL if that queue is empty.*/
 TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t)
               ol_list[MAX_ONION_HANDSHAKE_TYPE+1] = {
   TOR_TAILQ_HEAD_INITIALIZER(ol_list[0]), /* tap */
@@ -48,6 +92,42 @@ TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t)
 /** Number of entries of each type currently in each element of ol_list[]. */
 static int ol_entries[MAX_ONION_HANDSHAKE_TYPE+1];
 
+/** Array of lists of flows for each handshake type, in the order in which
+ * they will next get a turn. */
+static TOR_TAILQ_HEAD(onion_flow_head_t, onion_flow_t)
+              ol_flows[MAX_ONION_HANDSHAKE_TYPE+1] = {
+  TOR_TAILQ_HEAD_INITIALIZER(ol_flows[0]), /* tap */
+  TOR_TAILQ_HEAD_INITIALIZER(ol_flows[1]), /* fast */
+  TOR_TAILQ_HEAD_INITIALIZER(ol_flows[2]), /* ntor */
+};
+
+/** Helper for hash tables: return true iff <b>a</b> and <b>b</b> are the
+ * same flow. */
+static INLINE int
+onion_flows_eq_(onion_flow_t *a, onion_flow_t *b)
+{
+  return a->chan_id == b->chan_id && a->handshake_type == b->handshake_type;
+}
+
+/** Helper: return a hash of the channel and handshake type in <b>a</b>. */
+static INLINE unsigned int
+onion_flow_hash_(onion_flow_t *a)
+{
+  uint64_t array[2];
+  array[0] = a->chan_id;
+  array[1] = a->handshake_type;
+  return (unsigned) siphash24g(array, sizeof(array));
+}
+
+/** Map from [channel, handshake type] to the flow holding those entries. */
+static HT_HEAD(onion_flow_map, onion_flow_t)
+     onion_flow_map = HT_INITIALIZER();
+HT_PROTOTYPE(onion_flow_map, onion_flow_t, node,
+             onion_flow_hash_, onion_flows_eq_)
+HT_GENERATE2(onion_flow_map, onion_flow_t, node,
+             onion_flow_hash_, onion_flows_eq_, 0.6,
+             tor_reallocarray_, tor_free_)
+
 static int num_ntors_per_tap(void);
 static void onion_queue_entry_remove(onion_queue_t *victim);
 
@@ -60,8 +140,8 @@ static void onion_queue_entry_remove(onion_queue_t *victim);
 
 /** Return true iff we have room to queue another onionskin of type
  * <b>type</b>. */
-static int
-have_room_for_onionskin(uint16_t type)
+MOCK_IMPL(STATIC int,
+have_room_for_onionskin,(uint16_t type))
 {
   const or_options_t *options = get_options();
   int num_cpus;
@@ -120,14 +200,201 @@ have_room_for_onionskin(uint16_t type)
   return 1;
 }
 
-/** Add <b>circ</b> to the end of ol_list and return 0, except
- * if ol_list is too long, in which case do nothing and return -1.
+/** Return the current time in msec, as used to measure how long entries
+ * have been waiting on the onion queue. */
+MOCK_IMPL(STATIC uint64_t,
+onion_queue_now_msec,(void))
+{
+  struct timeval now;
+  tor_gettimeofday_cached_monotonic(&now);
+  return ((uint64_t)now.tv_sec) * 1000 + now.tv_usec / 1000;
+}
+
+/** Return the CoDel target: the sojourn time, in msec, that we're willing
+ * to let a flow's entries stay above for a whole interval before we start
+ * dropping. */
+static int32_t
+onion_queue_target_msec(void)
+{
+#define DEFAULT_ONION_QUEUE_TARGET_MSEC 100
+#define MIN_ONION_QUEUE_TARGET_MSEC 1
+#define MAX_ONION_QUEUE_TARGET_MSEC (ONIONQUEUE_WAIT_CUTOFF*1000)
+  return networkstatus_get_param(NULL, "OnionQueueTargetDelay",
+                                 DEFAULT_ONION_QUEUE_TARGET_MSEC,
+                                 MIN_ONION_QUEUE_TARGET_MSEC,
+                                 MAX_ONION_QUEUE_TARGET_MSEC);
+}
+
+/** Return the CoDel interval, in msec. */
+static int32_t
+onion_queue_interval_msec(void)
+{
+#define DEFAULT_ONION_QUEUE_INTERVAL_MSEC 1000
+#define MIN_ONION_QUEUE_INTERVAL_MSEC 1
+#define MAX_ONION_QUEUE_INTERVAL_MSEC 60000
+  return networkstatus_get_param(NULL, "OnionQueueInterval",
+                                 DEFAULT_ONION_QUEUE_INTERVAL_MSEC,
+                                 MIN_ONION_QUEUE_INTERVAL_MSEC,
+                                 MAX_ONION_QUEUE_INTERVAL_MSEC);
+}
+
+/** Return the flow for create requests of type <b>handshake_type</b> from
+ * the inbound channel of <b>circ</b>, creating it if there isn't one. */
+static onion_flow_t *
+onion_flow_get(const or_circuit_t *circ, uint16_t handshake_type)
+{
+  onion_flow_t search, *flow;
+  memset(&search, 0, sizeof(search));
+  search.chan_id = circ->p_chan ? circ->p_chan->global_identifier : 0;
+  search.handshake_type = handshake_type;
+
+  flow = HT_FIND(onion_flow_map, &onion_flow_map, &search);
+  if (!flow) {
+    flow = tor_malloc_zero(sizeof(onion_flow_t));
+    flow->chan_id = search.chan_id;
+    flow->handshake_type = handshake_type;
+    TOR_TAILQ_INIT(&flow->entries);
+    HT_INSERT(onion_flow_map, &onion_flow_map, flow);
+    TOR_TAILQ_INSERT_TAIL(&ol_flows[handshake_type], flow, next_flow);
+  }
+  return flow;
+}
+
+/** Return the flow of type <b>handshake_type</b> with the most entries, or
+ * NULL if there are none. */
+static onion_flow_t *
+onion_flow_get_fattest(uint16_t handshake_type)
+{
+  onion_flow_t *flow, *fattest = NULL;
+  TOR_TAILQ_FOREACH(flow, &ol_flows[handshake_type], next_flow) {
+    if (!fattest || flow->n_entries > fattest->n_entries)
+      fattest = flow;
+  }
+  return fattest;
+}
+
+/** Remove <b>victim</b> from the queue and close its circuit, since we
+ * don't expect to answer it in time.  <b>why</b> says why. */
+static void
+onion_queue_entry_drop(onion_queue_t *victim, const char *why)
+{
+  or_circuit_t *circ = victim->circ;
+  onion_queue_entry_remove(victim);
+  log_info(LD_CIRC,
+           "Circuit create request %s; canceling due to overload.", why);
+  circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+}
+
+/** Drop every queued create request that has waited longer than
+ * ONIONQUEUE_WAIT_CUTOFF as of <b>now_msec</b>: the client will have given
+ * up on it by the time we could answer. */
+static void
+onion_queue_cull_elderly(uint64_t now_msec)
+{
+  int i;
+  for (i = 0; i <= MAX_ONION_HANDSHAKE_TYPE; ++i) {
+    onion_queue_t *head;
+    while ((head = TOR_TAILQ_FIRST(&ol_list[i])) &&
+           head->when_added_msec + ONIONQUEUE_WAIT_CUTOFF*1000 <= now_msec) {
+      onion_queue_entry_drop(head, "is too old");
+    }
+  }
+}
+
+/** Return true iff CoDel thinks that <b>flow</b> has been above its target
+ * sojourn time for long enough that we should drop its first entry, as of
+ * <b>now_msec</b>. Update the flow's CoDel state. */
+static int
+onion_flow_ok_to_drop(onion_flow_t *flow, uint64_t now_msec)
+{
+  const onion_queue_t *head = TOR_TAILQ_FIRST(&flow->entries);
+  uint64_t sojourn;
+
+  tor_assert(head);
+  sojourn = now_msec > head->when_added_msec ?
+    now_msec - head->when_added_msec : 0;
+
+  /* Never drop the last entry of a flow: it isn't standing in anybody's
+   * way. */
+  if (sojourn < (uint64_t)onion_queue_target_msec() || flow->n_entries <= 1) {
+    flow->first_above_msec = 0;
+    return 0;
+  }
+  if (flow->first_above_msec == 0) {
+    flow->first_above_msec = now_msec + onion_queue_interval_msec();
+    return 0;
+  }
+  return now_msec >= flow->first_above_msec;
+}
+
+/** Return the time at which CoDel should next drop an entry, if it dropped
+ * its <b>count</b>th entry at <b>t</b>. */
+static uint64_t
+onion_flow_control_law(uint64_t t, unsigned int count)
+{
+  return t + (uint64_t)(onion_queue_interval_msec() / sqrt((double)count));
+}
+
+/** Remove and return the first entry in <b>flow</b> that CoDel lets us
+ * process as of <b>now_msec</b>, dropping any entries before it that CoDel
+ * tells us to shed. <b>flow</b> must not be empty. */
+static onion_queue_t *
+onion_flow_dequeue(onion_flow_t *flow, uint64_t now_msec)
+{
+  onion_queue_t *head;
+  int ok_to_drop = onion_flow_ok_to_drop(flow, now_msec);
+
+  /* Since onion_flow_ok_to_drop() never lets us drop the last entry, the
+   * flow stays non-empty throughout. */
+  if (flow->dropping) {
+    if (!ok_to_drop) {
+      flow->dropping = 0;
+    } else {
+      while (flow->dropping && now_msec >= flow->drop_next_msec) {
+        onion_queue_entry_drop(TOR_TAILQ_FIRST(&flow->entries),
+                               "has been waiting too long");
+        ++flow->drop_count;
+        if (!onion_flow_ok_to_drop(flow, now_msec)) {
+          flow->dropping = 0;
+        } else {
+          flow->drop_next_msec =
+            onion_flow_control_law(flow->drop_next_msec, flow->drop_count);
+        }
+      }
+    }
+  } else if (ok_to_drop) {
+    unsigned int delta = flow->drop_count - flow->last_drop_count;
+    onion_queue_entry_drop(TOR_TAILQ_FIRST(&flow->entries),
+                           "has been waiting too long");
+    onion_flow_ok_to_drop(flow, now_msec);
+    flow->dropping = 1;
+    /* If we were dropping recently, resume near the old drop rate. */
+    if (delta > 1 && now_msec < flow->drop_next_msec +
+                                 16 * (uint64_t)onion_queue_interval_msec())
+      flow->drop_count = delta;
+    else
+      flow->drop_count = 1;
+    flow->drop_next_msec = onion_flow_control_law(now_msec, flow->drop_count);
+    flow->last_drop_count = flow->drop_count;
+  }
+
+  head = TOR_TAILQ_FIRST(&flow->entries);
+  tor_assert(head);
+  return head;
+}
+
+/** Add <b>circ</b> to the end of its flow in ol_list and return 0. If the
+ * queue is too long, make room by dropping the oldest entry of whichever
+ * flow of the same type has the most entries.  Return -1 if the queue is
+ * too long but has no entries of this type to drop, or if the onionskin is
+ * of an unknown type.
  */
 int
 onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 {
   onion_queue_t *tmp;
-  time_t now = time(NULL);
+  onion_flow_t *flow;
+  uint64_t now_msec = onion_queue_now_msec();
 
   if (onionskin->handshake_type > MAX_ONION_HANDSHAKE_TYPE) {
     log_warn(LD_BUG, "Handshake %d out of range! Dropping.",
@@ -135,12 +402,6 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
     return -1;
   }
 
-  tmp = tor_malloc_zero(sizeof(onion_queue_t));
-  tmp->circ = circ;
-  tmp->handshake_type = onionskin->handshake_type;
-  tmp->onionskin = onionskin;
-  tmp->when_added = now;
-
   if (!have_room_for_onionskin(onionskin->handshake_type)) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
     static ratelim_t last_warned =
@@ -155,10 +416,29 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
                "restricted exit policy.%s",m);
       tor_free(m);
     }
-    tor_free(tmp);
-    return -1;
+    /* Shed the request that is most likely to be doomed: the oldest one
+     * from the channel that is taking up the most room. */
+    flow = onion_flow_get_fattest(onionskin->handshake_type);
+    if (!flow) {
+      /* The queue is full of the other type, which isn't ours to shed.
+       * Turn this one away instead. */
+      return -1;
+    }
+    onion_queue_entry_drop(TOR_TAILQ_FIRST(&flow->entries),
+                           "was pushed out by a newer one");
   }
 
+  tmp = tor_malloc_zero(sizeof(onion_queue_t));
+  tmp->circ = circ;
+  tmp->handshake_type = onionskin->handshake_type;
+  tmp->onionskin = onionskin;
+  tmp->when_added_msec = now_msec;
+
+  flow = onion_flow_get(circ, onionskin->handshake_type);
+  tmp->flow = flow;
+  TOR_TAILQ_INSERT_TAIL(&flow->entries, tmp, next_in_flow);
+  ++flow->n_entries;
+
   ++ol_entries[onionskin->handshake_type];
   log_info(LD_OR, "New create (%s). Queues now ntor=%d and tap=%d.",
     onionskin->handshake_type == ONION_HANDSHAKE_TYPE_NTOR ? "ntor" : "tap",
@@ -169,18 +449,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   TOR_TAILQ_INSERT_TAIL(&ol_list[onionskin->handshake_type], tmp, next);
 
   /* cull elderly requests. */
-  while (1) {
-    onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[onionskin->handshake_type]);
-    if (now - head->when_added < (time_t)ONIONQUEUE_WAIT_CUTOFF)
-      break;
-
-    circ = head->circ;
-    circ->onionqueue_entry = NULL;
-    onion_queue_entry_remove(head);
-    log_info(LD_CIRC,
-             "Circuit create request is too old; canceling due to overload.");
-    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
-  }
+  onion_queue_cull_elderly(now_msec);
   return 0;
 }
 
@@ -241,18 +510,31 @@ decide_next_handshake_type(void)
 }
 
 /** Remove the highest priority item from ol_list[] and return it, or
- * return NULL if the lists are empty.
+ * return NULL if the lists are empty.  Within each handshake type, we take
+ * turns among the inbound channels that have requests waiting.
  */
 or_circuit_t *
 onion_next_task(create_cell_t **onionskin_out)
 {
   or_circuit_t *circ;
-  uint16_t handshake_to_choose = decide_next_handshake_type();
-  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+  uint16_t handshake_to_choose;
+  onion_flow_t *flow;
+  onion_queue_t *head;
+  uint64_t now_msec = onion_queue_now_msec();
+
+  onion_queue_cull_elderly(now_msec);
 
-  if (!head)
+  handshake_to_choose = decide_next_handshake_type();
+  flow = TOR_TAILQ_FIRST(&ol_flows[handshake_to_choose]);
+  if (!flow)
     return NULL; /* no onions pending, we're done */
 
+  /* Let the next flow go first next time. */
+  TOR_TAILQ_REMOVE(&ol_flows[handshake_to_choose], flow, next_flow);
+  TOR_TAILQ_INSERT_TAIL(&ol_flows[handshake_to_choose], flow, next_flow);
+
+  head = onion_flow_dequeue(flow, now_msec);
+
   tor_assert(head->circ);
   tor_assert(head->handshake_type <= MAX_ONION_HANDSHAKE_TYPE);
 //  tor_assert(head->circ->p_chan); /* make sure it's still valid */
@@ -298,10 +580,13 @@ onion_pending_remove(or_circuit_t *circ)
 }
 
 /** Remove a queue entry <b>victim</b> from the queue, unlinking it from
- * its circuit and freeing it and any structures it owns.*/
+ * its circuit and freeing it and any structures it owns.  Free its flow
+ * if it was the last entry there.*/
 static void
 onion_queue_entry_remove(onion_queue_t *victim)
 {
+  onion_flow_t *flow;
+
   if (victim->handshake_type > MAX_ONION_HANDSHAKE_TYPE) {
     log_warn(LD_BUG, "Handshake %d out of range! Dropping.",
              victim->handshake_type);
@@ -311,6 +596,14 @@ onion_queue_entry_remove(onion_queue_t *victim)
 
   TOR_TAILQ_REMOVE(&ol_list[victim->handshake_type], victim, next);
 
+  flow = victim->flow;
+  TOR_TAILQ_REMOVE(&flow->entries, victim, next_in_flow);
+  if (--flow->n_entries == 0) {
+    HT_REMOVE(onion_flow_map, &onion_flow_map, flow);
+    TOR_TAILQ_REMOVE(&ol_flows[flow->handshake_type], flow, next_flow);
+    tor_free(flow);
+  }
+
   if (victim->circ)
     victim->circ->onionqueue_entry = NULL;
 
@@ -333,31 +626,34 @@ clear_pending_onions(void)
       onion_queue_entry_remove(victim);
     }
     tor_assert(TOR_TAILQ_EMPTY(&ol_list[i]));
+    tor_assert(TOR_TAILQ_EMPTY(&ol_flows[i]));
   }
+  tor_assert(HT_EMPTY(&onion_flow_map));
+  HT_CLEAR(onion_flow_map, &onion_flow_map);
   memset(ol_entries, 0, sizeof(ol_entries));
 }
 
 /* ============================================================ */
 
-/** Fill in a server_onion_keys_t object at <b>keys</b> with all of the keys
+/** Return a new server_onion_keys_t object with all of the keys
  * and other info we might need to do onion handshakes.  (We make a copy of
  * our keys for each cpuworker to avoid race conditions with the main thread,
  * and to avoid locking) */
-void
-setup_server_onion_keys(server_onion_keys_t *keys)
+server_onion_keys_t *
+server_onion_keys_new(void)
 {
-  memset(keys, 0, sizeof(server_onion_keys_t));
+  server_onion_keys_t *keys = tor_malloc_zero(sizeof(server_onion_keys_t));
   memcpy(keys->my_identity, router_get_my_id_digest(), DIGEST_LEN);
   dup_onion_keys(&keys->onion_key, &keys->last_onion_key);
   keys->curve25519_key_map = construct_ntor_key_map();
   keys->junk_keypair = tor_malloc_zero(sizeof(curve25519_keypair_t));
   curve25519_keypair_generate(keys->junk_keypair, 0);
+  return keys;
 }
 
-/** Release all storage held in <b>keys</b>, but do not free <b>keys</b>
- * itself (as it's likely to be stack-allocated.) */
+/** Release all storage held in <b>keys</b>. */
 void
-release_server_onion_keys(server_onion_keys_t *keys)
+server_onion_keys_free(server_onion_keys_t *keys)
 {
   if (! keys)
     return;
@@ -366,7 +662,8 @@ release_server_onion_keys(server_onion_keys_t *keys)
   crypto_pk_free(keys->last_onion_key);
   ntor_key_map_free(keys->curve25519_key_map);
   tor_free(keys->junk_keypair);
-  memset(keys, 0, sizeof(server_onion_keys_t));
+  memwipe(keys, 0, sizeof(server_onion_keys_t));
+  tor_free(keys);
 }
 
 /** Release whatever storage is held in <b>state</b>, depending on its
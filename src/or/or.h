@@ -97,6 +97,7 @@
 #include "replaycache.h"
 #include "crypto_curve25519.h"
 #include "tor_queue.h"
+#include "timers.h"
 
 /* These signals are defined to help handle_control_signal work.
  */
@@ -213,8 +214,7 @@ typedef enum {
 #define CONN_TYPE_DIR_LISTENER 8
 /** Type for HTTP connections to the directory server. */
 #define CONN_TYPE_DIR 9
-/** Connection from the main process to a CPU worker process. */
-#define CONN_TYPE_CPUWORKER 10
+/* Type 10 was formerly used for connections to CPU worker processes. */
 /** Type for listening for connections from user interface process. */
 #define CONN_TYPE_CONTROL_LISTENER 11
 /** Type for connections from user interface process. */
@@ -276,17 +276,6 @@ typedef enum {
 /** State for any listener connection. */
 #define LISTENER_STATE_READY 0
 
-#define CPUWORKER_STATE_MIN_ 1
-/** State for a connection to a cpuworker process that's idle. */
-#define CPUWORKER_STATE_IDLE 1
-/** State for a connection to a cpuworker process that's processing a
- * handshake. */
-#define CPUWORKER_STATE_BUSY_ONION 2
-#define CPUWORKER_STATE_MAX_ 2
-
-#define CPUWORKER_TASK_ONION CPUWORKER_STATE_BUSY_ONION
-#define CPUWORKER_TASK_SHUTDOWN 255
-
 #define OR_CONN_STATE_MIN_ 1
 /** State for a connection to an OR: waiting for connect() to finish. */
 #define OR_CONN_STATE_CONNECTING 1
@@ -1111,18 +1100,35 @@ typedef struct ext_or_cmd_t {
 
 /** A cell as packed for writing to the network. */
 typedef struct packed_cell_t {
-  /** Next cell queued on this circuit. */
-  TOR_SIMPLEQ_ENTRY(packed_cell_t) next;
+  /** The chunk that holds this cell, if it was queued on a cell_queue_t;
+   * NULL if it was allocated on its own. */
+  struct cell_chunk_t *chunk;
   char body[CELL_MAX_NETWORK_SIZE]; /**< Cell as packed for network. */
   uint32_t inserted_time; /**< Time (in milliseconds since epoch, with high
                            * bits truncated) when this cell was inserted. */
 } packed_cell_t;
 
+/** A contiguous block of cells in a cell_queue_t.  Cells are appended at
+ * the end of the last chunk in a queue and popped from the start of the
+ * first one.  A popped cell stays in its chunk until it is freed, so the
+ * chunk is reference-counted. */
+typedef struct cell_chunk_t {
+  struct cell_chunk_t *next; /**< The next chunk in the queue. */
+  uint16_t capacity; /**< How many cells fit in <b>cells</b>? */
+  uint16_t first; /**< Index of the first cell still in the queue. */
+  uint16_t n_queued; /**< How many cells are still in the queue? */
+  /** Number of cells popped from this chunk but not yet freed, plus one if
+   * the chunk is still part of a queue. */
+  uint16_t refcnt;
+  packed_cell_t cells[FLEXIBLE_ARRAY_MEMBER]; /**< The cells themselves. */
+} cell_chunk_t;
+
 /** A queue of cells on a circuit, waiting to be added to the
  * or_connection_t's outbuf. */
 typedef struct cell_queue_t {
-  /** Linked list of packed_cell_t*/
-  TOR_SIMPLEQ_HEAD(cell_simpleq, packed_cell_t) head;
+  /** First and last chunks of cells in the queue; every chunk here has
+   * at least one cell queued. */
+  cell_chunk_t *head, *tail;
   int n; /**< The number of cells in the queue. */
 } cell_queue_t;
 
@@ -1137,6 +1143,8 @@ typedef struct {
 
 typedef struct buf_t buf_t;
 typedef struct socks_request_t socks_request_t;
+/* struct tls_shard_job_t is in tlsshard.h */
+typedef struct tls_shard_job_t tls_shard_job_t;
 #ifdef USE_BUFFEREVENTS
 #define generic_buffer_t struct evbuffer
 #else
@@ -1187,6 +1195,9 @@ typedef struct connection_t {
   unsigned int write_blocked_on_bw:1; /**< Boolean: should we start writing
                              * again once the bandwidth throttler allows
                              * writes? */
+  unsigned int on_blocked_on_bw_list:1; /**< Boolean: is this connection in
+                             * the list of connections that the bandwidth
+                             * throttler must wake up? */
   unsigned int hold_open_until_flushed:1; /**< Despite this connection's being
                                       * marked for close, do we flush it
                                       * before closing it? */
@@ -1198,6 +1209,21 @@ typedef struct connection_t {
   /** True if connection_handle_write is currently running on this connection.
    */
   unsigned int in_connection_handle_write:1;
+  /** True iff this connection is waiting for the next batch of io_uring
+   * reads. */
+  unsigned int in_read_batch:1;
+  /** True iff batched_read_result holds the result of a read that the
+   * kernel has already done for us, and whose bytes are already on the
+   * inbuf; connection_handle_read() should account for it instead of
+   * reading. */
+  unsigned int has_batched_read_result:1;
+  /** True iff this connection is waiting for the next batch of io_uring
+   * writes. */
+  unsigned int in_write_batch:1;
+  /** True iff batched_write_result holds the result of a write that the
+   * kernel has already done for us, and that connection_handle_write()
+   * should account for instead of writing. */
+  unsigned int has_batched_write_result:1;
 
   /* For linked connections:
    */
@@ -1228,6 +1254,12 @@ typedef struct connection_t {
   buf_t *outbuf; /**< Buffer holding data to write over this connection. */
   size_t outbuf_flushlen; /**< How much data should we try to flush from the
                            * outbuf? */
+  /** If has_batched_read_result is set, the number of bytes that a batched
+   * read added to the inbuf, or a negative errno value. */
+  int batched_read_result;
+  /** If has_batched_write_result is set, the number of bytes that a batched
+   * write sent from the outbuf, or a negative errno value. */
+  int batched_write_result;
   time_t timestamp_lastread; /**< When was the last time libevent said we could
                               * read? */
   time_t timestamp_lastwritten; /**< When was the last time libevent said we
@@ -1239,6 +1271,10 @@ typedef struct connection_t {
 
   time_t timestamp_created; /**< When was this connection_t created? */
 
+  /** Timer for the next time that run_connection_housekeeping() needs to
+   * look at this connection. */
+  wheel_timer_t housekeeping_timer;
+
   /* XXXX_IP6 make this IPv6-capable */
   int socket_family; /**< Address family of this connection's socket.  Usually
                       * AF_INET, but it can also be AF_UNIX, or in the future
@@ -1499,6 +1535,34 @@ typedef struct or_connection_t {
   /** True iff this connection has had its bootstrap failure logged with
    * control_event_bootstrap_problem. */
   unsigned int have_noted_bootstrap_problem:1;
+  /** True iff we are holding off on writing this connection's outbuf in the
+   * hope of filling a whole TLS record. */
+  unsigned int coalescing_outbuf:1;
+  /** True iff we held off on writing this connection's outbuf, and should
+   * now write it no matter how little it holds. */
+  unsigned int coalesce_delay_expired:1;
+  /** True iff main.c has put this connection in the batch that it will
+   * next hand to the TLS shards (see tlsshard.c). */
+  unsigned int in_tls_shard_batch:1;
+  /** True iff the next TLS shard batch should read from this connection. */
+  unsigned int tls_shard_wants_read:1;
+  /** True iff the next TLS shard batch should write to this connection. */
+  unsigned int tls_shard_wants_write:1;
+  /** True iff a TLS shard has read from this connection, and
+   * tls_shard_read_result holds what it got. */
+  unsigned int has_tls_shard_read_result:1;
+  /** True iff a TLS shard has written to this connection, and
+   * tls_shard_write_result holds what it got. */
+  unsigned int has_tls_shard_write_result:1;
+  /** True iff a TLS shard thread has a job for this connection, and we've
+   * stopped watching it for events until the job is done. */
+  unsigned int tls_shard_suspended:1;
+  /** While tls_shard_suspended is set, true iff we should watch this
+   * connection for reads once the job is done. */
+  unsigned int tls_shard_reading:1;
+  /** While tls_shard_suspended is set, true iff we should watch this
+   * connection for writes once the job is done. */
+  unsigned int tls_shard_writing:1;
 
   uint16_t link_proto; /**< What protocol version are we using? 0 for
                         * "none negotiated yet." */
@@ -1519,6 +1583,11 @@ typedef struct or_connection_t {
                     * add 'bandwidthrate' to this, capping it at
                     * bandwidthburst. (OPEN ORs only) */
   int write_bucket; /**< When this hits 0, stop writing. Like read_bucket. */
+  /** The value of the bucket clock when we last added tokens to read_bucket
+   * and write_bucket.  We add the tokens for the time since then whenever we
+   * look at the buckets, rather than topping up every connection on every
+   * refill. */
+  uint64_t buckets_last_refilled;
 #else
   /** A rate-limiting configuration object to determine how this connection
    * set its read- and write- limits. */
@@ -1526,6 +1595,23 @@ typedef struct or_connection_t {
   struct ev_token_bucket_cfg *bucket_cfg;
 #endif
 
+  /** The TLS shard job that this connection is part of, if any.  Until
+   * it is done, the main thread must not touch the connection's TLS
+   * object, the front of its outbuf, or the end of its inbuf. */
+  tls_shard_job_t *tls_shard_job;
+  /** If has_tls_shard_read_result is set, what read_to_buf_tls() would have
+   * returned for the read that a TLS shard did for us. */
+  int tls_shard_read_result;
+  /** If has_tls_shard_read_result is set, how many bytes that read added to
+   * the inbuf. */
+  size_t tls_shard_n_read;
+  /** If has_tls_shard_write_result is set, what flush_buf_tls() would have
+   * returned for the write that a TLS shard did for us. */
+  int tls_shard_write_result;
+  /** If has_tls_shard_write_result is set, how many bytes that write took
+   * from the outbuf. */
+  size_t tls_shard_n_written;
+
   struct or_connection_t *next_with_same_id; /**< Next connection with same
                                               * identity digest as this one. */
   /** Last emptied read token bucket in msec since midnight; only used if
@@ -2964,6 +3050,10 @@ typedef enum {
 typedef struct origin_circuit_t {
   circuit_t base_;
 
+  /** Index in smartlist of all origin circuits
+   * (global_origin_circuit_list). */
+  int global_origin_circuit_list_idx;
+
   /** Linked list of AP streams (or EXIT streams if hidden service)
    * associated with this circuit. */
   edge_connection_t *p_streams;
@@ -3155,6 +3245,10 @@ typedef struct or_circuit_t {
   /** Pointer to an entry on the onion queue, if this circuit is waiting for a
    * chance to give an onionskin to a cpuworker. Used only in onion.c */
   struct onion_queue_t *onionqueue_entry;
+  /** Pointer to a workqueue entry, if this circuit has given an onionskin to
+   * a cpuworker and is waiting for a response. Used to detach the circuit
+   * from the cpuworker job if the circuit is freed first. */
+  struct workqueue_entry_s *workqueue_entry;
 
   /** The circuit_id used in the previous (backward) hop of this circuit. */
   circid_t p_circ_id;
@@ -3169,6 +3263,11 @@ typedef struct or_circuit_t {
   circuitmux_t *p_mux;
   /** Linked list of Exit streams associated with this circuit. */
   edge_connection_t *n_streams;
+  /** How many streams are on n_streams? */
+  unsigned int n_streams_count;
+  /** If n_streams has grown long, an index of it by stream ID; see
+   * circuitlist.c. */
+  struct stream_id_map_t *n_streams_map;
   /** Linked list of Exit streams associated with this circuit that are
    * still being resolved. */
   edge_connection_t *resolving_streams;
@@ -3694,6 +3793,11 @@ typedef struct {
                              * waiting for this many seconds. If zero, use
                              * our default internal timeout schedule. */
   int MaxOnionQueueDelay; /**<DOCDOC*/
+
+  /** How long, in milliseconds, may we hold off on writing data to an OR
+   * connection in the hope of filling a whole TLS record?  0 means never
+   * wait. */
+  int MaxTLSRecordCoalesceDelay;
   int NewCircuitPeriod; /**< How long do we use a circuit before building
                          * a new one? */
   int MaxCircuitDirtiness; /**< Never use circs that were first used more than
@@ -3712,9 +3816,18 @@ typedef struct {
                                  * willing to use for all relayed conns? */
   uint64_t RelayBandwidthBurst; /**< How much bandwidth, at maximum, will we
                                  * use in a second for all relayed conns? */
+  uint64_t DirBandwidthRate; /**< How much bandwidth, on average, are we
+                              * willing to use for answering directory
+                              * requests? */
+  uint64_t DirBandwidthBurst; /**< How much bandwidth, at maximum, will we use
+                               * in a second for answering directory
+                               * requests? */
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** How many listening sockets should we open for each ORPort?  If this is
+   * more than one, they all share the port with SO_REUSEPORT. */
+  int NumORPortListeners;
 //int RunTesting; /**< If true, create testing circuits to measure how well the
 //                 * other ORs are running. */
   config_line_t *RendConfigLines; /**< List of configuration lines
@@ -4243,6 +4356,19 @@ typedef struct {
 
   char *TLSECGroup; /**< One of "P256", "P224", or nil for auto */
 
+  /** If true, give the record keys of our open TLS connections to the
+   * kernel when it can take them. */
+  int UseKernelTLS;
+
+  /** If true, hand the kernel the writes for all of our plaintext sockets
+   * that become writable together as one batch, using io_uring. */
+  int UseIOUring;
+
+  /** How many threads besides the main one should do the TLS reads and
+   * writes for our open OR connections?  0 for "do them all in the main
+   * thread." */
+  int NumTLSThreads;
+
   /** Autobool: should we use the ntor handshake if we can? */
   int UseNTorHandshake;
 
@@ -4268,6 +4394,16 @@ typedef struct {
    * when sending.
    */
   int SchedulerMaxFlushCells__;
+
+  /** List of schedulers to use, in order of preference; we use the first
+   * one that this platform supports. */
+  smartlist_t *Schedulers;
+  /** How long (msec) should the KIST scheduler wait before trying again to
+   * write to channels whose sockets were full? */
+  int KISTSchedRunInterval;
+  /** How much data should KIST let each socket queue beyond its congestion
+   * window, as a multiple of the congestion window? */
+  double KISTSockBufSizeFactor;
 } or_options_t;
 
 /** Persistent state for an onion router, as saved to disk. */
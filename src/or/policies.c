@@ -22,6 +22,9 @@
 static smartlist_t *socks_policy = NULL;
 /** Policy that addresses for incoming directory connections must match. */
 static smartlist_t *dir_policy = NULL;
+/** Compiled versions of socks_policy and dir_policy. */
+static compiled_addr_policy_t *socks_policy_compiled = NULL;
+static compiled_addr_policy_t *dir_policy_compiled = NULL;
 /** Policy that addresses for incoming router descriptors must match in order
  * to be published by us. */
 static smartlist_t *authdir_reject_policy = NULL;
@@ -62,6 +65,7 @@ static const char *private_nets[] = {
   NULL
 };
 
+static int addr_policy_result_permits(addr_policy_result_t p);
 static int policies_parse_exit_policy_internal(config_line_t *cfg,
                                                smartlist_t **dest,
                                                int ipv6_exit,
@@ -273,8 +277,15 @@ static int
 addr_policy_permits_tor_addr(const tor_addr_t *addr, uint16_t port,
                             smartlist_t *policy)
 {
-  addr_policy_result_t p;
-  p = compare_tor_addr_to_addr_policy(addr, port, policy);
+  return addr_policy_result_permits(
+                     compare_tor_addr_to_addr_policy(addr, port, policy));
+}
+
+/** Return true iff the result <b>p</b> of comparing an address to a policy
+ * means that we should allow the connection. */
+static int
+addr_policy_result_permits(addr_policy_result_t p)
+{
   switch (p) {
     case ADDR_POLICY_PROBABLY_ACCEPTED:
     case ADDR_POLICY_ACCEPTED:
@@ -352,7 +363,8 @@ fascist_firewall_allows_address_dir(const tor_addr_t *addr, uint16_t port)
 int
 dir_policy_permits_address(const tor_addr_t *addr)
 {
-  return addr_policy_permits_tor_addr(addr, 1, dir_policy);
+  return addr_policy_result_permits(
+           compare_tor_addr_to_compiled_policy(addr, 1, dir_policy_compiled));
 }
 
 /** Return 1 if <b>addr</b> is permitted to connect to our socks port,
@@ -361,7 +373,8 @@ dir_policy_permits_address(const tor_addr_t *addr)
 int
 socks_policy_permits_address(const tor_addr_t *addr)
 {
-  return addr_policy_permits_tor_addr(addr, 1, socks_policy);
+  return addr_policy_result_permits(
+         compare_tor_addr_to_compiled_policy(addr, 1, socks_policy_compiled));
 }
 
 /** Return true iff the address <b>addr</b> is in a country listed in the
@@ -528,6 +541,10 @@ policies_parse_from_options(const or_options_t *options)
     ret = -1;
   if (parse_reachable_addresses() < 0)
     ret = -1;
+  compiled_addr_policy_free(socks_policy_compiled);
+  socks_policy_compiled = addr_policy_compile(socks_policy);
+  compiled_addr_policy_free(dir_policy_compiled);
+  dir_policy_compiled = addr_policy_compile(dir_policy);
   return ret;
 }
 
@@ -775,6 +792,274 @@ compare_tor_addr_to_addr_policy,(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** A range of ports in a policy_trie_node_t, and the first entry of the
+ * policy that matches them there. */
+typedef struct policy_port_range_t {
+  uint16_t prt_min; /**< Lowest port in the range. */
+  uint16_t prt_max; /**< Highest port in the range. */
+  /** Position of the first matching entry in the policy. */
+  int idx;
+  /** What to do when this range matches. */
+  addr_policy_action_bitfield_t policy_type:2;
+} policy_port_range_t;
+
+/** A node in the radix tree of a compiled_addr_policy_t.  The path from the
+ * root to a node at depth <b>d</b> spells out the first <b>d</b> bits of an
+ * address; the node holds the entries whose masks are exactly those bits. */
+typedef struct policy_trie_node_t {
+  /** Children for addresses whose next bit is 0 or 1. */
+  struct policy_trie_node_t *child[2];
+  /** The ports that entries ending at this node cover, as sorted,
+   * disjoint ranges. */
+  policy_port_range_t *ranges;
+  int n_ranges;
+  /** While we compile: a list of policy_port_range_t, one for each entry
+   * ending at this node, in policy order. */
+  smartlist_t *pending;
+} policy_trie_node_t;
+
+/** An address policy, compiled so that we can look up a known address and
+ * port without walking every entry. */
+struct compiled_addr_policy_t {
+  /** The policy that we compiled.  We use it for the cases that the radix
+   * trees don't cover. */
+  const smartlist_t *policy;
+  /** Radix trees for the IPv4 and IPv6 entries of the policy. */
+  policy_trie_node_t *root4;
+  policy_trie_node_t *root6;
+};
+
+/** Return bit <b>bit</b> of <b>addr</b>, counting from the most significant
+ * bit of the address. */
+static INLINE int
+policy_addr_get_bit(const tor_addr_t *addr, int bit)
+{
+  if (tor_addr_family(addr) == AF_INET) {
+    return (tor_addr_to_ipv4h(addr) >> (31-bit)) & 1;
+  } else {
+    const uint8_t *a = tor_addr_to_in6_addr8(addr);
+    return (a[bit>>3] >> (7-(bit&7))) & 1;
+  }
+}
+
+/** Return the number of bits in an address of the same family as
+ * <b>addr</b>. */
+static INLINE int
+policy_addr_n_bits(const tor_addr_t *addr)
+{
+  return tor_addr_family(addr) == AF_INET ? 32 : 128;
+}
+
+/** Release all storage held by the radix tree under <b>node</b>. */
+static void
+policy_trie_node_free(policy_trie_node_t *node)
+{
+  if (!node)
+    return;
+  policy_trie_node_free(node->child[0]);
+  policy_trie_node_free(node->child[1]);
+  if (node->pending) {
+    SMARTLIST_FOREACH(node->pending, policy_port_range_t *, r, tor_free(r));
+    smartlist_free(node->pending);
+  }
+  tor_free(node->ranges);
+  tor_free(node);
+}
+
+/** Helper for sorting port boundaries. */
+static int
+compare_uint32s_(const void **a, const void **b)
+{
+  const uint32_t *ia = *a, *ib = *b;
+  return (*ia < *ib) ? -1 : ((*ia > *ib) ? 1 : 0);
+}
+
+/** Turn the pending entries of <b>node</b> into its sorted, disjoint port
+ * ranges, so that each port maps to the first entry at this node that
+ * covers it; then do the same for the rest of the tree under <b>node</b>.
+ */
+static void
+policy_trie_node_finish(policy_trie_node_t *node)
+{
+  if (!node)
+    return;
+  policy_trie_node_finish(node->child[0]);
+  policy_trie_node_finish(node->child[1]);
+  if (!node->pending)
+    return;
+
+  {
+    const int n_entries = smartlist_len(node->pending);
+    uint32_t *bounds = tor_calloc(n_entries * 2, sizeof(uint32_t));
+    smartlist_t *sorted = smartlist_new();
+    int i;
+
+    /* Every place where some entry starts or stops covering ports. */
+    SMARTLIST_FOREACH_BEGIN(node->pending, policy_port_range_t *, r) {
+      bounds[r_sl_idx*2] = r->prt_min;
+      bounds[r_sl_idx*2+1] = ((uint32_t)r->prt_max) + 1;
+      smartlist_add(sorted, &bounds[r_sl_idx*2]);
+      smartlist_add(sorted, &bounds[r_sl_idx*2+1]);
+    } SMARTLIST_FOREACH_END(r);
+    smartlist_sort(sorted, compare_uint32s_);
+
+    /* Between two adjacent bounds, the same entries cover every port. */
+    node->ranges = tor_calloc(n_entries * 2, sizeof(policy_port_range_t));
+    for (i = 0; i + 1 < smartlist_len(sorted); ++i) {
+      const uint32_t lo = *(uint32_t *)smartlist_get(sorted, i);
+      const uint32_t hi = *(uint32_t *)smartlist_get(sorted, i+1);
+      policy_port_range_t *last;
+      if (lo == hi)
+        continue;
+      SMARTLIST_FOREACH_BEGIN(node->pending, policy_port_range_t *, r) {
+        if (r->prt_min <= lo && lo <= r->prt_max) {
+          last = node->n_ranges ? &node->ranges[node->n_ranges-1] : NULL;
+          if (last && last->idx == r->idx &&
+              (uint32_t)last->prt_max + 1 == lo) {
+            last->prt_max = hi - 1;
+          } else {
+            last = &node->ranges[node->n_ranges++];
+            last->prt_min = lo;
+            last->prt_max = hi - 1;
+            last->idx = r->idx;
+            last->policy_type = r->policy_type;
+          }
+          break;
+        }
+      } SMARTLIST_FOREACH_END(r);
+    }
+
+    smartlist_free(sorted);
+    tor_free(bounds);
+    SMARTLIST_FOREACH(node->pending, policy_port_range_t *, r, tor_free(r));
+    smartlist_free(node->pending);
+    node->pending = NULL;
+  }
+}
+
+/** Compile <b>policy</b> (which may be NULL), and return the result.  The
+ * result refers to <b>policy</b>, which must not change or be freed while
+ * the result is in use. */
+compiled_addr_policy_t *
+addr_policy_compile(const smartlist_t *policy)
+{
+  compiled_addr_policy_t *compiled =
+    tor_malloc_zero(sizeof(compiled_addr_policy_t));
+  compiled->policy = policy;
+  if (!policy)
+    return compiled;
+
+  compiled->root4 = tor_malloc_zero(sizeof(policy_trie_node_t));
+  compiled->root6 = tor_malloc_zero(sizeof(policy_trie_node_t));
+
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, ent) {
+    const sa_family_t family = tor_addr_family(&ent->addr);
+    policy_trie_node_t *node;
+    policy_port_range_t *r;
+    int bit, maskbits;
+
+    /* Entries for no particular family never match a known address. */
+    if (family != AF_INET && family != AF_INET6)
+      continue;
+    if (ent->prt_min > ent->prt_max)
+      continue;
+
+    node = (family == AF_INET) ? compiled->root4 : compiled->root6;
+    maskbits = MIN(ent->maskbits, policy_addr_n_bits(&ent->addr));
+    for (bit = 0; bit < maskbits; ++bit) {
+      const int b = policy_addr_get_bit(&ent->addr, bit);
+      if (!node->child[b])
+        node->child[b] = tor_malloc_zero(sizeof(policy_trie_node_t));
+      node = node->child[b];
+    }
+
+    r = tor_malloc_zero(sizeof(policy_port_range_t));
+    r->prt_min = ent->prt_min;
+    r->prt_max = ent->prt_max;
+    r->idx = ent_sl_idx;
+    r->policy_type = ent->policy_type;
+    if (!node->pending)
+      node->pending = smartlist_new();
+    smartlist_add(node->pending, r);
+  } SMARTLIST_FOREACH_END(ent);
+
+  policy_trie_node_finish(compiled->root4);
+  policy_trie_node_finish(compiled->root6);
+  return compiled;
+}
+
+/** Release all storage held by <b>compiled</b>. */
+void
+compiled_addr_policy_free(compiled_addr_policy_t *compiled)
+{
+  if (!compiled)
+    return;
+  policy_trie_node_free(compiled->root4);
+  policy_trie_node_free(compiled->root6);
+  tor_free(compiled);
+}
+
+/** Return the port range of <b>node</b> that holds <b>port</b>, or NULL if
+ * none does. */
+static const policy_port_range_t *
+policy_trie_node_find_port(const policy_trie_node_t *node, uint16_t port)
+{
+  int lo = 0, hi = node->n_ranges - 1;
+  while (lo <= hi) {
+    const int mid = (lo + hi) / 2;
+    const policy_port_range_t *r = &node->ranges[mid];
+    if (port < r->prt_min)
+      hi = mid - 1;
+    else if (port > r->prt_max)
+      lo = mid + 1;
+    else
+      return r;
+  }
+  return NULL;
+}
+
+/** As compare_tor_addr_to_addr_policy(), but for a compiled policy (which
+ * may be NULL, to accept everything).  When we know both the address and
+ * the port, this takes time proportional to the length of the address, not
+ * of the policy. */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const compiled_addr_policy_t *compiled)
+{
+  const policy_trie_node_t *node;
+  const policy_port_range_t *best = NULL;
+  int bit, n_bits;
+
+  if (!compiled || !compiled->policy)
+    return ADDR_POLICY_ACCEPTED;
+  if (addr == NULL || tor_addr_is_null(addr) || port == 0 ||
+      (tor_addr_family(addr) != AF_INET && tor_addr_family(addr) != AF_INET6))
+    return compare_tor_addr_to_addr_policy(addr, port, compiled->policy);
+
+  /* Every entry that matches the address ends at a node on its path; the
+   * first entry in the policy that matches the port as well wins. */
+  node = (tor_addr_family(addr) == AF_INET) ?
+    compiled->root4 : compiled->root6;
+  n_bits = policy_addr_n_bits(addr);
+  for (bit = 0; node; ++bit) {
+    if (node->n_ranges) {
+      const policy_port_range_t *r = policy_trie_node_find_port(node, port);
+      if (r && (!best || r->idx < best->idx))
+        best = r;
+    }
+    if (bit == n_bits)
+      break;
+    node = node->child[policy_addr_get_bit(addr, bit)];
+  }
+
+  if (!best) {
+    /* accept all by default. */
+    return ADDR_POLICY_ACCEPTED;
+  }
+  return best->policy_type == ADDR_POLICY_ACCEPT ?
+    ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+}
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -1060,6 +1345,7 @@ void
 policies_set_node_exitpolicy_to_reject_all(node_t *node)
 {
   node->rejects_all = 1;
+  nodelist_clear_exit_port_index();
 }
 
 /** Return 1 if there is at least one /8 subnet in <b>policy</b> that
@@ -1806,6 +2092,10 @@ policies_free_all(void)
   reachable_or_addr_policy = NULL;
   addr_policy_list_free(reachable_dir_addr_policy);
   reachable_dir_addr_policy = NULL;
+  compiled_addr_policy_free(socks_policy_compiled);
+  socks_policy_compiled = NULL;
+  compiled_addr_policy_free(dir_policy_compiled);
+  dir_policy_compiled = NULL;
   addr_policy_list_free(socks_policy);
   socks_policy = NULL;
   addr_policy_list_free(dir_policy);
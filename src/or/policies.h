@@ -24,6 +24,8 @@
 
 typedef int exit_policy_parser_cfg_t;
 
+typedef struct compiled_addr_policy_t compiled_addr_policy_t;
+
 int firewall_is_fascist_or(void);
 int fascist_firewall_allows_address_or(const tor_addr_t *addr, uint16_t port);
 int fascist_firewall_allows_or(const routerinfo_t *ri);
@@ -45,6 +47,12 @@ int cmp_addr_policies(smartlist_t *a, smartlist_t *b);
 MOCK_DECL(addr_policy_result_t, compare_tor_addr_to_addr_policy,
     (const tor_addr_t *addr, uint16_t port, const smartlist_t *policy));
 
+compiled_addr_policy_t *addr_policy_compile(const smartlist_t *policy);
+void compiled_addr_policy_free(compiled_addr_policy_t *compiled);
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                          const tor_addr_t *addr, uint16_t port,
+                          const compiled_addr_policy_t *compiled);
+
 addr_policy_result_t compare_tor_addr_to_node_policy(const tor_addr_t *addr,
                               uint16_t port, const node_t *node);
 
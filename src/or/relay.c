@@ -58,6 +58,10 @@ static int circuit_resume_edge_reading_helper(edge_connection_t *conn,
 static int circuit_consider_stop_edge_reading(circuit_t *circ,
                                               crypt_path_t *layer_hint);
 static int circuit_queue_streams_are_blocked(circuit_t *circ);
+static int circuit_receive_crypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                          cell_direction_t cell_direction,
+                                          crypt_path_t *layer_hint,
+                                          char recognized);
 static void adjust_exit_policy_from_exitpolicy_failure(origin_circuit_t *circ,
                                                   entry_connection_t *conn,
                                                   node_t *node,
@@ -85,64 +89,102 @@ uint64_t stats_n_relay_cells_delivered = 0;
 /** Used to tell which stream to read from first on a circuit. */
 static tor_weak_rng_t stream_choice_rng = TOR_WEAK_RNG_INIT;
 
-/** Update digest from the payload of cell. Assign integrity part to
- * cell.
+/** Offset of the integrity field within a relay header. */
+#define RELAY_INTEGRITY_OFFSET 5
+/** Offset of the recognized field within a relay header. */
+#define RELAY_RECOGNIZED_OFFSET 1
+
+/** Update <b>digest</b> from the payload of <b>cell</b>, assign the
+ * integrity part to <b>cell</b>, and encrypt the payload with
+ * <b>cipher</b>, all in one pass over the payload.
+ *
+ * The integrity part can't be known until the whole payload has been
+ * hashed, by which point the header has already been encrypted.  Since
+ * our cipher is a stream cipher, we patch it in afterwards by XORing the
+ * difference between the old and new integrity values into the
+ * ciphertext.
+ *
+ * Return -1 if the crypto fails, else return 0.
  */
-static void
-relay_set_digest(crypto_digest_t *digest, cell_t *cell)
+static int
+relay_encrypt_and_set_digest(crypto_cipher_t *cipher,
+                             crypto_digest_t *digest, cell_t *cell)
 {
-  char integrity[4];
-  relay_header_t rh;
+  uint8_t old_integrity[4], integrity[4];
+  uint8_t *field = cell->payload + RELAY_INTEGRITY_OFFSET;
+  int i;
+
+  memcpy(old_integrity, field, 4);
+  if (crypto_cipher_crypt_digest_inplace(cipher, digest,
+                                         (char*)cell->payload,
+                                         CELL_PAYLOAD_SIZE, 1) < 0) {
+    log_warn(LD_BUG,"Error during relay encryption");
+    return -1;
+  }
+  crypto_digest_get_digest(digest, (char*)integrity, 4);
+  for (i = 0; i < 4; ++i)
+    field[i] ^= old_integrity[i] ^ integrity[i];
+  return 0;
+}
 
-  crypto_digest_add_bytes(digest, (char*)cell->payload, CELL_PAYLOAD_SIZE);
-  crypto_digest_get_digest(digest, integrity, 4);
-//  log_fn(LOG_DEBUG,"Putting digest of %u %u %u %u into relay cell.",
-//    integrity[0], integrity[1], integrity[2], integrity[3]);
-  relay_header_unpack(&rh, cell->payload);
-  memcpy(rh.integrity, integrity, 4);
-  relay_header_pack(cell->payload, &rh);
+/** Helper: the relay header of <b>cell</b> has been decrypted, and its
+ * recognized field is zero.  Check whether the hop whose running digest is
+ * <b>digest</b> recognizes the cell, decrypting the rest of the payload with
+ * <b>cipher</b> in the same pass.  If the integrity part is valid, update
+ * <b>digest</b>, leave the integrity part of <b>cell</b> zeroed, and return
+ * 1.  Otherwise leave <b>digest</b> and the cell header as they were and
+ * return 0.
+ */
+static int
+relay_check_digest(crypto_cipher_t *cipher, crypto_digest_t *digest,
+                   cell_t *cell)
+{
+  char header[RELAY_HEADER_SIZE];
+  char *payload = (char*) cell->payload;
+
+  memcpy(header, payload, RELAY_HEADER_SIZE);
+  memset(header + RELAY_INTEGRITY_OFFSET, 0, 4);
+  if (crypto_cipher_decrypt_digest_check(cipher, digest,
+                                         header, RELAY_HEADER_SIZE,
+                                         payload + RELAY_HEADER_SIZE,
+                                         RELAY_PAYLOAD_SIZE,
+                                         payload + RELAY_INTEGRITY_OFFSET,
+                                         4)) {
+    memset(payload + RELAY_INTEGRITY_OFFSET, 0, 4);
+    return 1;
+  }
+  return 0;
 }
 
-/** Does the digest for this circuit indicate that this cell is for us?
+/** Decrypt the payload of <b>cell</b> with <b>cipher</b>, and check
+ * whether the hop whose running digest is <b>digest</b> recognizes it.
  *
- * Update digest from the payload of cell (with the integrity part set
- * to 0). If the integrity part is valid, return 1, else restore digest
- * and cell to their original state and return 0.
+ * We decrypt the header first.  Only if its recognized field is zero do we
+ * decrypt the rest while hashing it (with the integrity part set to 0).
+ * Return 1 if the cell is recognized, 0 if it isn't, and -1 if the crypto
+ * fails.
  */
 static int
-relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
+relay_decrypt_and_check_digest(crypto_cipher_t *cipher,
+                               crypto_digest_t *digest, cell_t *cell)
 {
-  uint32_t received_integrity, calculated_integrity;
-  relay_header_t rh;
-  crypto_digest_t *backup_digest=NULL;
-
-  backup_digest = crypto_digest_dup(digest);
-
-  relay_header_unpack(&rh, cell->payload);
-  memcpy(&received_integrity, rh.integrity, 4);
-  memset(rh.integrity, 0, 4);
-  relay_header_pack(cell->payload, &rh);
-
-//  log_fn(LOG_DEBUG,"Reading digest of %u %u %u %u from relay cell.",
-//    received_integrity[0], received_integrity[1],
-//    received_integrity[2], received_integrity[3]);
-
-  crypto_digest_add_bytes(digest, (char*) cell->payload, CELL_PAYLOAD_SIZE);
-  crypto_digest_get_digest(digest, (char*) &calculated_integrity, 4);
-
-  if (calculated_integrity != received_integrity) {
-//    log_fn(LOG_INFO,"Recognized=0 but bad digest. Not recognizing.");
-// (%d vs %d).", received_integrity, calculated_integrity);
-    /* restore digest to its old form */
-    crypto_digest_assign(digest, backup_digest);
-    /* restore the relay header */
-    memcpy(rh.integrity, &received_integrity, 4);
-    relay_header_pack(cell->payload, &rh);
-    crypto_digest_free(backup_digest);
+  char *payload = (char*) cell->payload;
+
+  if (crypto_cipher_crypt_inplace(cipher, payload, RELAY_HEADER_SIZE) < 0)
+    goto err;
+  if (get_uint16(payload + RELAY_RECOGNIZED_OFFSET) != 0) {
+    /* Not for this hop: the rest just needs decrypting. */
+    if (crypto_cipher_crypt_inplace(cipher, payload + RELAY_HEADER_SIZE,
+                                    RELAY_PAYLOAD_SIZE) < 0)
+      goto err;
     return 0;
   }
-  crypto_digest_free(backup_digest);
-  return 1;
+
+  /* It's possibly recognized; we have to check the digest to be sure. */
+  return relay_check_digest(cipher, digest, cell);
+ err:
+  log_warn(LD_BUG,"Error during relay encryption");
+  return -1;
 }
 
 /** Apply <b>cipher</b> to CELL_PAYLOAD_SIZE bytes of <b>in</b>
@@ -183,10 +225,8 @@ int
 circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction)
 {
-  channel_t *chan = NULL;
   crypt_path_t *layer_hint=NULL;
   char recognized=0;
-  int reason;
 
   tor_assert(cell);
   tor_assert(circ);
@@ -200,6 +240,26 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
     return -END_CIRC_REASON_INTERNAL;
   }
 
+  return circuit_receive_crypted_relay_cell(cell, circ, cell_direction,
+                                            layer_hint, recognized);
+}
+
+/** Helper for circuit_receive_relay_cell() and
+ * circuit_receive_relay_cells(): <b>cell</b> has been through
+ * relay_crypt(), which set <b>layer_hint</b> and <b>recognized</b>.  If it
+ * was recognized, deliver it to the right connection_edge; otherwise
+ * append it to the appropriate cell_queue on <b>circ</b>.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+static int
+circuit_receive_crypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                   cell_direction_t cell_direction,
+                                   crypt_path_t *layer_hint, char recognized)
+{
+  channel_t *chan = NULL;
+  int reason;
+
   if (recognized) {
     edge_connection_t *conn = NULL;
 
@@ -293,6 +353,81 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   return 0;
 }
 
+/** As circuit_receive_relay_cell(), for each of the <b>n_items</b> cells in
+ * <b>items</b>, which must be in the order that they arrived.  The caller
+ * sets <b>circ</b>, <b>cell</b> and <b>cell_direction</b> for each item;
+ * we set <b>result</b> to what circuit_receive_relay_cell() would have
+ * returned, and mark the circuit for close if that is negative, before
+ * going on to the next cell.
+ *
+ * The cells on circuits that don't start here are crypted all at once with
+ * relay_crypt_cells(); this is safe because the handling of one such cell
+ * never changes the keys that another one needs.  At the origin a cell can
+ * add a hop to the circuit, so those cells are crypted one at a time as we
+ * handle them.
+ */
+void
+circuit_receive_relay_cells(relay_crypt_item_t *items, int n_items)
+{
+  /* Static to keep them off the stack: only the main thread handles cells,
+   * and handling a cell never gets us back here. */
+  static relay_crypt_item_t batch[RELAY_CRYPT_MAX_CELLS];
+  static int batch_idx[RELAY_CRYPT_MAX_CELLS];
+  int i, n_batch = 0, n_crypted;
+
+  tor_assert(items || n_items == 0);
+  tor_assert(n_items <= RELAY_CRYPT_MAX_CELLS);
+
+  for (i = 0; i < n_items; ++i) {
+    circuit_t *circ = items[i].circ;
+    tor_assert(circ);
+    if (CIRCUIT_IS_ORIGIN(circ) || circ->marked_for_close)
+      continue;
+    memcpy(&batch[n_batch], &items[i], sizeof(relay_crypt_item_t));
+    batch_idx[n_batch++] = i;
+  }
+  relay_crypt_cells(batch, n_batch);
+
+  n_crypted = n_batch;
+  n_batch = 0;
+  for (i = 0; i < n_items; ++i) {
+    relay_crypt_item_t *item = &items[i];
+    circuit_t *circ = item->circ;
+    int crypted = n_batch < n_crypted && batch_idx[n_batch] == i;
+    int reason;
+
+    if (crypted) {
+      item->layer_hint = batch[n_batch].layer_hint;
+      item->recognized = batch[n_batch].recognized;
+      item->result = batch[n_batch].result;
+      ++n_batch;
+    }
+
+    if (circ->marked_for_close) {
+      reason = 0;
+    } else if (!crypted) {
+      reason = circuit_receive_relay_cell(item->cell, circ,
+                                          item->cell_direction);
+    } else if (item->result < 0) {
+      log_warn(LD_BUG,"relay crypt failed. Dropping connection.");
+      reason = -END_CIRC_REASON_INTERNAL;
+    } else {
+      reason = circuit_receive_crypted_relay_cell(item->cell, circ,
+                                                  item->cell_direction,
+                                                  item->layer_hint,
+                                                  item->recognized);
+    }
+
+    item->result = reason;
+    if (reason < 0) {
+      log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,"circuit_receive_relay_cell "
+             "(%s) failed. Closing.",
+             item->cell_direction==CELL_DIRECTION_OUT?"forward":"backward");
+      circuit_mark_for_close(circ, -reason);
+    }
+  }
+}
+
 /** Do the appropriate en/decryptions for <b>cell</b> arriving on
  * <b>circ</b> in direction <b>cell_direction</b>.
  *
@@ -314,7 +449,7 @@ int
 relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
             crypt_path_t **layer_hint, char *recognized)
 {
-  relay_header_t rh;
+  int r;
 
   tor_assert(circ);
   tor_assert(cell);
@@ -335,17 +470,14 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
       do { /* Remember: cpath is in forward order, that is, first hop first. */
         tor_assert(thishop);
 
-        if (relay_crypt_one_payload(thishop->b_crypto, cell->payload, 0) < 0)
+        r = relay_decrypt_and_check_digest(thishop->b_crypto,
+                                           thishop->b_digest, cell);
+        if (r < 0)
           return -1;
-
-        relay_header_unpack(&rh, cell->payload);
-        if (rh.recognized == 0) {
-          /* it's possibly recognized. have to check digest to be sure. */
-          if (relay_digest_matches(thishop->b_digest, cell)) {
-            *recognized = 1;
-            *layer_hint = thishop;
-            return 0;
-          }
+        if (r > 0) {
+          *recognized = 1;
+          *layer_hint = thishop;
+          return 0;
         }
 
         thishop = thishop->next;
@@ -363,20 +495,159 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
   } else /* cell_direction == CELL_DIRECTION_OUT */ {
     /* we're in the middle. Just one crypt. */
 
-    if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->n_crypto,
-                                cell->payload, 0) < 0)
+    r = relay_decrypt_and_check_digest(TO_OR_CIRCUIT(circ)->n_crypto,
+                                       TO_OR_CIRCUIT(circ)->n_digest, cell);
+    if (r < 0)
       return -1;
+    if (r > 0)
+      *recognized = 1;
+  }
+  return 0;
+}
 
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
-      /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(TO_OR_CIRCUIT(circ)->n_digest, cell)) {
-        *recognized = 1;
-        return 0;
+/** How many cells at most does relay_crypt_cells() crypt in one call to
+ * crypto_cipher_crypt_inplace_multi()? */
+#define RELAY_CRYPT_BATCH 8
+
+/** Helper for relay_crypt_cells(): return the cipher that <b>item</b>,
+ * which is not on an origin circuit, needs. */
+static crypto_cipher_t *
+relay_crypt_item_cipher(const relay_crypt_item_t *item)
+{
+  or_circuit_t *or_circ = TO_OR_CIRCUIT(item->circ);
+  return (item->cell_direction == CELL_DIRECTION_IN) ?
+    or_circ->p_crypto : or_circ->n_crypto;
+}
+
+/** As relay_crypt(), but for each of the <b>n_items</b> cells in
+ * <b>items</b>, which must be in the order that they arrived.  For each
+ * item, set <b>layer_hint</b>, <b>recognized</b>, and <b>result</b> as
+ * relay_crypt() would set *layer_hint and *recognized and what it would
+ * return.
+ *
+ * When we're not at the origin, every cell gets exactly one layer of
+ * crypto, so we first crypt the cells in groups that share a cipher,
+ * generating the keystream for several cells at a time.  Then we check
+ * which of the exitward cells are recognized.  A circuit's digest has to
+ * see its cells one at a time, but different circuits' digests don't, so
+ * each round of checks takes the earliest unchecked cell from each circuit
+ * and checks them side by side.  At the origin, each cell is peeled back a
+ * different number of layers, so we handle those cells one at a time.
+ */
+void
+relay_crypt_cells(relay_crypt_item_t *items, int n_items)
+{
+  /* What's left to do for each item.  Static, like the batch in
+   * circuit_receive_relay_cells(). */
+  static enum {
+    ITEM_DONE, ITEM_CRYPT, ITEM_CHECK
+  } todo[RELAY_CRYPT_MAX_CELLS];
+  char *payloads[RELAY_CRYPT_BATCH];
+  int batch_idx[RELAY_CRYPT_BATCH];
+  crypto_digest_t *digests[RELAY_CRYPT_BATCH];
+  const char *data[RELAY_CRYPT_BATCH], *expected[RELAY_CRYPT_BATCH];
+  char received[RELAY_CRYPT_BATCH][4];
+  int matched[RELAY_CRYPT_BATCH];
+  int i, j, k, n_batch, n_pending = 0;
+
+  tor_assert(items || n_items == 0);
+  tor_assert(n_items <= RELAY_CRYPT_MAX_CELLS);
+
+  for (i = 0; i < n_items; ++i) {
+    relay_crypt_item_t *item = &items[i];
+    tor_assert(item->circ);
+    tor_assert(item->cell);
+    tor_assert(item->cell_direction == CELL_DIRECTION_IN ||
+               item->cell_direction == CELL_DIRECTION_OUT);
+    item->layer_hint = NULL;
+    item->recognized = 0;
+    item->result = 0;
+    if (CIRCUIT_IS_ORIGIN(item->circ)) {
+      item->result = relay_crypt(item->circ, item->cell,
+                                 item->cell_direction, &item->layer_hint,
+                                 &item->recognized);
+      todo[i] = ITEM_DONE;
+    } else {
+      todo[i] = ITEM_CRYPT;
+    }
+  }
+
+  /* Crypt each cell, in groups that share a cipher.  Taking the earliest
+   * cell still to do each time keeps every cipher's cells in order. */
+  for (i = 0; i < n_items; ++i) {
+    crypto_cipher_t *cipher;
+    if (todo[i] != ITEM_CRYPT)
+      continue;
+    cipher = relay_crypt_item_cipher(&items[i]);
+    n_batch = 0;
+    for (j = i; j < n_items && n_batch < RELAY_CRYPT_BATCH; ++j) {
+      if (todo[j] != ITEM_CRYPT ||
+          relay_crypt_item_cipher(&items[j]) != cipher)
+        continue;
+      batch_idx[n_batch] = j;
+      payloads[n_batch++] = (char*) items[j].cell->payload;
+    }
+    if (crypto_cipher_crypt_inplace_multi(cipher, payloads,
+                                          CELL_PAYLOAD_SIZE, n_batch) < 0) {
+      log_warn(LD_BUG,"Error during relay encryption");
+      for (k = 0; k < n_batch; ++k) {
+        items[batch_idx[k]].result = -1;
+        todo[batch_idx[k]] = ITEM_DONE;
+      }
+      continue;
+    }
+    for (k = 0; k < n_batch; ++k) {
+      relay_crypt_item_t *item = &items[batch_idx[k]];
+      if (item->cell_direction == CELL_DIRECTION_OUT &&
+          get_uint16(item->cell->payload + RELAY_RECOGNIZED_OFFSET) == 0) {
+        /* it's possibly recognized. have to check digest to be sure. */
+        todo[batch_idx[k]] = ITEM_CHECK;
+        ++n_pending;
+      } else {
+        todo[batch_idx[k]] = ITEM_DONE;
       }
     }
   }
-  return 0;
+
+  /* Check the digests of the possibly recognized cells, at most one per
+   * circuit in each round. */
+  while (n_pending) {
+    n_batch = 0;
+    for (i = 0; i < n_items && n_batch < RELAY_CRYPT_BATCH; ++i) {
+      crypto_digest_t *digest;
+      uint8_t *payload;
+      if (todo[i] != ITEM_CHECK)
+        continue;
+      digest = TO_OR_CIRCUIT(items[i].circ)->n_digest;
+      for (k = 0; k < n_batch; ++k) {
+        if (digests[k] == digest)
+          break;
+      }
+      if (k < n_batch)
+        continue; /* This circuit's earlier cell goes first. */
+      payload = items[i].cell->payload;
+      memcpy(received[n_batch], payload + RELAY_INTEGRITY_OFFSET, 4);
+      memset(payload + RELAY_INTEGRITY_OFFSET, 0, 4);
+      batch_idx[n_batch] = i;
+      digests[n_batch] = digest;
+      data[n_batch] = (const char*) payload;
+      expected[n_batch] = received[n_batch];
+      ++n_batch;
+    }
+    crypto_digest_check_multi(digests, data, CELL_PAYLOAD_SIZE,
+                              expected, 4, matched, n_batch);
+    for (k = 0; k < n_batch; ++k) {
+      relay_crypt_item_t *item = &items[batch_idx[k]];
+      if (matched[k]) {
+        item->recognized = 1;
+      } else {
+        /* restore the relay header */
+        memcpy(item->cell->payload + RELAY_INTEGRITY_OFFSET, received[k], 4);
+      }
+      todo[batch_idx[k]] = ITEM_DONE;
+      --n_pending;
+    }
+  }
 }
 
 /** Package a relay cell from an edge:
@@ -405,20 +676,22 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
       return 0; /* just drop it */
     }
 
-    relay_set_digest(layer_hint->f_digest, cell);
-
     thishop = layer_hint;
+    log_debug(LD_OR,"crypting a layer of the relay cell.");
+    if (relay_encrypt_and_set_digest(thishop->f_crypto, thishop->f_digest,
+                                     cell) < 0) {
+      return -1;
+    }
     /* moving from farthest to nearest hop */
-    do {
+    while (thishop != TO_ORIGIN_CIRCUIT(circ)->cpath) {
+      thishop = thishop->prev;
       tor_assert(thishop);
       /* XXXX RD This is a bug, right? */
       log_debug(LD_OR,"crypting a layer of the relay cell.");
       if (relay_crypt_one_payload(thishop->f_crypto, cell->payload, 1) < 0) {
         return -1;
       }
-
-      thishop = thishop->prev;
-    } while (thishop != TO_ORIGIN_CIRCUIT(circ)->cpath->prev);
+    }
 
   } else { /* incoming cell */
     or_circuit_t *or_circ;
@@ -431,8 +704,8 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
     }
     or_circ = TO_OR_CIRCUIT(circ);
     chan = or_circ->p_chan;
-    relay_set_digest(or_circ->p_digest, cell);
-    if (relay_crypt_one_payload(or_circ->p_crypto, cell->payload, 1) < 0)
+    if (relay_encrypt_and_set_digest(or_circ->p_crypto, or_circ->p_digest,
+                                     cell) < 0)
       return -1;
   }
   ++stats_n_relay_cells_relayed;
@@ -471,17 +744,28 @@ relay_lookup_conn(circuit_t *circ, cell_t *cell,
       }
     }
   } else {
-    for (tmpconn = TO_OR_CIRCUIT(circ)->n_streams; tmpconn;
-         tmpconn=tmpconn->next_stream) {
-      if (rh.stream_id == tmpconn->stream_id &&
-          !tmpconn->base_.marked_for_close) {
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    if (or_circuit_find_n_stream(or_circ, rh.stream_id, &tmpconn)) {
+      /* The index says that at most one stream on n_streams has this ID. */
+      if (tmpconn && !tmpconn->base_.marked_for_close) {
         log_debug(LD_EXIT,"found conn for stream %d.", rh.stream_id);
         if (cell_direction == CELL_DIRECTION_OUT ||
             connection_edge_is_rendezvous_stream(tmpconn))
           return tmpconn;
       }
+    } else {
+      for (tmpconn = or_circ->n_streams; tmpconn;
+           tmpconn=tmpconn->next_stream) {
+        if (rh.stream_id == tmpconn->stream_id &&
+            !tmpconn->base_.marked_for_close) {
+          log_debug(LD_EXIT,"found conn for stream %d.", rh.stream_id);
+          if (cell_direction == CELL_DIRECTION_OUT ||
+              connection_edge_is_rendezvous_stream(tmpconn))
+            return tmpconn;
+        }
+      }
     }
-    for (tmpconn = TO_OR_CIRCUIT(circ)->resolving_streams; tmpconn;
+    for (tmpconn = or_circ->resolving_streams; tmpconn;
          tmpconn=tmpconn->next_stream) {
       if (rh.stream_id == tmpconn->stream_id &&
           !tmpconn->base_.marked_for_close) {
@@ -2246,9 +2530,50 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
 #define assert_cmux_ok_paranoid(chan)
 #endif
 
-/** The total number of cells we have allocated. */
+/** The total number of cells we have allocated, whether on their own or as
+ * part of a cell_chunk_t. */
 static size_t total_cells_allocated = 0;
 
+/** The number of cells we have allocated on their own, outside any
+ * cell_chunk_t. */
+static size_t total_loose_cells_allocated = 0;
+
+/** The total number of bytes we have allocated for cell_chunk_t objects,
+ * including the ones on the freelists. */
+static size_t total_cell_chunk_bytes = 0;
+
+/** A freelist of cell chunks that all have the same capacity. */
+typedef struct cell_chunk_freelist_t {
+  int capacity; /**< How many cells do the chunks on this freelist hold? */
+  int max_length; /**< Never allow more than this number of chunks in the
+                   * freelist. */
+  int slack; /**< When trimming the freelist, leave this number of extra
+              * chunks beyond lowest_length.*/
+  int cur_length; /**< How many chunks on the freelist now? */
+  int lowest_length; /**< What's the smallest value of cur_length since the
+                      * last time we cleaned this freelist? */
+  uint64_t n_alloc; /**< How many chunks have we had to malloc? */
+  uint64_t n_hit; /**< How many chunks have we taken from the freelist? */
+  cell_chunk_t *head; /**< First chunk on the freelist. */
+} cell_chunk_freelist_t;
+
+/** Macro to help define freelists. */
+#define FL(c,m,s) { c, m, s, 0, 0, 0, 0, NULL }
+
+/** Static array of freelists, one for each chunk capacity, sorted by
+ * capacity.  Every chunk we allocate has one of these capacities, so a
+ * queue that drains and refills reuses its chunks instead of going back to
+ * malloc.  The lengths keep each freelist under about half a megabyte. */
+static cell_chunk_freelist_t cell_chunk_freelists[] = {
+  FL(1, 256, 16), FL(2, 256, 16), FL(4, 128, 8), FL(8, 64, 8),
+  FL(16, 64, 4), FL(32, 32, 4), FL(64, 16, 2),
+};
+#undef FL
+
+/** Smallest and largest number of cells to put in a new cell_chunk_t. */
+#define CELL_CHUNK_MIN_CELLS 1
+#define CELL_CHUNK_MAX_CELLS 64
+
 #ifdef ENABLE_MEMPOOLS
 /** A memory pool to allocate packed_cell_t objects. */
 static mp_pool_t *cell_pool = NULL;
@@ -2304,15 +2629,114 @@ static INLINE void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
   --total_cells_allocated;
+  --total_loose_cells_allocated;
   relay_free_cell(cell);
 }
 
-/** Allocate and return a new packed_cell_t. */
-STATIC packed_cell_t *
+/** Allocate and return a new packed_cell_t, not part of any cell queue. */
+packed_cell_t *
 packed_cell_new(void)
 {
+  packed_cell_t *cell;
   ++total_cells_allocated;
-  return relay_alloc_cell();
+  ++total_loose_cells_allocated;
+  cell = relay_alloc_cell();
+  cell->chunk = NULL;
+  return cell;
+}
+
+/** Return the freelist for chunks that hold <b>capacity</b> cells.
+ * <b>capacity</b> must be a power of two between CELL_CHUNK_MIN_CELLS and
+ * CELL_CHUNK_MAX_CELLS. */
+static INLINE cell_chunk_freelist_t *
+cell_chunk_get_freelist(int capacity)
+{
+  int i = tor_log2(capacity);
+  tor_assert(i < (int)(ARRAY_LENGTH(cell_chunk_freelists)));
+  tor_assert(cell_chunk_freelists[i].capacity == capacity);
+  return &cell_chunk_freelists[i];
+}
+
+/** Return a new cell_chunk_t with room for <b>capacity</b> cells, from the
+ * freelist if we can, holding a reference for the queue that will contain
+ * it. */
+static cell_chunk_t *
+cell_chunk_new(int capacity)
+{
+  cell_chunk_freelist_t *freelist = cell_chunk_get_freelist(capacity);
+  cell_chunk_t *chunk;
+  if (freelist->head) {
+    chunk = freelist->head;
+    freelist->head = chunk->next;
+    if (--freelist->cur_length < freelist->lowest_length)
+      freelist->lowest_length = freelist->cur_length;
+    ++freelist->n_hit;
+  } else {
+    size_t sz = CELL_CHUNK_ALLOC_SIZE(capacity);
+    chunk = tor_malloc(sz);
+    total_cell_chunk_bytes += sz;
+    ++freelist->n_alloc;
+  }
+  chunk->next = NULL;
+  chunk->capacity = capacity;
+  chunk->first = chunk->n_queued = 0;
+  chunk->refcnt = 1;
+  return chunk;
+}
+
+/** Release one reference to <b>chunk</b>.  If that was the last one, put
+ * the chunk on its freelist, or free it if the freelist is full. */
+static void
+cell_chunk_decref(cell_chunk_t *chunk)
+{
+  cell_chunk_freelist_t *freelist;
+  tor_assert(chunk->refcnt > 0);
+  if (--chunk->refcnt)
+    return;
+  freelist = cell_chunk_get_freelist(chunk->capacity);
+  if (freelist->cur_length < freelist->max_length) {
+    chunk->next = freelist->head;
+    freelist->head = chunk;
+    ++freelist->cur_length;
+  } else {
+    tor_assert(total_cell_chunk_bytes >=
+               CELL_CHUNK_ALLOC_SIZE(chunk->capacity));
+    total_cell_chunk_bytes -= CELL_CHUNK_ALLOC_SIZE(chunk->capacity);
+    tor_free(chunk);
+  }
+}
+
+/** Free the chunks on the cell chunk freelists that we haven't needed since
+ * the last time we were called, keeping a little slack; or all of them, if
+ * <b>free_all</b> is true.  Return the number of bytes freed. */
+size_t
+cell_chunk_shrink_freelists(int free_all)
+{
+  size_t total_freed = 0;
+  int i;
+  for (i = 0; i < (int)(ARRAY_LENGTH(cell_chunk_freelists)); ++i) {
+    cell_chunk_freelist_t *freelist = &cell_chunk_freelists[i];
+    int n_to_keep = free_all ? 0 :
+      MIN(freelist->cur_length,
+          freelist->cur_length - freelist->lowest_length + freelist->slack);
+    cell_chunk_t **chp = &freelist->head, *chunk;
+    int n;
+    for (n = 0; n < n_to_keep; ++n)
+      chp = &(*chp)->next;
+    chunk = *chp;
+    *chp = NULL;
+    while (chunk) {
+      cell_chunk_t *next = chunk->next;
+      size_t sz = CELL_CHUNK_ALLOC_SIZE(chunk->capacity);
+      tor_assert(total_cell_chunk_bytes >= sz);
+      total_cell_chunk_bytes -= sz;
+      total_freed += sz;
+      tor_free(chunk);
+      chunk = next;
+    }
+    freelist->cur_length = freelist->lowest_length = n_to_keep;
+  }
+  return total_freed;
 }
 
 /** Return a packed cell used outside by channel_t lower layer */
@@ -2321,7 +2745,12 @@ packed_cell_free(packed_cell_t *cell)
 {
   if (!cell)
     return;
-  packed_cell_free_unchecked(cell);
+  if (cell->chunk) {
+    --total_cells_allocated;
+    cell_chunk_decref(cell->chunk);
+  } else {
+    packed_cell_free_unchecked(cell);
+  }
 }
 
 /** Log current statistics for cell pool allocation at log level
@@ -2339,28 +2768,67 @@ dump_cell_pool_usage(int severity)
   }
   SMARTLIST_FOREACH_END(c);
   tor_log(severity, LD_MM,
-          "%d cells allocated on %d circuits. %d cells leaked.",
-          n_cells, n_circs, (int)total_cells_allocated - n_cells);
+          "%d cells allocated on %d circuits, using "U64_FORMAT" bytes of "
+          "cell chunks. %d cells leaked.",
+          n_cells, n_circs, U64_PRINTF_ARG(total_cell_chunk_bytes),
+          (int)total_cells_allocated - n_cells);
+  {
+    int i;
+    for (i = 0; i < (int)(ARRAY_LENGTH(cell_chunk_freelists)); ++i) {
+      const cell_chunk_freelist_t *freelist = &cell_chunk_freelists[i];
+      tor_log(severity, LD_MM,
+              "  %d chunks of %d cells on freelist; "U64_FORMAT" allocated, "
+              U64_FORMAT" reused.",
+              freelist->cur_length, freelist->capacity,
+              U64_PRINTF_ARG(freelist->n_alloc),
+              U64_PRINTF_ARG(freelist->n_hit));
+    }
+  }
 #ifdef ENABLE_MEMPOOLS
   mp_pool_log_status(cell_pool, severity);
 #endif
 }
 
-/** Allocate a new copy of packed <b>cell</b>. */
-static INLINE packed_cell_t *
-packed_cell_copy(const cell_t *cell, int wide_circ_ids)
+/** Add a new cell at the end of <b>queue</b>, and return a pointer to it so
+ * that the caller can fill it in. */
+static packed_cell_t *
+cell_queue_append_new(cell_queue_t *queue)
 {
-  packed_cell_t *c = packed_cell_new();
-  cell_pack(c, cell, wide_circ_ids);
-  return c;
+  cell_chunk_t *chunk = queue->tail;
+  packed_cell_t *cell;
+
+  if (!chunk || chunk->first + chunk->n_queued == chunk->capacity) {
+    /* Make the new chunk about as big as the queue already is, so that
+     * deep queues use a few big chunks and shallow ones don't waste space.
+     * Round up to a power of two, so that it can go on a freelist. */
+    int capacity = MIN(CELL_CHUNK_MAX_CELLS,
+                       MAX(CELL_CHUNK_MIN_CELLS, queue->n));
+    capacity = 1 << tor_log2(capacity * 2 - 1);
+    chunk = cell_chunk_new(capacity);
+    if (queue->tail)
+      queue->tail->next = chunk;
+    else
+      queue->head = chunk;
+    queue->tail = chunk;
+  }
+
+  cell = &chunk->cells[chunk->first + chunk->n_queued];
+  cell->chunk = chunk;
+  ++chunk->n_queued;
+  ++queue->n;
+  ++total_cells_allocated;
+  return cell;
 }
 
-/** Append <b>cell</b> to the end of <b>queue</b>. */
+/** Append <b>cell</b> to the end of <b>queue</b>.  The queue keeps a copy of
+ * the cell; <b>cell</b> itself is freed. */
 void
 cell_queue_append(cell_queue_t *queue, packed_cell_t *cell)
 {
-  TOR_SIMPLEQ_INSERT_TAIL(&queue->head, cell, next);
-  ++queue->n;
+  packed_cell_t *copy = cell_queue_append_new(queue);
+  memcpy(copy->body, cell->body, sizeof(copy->body));
+  copy->inserted_time = cell->inserted_time;
+  packed_cell_free(cell);
 }
 
 /** Append a newly allocated copy of <b>cell</b> to the end of the
@@ -2373,15 +2841,14 @@ cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
                               int wide_circ_ids, int use_stats)
 {
   struct timeval now;
-  packed_cell_t *copy = packed_cell_copy(cell, wide_circ_ids);
+  packed_cell_t *copy = cell_queue_append_new(queue);
   (void)circ;
   (void)exitward;
   (void)use_stats;
   tor_gettimeofday_cached_monotonic(&now);
 
+  cell_pack(copy, cell, wide_circ_ids);
   copy->inserted_time = (uint32_t)tv_to_msec(&now);
-
-  cell_queue_append(queue, copy);
 }
 
 /** Initialize <b>queue</b> as an empty cell queue. */
@@ -2389,32 +2856,55 @@ void
 cell_queue_init(cell_queue_t *queue)
 {
   memset(queue, 0, sizeof(cell_queue_t));
-  TOR_SIMPLEQ_INIT(&queue->head);
 }
 
 /** Remove and free every cell in <b>queue</b>. */
 void
 cell_queue_clear(cell_queue_t *queue)
 {
-  packed_cell_t *cell;
-  while ((cell = TOR_SIMPLEQ_FIRST(&queue->head))) {
-    TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
-    packed_cell_free_unchecked(cell);
-  }
-  TOR_SIMPLEQ_INIT(&queue->head);
+  cell_chunk_t *chunk, *next;
+  for (chunk = queue->head; chunk; chunk = next) {
+    next = chunk->next;
+    chunk->next = NULL;
+    total_cells_allocated -= chunk->n_queued;
+    chunk->n_queued = 0;
+    cell_chunk_decref(chunk);
+  }
+  queue->head = queue->tail = NULL;
   queue->n = 0;
 }
 
+/** Return the cell at the head of <b>queue</b> without removing it, or NULL
+ * if <b>queue</b> is empty. */
+packed_cell_t *
+cell_queue_first(const cell_queue_t *queue)
+{
+  cell_chunk_t *chunk = queue->head;
+  return chunk ? &chunk->cells[chunk->first] : NULL;
+}
+
 /** Extract and return the cell at the head of <b>queue</b>; return NULL if
- * <b>queue</b> is empty. */
+ * <b>queue</b> is empty.  The caller must free the cell with
+ * packed_cell_free(). */
 STATIC packed_cell_t *
 cell_queue_pop(cell_queue_t *queue)
 {
-  packed_cell_t *cell = TOR_SIMPLEQ_FIRST(&queue->head);
-  if (!cell)
+  cell_chunk_t *chunk = queue->head;
+  packed_cell_t *cell;
+  if (!chunk)
     return NULL;
-  TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
+
+  cell = &chunk->cells[chunk->first++];
+  ++chunk->refcnt; /* for the cell we're returning */
   --queue->n;
+  if (--chunk->n_queued == 0) {
+    /* Nothing left in this chunk; it leaves the queue. */
+    queue->head = chunk->next;
+    if (!queue->head)
+      queue->tail = NULL;
+    chunk->next = NULL;
+    cell_chunk_decref(chunk);
+  }
   return cell;
 }
 
@@ -2426,11 +2916,26 @@ packed_cell_mem_cost(void)
   return RELAY_CELL_MEM_COST;
 }
 
-/** DOCDOC */
+/** Return the number of bytes allocated for the chunks that hold the cells
+ * in <b>queue</b>. */
+size_t
+cell_queue_get_allocation(const cell_queue_t *queue)
+{
+  const cell_chunk_t *chunk;
+  size_t total = 0;
+  for (chunk = queue->head; chunk; chunk = chunk->next)
+    total += CELL_CHUNK_ALLOC_SIZE(chunk->capacity);
+  return total;
+}
+
+/** Return the number of bytes allocated for cells: all the cell chunks,
+ * whether in a queue, held by popped cells, or on a freelist, plus the
+ * cells allocated on their own. */
 STATIC size_t
 cell_queues_get_total_allocation(void)
 {
-  return total_cells_allocated * packed_cell_mem_cost();
+  return total_cell_chunk_bytes +
+    total_loose_cells_allocated * packed_cell_mem_cost();
 }
 
 /** Check whether we've got too much space used for cells.  If so,
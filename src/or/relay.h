@@ -47,15 +47,40 @@ void init_cell_pool(void);
 void free_cell_pool(void);
 void clean_cell_pool(void);
 #endif /* ENABLE_MEMPOOLS */
+size_t cell_chunk_shrink_freelists(int free_all);
 void dump_cell_pool_usage(int severity);
 size_t packed_cell_mem_cost(void);
 
 /* For channeltls.c */
+packed_cell_t *packed_cell_new(void);
 void packed_cell_free(packed_cell_t *cell);
 
 void cell_queue_init(cell_queue_t *queue);
 void cell_queue_clear(cell_queue_t *queue);
 void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
+packed_cell_t *cell_queue_first(const cell_queue_t *queue);
+size_t cell_queue_get_allocation(const cell_queue_t *queue);
+
+/** Iterate over every cell in the cell_queue_t <b>queue</b>, from first to
+ * last, assigning each one in turn to a packed_cell_t pointer named
+ * <b>var</b>.  Must be closed with CELL_QUEUE_FOREACH_END(var).  The queue
+ * must not be modified during the loop, and "break" will not leave it. */
+#define CELL_QUEUE_FOREACH_BEGIN(queue, var)                            \
+  STMT_BEGIN                                                            \
+    cell_chunk_t *var ## _chunk;                                        \
+    int var ## _idx;                                                    \
+    packed_cell_t *var;                                                 \
+    for (var ## _chunk = (queue)->head; var ## _chunk;                  \
+         var ## _chunk = var ## _chunk->next) {                         \
+      for (var ## _idx = var ## _chunk->first;                          \
+           var ## _idx < var ## _chunk->first + var ## _chunk->n_queued; \
+           ++var ## _idx) {                                             \
+        var = &var ## _chunk->cells[var ## _idx];
+
+#define CELL_QUEUE_FOREACH_END(var)             \
+      }                                         \
+    }                                           \
+  STMT_END
 void cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
                                    int exitward, const cell_t *cell,
                                    int wide_circ_ids, int use_stats);
@@ -83,6 +108,29 @@ void stream_choice_seed_weak_rng(void);
 int relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
                 crypt_path_t **layer_hint, char *recognized);
 
+/** The largest number of cells that relay_crypt_cells() and
+ * circuit_receive_relay_cells() take at once. */
+#define RELAY_CRYPT_MAX_CELLS 64
+
+/** A relay cell for relay_crypt_cells() to crypt, and what it found. */
+typedef struct relay_crypt_item_t {
+  /** The circuit that the cell arrived on. */
+  circuit_t *circ;
+  /** The cell itself; crypted in place. */
+  cell_t *cell;
+  /** Which way the cell is going on <b>circ</b>. */
+  cell_direction_t cell_direction;
+  /** Set as relay_crypt() would set *layer_hint. */
+  crypt_path_t *layer_hint;
+  /** Set as relay_crypt() would set *recognized. */
+  char recognized;
+  /** Set to what relay_crypt() would have returned. */
+  int result;
+} relay_crypt_item_t;
+
+void relay_crypt_cells(relay_crypt_item_t *items, int n_items);
+void circuit_receive_relay_cells(relay_crypt_item_t *items, int n_items);
+
 circid_t packed_cell_get_circid(const packed_cell_t *cell, int wide_circ_ids);
 
 #ifdef RELAY_PRIVATE
@@ -100,7 +148,11 @@ STATIC int resolved_cell_parse(const cell_t *cell, const relay_header_t *rh,
 STATIC int connection_edge_process_resolved_cell(edge_connection_t *conn,
                                                  const cell_t *cell,
                                                  const relay_header_t *rh);
-STATIC packed_cell_t *packed_cell_new(void);
+/** Return the number of bytes to allocate for a cell_chunk_t that holds
+ * <b>n</b> cells. */
+#define CELL_CHUNK_ALLOC_SIZE(n) \
+  (STRUCT_OFFSET(cell_chunk_t, cells) + (n) * sizeof(packed_cell_t))
+
 STATIC packed_cell_t *cell_queue_pop(cell_queue_t *queue);
 STATIC size_t cell_queues_get_total_allocation(void);
 STATIC int cell_queues_check_size(void);
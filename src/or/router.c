@@ -671,6 +671,8 @@ router_initialize_tls_context(void)
     else if (!strcasecmp(options->TLSECGroup, "P224"))
       flags |= TOR_TLS_CTX_USE_ECDHE_P224;
   }
+  if (options->UseKernelTLS)
+    flags |= TOR_TLS_CTX_USE_KERNEL_TLS;
   if (!lifetime) { /* we should guess a good ssl cert lifetime */
 
     /* choose between 5 and 365 days, and round to the day */
@@ -1570,6 +1572,8 @@ router_get_advertised_dir_port(const or_options_t *options, uint16_t dirport)
 
 /** My routerinfo. */
 static routerinfo_t *desc_routerinfo = NULL;
+/** The exit policy of desc_routerinfo, compiled. */
+static compiled_addr_policy_t *desc_exit_policy_compiled = NULL;
 /** My extrainfo */
 static extrainfo_t *desc_extrainfo = NULL;
 /** Why did we most recently decide to regenerate our descriptor?  Used to
@@ -1650,8 +1654,8 @@ router_compare_to_my_exit_policy(const tor_addr_t *addr, uint16_t port)
    * at desc_routerinfio->ipv6_exit_policy, since that's a port summary. */
   if ((tor_addr_family(addr) == AF_INET ||
        tor_addr_family(addr) == AF_INET6)) {
-    return compare_tor_addr_to_addr_policy(addr, port,
-                    desc_routerinfo->exit_policy) != ADDR_POLICY_ACCEPTED;
+    return compare_tor_addr_to_compiled_policy(addr, port,
+                    desc_exit_policy_compiled) != ADDR_POLICY_ACCEPTED;
 #if 0
   } else if (tor_addr_family(addr) == AF_INET6) {
     return get_options()->IPv6Exit &&
@@ -2011,8 +2015,10 @@ router_rebuild_descriptor(int force)
     tor_assert(! routerinfo_incompatible_with_extrainfo(ri, ei, NULL, NULL));
   }
 
+  compiled_addr_policy_free(desc_exit_policy_compiled);
   routerinfo_free(desc_routerinfo);
   desc_routerinfo = ri;
+  desc_exit_policy_compiled = addr_policy_compile(ri->exit_policy);
   extrainfo_free(desc_extrainfo);
   desc_extrainfo = ei;
 
@@ -3087,6 +3093,7 @@ router_free_all(void)
   crypto_pk_free(server_identitykey);
   crypto_pk_free(client_identitykey);
   tor_mutex_free(key_lock);
+  compiled_addr_policy_free(desc_exit_policy_compiled);
   routerinfo_free(desc_routerinfo);
   extrainfo_free(desc_extrainfo);
   crypto_pk_free(authority_signing_key);
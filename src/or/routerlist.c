@@ -1733,6 +1733,25 @@ routerlist_add_node_and_family(smartlist_t *sl, const routerinfo_t *router)
   nodelist_add_node_and_family(sl, node);
 }
 
+/** Return true iff <b>node</b> is suitable for a circuit, given the
+ * requirements that router_add_running_nodes_to_smartlist() takes. */
+static int
+node_is_running_candidate(const node_t *node, int allow_invalid,
+                          int need_uptime, int need_capacity,
+                          int need_guard, int need_desc)
+{
+  if (!node->is_running ||
+      (!node->is_valid && !allow_invalid))
+    return 0;
+  if (need_desc && !(node->ri || (node->rs && node->md)))
+    return 0;
+  if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
+    return 0;
+  if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
+    return 0;
+  return 1;
+}
+
 /** Add every suitable node from our nodelist to <b>sl</b>, so that
  * we can pick a node for a circuit.
  */
@@ -1742,17 +1761,9 @@ router_add_running_nodes_to_smartlist(smartlist_t *sl, int allow_invalid,
                                       int need_guard, int need_desc)
 { /* XXXX MOVE */
   SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
-    if (!node->is_running ||
-        (!node->is_valid && !allow_invalid))
-      continue;
-    if (need_desc && !(node->ri || (node->rs && node->md)))
-      continue;
-    if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
-      continue;
-    if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
-      continue;
-
-    smartlist_add(sl, (void *)node);
+    if (node_is_running_candidate(node, allow_invalid, need_uptime,
+                                  need_capacity, need_guard, need_desc))
+      smartlist_add(sl, (void *)node);
   } SMARTLIST_FOREACH_END(node);
 }
 
@@ -1886,6 +1897,129 @@ choose_array_element_by_weight(const u64_dbl_t *entries, int n_entries)
   return i_chosen;
 }
 
+/** How many bits of precision do the thresholds in an alias_table_t have? */
+#define ALIAS_TABLE_PROB_BITS 40
+/** The threshold for a column of an alias_table_t that never defers to its
+ * alias. */
+#define ALIAS_TABLE_PROB_ONE (U64_LITERAL(1) << ALIAS_TABLE_PROB_BITS)
+/** The most entries that an alias_table_t can hold without a random value
+ * for it overflowing. */
+#define ALIAS_TABLE_MAX_ENTRIES (1<<22)
+
+/** Build and return an alias table for picking among the
+ * <b>n_entries</b>-element array <b>entries</b>, choosing each element with
+ * the same probability as choose_array_element_by_weight() would.  Return
+ * NULL if there are no entries.
+ *
+ * We use Vose's version of Walker's alias method: the table has a column
+ * for each entry, and each column holds the chance of picking that entry
+ * itself, and the one other entry (its alias) that we pick otherwise.
+ * Building the table takes time linear in <b>n_entries</b>; after that, a
+ * choice takes constant time.
+ */
+STATIC alias_table_t *
+alias_table_new(const u64_dbl_t *entries, int n_entries)
+{
+  alias_table_t *table;
+  double *prob;
+  int *small, *large;
+  int n_small = 0, n_large = 0, i;
+  uint64_t total = 0;
+
+  if (n_entries < 1)
+    return NULL;
+  tor_assert(n_entries <= ALIAS_TABLE_MAX_ENTRIES);
+
+  table = tor_malloc_zero(sizeof(alias_table_t));
+  table->n = n_entries;
+  table->threshold = tor_calloc(n_entries, sizeof(uint64_t));
+  table->alias = tor_calloc(n_entries, sizeof(int));
+
+  for (i = 0; i < n_entries; ++i)
+    total += entries[i].u64;
+  tor_assert(total < INT64_MAX);
+
+  if (total == 0) {
+    /* Choose uniformly. */
+    for (i = 0; i < n_entries; ++i) {
+      table->threshold[i] = ALIAS_TABLE_PROB_ONE;
+      table->alias[i] = i;
+    }
+    return table;
+  }
+
+  /* Scale each entry so that their average is 1, and sort them into those
+   * that can't fill a column of their own, and those that can. */
+  prob = tor_calloc(n_entries, sizeof(double));
+  small = tor_calloc(n_entries, sizeof(int));
+  large = tor_calloc(n_entries, sizeof(int));
+  for (i = 0; i < n_entries; ++i) {
+    prob[i] = ((double)entries[i].u64) * n_entries / (double)total;
+    if (prob[i] < 1.0)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+
+  /* Fill each small entry's column with part of a large entry. */
+  while (n_small && n_large) {
+    const int s = small[--n_small];
+    const int l = large[--n_large];
+    table->threshold[s] = (uint64_t) (prob[s] * ALIAS_TABLE_PROB_ONE);
+    table->alias[s] = l;
+    prob[l] = (prob[l] + prob[s]) - 1.0;
+    if (prob[l] < 1.0)
+      small[n_small++] = l;
+    else
+      large[n_large++] = l;
+  }
+  /* Whatever is left fills its own column, give or take rounding. */
+  while (n_large) {
+    const int l = large[--n_large];
+    table->threshold[l] = ALIAS_TABLE_PROB_ONE;
+    table->alias[l] = l;
+  }
+  while (n_small) {
+    const int s = small[--n_small];
+    table->threshold[s] = ALIAS_TABLE_PROB_ONE;
+    table->alias[s] = s;
+  }
+
+  tor_free(prob);
+  tor_free(small);
+  tor_free(large);
+  return table;
+}
+
+/** Release all storage held by <b>table</b>. */
+STATIC void
+alias_table_free(alias_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->threshold);
+  tor_free(table->alias);
+  tor_free(table);
+}
+
+/** Pick a random entry from <b>table</b>, as alias_table_new() describes,
+ * and return its index.  Like choose_array_element_by_weight(), this takes
+ * the same amount of time whichever entry it picks. */
+STATIC int
+alias_table_choose(const alias_table_t *table)
+{
+  uint64_t r;
+  int column;
+
+  tor_assert(table);
+  tor_assert(table->n > 0);
+
+  r = crypto_rand_uint64(((uint64_t)table->n) << ALIAS_TABLE_PROB_BITS);
+  column = (int) (r >> ALIAS_TABLE_PROB_BITS);
+  r &= ALIAS_TABLE_PROB_ONE - 1;
+  return (r < table->threshold[column]) ? column : table->alias[column];
+}
+
 /** When weighting bridges, enforce these values as lower and upper
  * bound for believable bandwidth, because there is no way for us
  * to verify a bridge's bandwidth currently. */
@@ -2155,6 +2289,165 @@ node_sl_choose_by_bandwidth(const smartlist_t *sl,
   return smartlist_choose_node_by_bandwidth_weights(sl, rule);
 }
 
+/** The nodes that router_choose_random_node() may pick for one position and
+ * set of flags, and an alias table for picking among them by their weighted
+ * bandwidths. */
+typedef struct node_bw_table_t {
+  /** The nodes in the table, in the same order as the table's entries. */
+  smartlist_t *nodes;
+  /** The alias table, or NULL if there are no nodes. */
+  alias_table_t *alias;
+} node_bw_table_t;
+
+/** Bit in the index of a node_bw_table_t for CRN_NEED_UPTIME. */
+#define BW_TABLE_NEED_UPTIME  (1<<0)
+/** Bit in the index of a node_bw_table_t for CRN_NEED_CAPACITY. */
+#define BW_TABLE_NEED_CAPACITY (1<<1)
+/** Bit in the index of a node_bw_table_t for CRN_NEED_GUARD. */
+#define BW_TABLE_NEED_GUARD (1<<2)
+/** How many combinations of the BW_TABLE_* flags are there? */
+#define BW_TABLE_N_FLAG_SETS (1<<3)
+
+/** The node_bw_table_t for each weighting rule and combination of flags that
+ * router_choose_random_node() has needed since we last set a consensus, or
+ * NULL for those that it hasn't needed yet. */
+static node_bw_table_t *node_bw_tables[WEIGHT_FOR_DIR+1][BW_TABLE_N_FLAG_SETS];
+
+/** How many nodes will we draw from a node_bw_table_t, looking for one that
+ * we may use, before we fall back to looking at every node? */
+#define BW_TABLE_MAX_TRIES 32
+
+/** Release all storage held by <b>table</b>. */
+static void
+node_bw_table_free(node_bw_table_t *table)
+{
+  if (!table)
+    return;
+  smartlist_free(table->nodes);
+  alias_table_free(table->alias);
+  tor_free(table);
+}
+
+/** Discard every node_bw_table_t, because the consensus that they came from
+ * is going away.  We'll build new ones as we need them. */
+void
+router_clear_bw_tables(void)
+{
+  int rule, flags;
+  for (rule = 0; rule <= WEIGHT_FOR_DIR; ++rule) {
+    for (flags = 0; flags < BW_TABLE_N_FLAG_SETS; ++flags) {
+      node_bw_table_free(node_bw_tables[rule][flags]);
+      node_bw_tables[rule][flags] = NULL;
+    }
+  }
+}
+
+/** Build and return a node_bw_table_t holding every node in the consensus
+ * that is valid and has the flags in <b>flags</b> (a combination of
+ * BW_TABLE_*), weighted by <b>rule</b>.
+ *
+ * Nothing that decides whether a node is in the table, or its weight,
+ * changes until the next consensus -- unless we are an authority, which
+ * sets those flags itself.  Anything that can change sooner, such as
+ * whether the node is running or has a descriptor, is left for the caller
+ * to check on the node it picks. */
+static node_bw_table_t *
+node_bw_table_new(bandwidth_weight_rule_t rule, int flags)
+{
+  node_bw_table_t *table = tor_malloc_zero(sizeof(node_bw_table_t));
+  u64_dbl_t *bandwidths = NULL;
+
+  table->nodes = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
+    if (!node->rs || !node->is_valid)
+      continue;
+    if (node_is_unreliable(node, (flags & BW_TABLE_NEED_UPTIME) != 0,
+                           (flags & BW_TABLE_NEED_CAPACITY) != 0,
+                           (flags & BW_TABLE_NEED_GUARD) != 0))
+      continue;
+    smartlist_add(table->nodes, (void *)node);
+  } SMARTLIST_FOREACH_END(node);
+
+  if (smartlist_len(table->nodes) &&
+      compute_weighted_bandwidths(table->nodes, rule, &bandwidths) == 0) {
+    scale_array_elements_to_u64(bandwidths, smartlist_len(table->nodes),
+                                NULL);
+    table->alias = alias_table_new(bandwidths, smartlist_len(table->nodes));
+    tor_free(bandwidths);
+  }
+
+  log_info(LD_CIRC, "Built a table of %d nodes for rule %s and flags %d.",
+           smartlist_len(table->nodes),
+           bandwidth_weight_rule_to_string(rule), flags);
+  return table;
+}
+
+/** Helper for router_choose_random_node(): try to pick a node the way it
+ * would, without looking at every node.  We draw nodes from a precomputed
+ * node_bw_table_t until we find one that router_choose_random_node() would
+ * have considered; since the table holds every node that it could consider,
+ * each such node is as likely to come up as it would be there.
+ *
+ * Return NULL if we can't use a table for these arguments, or if we don't
+ * find a usable node soon enough; the caller should then fall back to
+ * looking at every node. */
+static const node_t *
+router_choose_random_node_from_bw_table(bandwidth_weight_rule_t rule,
+                                        router_crn_flags_t crn_flags,
+                                        const smartlist_t *excludednodes,
+                                        const smartlist_t *excludedsmartlist,
+                                        const routerset_t *excludedset)
+{
+  const int need_uptime = (crn_flags & CRN_NEED_UPTIME) != 0;
+  const int need_capacity = (crn_flags & CRN_NEED_CAPACITY) != 0;
+  const int need_guard = (crn_flags & CRN_NEED_GUARD) != 0;
+  const int need_desc = (crn_flags & CRN_NEED_DESC) != 0;
+  node_bw_table_t *table;
+  int flags = 0, i;
+
+  /* Invalid nodes have no consensus flags that we could build a table
+   * from, and authorities change nodes' flags as they go. */
+  if ((crn_flags & CRN_ALLOW_INVALID) || authdir_mode_v3(get_options()))
+    return NULL;
+  if (!networkstatus_get_latest_consensus())
+    return NULL;
+
+  if (need_uptime)
+    flags |= BW_TABLE_NEED_UPTIME;
+  if (need_capacity)
+    flags |= BW_TABLE_NEED_CAPACITY;
+  if (need_guard)
+    flags |= BW_TABLE_NEED_GUARD;
+
+  table = node_bw_tables[rule][flags];
+  if (!table)
+    table = node_bw_tables[rule][flags] = node_bw_table_new(rule, flags);
+  if (!table->alias)
+    return NULL;
+
+  for (i = 0; i < BW_TABLE_MAX_TRIES; ++i) {
+    const node_t *node =
+      smartlist_get(table->nodes, alias_table_choose(table->alias));
+    if (!node_is_running_candidate(node, 0, need_uptime, need_capacity,
+                                   need_guard, need_desc))
+      continue;
+    if (get_options()->ExcludeSingleHopRelays &&
+        node_allows_single_hop_exits(node))
+      continue;
+    if (smartlist_contains(excludednodes, node))
+      continue;
+    if (excludedsmartlist && smartlist_contains(excludedsmartlist, node))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+    return node;
+  }
+
+  log_debug(LD_CIRC, "Found no usable node in %d tries; looking at every "
+            "node instead.", BW_TABLE_MAX_TRIES);
+  return NULL;
+}
+
 /** Return a random running node from the nodelist. Never
  * pick a node that is in
  * <b>excludedsmartlist</b>, or which matches <b>excludedset</b>,
@@ -2185,8 +2478,7 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   const int weight_for_exit = (flags & CRN_WEIGHT_AS_EXIT) != 0;
   const int need_desc = (flags & CRN_NEED_DESC) != 0;
 
-  smartlist_t *sl=smartlist_new(),
-    *excludednodes=smartlist_new();
+  smartlist_t *sl, *excludednodes=smartlist_new();
   const node_t *choice = NULL;
   const routerinfo_t *r;
   bandwidth_weight_rule_t rule;
@@ -2195,6 +2487,18 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   rule = weight_for_exit ? WEIGHT_FOR_EXIT :
     (need_guard ? WEIGHT_FOR_GUARD : WEIGHT_FOR_MID);
 
+  if ((r = routerlist_find_my_routerinfo()))
+    routerlist_add_node_and_family(excludednodes, r);
+
+  choice = router_choose_random_node_from_bw_table(rule, flags,
+                                                   excludednodes,
+                                                   excludedsmartlist,
+                                                   excludedset);
+  if (choice) {
+    smartlist_free(excludednodes);
+    return choice;
+  }
+
   /* Exclude relays that allow single hop exit circuits, if the user
    * wants to (such relays might be risky) */
   if (get_options()->ExcludeSingleHopRelays) {
@@ -2204,9 +2508,7 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
       });
   }
 
-  if ((r = routerlist_find_my_routerinfo()))
-    routerlist_add_node_and_family(excludednodes, r);
-
+  sl = smartlist_new();
   router_add_running_nodes_to_smartlist(sl, allow_invalid,
                                         need_uptime, need_capacity,
                                         need_guard, need_desc);
@@ -70,6 +70,7 @@ double frac_nodes_with_descriptors(const smartlist_t *sl,
 const node_t *router_choose_random_node(smartlist_t *excludedsmartlist,
                                         struct routerset_t *excludedset,
                                         router_crn_flags_t flags);
+void router_clear_bw_tables(void);
 
 int router_is_named(const routerinfo_t *router);
 int router_digest_is_trusted_dir_type(const char *digest,
@@ -224,6 +225,23 @@ STATIC int choose_array_element_by_weight(const u64_dbl_t *entries,
 STATIC void scale_array_elements_to_u64(u64_dbl_t *entries, int n_entries,
                                         uint64_t *total_out);
 
+/** A table for choosing among a fixed set of weighted elements in constant
+ * time; see alias_table_new(). */
+typedef struct alias_table_t {
+  /** How many elements (and columns) are there? */
+  int n;
+  /** For each column, how likely we are to choose that column's own element
+   * rather than its alias, out of ALIAS_TABLE_PROB_ONE. */
+  uint64_t *threshold;
+  /** For each column, the element that we choose otherwise. */
+  int *alias;
+} alias_table_t;
+
+STATIC alias_table_t *alias_table_new(const u64_dbl_t *entries,
+                                      int n_entries);
+STATIC void alias_table_free(alias_table_t *table);
+STATIC int alias_table_choose(const alias_table_t *table);
+
 MOCK_DECL(int, router_descriptor_is_older_than, (const routerinfo_t *router,
                                                  int seconds));
 MOCK_DECL(STATIC was_router_added_t, extrainfo_insert,
@@ -10,6 +10,8 @@
 
 #define TOR_CHANNEL_INTERNAL_ /* For channel_flush_some_cells() */
 #include "channel.h"
+#include "channeltls.h"
+#include "connection.h"
 
 #include "compat_libevent.h"
 #define SCHEDULER_PRIVATE_
@@ -21,6 +23,19 @@
 #include <event.h>
 #endif
 
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+#ifdef HAVE_LINUX_SOCKIOS_H
+#include <linux/sockios.h>
+#endif
+
+#if defined(TCP_INFO) && defined(SIOCOUTQ)
+/** Defined if we can ask the kernel about the state of TCP sockets, which
+ * the KIST scheduler needs. */
+#define HAVE_KIST_SUPPORT
+#endif
+
 /*
  * Scheduler high/low watermarks
  */
@@ -36,6 +51,31 @@ static uint32_t sched_q_high_water = 32768;
 
 static uint32_t sched_max_flush_cells = 16;
 
+/*
+ * Kernel-informed socket transport (KIST) scheduling: if enabled, ask the
+ * kernel how much each channel's socket can actually send before pulling
+ * cells out of its circuitmux, so that cells wait in the circuit queues
+ * (where circuitmux priority still applies) rather than in the kernel's
+ * socket buffers.
+ */
+
+static int sched_use_kist = 0;
+
+/*
+ * How long to wait before running the scheduler again when some channels
+ * are only waiting for room in their sockets.
+ */
+
+static uint32_t sched_kist_run_interval_msec = 10;
+
+/*
+ * How much data beyond the congestion window we let a socket queue, as a
+ * multiple of the congestion window; this keeps the kernel from running
+ * dry between scheduler runs.
+ */
+
+static double sched_kist_sock_buf_size_factor = 1.0;
+
 /*
  * Write scheduling works by keeping track of which channels can
  * accept cells, and have cells to write.  From the scheduler's perspective,
@@ -136,6 +176,14 @@ STATIC uint64_t queue_heuristic = 0;
 
 STATIC time_t queue_heuristic_timestamp = 0;
 
+/*
+ * Set by scheduler_run() if KIST left some channels pending because their
+ * sockets had no room; we'll retry them after sched_kist_run_interval_msec
+ * instead of right away.
+ */
+
+STATIC int kist_channels_blocked = 0;
+
 /* Scheduler static function declarations */
 
 static void scheduler_evt_callback(evutil_socket_t fd,
@@ -234,7 +282,17 @@ scheduler_evt_callback(evutil_socket_t fd, short events, void *arg)
   scheduler_run();
 
   /* Do we have more work to do? */
-  if (scheduler_more_work()) scheduler_retrigger();
+  if (scheduler_more_work()) {
+    if (kist_channels_blocked) {
+      /* Give the kernel a chance to drain the sockets first */
+      struct timeval tv;
+      tv.tv_sec = sched_kist_run_interval_msec / 1000;
+      tv.tv_usec = (sched_kist_run_interval_msec % 1000) * 1000;
+      event_add(run_sched_ev, &tv);
+    } else {
+      scheduler_retrigger();
+    }
+  }
 }
 
 /** Mark a channel as no longer ready to accept writes */
@@ -387,12 +445,15 @@ scheduler_run, (void))
 {
   int n_cells, n_chans_before, n_chans_after;
   uint64_t q_len_before, q_heur_before, q_len_after, q_heur_after;
+  int kist_cells, socket_full;
   ssize_t flushed, flushed_this_time;
   smartlist_t *to_readd = NULL;
   channel_t *chan = NULL;
 
   log_debug(LD_SCHED, "We have a chance to run the scheduler");
 
+  kist_channels_blocked = 0;
+
   if (scheduler_get_queue_heuristic() < sched_q_low_water) {
     n_chans_before = smartlist_len(channels_pending);
     q_len_before = channel_get_global_queue_estimate();
@@ -408,6 +469,15 @@ scheduler_run, (void))
 
       /* Figure out how many cells we can write */
       n_cells = channel_num_cells_writeable(chan);
+      socket_full = 0;
+      if (sched_use_kist) {
+        /* Don't write more than the socket can send right away */
+        kist_cells = scheduler_kist_cells_writeable(chan);
+        if (kist_cells >= 0 && kist_cells < n_cells) {
+          n_cells = kist_cells;
+          socket_full = 1;
+        }
+      }
       if (n_cells > 0) {
         log_debug(LD_SCHED,
                   "Scheduler saw pending channel " U64_FORMAT " at %p with "
@@ -437,10 +507,11 @@ scheduler_run, (void))
           /* The channel may still have some cells */
           if (channel_more_to_flush(chan)) {
           /* The channel goes to either pending or waiting_to_write */
-            if (channel_num_cells_writeable(chan) > 0) {
+            if (socket_full || channel_num_cells_writeable(chan) > 0) {
               /* Add it back to pending later */
               if (!to_readd) to_readd = smartlist_new();
               smartlist_add(to_readd, chan);
+              if (socket_full) kist_channels_blocked = 1;
               log_debug(LD_SCHED,
                         "Channel " U64_FORMAT " at %p "
                         "is still pending",
@@ -488,6 +559,18 @@ scheduler_run, (void))
                   U64_FORMAT " at %p",
                   (int)flushed, U64_PRINTF_ARG(chan->global_identifier),
                   chan);
+      } else if (socket_full) {
+        /*
+         * The channel could take more cells, but its socket is full; keep
+         * it pending, since nothing will tell us when the kernel drains it.
+         */
+        log_debug(LD_SCHED,
+                  "Scheduler saw pending channel " U64_FORMAT " at %p with "
+                  "a full socket",
+                  U64_PRINTF_ARG(chan->global_identifier), chan);
+        if (!to_readd) to_readd = smartlist_new();
+        smartlist_add(to_readd, chan);
+        kist_channels_blocked = 1;
       } else {
         log_info(LD_SCHED,
                  "Scheduler saw pending channel " U64_FORMAT " at %p with "
@@ -523,6 +606,95 @@ scheduler_run, (void))
   }
 }
 
+/**
+ * Ask the kernel how many more cells the socket under <b>chan</b> can take
+ * without them piling up in its send buffer: enough to fill the congestion
+ * window, plus sched_kist_sock_buf_size_factor congestion windows extra,
+ * less what's already in the socket and in the connection's outbuf.
+ * Return -1 if we can't tell, in which case the caller shouldn't limit
+ * <b>chan</b>.
+ */
+
+MOCK_IMPL(STATIC int,
+scheduler_kist_cells_writeable, (channel_t *chan))
+{
+#ifdef HAVE_KIST_SUPPORT
+  channel_tls_t *tlschan;
+  connection_t *conn;
+  struct tcp_info tcp;
+  socklen_t tcp_len = sizeof(tcp);
+  int outq = 0;
+  int64_t limit;
+
+  tor_assert(chan);
+
+  if (chan->magic != TLS_CHAN_MAGIC) return -1;
+  tlschan = BASE_CHAN_TO_TLS(chan);
+  if (!tlschan->conn) return -1;
+  conn = TO_CONN(tlschan->conn);
+  if (!SOCKET_OK(conn->s)) return -1;
+
+  memset(&tcp, 0, sizeof(tcp));
+  if (getsockopt(conn->s, SOL_TCP, TCP_INFO, (void *)&tcp, &tcp_len) < 0 ||
+      ioctl(conn->s, SIOCOUTQ, &outq) < 0) {
+    log_debug(LD_SCHED,
+              "Couldn't get socket info for channel " U64_FORMAT ": %s",
+              U64_PRINTF_ARG(chan->global_identifier),
+              tor_socket_strerror(tor_socket_errno(conn->s)));
+    return -1;
+  }
+
+  limit = (int64_t)((1.0 + sched_kist_sock_buf_size_factor) *
+                    tcp.tcpi_snd_cwnd * tcp.tcpi_snd_mss);
+  limit -= outq;
+  limit -= connection_get_outbuf_len(conn);
+  if (limit <= 0) return 0;
+
+  limit /= get_cell_network_size(chan->wide_circ_ids);
+  return (int)MIN(limit, INT_MAX);
+#else
+  (void)chan;
+  return -1;
+#endif
+}
+
+/** Return true iff we can use the KIST scheduler on this platform */
+
+int
+scheduler_can_use_kist(void)
+{
+#ifdef HAVE_KIST_SUPPORT
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Choose between the KIST scheduler (if <b>use_kist</b> is true) and the
+ * vanilla one, and set the KIST run interval and socket buffer factor.
+ */
+
+void
+scheduler_set_kist(int use_kist, uint32_t run_interval_msec,
+                   double sock_buf_size_factor)
+{
+  /* Sanity assertions - caller should ensure these are true */
+  tor_assert(!use_kist || scheduler_can_use_kist());
+  tor_assert(run_interval_msec > 0);
+  tor_assert(sock_buf_size_factor >= 0.0);
+
+  if (!use_kist != !sched_use_kist) {
+    log_notice(LD_SCHED, "Using the %s scheduler.",
+               use_kist ? "KIST" : "vanilla");
+  }
+
+  sched_use_kist = use_kist;
+  sched_kist_run_interval_msec = run_interval_msec;
+  sched_kist_sock_buf_size_factor = sock_buf_size_factor;
+  if (!use_kist) kist_channels_blocked = 0;
+}
+
 /** Trigger the scheduling event so we run the scheduler later */
 
 #if 0
@@ -37,6 +37,11 @@ void scheduler_touch_channel(channel_t *chan);
 /* Adjust the watermarks from config file*/
 void scheduler_set_watermarks(uint32_t lo, uint32_t hi, uint32_t max_flush);
 
+/* Choose between the KIST and vanilla schedulers from config file */
+int scheduler_can_use_kist(void);
+void scheduler_set_kist(int use_kist, uint32_t run_interval_msec,
+                        double sock_buf_size_factor);
+
 /* Things only scheduler.c and its test suite should see */
 
 #ifdef SCHEDULER_PRIVATE_
@@ -44,6 +49,7 @@ MOCK_DECL(STATIC int, scheduler_compare_channels,
           (const void *c1_v, const void *c2_v));
 STATIC uint64_t scheduler_get_queue_heuristic(void);
 STATIC void scheduler_update_queue_heuristic(time_t now);
+MOCK_DECL(STATIC int, scheduler_kist_cells_writeable, (channel_t *chan));
 #endif
 
 #endif /* !defined(TOR_SCHEDULER_H) */
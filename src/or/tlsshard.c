@@ -0,0 +1,501 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file tlsshard.c
+ * \brief Divides the TLS work for our open OR connections among several
+ * threads.
+ *
+ * When NumTLSThreads is set, main.c collects the open OR connections that
+ * become readable or writable during a pass through the event loop, and
+ * hands them to tls_shards_run_batch() together.  Each connection belongs
+ * to one shard, chosen by its global identifier: shard 0 is the main
+ * thread, and each other shard has a thread of its own.  The main thread
+ * does shard 0's jobs right away; the other shards do theirs while the
+ * main thread goes back to its event loop, and then wake it up through an
+ * alert socket to take the results.
+ *
+ * A shard reads straight into the free space at the end of a connection's
+ * inbuf, and writes straight from the chunks at the front of its outbuf,
+ * gathering them into a scratch record only when a TLS record would span
+ * two chunks.  The main thread still does everything else: cells,
+ * channels, circuits, and bandwidth accounting.  Since no circuit state
+ * ever leaves the main thread, circuits whose channels are on different
+ * shards need no special handling.
+ *
+ * Until its job is done, the main thread stops watching a connection for
+ * events, and doesn't touch its TLS object, the front of its outbuf, or
+ * the end of its inbuf.  (Adding cells to the end of the outbuf is fine.)
+ * Anything that needs those sooner calls tls_shards_wait_for_conn().
+ **/
+
+#define TLSSHARD_PRIVATE
+#include "or.h"
+#include "buffers.h"
+#include "config.h"
+#include "connection.h"
+#include "connection_or.h"
+#include "main.h"
+#include "tlsshard.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+/** The most data that a shard will read from, or write to, one connection
+ * in a single batch.  A connection with more to do stays readable or
+ * writable, and gets another turn in the next batch. */
+#define TLS_SHARD_MAX_BYTES (1<<16)
+
+/** One of the shards among which we divide our open OR connections. */
+typedef struct tls_shard_t {
+  /** The jobs that the main thread has given this shard, and that it hasn't
+   * started.  Protected by shards_lock. */
+  smartlist_t *todo;
+  /** The jobs that this shard is running now.  Only the shard's thread
+   * touches this. */
+  smartlist_t *running;
+  /** Space for gathering a TLS record from several outbuf chunks. */
+  char record_buf[TOR_TLS_MAX_RECORD_PLAINTEXT];
+} tls_shard_t;
+
+/** Every shard that we've set up.  Shard 0 is the main thread; each of the
+ * others has a thread of its own. */
+static tls_shard_t *shards[TLS_SHARD_MAX_THREADS + 1];
+/** How many entries of <b>shards</b> are set? */
+static int n_shards = 0;
+/** True iff we have failed to launch a shard thread, and shouldn't try to
+ * launch any more. */
+static int shard_launch_failed = 0;
+/** Lock that protects the todo list of every shard, done_jobs, and the
+ * done flag of every job. */
+static tor_mutex_t *shards_lock = NULL;
+/** Condition that we signal when some shard has new jobs to run. */
+static tor_cond_t *shards_work_cond = NULL;
+/** Condition that we signal when a shard thread has finished some jobs. */
+static tor_cond_t *shards_done_cond = NULL;
+/** Jobs that shard threads have finished, and whose results the main thread
+ * hasn't taken yet. */
+static smartlist_t *done_jobs = NULL;
+/** Sockets that the shard threads use to wake up the main thread when they
+ * add to done_jobs. */
+static alert_sockets_t shards_alert;
+/** Event that fires when the shard threads have woken up the main thread. */
+static struct event *shards_reply_event = NULL;
+
+/** Do the TLS reads and writes that <b>job</b> asks for, the same way that
+ * read_to_buf_tls() and flush_buf_tls() would.  This runs on the thread of
+ * the job's shard, and touches nothing but the job, its TLS object, and
+ * the buffer memory that the job points to. */
+MOCK_IMPL(STATIC void,
+tls_shard_run_job,(tls_shard_job_t *job))
+{
+  int r;
+
+  if (job->read_mem) {
+    size_t total = 0;
+    r = 0;
+    while (total < job->read_max) {
+      size_t readlen = job->read_max - total;
+      r = tor_tls_read(job->tls, job->read_mem + total, readlen);
+      if (r < 0)
+        break;
+      total += r;
+      if ((size_t)r < readlen) /* eof, block, or no more to read. */
+        break;
+    }
+    job->n_read = total;
+    job->read_result = r < 0 ? r : (int)total;
+  }
+
+  if (job->n_write_chunks) {
+    size_t written = 0, offset = 0;
+    int idx = 0;
+    do {
+      size_t n = MIN(job->write_max - written, TOR_TLS_MAX_RECORD_PLAINTEXT);
+      size_t forced = tor_tls_get_forced_write_size(job->tls);
+      const char *data;
+      if (forced > n)
+        n = forced;
+      tor_assert(written + n <= job->write_len);
+      if (job->write_data_len[idx] - offset >= n) {
+        data = job->write_data[idx] + offset;
+      } else {
+        /* The record spans chunks: gather it. */
+        size_t copied = 0, off = offset;
+        int i = idx;
+        while (copied < n) {
+          size_t k = MIN(job->write_data_len[i] - off, n - copied);
+          memcpy(job->record_buf + copied, job->write_data[i] + off, k);
+          copied += k;
+          off = 0;
+          ++i;
+        }
+        data = job->record_buf;
+      }
+      r = tor_tls_write(job->tls, data, n);
+      if (r < 0)
+        break;
+      if (r > 0) /* Each write is a single record. */
+        ++job->n_records_written;
+      written += r;
+      offset += r;
+      while (idx < job->n_write_chunks &&
+             offset >= job->write_data_len[idx] && written < job->write_len) {
+        offset -= job->write_data_len[idx];
+        ++idx;
+      }
+    } while (r > 0 && written < job->write_max);
+    job->n_written = written;
+    job->write_result = r < 0 ? r : (int)written;
+  }
+}
+
+/** Main function for the thread of <b>arg</b>, a shard: run the jobs that
+ * the main thread gives it, forever. */
+static void
+tls_shard_thread_main(void *arg)
+{
+  tls_shard_t *shard = arg;
+
+  tor_mutex_acquire(shards_lock);
+  for (;;) {
+    smartlist_t *tmp;
+    int was_empty;
+    while (!smartlist_len(shard->todo)) {
+      if (tor_cond_wait(shards_work_cond, shards_lock) < 0)
+        log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    }
+    tmp = shard->running;
+    shard->running = shard->todo;
+    shard->todo = tmp;
+    tor_mutex_release(shards_lock);
+
+    SMARTLIST_FOREACH(shard->running, tls_shard_job_t *, job,
+                      tls_shard_run_job(job));
+
+    tor_mutex_acquire(shards_lock);
+    was_empty = !smartlist_len(done_jobs);
+    SMARTLIST_FOREACH_BEGIN(shard->running, tls_shard_job_t *, job) {
+      job->done = 1;
+      smartlist_add(done_jobs, job);
+    } SMARTLIST_FOREACH_END(job);
+    smartlist_clear(shard->running);
+    tor_cond_signal_all(shards_done_cond);
+    if (was_empty &&
+        shards_alert.alert_fn(shards_alert.write_fd) < 0) {
+      log_warn(LD_GENERAL, "Unable to alert the main thread about finished "
+               "TLS work.");
+    }
+  }
+}
+
+/** Return a newly allocated shard with no jobs. */
+static tls_shard_t *
+tls_shard_new(void)
+{
+  tls_shard_t *shard = tor_malloc_zero(sizeof(tls_shard_t));
+  shard->todo = smartlist_new();
+  shard->running = smartlist_new();
+  return shard;
+}
+
+/** Libevent callback: the shard threads have finished some jobs.  Take
+ * their results. */
+static void
+tls_shards_reply_cb(evutil_socket_t sock, short events, void *arg)
+{
+  (void)sock;
+  (void)events;
+  (void)arg;
+
+  if (shards_alert.drain_fn(shards_alert.read_fd) < 0)
+    log_warn(LD_GENERAL, "Failure from drain_fd on TLS shard alert socket");
+  tls_shards_handle_replies();
+}
+
+/** Set up what we need before we launch any shard threads.  Return 0 on
+ * success, -1 on failure. */
+static int
+tls_shards_setup_threads(void)
+{
+  if (shards_reply_event)
+    return 0;
+  if (alert_sockets_create(&shards_alert, 0) < 0) {
+    log_warn(LD_GENERAL, "Couldn't create an alert socket for TLS work.");
+    return -1;
+  }
+  shards_reply_event = tor_event_new(tor_libevent_get_base(),
+                                     shards_alert.read_fd,
+                                     EV_READ|EV_PERSIST,
+                                     tls_shards_reply_cb, NULL);
+  if (event_add(shards_reply_event, NULL) < 0) {
+    log_warn(LD_GENERAL, "Couldn't watch the TLS shard alert socket.");
+    tor_event_free(shards_reply_event);
+    shards_reply_event = NULL;
+    alert_sockets_close(&shards_alert);
+    return -1;
+  }
+  return 0;
+}
+
+/** Return the number of shards that we should divide our OR connections
+ * among right now, launching any shard threads that NumTLSThreads calls
+ * for and that we don't have yet. */
+int
+tls_shards_get_n(void)
+{
+  const int n_wanted = get_options()->NumTLSThreads + 1;
+
+  if (!n_shards) {
+    shards_lock = tor_mutex_new();
+    shards_work_cond = tor_cond_new();
+    shards_done_cond = tor_cond_new();
+    done_jobs = smartlist_new();
+    shards[n_shards++] = tls_shard_new();
+  }
+
+  if (n_shards < n_wanted && !shard_launch_failed &&
+      tls_shards_setup_threads() < 0)
+    shard_launch_failed = 1;
+
+  while (n_shards < n_wanted && !shard_launch_failed) {
+    tls_shard_t *shard = tls_shard_new();
+    if (spawn_func(tls_shard_thread_main, shard) < 0) {
+      log_warn(LD_GENERAL, "Couldn't launch a thread for TLS work; going "
+               "on with %d.", n_shards - 1);
+      smartlist_free(shard->todo);
+      smartlist_free(shard->running);
+      tor_free(shard);
+      shard_launch_failed = 1;
+      break;
+    }
+    shards[n_shards++] = shard;
+  }
+
+  return MIN(n_shards, n_wanted);
+}
+
+/** Set up <b>job</b> to do the TLS reads and writes that <b>or_conn</b>
+ * wants in the current batch, within its bandwidth limits.  Return true iff
+ * there's anything for a shard to do. */
+static int
+tls_shard_job_prepare(tls_shard_job_t *job, or_connection_t *or_conn,
+                      time_t now)
+{
+  connection_t *conn = TO_CONN(or_conn);
+
+  job->conn = or_conn;
+  job->tls = or_conn->tls;
+  if (conn->marked_for_close)
+    return 0;
+
+  if (or_conn->tls_shard_wants_read) {
+    ssize_t at_most = connection_bucket_read_limit(conn, now);
+    if (at_most > TLS_SHARD_MAX_BYTES)
+      at_most = TLS_SHARD_MAX_BYTES;
+    if (at_most > 0)
+      job->read_mem = buf_get_read_space(conn->inbuf, at_most,
+                                         &job->read_max);
+  }
+
+  if (or_conn->tls_shard_wants_write && buf_datalen(conn->outbuf)) {
+    ssize_t max_to_write = connection_bucket_write_limit(conn, now);
+    if (max_to_write > TLS_SHARD_MAX_BYTES)
+      max_to_write = TLS_SHARD_MAX_BYTES;
+    if (max_to_write > 0 && !connection_or_should_coalesce_outbuf(or_conn)) {
+      /* Take at least a whole record, if there is one, in case the TLS
+       * library wants us to repeat a longer write than we'd do now. */
+      size_t len = MAX((size_t)max_to_write, TOR_TLS_MAX_RECORD_PLAINTEXT);
+      job->n_write_chunks = buf_get_chunk_data(conn->outbuf, len,
+                                               job->write_data,
+                                               job->write_data_len,
+                                               TLS_SHARD_MAX_WRITE_CHUNKS,
+                                               &job->write_len);
+      job->write_max = MIN((size_t)max_to_write, job->write_len);
+    }
+  }
+
+  return job->read_mem || job->n_write_chunks;
+}
+
+/** Now that its shard has run <b>job</b>, add the data that it read to
+ * its connection's inbuf, take the data that it wrote off the outbuf, and
+ * note the results for connection_handle_read() and
+ * connection_handle_write(). */
+static void
+tls_shard_job_finish(tls_shard_job_t *job)
+{
+  or_connection_t *or_conn = job->conn;
+  connection_t *conn = TO_CONN(or_conn);
+
+  tor_assert(!job->finished);
+  job->finished = 1;
+
+  if (job->read_mem) {
+    buf_note_read(conn->inbuf, job->n_read);
+    or_conn->tls_shard_read_result = job->read_result;
+    or_conn->tls_shard_n_read = job->n_read;
+    or_conn->has_tls_shard_read_result = 1;
+  }
+
+  if (job->n_write_chunks) {
+    flush_buf_tls_note_written(conn->outbuf, job->n_written,
+                               job->n_records_written,
+                               &conn->outbuf_flushlen);
+    or_conn->tls_shard_write_result = job->write_result;
+    or_conn->tls_shard_n_written = job->n_written;
+    or_conn->has_tls_shard_write_result = 1;
+  }
+}
+
+/** Take the results of <b>job</b>, which is done, let the main loop watch
+ * its connection again, free the job, and call its reply function. */
+static void
+tls_shard_job_reply(tls_shard_job_t *job)
+{
+  or_connection_t *or_conn = job->conn;
+  connection_t *conn = TO_CONN(or_conn);
+  void (*reply_fn)(connection_t *) = job->reply_fn;
+
+  if (!job->finished)
+    tls_shard_job_finish(job);
+  tor_assert(or_conn->tls_shard_job == job);
+  or_conn->tls_shard_job = NULL;
+  if (or_conn->tls_shard_suspended) {
+    or_conn->tls_shard_suspended = 0;
+    if (SOCKET_OK(conn->s) && or_conn->tls_shard_reading)
+      connection_start_reading(conn);
+    if (SOCKET_OK(conn->s) && or_conn->tls_shard_writing)
+      connection_start_writing(conn);
+  }
+  tor_free(job);
+
+  reply_fn(conn);
+}
+
+/** Take the results of every job that the shard threads have finished. */
+STATIC void
+tls_shards_handle_replies(void)
+{
+  smartlist_t *jobs;
+
+  if (!done_jobs)
+    return;
+  tor_mutex_acquire(shards_lock);
+  jobs = done_jobs;
+  done_jobs = smartlist_new();
+  tor_mutex_release(shards_lock);
+
+  SMARTLIST_FOREACH(jobs, tls_shard_job_t *, job, tls_shard_job_reply(job));
+  smartlist_free(jobs);
+}
+
+/** If a TLS shard has a job for <b>or_conn</b>, wait until it's done, and
+ * take its results, so that the main thread can use the connection's TLS
+ * object and buffers.  The job's reply still happens later, as usual. */
+void
+tls_shards_wait_for_conn(or_connection_t *or_conn)
+{
+  tls_shard_job_t *job = or_conn->tls_shard_job;
+
+  if (!job || job->finished)
+    return;
+  tor_mutex_acquire(shards_lock);
+  while (!job->done) {
+    if (tor_cond_wait(shards_done_cond, shards_lock) < 0)
+      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+  }
+  tor_mutex_release(shards_lock);
+  tls_shard_job_finish(job);
+}
+
+/** We're about to free <b>or_conn</b>.  If a TLS shard has a job for it,
+ * wait for the job, and then drop it without a reply. */
+void
+tls_shards_forget_conn(or_connection_t *or_conn)
+{
+  tls_shard_job_t *job = or_conn->tls_shard_job;
+
+  if (!job)
+    return;
+  tls_shards_wait_for_conn(or_conn);
+  tor_mutex_acquire(shards_lock);
+  smartlist_remove(done_jobs, job);
+  tor_mutex_release(shards_lock);
+  or_conn->tls_shard_job = NULL;
+  tor_free(job);
+}
+
+/** Start the TLS reads and writes that each open OR connection in
+ * <b>conns</b> wants, dividing the connections among our shards.  Once a
+ * connection's job is done, we call <b>reply_fn</b> on it from the main
+ * loop, with has_tls_shard_read_result or has_tls_shard_write_result set
+ * for whatever its shard did.  The main thread's own shard, and the
+ * connections that have nothing for a shard to do, get their replies
+ * before this returns. */
+void
+tls_shards_run_batch(smartlist_t *conns,
+                     void (*reply_fn)(connection_t *conn))
+{
+  const time_t now = approx_time();
+  smartlist_t *inline_jobs;
+  int n_in_use, any_async = 0;
+
+  if (!smartlist_len(conns))
+    return;
+
+  n_in_use = tls_shards_get_n();
+  inline_jobs = smartlist_new();
+
+  /* Every connection gets a job, even if it has nothing for a shard to do,
+   * so that none of them can be closed and freed until its reply. */
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+    or_connection_t *or_conn = TO_OR_CONN(conn);
+    tls_shard_job_t *job = tor_malloc_zero(sizeof(tls_shard_job_t));
+    const int shard = (int)(conn->global_identifier % n_in_use);
+    tor_assert(conn->type == CONN_TYPE_OR);
+    tor_assert(!or_conn->tls_shard_job);
+    job->reply_fn = reply_fn;
+    job->record_buf = shards[shard]->record_buf;
+    if (!tls_shard_job_prepare(job, or_conn, now)) {
+      job->done = 1;
+    } else if (shard != 0) {
+      /* Stop watching the connection until the job is done, so that the
+       * main loop doesn't spin on it; remember what to watch afterwards. */
+      or_conn->tls_shard_reading = connection_is_reading(conn);
+      or_conn->tls_shard_writing = connection_is_writing(conn);
+      connection_stop_reading(conn);
+      connection_stop_writing(conn);
+      or_conn->tls_shard_suspended = 1;
+      any_async = 1;
+    }
+    or_conn->tls_shard_job = job;
+    if (!or_conn->tls_shard_suspended)
+      smartlist_add(inline_jobs, job);
+  } SMARTLIST_FOREACH_END(conn);
+
+  if (any_async) {
+    tor_mutex_acquire(shards_lock);
+    SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+      or_connection_t *or_conn = TO_OR_CONN(conn);
+      if (or_conn->tls_shard_suspended)
+        smartlist_add(shards[conn->global_identifier % n_in_use]->todo,
+                      or_conn->tls_shard_job);
+    } SMARTLIST_FOREACH_END(conn);
+    tor_cond_signal_all(shards_work_cond);
+    tor_mutex_release(shards_lock);
+  }
+
+  SMARTLIST_FOREACH_BEGIN(inline_jobs, tls_shard_job_t *, job) {
+    if (!job->done) {
+      tls_shard_run_job(job);
+      job->done = 1;
+    }
+  } SMARTLIST_FOREACH_END(job);
+  SMARTLIST_FOREACH(inline_jobs, tls_shard_job_t *, job,
+                    tls_shard_job_reply(job));
+  smartlist_free(inline_jobs);
+}
@@ -0,0 +1,82 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file tlsshard.h
+ * \brief Header file for tlsshard.c.
+ **/
+
+#ifndef TOR_TLSSHARD_H
+#define TOR_TLSSHARD_H
+
+/** The largest number of threads, besides the main one, that we will divide
+ * our OR connections' TLS work among. */
+#define TLS_SHARD_MAX_THREADS 64
+
+int tls_shards_get_n(void);
+void tls_shards_run_batch(smartlist_t *conns,
+                          void (*reply_fn)(connection_t *conn));
+void tls_shards_wait_for_conn(or_connection_t *or_conn);
+void tls_shards_forget_conn(or_connection_t *or_conn);
+
+#ifdef TLSSHARD_PRIVATE
+/** The most chunks of an outbuf that one job will write from. */
+#define TLS_SHARD_MAX_WRITE_CHUNKS 16
+
+/** The TLS reads and writes that one shard should do for one OR connection
+ * as part of a batch. */
+struct tls_shard_job_t {
+  /** The connection that this job is for.  Only the main thread may look at
+   * this. */
+  or_connection_t *conn;
+  /** The connection's TLS object.  Until the job is done, only the thread
+   * that runs the job may touch it. */
+  tor_tls_t *tls;
+  /** Function for the main thread to call once it has taken the job's
+   * results. */
+  void (*reply_fn)(connection_t *conn);
+  /** Space for gathering a TLS record from several outbuf chunks.  It
+   * belongs to the job's shard. */
+  char *record_buf;
+  /** True iff the shard has run this job.  Protected by the shards' lock. */
+  unsigned int done:1;
+  /** True iff the main thread has taken this job's results. */
+  unsigned int finished:1;
+
+  /** Free space at the end of the connection's inbuf, where the shard should
+   * put the data that it reads, or NULL if it shouldn't read. */
+  char *read_mem;
+  /** How many bytes the shard may read onto read_mem. */
+  size_t read_max;
+  /** What the read got: a number of bytes, or a TOR_TLS_* error code. */
+  int read_result;
+  /** How many bytes the shard put onto read_mem. */
+  size_t n_read;
+
+  /** The data at the front of the connection's outbuf, one entry per chunk,
+   * for the shard to write. */
+  const char *write_data[TLS_SHARD_MAX_WRITE_CHUNKS];
+  /** How many bytes each entry of write_data holds. */
+  size_t write_data_len[TLS_SHARD_MAX_WRITE_CHUNKS];
+  /** How many entries of write_data are set.  0 if the shard shouldn't
+   * write. */
+  int n_write_chunks;
+  /** How many bytes write_data holds in all.  This can be more than
+   * write_max, so that the shard can repeat a write that the TLS library
+   * wants back. */
+  size_t write_len;
+  /** How many bytes the shard should try to write. */
+  size_t write_max;
+  /** What the write got: a number of bytes, or a TOR_TLS_* error code. */
+  int write_result;
+  /** How many bytes of write_data the shard wrote, and in how many TLS
+   * records. */
+  size_t n_written;
+  size_t n_records_written;
+};
+
+MOCK_DECL(STATIC void, tls_shard_run_job, (tls_shard_job_t *job));
+STATIC void tls_shards_handle_replies(void);
+#endif
+
+#endif
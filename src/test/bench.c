@@ -27,6 +27,7 @@ const char tor_git_revision[] = "";
 
 #include "config.h"
 #include "crypto_curve25519.h"
+#include "crypto_sha1_multi.h"
 #include "onion_ntor.h"
 #include "crypto_ed25519.h"
 
@@ -299,7 +300,9 @@ bench_cell_aes(void)
   const int iters = (1<<16);
   const int max_misalign = 15;
   char *b = tor_malloc(len+max_misalign);
+  char expected[4], computed[4];
   crypto_cipher_t *c;
+  crypto_digest_t *d;
   int i, misalign;
 
   c = crypto_cipher_new(NULL);
@@ -315,6 +318,51 @@ bench_cell_aes(void)
            NANOCOUNT(start, end, iters*len));
   }
 
+  /* Relay cells get digested as well as crypted: compare doing that in two
+   * passes with doing it in one. */
+  d = crypto_digest_new();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    crypto_digest_add_bytes(d, b, len);
+    crypto_cipher_crypt_inplace(c, b, len);
+  }
+  end = perftime();
+  printf("%d bytes, digest then crypt: %.2f nsec per byte\n", len,
+         NANOCOUNT(start, end, iters*len));
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    crypto_cipher_crypt_digest_inplace(c, d, b, len, 1);
+  }
+  end = perftime();
+  printf("%d bytes, combined crypt and digest: %.2f nsec per byte\n", len,
+         NANOCOUNT(start, end, iters*len));
+
+  /* And checking whether a cell is recognized, by backing up the digest as
+   * relay.c used to, or by checking it in the same pass as decrypting. */
+  memset(expected, 0xff, sizeof(expected));
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    crypto_digest_t *backup = crypto_digest_dup(d);
+    crypto_cipher_crypt_inplace(c, b, len);
+    crypto_digest_add_bytes(d, b, len);
+    crypto_digest_get_digest(d, computed, sizeof(computed));
+    if (tor_memneq(computed, expected, sizeof(computed)))
+      crypto_digest_assign(d, backup);
+    crypto_digest_free(backup);
+  }
+  end = perftime();
+  printf("%d bytes, decrypt and check with backup digest: %.2f nsec per "
+         "byte\n", len, NANOCOUNT(start, end, iters*len));
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    crypto_cipher_decrypt_digest_check(c, d, NULL, 0, b, len,
+                                       expected, sizeof(expected));
+  }
+  end = perftime();
+  printf("%d bytes, combined decrypt and check: %.2f nsec per byte\n", len,
+         NANOCOUNT(start, end, iters*len));
+
+  crypto_digest_free(d);
   crypto_cipher_free(c);
   tor_free(b);
 }
@@ -416,6 +464,74 @@ bench_siphash(void)
   }
 }
 
+/** Run benchmarks for updating several running SHA-1 digests at once. */
+static void
+bench_digest_multi(void)
+{
+  const int iters = 1<<14;
+  const int len = CELL_PAYLOAD_SIZE;
+  const int lanes[] = { 1, 4, 8 };
+  crypto_digest_t *digests[8];
+  const char *data[8];
+  char *buf = tor_malloc(8 * len);
+  uint64_t start, end;
+  int i, j;
+
+  crypto_rand(buf, 8 * len);
+  for (i = 0; i < 8; ++i)
+    data[i] = buf + i * len;
+
+  /* Digests updated one at a time use OpenSSL's SHA-1, however many lanes
+   * we have. */
+  for (i = 0; i < 8; ++i)
+    digests[i] = crypto_digest_new();
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    for (j = 0; j < 8; ++j)
+      crypto_digest_add_bytes(digests[j], data[j], len);
+  }
+  end = perftime();
+  printf("8 digests of %d bytes, one at a time: %.2f ns per byte\n", len,
+         NANOCOUNT(start, end, iters*8*len));
+  for (i = 0; i < 8; ++i)
+    crypto_digest_free(digests[i]);
+
+  /* For comparison: our portable SHA-1, one digest at a time. */
+  {
+    sha1_multi_state_t st;
+    sha1_multi_state_init(&st);
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      for (j = 0; j < 8; ++j)
+        sha1_multi_state_update(&st, (const uint8_t *)data[j], len);
+    }
+    end = perftime();
+    printf("8 digests of %d bytes, one at a time, portable: "
+           "%.2f ns per byte\n", len, NANOCOUNT(start, end, iters*8*len));
+  }
+
+  for (j = 0; j < (int)(ARRAY_LENGTH(lanes)); ++j) {
+    sha1_multi_set_n_lanes(lanes[j]);
+    if (sha1_multi_get_n_lanes() != lanes[j])
+      continue;
+    for (i = 0; i < 8; ++i)
+      digests[i] = crypto_digest_new();
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      crypto_digest_add_bytes_multi(digests, data, len, 8);
+    }
+    end = perftime();
+    printf("8 digests of %d bytes, %d lanes: %.2f ns per byte\n", len,
+           lanes[j], NANOCOUNT(start, end, iters*8*len));
+    for (i = 0; i < 8; ++i)
+      crypto_digest_free(digests[i]);
+  }
+  sha1_multi_set_n_lanes(-1);
+
+  tor_free(buf);
+}
+
 static void
 bench_cell_ops(void)
 {
@@ -427,6 +543,8 @@ bench_cell_ops(void)
   cell_t *cell = tor_malloc(sizeof(cell_t));
   int outbound;
   uint64_t start, end;
+  const int batch = 8;
+  relay_crypt_item_t items[8];
 
   crypto_rand((char*)cell->payload, sizeof(cell->payload));
 
@@ -457,6 +575,31 @@ bench_cell_ops(void)
            NANOCOUNT(start,end,iters*CELL_PAYLOAD_SIZE));
   }
 
+  /* The same, but with several cells for the circuit crypted at once. */
+  memset(items, 0, sizeof(items));
+  for (i = 0; i < batch; ++i) {
+    items[i].circ = TO_CIRCUIT(or_circ);
+    items[i].cell = tor_memdup(cell, sizeof(cell_t));
+  }
+  for (outbound = 0; outbound <= 1; ++outbound) {
+    cell_direction_t d = outbound ? CELL_DIRECTION_OUT : CELL_DIRECTION_IN;
+    for (i = 0; i < batch; ++i)
+      items[i].cell_direction = d;
+    start = perftime();
+    for (i = 0; i < iters; i += batch) {
+      relay_crypt_cells(items, batch);
+    }
+    end = perftime();
+    printf("%sbound cells, %d at a time: %.2f ns per cell. "
+           "(%.2f ns per byte of payload)\n",
+           outbound?"Out":" In", batch,
+           NANOCOUNT(start,end,iters),
+           NANOCOUNT(start,end,iters*CELL_PAYLOAD_SIZE));
+  }
+  for (i = 0; i < batch; ++i) {
+    tor_free(items[i].cell);
+  }
+
   crypto_digest_free(or_circ->p_digest);
   crypto_digest_free(or_circ->n_digest);
   crypto_cipher_free(or_circ->p_crypto);
@@ -574,6 +717,7 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(digest_multi),
   ENT(dh),
 #ifdef HAVE_EC_BENCHMARKS
   ENT(ecdh_p256),
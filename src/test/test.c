@@ -1094,6 +1094,109 @@ test_geoip_with_pt(void *arg)
   tor_free(s);
 }
 
+/** Run unit tests for the binary GeoIP format. */
+static void
+test_geoip_binary(void *arg)
+{
+  char *fname4 = NULL, *fname6 = NULL, *cache_fname = NULL;
+  char digest[DIGEST_LEN], digest_hex[HEX_DIGEST_LEN+1];
+  char *contents = NULL;
+  int expected[300];
+  int i;
+  struct in6_addr in6;
+  const char *geoip_text =
+    "# A comment\n"
+    "10,50,AB\n"
+    "52,90,XY\n"
+    "95,100,AB\n"
+    "\"105\",\"140\",\"ZZ\"\n"
+    "150,190,XY\n"
+    "200,250,AB\n";
+
+  (void)arg;
+  memset(&in6, 0, sizeof(in6));
+  memset(digest, 'x', sizeof(digest));
+
+  /* Start from an empty database; nothing to write yet. */
+  geoip_free_all();
+  fname4 = tor_strdup(get_fname("geoip-bin"));
+  fname6 = tor_strdup(get_fname("geoip6-bin"));
+  tt_int_op(-1,OP_EQ, geoip_write_binary_file(AF_INET, fname4, digest));
+
+  /* Same database as in test_geoip. */
+  tt_int_op(0,OP_EQ, geoip_parse_entry("10,50,AB", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("52,90,XY", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("95,100,AB", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("\"105\",\"140\",\"ZZ\"", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("\"150\",\"190\",\"XY\"", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("\"200\",\"250\",\"AB\"", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("::a,::32,AB", AF_INET6));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("::34,::5a,XY", AF_INET6));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("::5f,::64,AB", AF_INET6));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("::69,::8c,ZZ", AF_INET6));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("::96,::be,XY", AF_INET6));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("::c8,::fa,AB", AF_INET6));
+  for (i = 0; i < 300; ++i)
+    expected[i] = geoip_get_country_by_ipv4(i);
+
+  tt_int_op(0,OP_EQ, geoip_write_binary_file(AF_INET, fname4, digest));
+  tt_int_op(0,OP_EQ, geoip_write_binary_file(AF_INET6, fname6, digest));
+
+  /* Refuse stale, mismatched, or missing files. */
+  digest[0] = 'y';
+  tt_int_op(-1,OP_EQ, geoip_load_binary_file(AF_INET, fname4, digest));
+  digest[0] = 'x';
+  tt_int_op(-1,OP_EQ, geoip_load_binary_file(AF_INET6, fname4, digest));
+  tt_int_op(-1,OP_EQ, geoip_load_binary_file(AF_INET, get_fname("nonesuch"),
+                                             digest));
+
+  /* Loading the files gives the same answers as the text entries did. */
+  tt_int_op(0,OP_EQ, geoip_load_binary_file(AF_INET, fname4, digest));
+  tt_int_op(0,OP_EQ, geoip_load_binary_file(AF_INET6, fname6, digest));
+  tt_assert(geoip_is_loaded(AF_INET));
+  tt_assert(geoip_is_loaded(AF_INET6));
+  tt_int_op(4,OP_EQ, geoip_get_n_countries());
+  for (i = 0; i < 300; ++i) {
+    tt_int_op(expected[i],OP_EQ, geoip_get_country_by_ipv4(i));
+    SET_TEST_IPV6(i);
+    tt_int_op(expected[i],OP_EQ, geoip_get_country_by_ipv6(&in6));
+  }
+  CHECK_COUNTRY("??", 3);
+  CHECK_COUNTRY("ab", 32);
+  CHECK_COUNTRY("??", 51);
+  CHECK_COUNTRY("xy", 190);
+  CHECK_COUNTRY("ab", 250);
+  CHECK_COUNTRY("??", 2000);
+
+  /* A truncated file is no good. */
+  contents = read_file_to_str(fname4, RFTS_BIN, NULL);
+  tt_assert(contents);
+  tt_int_op(0,OP_EQ, write_bytes_to_file(fname4, contents, 60, 1));
+  tt_int_op(-1,OP_EQ, geoip_load_binary_file(AF_INET, fname4, digest));
+  tor_free(contents);
+
+  /* geoip_load_file() writes a cache the first time, and uses it the
+   * second time, with the same result and digest. */
+  tt_int_op(0,OP_EQ, write_str_to_file(fname4, geoip_text, 0));
+  crypto_digest(digest, geoip_text, strlen(geoip_text));
+  base16_encode(digest_hex, sizeof(digest_hex), digest, DIGEST_LEN);
+  cache_fname = get_datadir_fname("cached-geoip");
+  tt_int_op(0,OP_EQ, geoip_load_file(AF_INET, fname4));
+  tt_int_op(FN_FILE,OP_EQ, file_status(cache_fname));
+  tt_str_op(digest_hex,OP_EQ, geoip_db_digest(AF_INET));
+  tt_int_op(0,OP_EQ, geoip_load_binary_file(AF_INET, cache_fname, digest));
+  tt_int_op(0,OP_EQ, geoip_load_file(AF_INET, fname4));
+  tt_str_op(digest_hex,OP_EQ, geoip_db_digest(AF_INET));
+  for (i = 0; i < 300; ++i)
+    tt_int_op(expected[i],OP_EQ, geoip_get_country_by_ipv4(i));
+
+ done:
+  tor_free(fname4);
+  tor_free(fname6);
+  tor_free(cache_fname);
+  tor_free(contents);
+}
+
 #undef SET_TEST_ADDRESS
 #undef SET_TEST_IPV6
 #undef CHECK_COUNTRY
@@ -1272,6 +1375,7 @@ static struct testcase_t test_array[] = {
   ENT(rend_fns),
   ENT(geoip),
   FORK(geoip_with_pt),
+  FORK(geoip_binary),
   FORK(stats),
 
   END_OF_TESTCASES
@@ -1287,6 +1391,7 @@ extern struct testcase_t checkdir_tests[];
 extern struct testcase_t microdesc_tests[];
 extern struct testcase_t pt_tests[];
 extern struct testcase_t config_tests[];
+extern struct testcase_t connection_tests[];
 extern struct testcase_t introduce_tests[];
 extern struct testcase_t replaycache_tests[];
 extern struct testcase_t relaycell_tests[];
@@ -1302,6 +1407,7 @@ extern struct testcase_t controller_event_tests[];
 extern struct testcase_t logging_tests[];
 extern struct testcase_t hs_tests[];
 extern struct testcase_t nodelist_tests[];
+extern struct testcase_t onion_tests[];
 extern struct testcase_t routerkeys_tests[];
 extern struct testcase_t oom_tests[];
 extern struct testcase_t accounting_tests[];
@@ -1313,6 +1419,9 @@ extern struct testcase_t channel_tests[];
 extern struct testcase_t channeltls_tests[];
 extern struct testcase_t relay_tests[];
 extern struct testcase_t scheduler_tests[];
+extern struct testcase_t timers_tests[];
+extern struct testcase_t tlsshard_tests[];
+extern struct testcase_t workqueue_tests[];
 
 static struct testgroup_t testgroups[] = {
   { "", test_array },
@@ -1330,6 +1439,7 @@ static struct testgroup_t testgroups[] = {
   { "dir/md/", microdesc_tests },
   { "pt/", pt_tests },
   { "config/", config_tests },
+  { "connection/", connection_tests },
   { "replaycache/", replaycache_tests },
   { "relaycell/", relaycell_tests },
   { "introduce/", introduce_tests },
@@ -1341,6 +1451,7 @@ static struct testgroup_t testgroups[] = {
   { "control/", controller_event_tests },
   { "hs/", hs_tests },
   { "nodelist/", nodelist_tests },
+  { "onion/", onion_tests },
   { "routerkeys/", routerkeys_tests },
   { "oom/", oom_tests },
   { "accounting/", accounting_tests },
@@ -1351,6 +1462,9 @@ static struct testgroup_t testgroups[] = {
   { "channeltls/", channeltls_tests },
   { "relay/" , relay_tests },
   { "scheduler/", scheduler_tests },
+  { "timers/", timers_tests },
+  { "tlsshard/", tlsshard_tests },
+  { "workqueue/", workqueue_tests },
   END_OF_GROUPS
 };
 
@@ -6,9 +6,15 @@
 #define BUFFERS_PRIVATE
 #include "or.h"
 #include "buffers.h"
+#include "compat_uring.h"
 #include "ext_orport.h"
 #include "test.h"
 
+#ifdef USE_IO_URING
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
 /** Run unit tests for buffers.c */
 static void
 test_buffers_basic(void *arg)
@@ -526,6 +532,378 @@ test_buffer_allocation_tracking(void *arg)
   tor_free(junk);
 }
 
+static void
+test_buffer_socket_io(void *arg)
+{
+  char *junk = tor_malloc(20000), *out = tor_malloc(20010);
+  buf_t *buf1 = NULL, *buf2 = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  size_t flushlen;
+  int i, n, reached_eof = 0, socket_error = 0;
+
+  (void)arg;
+
+  crypto_rand(junk, 20000);
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[0]));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[1]));
+
+  /* Use small chunks, so that flushing the buffer means writing lots of
+   * them. */
+  buf1 = buf_new_with_capacity(256);
+  buf2 = buf_new_with_capacity(256);
+  for (i = 0; i < 20000; i += 500)
+    write_to_buf(junk + i, 500, buf1);
+  tt_int_op(buf_datalen(buf1), OP_EQ, 20000);
+
+  /* Flush some, but not all, of it. */
+  flushlen = 15000;
+  tt_int_op(flush_buf(fds[0], buf1, 12345, &flushlen), OP_EQ, 12345);
+  tt_int_op(flushlen, OP_EQ, 15000 - 12345);
+  tt_int_op(buf_datalen(buf1), OP_EQ, 20000 - 12345);
+  flushlen = buf_datalen(buf1);
+  tt_int_op(flush_buf(fds[0], buf1, flushlen, &flushlen), OP_EQ,
+            20000 - 12345);
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(buf_datalen(buf1), OP_EQ, 0);
+
+  /* Start the reading buffer with a partly-full chunk, so that reads have
+   * to fill the rest of it before they move on to a new one. */
+  write_to_buf("hello", 5, buf2);
+  n = read_to_buf(fds[1], 30000, buf2, &reached_eof, &socket_error);
+  tt_int_op(n, OP_EQ, 20000);
+  tt_int_op(reached_eof, OP_EQ, 0);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 20005);
+  fetch_from_buf(out, 20005, buf2);
+  tt_mem_op(out, OP_EQ, "hello", 5);
+  tt_mem_op(out+5, OP_EQ, junk, 20000);
+
+  /* Nothing left to read: we should block, not get eof. */
+  write_to_buf("hi", 2, buf2);
+  n = read_to_buf(fds[1], 1000, buf2, &reached_eof, &socket_error);
+  tt_int_op(n, OP_EQ, 0);
+  tt_int_op(reached_eof, OP_EQ, 0);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 2);
+
+  tor_close_socket(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  n = read_to_buf(fds[1], 1000, buf2, &reached_eof, &socket_error);
+  tt_int_op(n, OP_EQ, 0);
+  tt_int_op(reached_eof, OP_EQ, 1);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 2);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  buf_free(buf1);
+  buf_free(buf2);
+  tor_free(junk);
+  tor_free(out);
+}
+
+static void
+test_buffer_note_written(void *arg)
+{
+  buf_t *buf = NULL;
+  size_t flushlen;
+  char out[100];
+  (void)arg;
+
+  buf = buf_new();
+  write_to_buf("abcdefghij", 10, buf);
+  flushlen = 8;
+
+  tt_int_op(flush_buf_note_written(buf, 3, &flushlen), OP_EQ, 3);
+  tt_int_op(flushlen, OP_EQ, 5);
+  tt_int_op(buf_datalen(buf), OP_EQ, 7);
+  /* Blocking isn't an error; nothing gets removed. */
+  tt_int_op(flush_buf_note_written(buf, -EAGAIN, &flushlen), OP_EQ, 0);
+  tt_int_op(flushlen, OP_EQ, 5);
+  tt_int_op(buf_datalen(buf), OP_EQ, 7);
+  /* Other errors are, and they end up in errno. */
+  errno = 0;
+  tt_int_op(flush_buf_note_written(buf, -EPIPE, &flushlen), OP_EQ, -1);
+  tt_int_op(errno, OP_EQ, EPIPE);
+  tt_int_op(buf_datalen(buf), OP_EQ, 7);
+  fetch_from_buf(out, 7, buf);
+  tt_mem_op(out, OP_EQ, "defghij", 7);
+
+ done:
+  buf_free(buf);
+}
+
+/* Read into, and write from, a buffer's own memory. */
+static void
+test_buffer_in_place(void *arg)
+{
+  buf_t *buf = NULL;
+  const char *data[4];
+  size_t lens[4], len, total;
+  char *space, out[100];
+  int n;
+  (void)arg;
+
+  buf = buf_new_with_capacity(64);
+  space = buf_get_read_space(buf, 10, &len);
+  tt_assert(space);
+  tt_int_op(len, OP_EQ, 10);
+  /* Nothing is on the buffer until we say so. */
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+  memcpy(space, "abcdefg", 7);
+  buf_note_read(buf, 7);
+  tt_int_op(buf_datalen(buf), OP_EQ, 7);
+
+  /* Fill the rest of the first chunk, and spill into more. */
+  space = buf_get_read_space(buf, 1000, &len);
+  tt_int_op(len, OP_GT, 0);
+  tt_int_op(len, OP_LT, 1000);
+  memset(space, 'x', len);
+  buf_note_read(buf, len);
+  total = 7 + len;
+  write_to_buf("0123456789", 10, buf);
+  total += 10;
+  tt_int_op(buf_datalen(buf), OP_EQ, total);
+
+  /* The chunks describe the front of the buffer, in order. */
+  n = buf_get_chunk_data(buf, total, data, lens, 4, &len);
+  tt_int_op(n, OP_EQ, 2);
+  tt_int_op(len, OP_EQ, total);
+  tt_int_op(lens[0] + lens[1], OP_EQ, total);
+  tt_mem_op(data[0], OP_EQ, "abcdefgxx", 9);
+  tt_mem_op(data[1] + lens[1] - 10, OP_EQ, "0123456789", 10);
+
+  /* We can stop early, or at a limit on the number of chunks. */
+  n = buf_get_chunk_data(buf, 3, data, lens, 4, &len);
+  tt_int_op(n, OP_EQ, 1);
+  tt_int_op(len, OP_EQ, 3);
+  n = buf_get_chunk_data(buf, total, data, lens, 1, &len);
+  tt_int_op(n, OP_EQ, 1);
+  tt_int_op(len, OP_EQ, lens[0]);
+
+  /* Adding to the end doesn't move what's at the front. */
+  write_to_buf("hello", 5, buf);
+  tt_mem_op(data[0], OP_EQ, "abcdefg", 7);
+  fetch_from_buf(out, 7, buf);
+  tt_mem_op(out, OP_EQ, "abcdefg", 7);
+
+ done:
+  buf_free(buf);
+}
+
+#ifdef USE_IO_URING
+/* Write from several buffers to several sockets with one io_uring batch. */
+static void
+test_buffer_uring_flush(void *arg)
+{
+  tor_uring_t *ring = NULL;
+  buf_t *bufs[3] = { NULL, NULL, NULL };
+  tor_socket_t fds[3][2];
+  struct msghdr msgs[3];
+  struct iovec iovs[3][4];
+  size_t lens[3], flushlen;
+  char junk[100], out[1000];
+  int results[3] = { 0, 0, 0 };
+  uint64_t idx;
+  int i, j, result, n_done = 0;
+
+  (void)arg;
+  for (i = 0; i < 3; ++i)
+    fds[i][0] = fds[i][1] = TOR_INVALID_SOCKET;
+
+  ring = tor_uring_new(8);
+  if (!ring)
+    tt_skip(); /* The kernel won't let us have one. */
+  tt_int_op(tor_uring_get_n_entries(ring), OP_GE, 3);
+
+  for (i = 0; i < 3; ++i) {
+    tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]));
+    tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[i][0]));
+    tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[i][1]));
+    bufs[i] = buf_new_with_capacity(256);
+    memset(junk, 'a' + i, sizeof(junk));
+    for (j = 0; j < 10; ++j)
+      write_to_buf(junk, sizeof(junk), bufs[i]);
+
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    msgs[i].msg_iov = iovs[i];
+    msgs[i].msg_iovlen = buf_get_iovecs(bufs[i], 300 * (i + 1), iovs[i], 4,
+                                        &lens[i]);
+    tt_int_op(msgs[i].msg_iovlen, OP_GE, 1);
+    tt_int_op(msgs[i].msg_iovlen, OP_LE, 4);
+    tt_int_op(lens[i], OP_GT, 0);
+    tt_int_op(lens[i], OP_LE, 300 * (i + 1));
+    tt_int_op(0, OP_EQ, tor_uring_prep_sendmsg(ring, fds[i][0], &msgs[i],
+                                              MSG_DONTWAIT, i));
+  }
+
+  tt_int_op(0, OP_EQ, tor_uring_submit_and_wait(ring, 3));
+  while (tor_uring_get_completion(ring, &idx, &result)) {
+    tt_u64_op(idx, OP_LT, 3);
+    results[idx] = result;
+    ++n_done;
+  }
+  tt_int_op(n_done, OP_EQ, 3);
+
+  for (i = 0; i < 3; ++i) {
+    tt_int_op(results[i], OP_EQ, lens[i]);
+    flushlen = buf_datalen(bufs[i]);
+    tt_int_op(flush_buf_note_written(bufs[i], results[i], &flushlen), OP_EQ,
+              lens[i]);
+    tt_int_op(buf_datalen(bufs[i]), OP_EQ, 1000 - lens[i]);
+    tt_int_op(recv(fds[i][1], out, sizeof(out), 0), OP_EQ, lens[i]);
+    memset(junk, 'a' + i, sizeof(junk));
+    for (j = 0; j < (int)lens[i]; j += sizeof(junk))
+      tt_mem_op(out + j, OP_EQ, junk, MIN(sizeof(junk), lens[i] - j));
+  }
+
+ done:
+  for (i = 0; i < 3; ++i) {
+    if (SOCKET_OK(fds[i][0]))
+      tor_close_socket(fds[i][0]);
+    if (SOCKET_OK(fds[i][1]))
+      tor_close_socket(fds[i][1]);
+    buf_free(bufs[i]);
+  }
+  tor_uring_free(ring);
+}
+
+/* Read from several sockets into the free space of several buffers with one
+ * io_uring batch. */
+static void
+test_buffer_uring_read(void *arg)
+{
+  tor_uring_t *ring = NULL;
+  buf_t *bufs[3] = { NULL, NULL, NULL };
+  tor_socket_t fds[3][2];
+  struct msghdr msgs[3];
+  struct iovec iovs[3];
+  char junk[150], out[200];
+  int results[3] = { 1, 1, 1 };
+  uint64_t idx;
+  int i, result, n_done = 0;
+
+  (void)arg;
+  for (i = 0; i < 3; ++i)
+    fds[i][0] = fds[i][1] = TOR_INVALID_SOCKET;
+
+  ring = tor_uring_new(8);
+  if (!ring)
+    tt_skip(); /* The kernel won't let us have one. */
+
+  memset(junk, 'x', sizeof(junk));
+  for (i = 0; i < 3; ++i) {
+    size_t len;
+    tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]));
+    tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[i][0]));
+    tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[i][1]));
+    bufs[i] = buf_new_with_capacity(256);
+    write_to_buf("hello", 5, bufs[i]);
+
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    iovs[i].iov_base = buf_get_read_space(bufs[i], 1000, &len);
+    iovs[i].iov_len = len;
+    tt_int_op(len, OP_GE, sizeof(junk));
+    msgs[i].msg_iov = &iovs[i];
+    msgs[i].msg_iovlen = 1;
+    tt_int_op(0, OP_EQ, tor_uring_prep_recvmsg(ring, fds[i][0], &msgs[i],
+                                              MSG_DONTWAIT, i));
+  }
+  /* The first socket has data waiting, the second has nothing, and the
+   * third has reached EOF. */
+  tt_int_op(send(fds[0][1], junk, sizeof(junk), 0), OP_EQ, sizeof(junk));
+  tor_close_socket(fds[2][1]);
+  fds[2][1] = TOR_INVALID_SOCKET;
+
+  tt_int_op(0, OP_EQ, tor_uring_submit_and_wait(ring, 3));
+  while (tor_uring_get_completion(ring, &idx, &result)) {
+    tt_u64_op(idx, OP_LT, 3);
+    results[idx] = result;
+    ++n_done;
+  }
+  tt_int_op(n_done, OP_EQ, 3);
+
+  tt_int_op(results[0], OP_EQ, sizeof(junk));
+  tt_assert(results[1] < 0 && ERRNO_IS_EAGAIN(-results[1]));
+  tt_int_op(results[2], OP_EQ, 0);
+
+  buf_note_read(bufs[0], results[0]);
+  tt_int_op(buf_datalen(bufs[0]), OP_EQ, 5 + sizeof(junk));
+  fetch_from_buf(out, buf_datalen(bufs[0]), bufs[0]);
+  tt_mem_op(out, OP_EQ, "hello", 5);
+  tt_mem_op(out + 5, OP_EQ, junk, sizeof(junk));
+  tt_int_op(buf_datalen(bufs[1]), OP_EQ, 5);
+  tt_int_op(buf_datalen(bufs[2]), OP_EQ, 5);
+
+ done:
+  for (i = 0; i < 3; ++i) {
+    if (SOCKET_OK(fds[i][0]))
+      tor_close_socket(fds[i][0]);
+    if (SOCKET_OK(fds[i][1]))
+      tor_close_socket(fds[i][1]);
+    buf_free(bufs[i]);
+  }
+  tor_uring_free(ring);
+}
+
+/* Operations that we take back before the kernel sees them never happen;
+ * later ones still do. */
+static void
+test_buffer_uring_cancel(void *arg)
+{
+  tor_uring_t *ring = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  struct msghdr msgs[3];
+  struct iovec iovs[3];
+  char data[3] = { 'a', 'b', 'c' }, out[10];
+  uint64_t idx;
+  int i, result, n_done = 0;
+
+  (void)arg;
+  ring = tor_uring_new(8);
+  if (!ring)
+    tt_skip(); /* The kernel won't let us have one. */
+
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[0]));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[1]));
+  for (i = 0; i < 3; ++i) {
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    iovs[i].iov_base = &data[i];
+    iovs[i].iov_len = 1;
+    msgs[i].msg_iov = &iovs[i];
+    msgs[i].msg_iovlen = 1;
+  }
+
+  tt_int_op(0, OP_EQ, tor_uring_prep_sendmsg(ring, fds[0], &msgs[0],
+                                            MSG_DONTWAIT, 0));
+  tt_int_op(0, OP_EQ, tor_uring_prep_sendmsg(ring, fds[0], &msgs[1],
+                                            MSG_DONTWAIT, 1));
+  tt_uint_op(tor_uring_cancel_unsubmitted(ring), OP_EQ, 2);
+  tt_uint_op(tor_uring_cancel_unsubmitted(ring), OP_EQ, 0);
+
+  tt_int_op(0, OP_EQ, tor_uring_prep_sendmsg(ring, fds[0], &msgs[2],
+                                            MSG_DONTWAIT, 2));
+  tt_int_op(0, OP_EQ, tor_uring_submit_and_wait(ring, 1));
+  while (tor_uring_get_completion(ring, &idx, &result)) {
+    tt_u64_op(idx, OP_EQ, 2);
+    tt_int_op(result, OP_EQ, 1);
+    ++n_done;
+  }
+  tt_int_op(n_done, OP_EQ, 1);
+  tt_int_op(recv(fds[1], out, sizeof(out), 0), OP_EQ, 1);
+  tt_int_op(out[0], OP_EQ, 'c');
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  tor_uring_free(ring);
+}
+#endif
+
 static void
 test_buffer_time_tracking(void *arg)
 {
@@ -721,6 +1099,14 @@ struct testcase_t buffer_tests[] = {
   { "ext_or_cmd", test_buffer_ext_or_cmd, TT_FORK, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
+  { "socket_io", test_buffer_socket_io, TT_FORK, NULL, NULL },
+  { "note_written", test_buffer_note_written, 0, NULL, NULL },
+  { "in_place", test_buffer_in_place, TT_FORK, NULL, NULL },
+#ifdef USE_IO_URING
+  { "uring_flush", test_buffer_uring_flush, TT_FORK, NULL, NULL },
+  { "uring_read", test_buffer_uring_read, TT_FORK, NULL, NULL },
+  { "uring_cancel", test_buffer_uring_cancel, TT_FORK, NULL, NULL },
+#endif
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
   { "zlib", test_buffers_zlib, TT_FORK, NULL, NULL },
   { "zlib_fin_with_nil", test_buffers_zlib_fin_with_nil, TT_FORK, NULL, NULL },
@@ -23,30 +23,46 @@ test_cq_manip(void *arg)
   cell_queue_init(&cq);
   tt_int_op(cq.n, OP_EQ, 0);
 
-  pc1 = packed_cell_new();
-  pc2 = packed_cell_new();
-  pc3 = packed_cell_new();
-  pc4 = packed_cell_new();
-  tt_assert(pc1 && pc2 && pc3 && pc4);
+#define NEW_CELL(pc, ch) STMT_BEGIN                   \
+    pc = packed_cell_new();                             \
+    memset(pc->body, (ch), sizeof(pc->body));           \
+  STMT_END
+#define POP_CELL(ch) STMT_BEGIN                         \
+    pc_tmp = cell_queue_pop(&cq);                       \
+    tt_ptr_op(pc_tmp, OP_NE, NULL);                     \
+    tt_int_op(pc_tmp->body[0], OP_EQ, (ch));            \
+    tt_int_op(pc_tmp->body[CELL_MAX_NETWORK_SIZE-1], OP_EQ, (ch)); \
+    packed_cell_free(pc_tmp);                           \
+    pc_tmp = NULL;                                      \
+  STMT_END
 
   tt_ptr_op(NULL, OP_EQ, cell_queue_pop(&cq));
+  tt_ptr_op(NULL, OP_EQ, cell_queue_first(&cq));
 
-  /* Add and remove a singleton. */
+  /* Add and remove a singleton.  The queue takes ownership of the cell. */
+  NEW_CELL(pc1, '1');
   cell_queue_append(&cq, pc1);
+  pc1 = NULL;
   tt_int_op(cq.n, OP_EQ, 1);
-  tt_ptr_op(pc1, OP_EQ, cell_queue_pop(&cq));
+  tt_int_op(cell_queue_first(&cq)->body[0], OP_EQ, '1');
+  POP_CELL('1');
   tt_int_op(cq.n, OP_EQ, 0);
 
   /* Add and remove four items */
+  NEW_CELL(pc4, '4');
+  NEW_CELL(pc3, '3');
+  NEW_CELL(pc2, '2');
+  NEW_CELL(pc1, '1');
   cell_queue_append(&cq, pc4);
   cell_queue_append(&cq, pc3);
   cell_queue_append(&cq, pc2);
   cell_queue_append(&cq, pc1);
+  pc1 = pc2 = pc3 = pc4 = NULL;
   tt_int_op(cq.n, OP_EQ, 4);
-  tt_ptr_op(pc4, OP_EQ, cell_queue_pop(&cq));
-  tt_ptr_op(pc3, OP_EQ, cell_queue_pop(&cq));
-  tt_ptr_op(pc2, OP_EQ, cell_queue_pop(&cq));
-  tt_ptr_op(pc1, OP_EQ, cell_queue_pop(&cq));
+  POP_CELL('4');
+  POP_CELL('3');
+  POP_CELL('2');
+  POP_CELL('1');
   tt_int_op(cq.n, OP_EQ, 0);
   tt_ptr_op(NULL, OP_EQ, cell_queue_pop(&cq));
 
@@ -84,12 +100,17 @@ test_cq_manip(void *arg)
   tt_ptr_op(NULL, OP_EQ, cell_queue_pop(&cq));
 
   /* Now make sure cell_queue_clear works. */
+  NEW_CELL(pc2, '2');
+  NEW_CELL(pc1, '1');
   cell_queue_append(&cq, pc2);
   cell_queue_append(&cq, pc1);
+  pc2 = pc1 = NULL; /* prevent double-free */
   tt_int_op(cq.n, OP_EQ, 2);
   cell_queue_clear(&cq);
-  pc2 = pc1 = NULL; /* prevent double-free */
   tt_int_op(cq.n, OP_EQ, 0);
+  /* The emptied chunks wait on the freelists until we shrink them. */
+  cell_chunk_shrink_freelists(1);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 0);
 
  done:
   packed_cell_free(pc1);
@@ -103,6 +124,106 @@ test_cq_manip(void *arg)
 #ifdef ENABLE_MEMPOOLS
   free_cell_pool();
 #endif /* ENABLE_MEMPOOLS */
+#undef NEW_CELL
+#undef POP_CELL
+}
+
+static void
+test_cq_chunks(void *arg)
+{
+  cell_queue_t cq;
+  packed_cell_t *pc = NULL, *held = NULL;
+  int i, n_seen, next_in = 0, next_out = 0;
+  size_t alloc_400;
+  (void) arg;
+
+#ifdef ENABLE_MEMPOOLS
+  init_cell_pool();
+#endif /* ENABLE_MEMPOOLS */
+
+  cell_queue_init(&cq);
+
+  /* Queue enough cells to need several chunks, including some of the
+   * largest size. */
+  for (i = 0; i < 400; ++i) {
+    pc = packed_cell_new();
+    set_uint32(pc->body, htonl(next_in++));
+    cell_queue_append(&cq, pc);
+  }
+  pc = NULL;
+  tt_int_op(cq.n, OP_EQ, 400);
+  /* Chunks grow with the queue, in powers of two, up to 64 cells. */
+  alloc_400 = 2 * CELL_CHUNK_ALLOC_SIZE(1) + CELL_CHUNK_ALLOC_SIZE(2) +
+    CELL_CHUNK_ALLOC_SIZE(4) + CELL_CHUNK_ALLOC_SIZE(8) +
+    CELL_CHUNK_ALLOC_SIZE(16) + CELL_CHUNK_ALLOC_SIZE(32) +
+    6 * CELL_CHUNK_ALLOC_SIZE(64);
+  tt_int_op(cell_queue_get_allocation(&cq), OP_EQ, alloc_400);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, alloc_400);
+
+  n_seen = 0;
+  CELL_QUEUE_FOREACH_BEGIN(&cq, cell) {
+    tt_int_op(ntohl(get_uint32(cell->body)), OP_EQ, n_seen);
+    ++n_seen;
+  } CELL_QUEUE_FOREACH_END(cell);
+  tt_int_op(n_seen, OP_EQ, 400);
+
+  /* Hold on to a popped cell while its chunk drains out of the queue. */
+  held = cell_queue_pop(&cq);
+  tt_int_op(ntohl(get_uint32(held->body)), OP_EQ, next_out++);
+
+  /* Interleave pops and appends, and make sure order is kept. */
+  for (i = 0; i < 1000; ++i) {
+    if (i % 3 != 2) {
+      pc = cell_queue_pop(&cq);
+      tt_int_op(ntohl(get_uint32(pc->body)), OP_EQ, next_out++);
+      packed_cell_free(pc);
+    } else {
+      pc = packed_cell_new();
+      set_uint32(pc->body, htonl(next_in++));
+      cell_queue_append(&cq, pc);
+    }
+    pc = NULL;
+  }
+  tt_int_op(cq.n, OP_EQ, next_in - next_out);
+  tt_int_op(ntohl(get_uint32(cell_queue_first(&cq)->body)), OP_EQ,
+            next_out);
+  tt_int_op(ntohl(get_uint32(held->body)), OP_EQ, 0);
+  /* The held cell keeps its chunk allocated, outside the queue. */
+  tt_int_op(cell_queues_get_total_allocation(), OP_GE,
+            cell_queue_get_allocation(&cq) + CELL_CHUNK_ALLOC_SIZE(1));
+
+  while ((pc = cell_queue_pop(&cq))) {
+    tt_int_op(ntohl(get_uint32(pc->body)), OP_EQ, next_out++);
+    packed_cell_free(pc);
+  }
+  tt_int_op(next_out, OP_EQ, next_in);
+  tt_int_op(cq.n, OP_EQ, 0);
+  packed_cell_free(held);
+  held = NULL;
+  tt_int_op(cell_queue_get_allocation(&cq), OP_EQ, 0);
+
+  /* The drained chunks went on the freelists, so filling the queue up
+   * again reuses them instead of allocating more. */
+  tt_int_op(cell_queues_get_total_allocation(), OP_GE, alloc_400);
+  for (i = 0; i < 400; ++i) {
+    pc = packed_cell_new();
+    cell_queue_append(&cq, pc);
+  }
+  pc = NULL;
+  tt_int_op(cell_queue_get_allocation(&cq), OP_EQ, alloc_400);
+  cell_chunk_shrink_freelists(1);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, alloc_400);
+  cell_queue_clear(&cq);
+  tt_int_op(cell_chunk_shrink_freelists(1), OP_EQ, alloc_400);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  packed_cell_free(pc);
+  packed_cell_free(held);
+  cell_queue_clear(&cq);
+#ifdef ENABLE_MEMPOOLS
+  free_cell_pool();
+#endif /* ENABLE_MEMPOOLS */
 }
 
 static void
@@ -129,17 +250,20 @@ test_circuit_n_cells(void *arg)
   origin_c = origin_circuit_new();
   origin_c->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
 
-  tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(or_c)), OP_EQ, 0);
+  tt_int_op(circ_queues_get_allocation(TO_CIRCUIT(or_c)), OP_EQ, 0);
   cell_queue_append(&or_c->p_chan_cells, pc1);
-  tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(or_c)), OP_EQ, 1);
+  tt_int_op(circ_queues_get_allocation(TO_CIRCUIT(or_c)), OP_EQ,
+            CELL_CHUNK_ALLOC_SIZE(1));
   cell_queue_append(&or_c->base_.n_chan_cells, pc2);
   cell_queue_append(&or_c->base_.n_chan_cells, pc3);
-  tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(or_c)), OP_EQ, 3);
+  tt_int_op(circ_queues_get_allocation(TO_CIRCUIT(or_c)), OP_EQ,
+            3 * CELL_CHUNK_ALLOC_SIZE(1));
 
-  tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(origin_c)), OP_EQ, 0);
+  tt_int_op(circ_queues_get_allocation(TO_CIRCUIT(origin_c)), OP_EQ, 0);
   cell_queue_append(&origin_c->base_.n_chan_cells, pc4);
   cell_queue_append(&origin_c->base_.n_chan_cells, pc5);
-  tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(origin_c)), OP_EQ, 2);
+  tt_int_op(circ_queues_get_allocation(TO_CIRCUIT(origin_c)), OP_EQ,
+            2 * CELL_CHUNK_ALLOC_SIZE(1));
 
  done:
   circuit_free(TO_CIRCUIT(or_c));
@@ -152,6 +276,7 @@ test_circuit_n_cells(void *arg)
 
 struct testcase_t cell_queue_tests[] = {
   { "basic", test_cq_manip, TT_FORK, NULL, NULL, },
+  { "chunks", test_cq_chunks, TT_FORK, NULL, NULL, },
   { "circ_n_cells", test_circuit_n_cells, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -8,6 +8,7 @@
 #include "channel.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
+#include "circuituse.h"
 #include "test.h"
 
 static channel_t *
@@ -166,6 +167,12 @@ test_clist_maps(void *arg)
     tor_free(ch2->cmux);
   if (ch3)
     tor_free(ch3->cmux);
+  if (ch1)
+    channel_free_circid_table(ch1);
+  if (ch2)
+    channel_free_circid_table(ch2);
+  if (ch3)
+    channel_free_circid_table(ch3);
   tor_free(ch1);
   tor_free(ch2);
   tor_free(ch3);
@@ -173,6 +180,113 @@ test_clist_maps(void *arg)
   UNMOCK(circuitmux_detach_circuit);
 }
 
+static void
+test_clist_circid_table(void *arg)
+{
+  channel_t *ch1 = new_fake_channel();
+  channel_t *ch2 = new_fake_channel();
+  circid_t id;
+  (void) arg;
+
+  /* Placeholders use the same maps as circuits, without needing any. */
+  for (id = 1; id <= 1000; ++id)
+    channel_mark_circid_unusable(ch1, id * 7919);
+  channel_mark_circid_unusable(ch2, 7919);
+  tt_int_op(ch1->circid_table_n, OP_EQ, 1000);
+  tt_int_op(ch1->circid_table_size, OP_GE, 2000);
+  tt_int_op(ch2->circid_table_n, OP_EQ, 1);
+
+  for (id = 1; id <= 1000; ++id)
+    tt_int_op(circuit_id_in_use_on_channel(id * 7919, ch1), OP_EQ, 2);
+  tt_int_op(circuit_id_in_use_on_channel(7919 * 2, ch2), OP_EQ, 0);
+  tt_int_op(circuit_id_in_use_on_channel(7918, ch1), OP_EQ, 0);
+
+  /* Removing entries has to leave the rest of their runs reachable. */
+  for (id = 1; id <= 1000; id += 2)
+    channel_mark_circid_usable(ch1, id * 7919);
+  tt_int_op(ch1->circid_table_n, OP_EQ, 500);
+  for (id = 1; id <= 1000; ++id) {
+    tt_int_op(circuit_id_in_use_on_channel(id * 7919, ch1), OP_EQ,
+              (id % 2) ? 0 : 2);
+  }
+  tt_int_op(circuit_id_in_use_on_channel(7919, ch2), OP_EQ, 2);
+
+  channel_mark_circid_usable(ch2, 7919);
+  tt_int_op(ch2->circid_table_n, OP_EQ, 0);
+  tt_int_op(circuit_id_in_use_on_channel(7919, ch2), OP_EQ, 0);
+
+ done:
+  channel_free_circid_table(ch1);
+  channel_free_circid_table(ch2);
+  tor_free(ch1);
+  tor_free(ch2);
+}
+
+static void
+test_clist_n_streams_map(void *arg)
+{
+  or_circuit_t *or_c = or_circuit_new(0, NULL);
+  edge_connection_t *conns[41], *found;
+  int i;
+  (void) arg;
+
+  memset(conns, 0, sizeof(conns));
+  for (i = 0; i < 41; ++i) {
+    conns[i] = tor_malloc_zero(sizeof(edge_connection_t));
+    conns[i]->base_.type = CONN_TYPE_EXIT;
+    conns[i]->on_circuit = TO_CIRCUIT(or_c);
+    /* The last one reuses the ID of the fourth. */
+    conns[i]->stream_id = (i < 40) ? 1000 + i * 300 : 1900;
+  }
+
+  /* No index until there are enough streams. */
+  for (i = 0; i < 32; ++i)
+    or_circuit_add_n_stream(or_c, conns[i]);
+  tt_int_op(or_c->n_streams_count, OP_EQ, 32);
+  tt_int_op(0, OP_EQ, or_circuit_find_n_stream(or_c, 1000, &found));
+  for (i = 32; i < 41; ++i)
+    or_circuit_add_n_stream(or_c, conns[i]);
+  tt_ptr_op(or_c->n_streams, OP_EQ, conns[40]);
+
+  for (i = 0; i < 40; ++i) {
+    if (i == 3)
+      continue;
+    tt_int_op(1, OP_EQ,
+              or_circuit_find_n_stream(or_c, conns[i]->stream_id, &found));
+    tt_ptr_op(found, OP_EQ, conns[i]);
+  }
+  tt_int_op(1, OP_EQ, or_circuit_find_n_stream(or_c, 1001, &found));
+  tt_ptr_op(found, OP_EQ, NULL);
+  tt_int_op(1, OP_EQ, or_circuit_find_n_stream(or_c, 65535, &found));
+  tt_ptr_op(found, OP_EQ, NULL);
+  /* Two streams share this ID, so the caller has to look at both. */
+  tt_int_op(0, OP_EQ, or_circuit_find_n_stream(or_c, 1900, &found));
+
+  circuit_detach_stream(TO_CIRCUIT(or_c), conns[40]);
+  tt_int_op(1, OP_EQ, or_circuit_find_n_stream(or_c, 1900, &found));
+  tt_ptr_op(found, OP_EQ, conns[3]);
+  circuit_detach_stream(TO_CIRCUIT(or_c), conns[3]);
+  tt_int_op(1, OP_EQ, or_circuit_find_n_stream(or_c, 1900, &found));
+  tt_ptr_op(found, OP_EQ, NULL);
+  tt_int_op(1, OP_EQ, or_circuit_find_n_stream(or_c, 1300, &found));
+  tt_ptr_op(found, OP_EQ, conns[1]);
+
+  /* Once the list is short again, we drop the index. */
+  for (i = 39; i >= 16; --i)
+    circuit_detach_stream(TO_CIRCUIT(or_c), conns[i]);
+  tt_int_op(or_c->n_streams_count, OP_EQ, 15);
+  tt_ptr_op(or_c->n_streams_map, OP_EQ, NULL);
+  tt_int_op(0, OP_EQ, or_circuit_find_n_stream(or_c, 1300, &found));
+
+ done:
+  for (i = 0; i < 41; ++i) {
+    if (conns[i] && conns[i]->on_circuit)
+      circuit_detach_stream(TO_CIRCUIT(or_c), conns[i]);
+    tor_free(conns[i]);
+  }
+  circuit_free(TO_CIRCUIT(or_c));
+}
+
 static void
 test_rend_token_maps(void *arg)
 {
@@ -345,6 +459,8 @@ test_pick_circid(void *arg)
 
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
+  { "circid_table", test_clist_circid_table, TT_FORK, NULL, NULL },
+  { "n_streams_map", test_clist_n_streams_map, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
@@ -7,6 +7,8 @@
 #include "or.h"
 #include "channel.h"
 #include "circuitmux.h"
+#include "circuitmux_ewma.h"
+#include "compat_libevent.h"
 #include "relay.h"
 #include "scheduler.h"
 #include "test.h"
@@ -88,8 +90,135 @@ test_cmux_destroy_cell_queue(void *arg)
 #endif /* ENABLE_MEMPOOLS */
 }
 
+/** How many circuits test_cmux_ewma_lazy_rescale() schedules among. */
+#define N_EWMA_CIRCS 6
+/** How many steps test_cmux_ewma_lazy_rescale() runs for. */
+#define N_EWMA_STEPS 2000
+
+/** Run the EWMA policy through a fixed sequence of activity on
+ * N_EWMA_CIRCS circuits, rescaling whenever the values grow by more than
+ * <b>max_scale</b>, and record which circuit it picks at each step in
+ * <b>picks_out</b>.  Return the number of steps on which there was nothing
+ * to pick. */
+static int
+run_ewma_sequence(double max_scale, int *picks_out)
+{
+  const circuitmux_policy_t *pol = &ewma_policy;
+  circuitmux_t *cmux = circuitmux_alloc();
+  circuitmux_policy_data_t *pol_data;
+  circuitmux_policy_circ_data_t *circ_data[N_EWMA_CIRCS];
+  circuit_t circs[N_EWMA_CIRCS];
+  int active[N_EWMA_CIRCS];
+  struct timeval now;
+  uint32_t seed = 12345;
+  int i, step, n_idle = 0;
+
+  ewma_max_scale = max_scale;
+  now.tv_sec = 1000000000;
+  now.tv_usec = 0;
+  tor_gettimeofday_cache_set(&now);
+  update_approx_time(now.tv_sec);
+
+  memset(circs, 0, sizeof(circs));
+  pol_data = pol->alloc_cmux_data(cmux);
+  for (i = 0; i < N_EWMA_CIRCS; ++i) {
+    circ_data[i] = pol->alloc_circ_data(cmux, pol_data, &circs[i],
+                                        CELL_DIRECTION_OUT, 0);
+    pol->notify_circ_active(cmux, pol_data, &circs[i], circ_data[i]);
+    active[i] = 1;
+  }
+
+/* A fixed pseudorandom sequence, so that every run sees the same activity */
+#define NEXT_RAND() (seed = seed * 1103515245 + 12345, (seed >> 16) & 0x7fff)
+
+  for (step = 0; step < N_EWMA_STEPS; ++step) {
+    circuit_t *circ;
+    int which = NEXT_RAND() % N_EWMA_CIRCS;
+
+    /* Let some time pass: usually a little, sometimes several ticks. */
+    if (NEXT_RAND() % 50 == 0)
+      now.tv_sec += 5 + NEXT_RAND() % 60;
+    now.tv_usec += 1000 * (NEXT_RAND() % 400);
+    now.tv_sec += now.tv_usec / 1000000;
+    now.tv_usec %= 1000000;
+    tor_gettimeofday_cache_set(&now);
+    update_approx_time(now.tv_sec);
+
+    /* Sometimes a circuit runs out of cells, or gets some more. */
+    if (NEXT_RAND() % 8 == 0) {
+      if (active[which])
+        pol->notify_circ_inactive(cmux, pol_data, &circs[which],
+                                  circ_data[which]);
+      else
+        pol->notify_circ_active(cmux, pol_data, &circs[which],
+                                circ_data[which]);
+      active[which] = !active[which];
+    }
+
+    circ = pol->pick_active_circuit(cmux, pol_data);
+    if (!circ) {
+      picks_out[step] = -1;
+      ++n_idle;
+      continue;
+    }
+    picks_out[step] = (int)(circ - circs);
+    pol->notify_xmit_cells(cmux, pol_data, circ,
+                           circ_data[picks_out[step]],
+                           1 + NEXT_RAND() % 4);
+  }
+#undef NEXT_RAND
+
+  for (i = 0; i < N_EWMA_CIRCS; ++i) {
+    if (active[i])
+      pol->notify_circ_inactive(cmux, pol_data, &circs[i], circ_data[i]);
+    pol->free_circ_data(cmux, pol_data, &circs[i], circ_data[i]);
+  }
+  pol->free_cmux_data(cmux, pol_data);
+  circuitmux_free(cmux);
+  return n_idle;
+}
+
+/** Rescaling the EWMA values lazily, only when they get large, must pick
+ * circuits in the same order as rescaling them on every tick. */
+static void
+test_cmux_ewma_lazy_rescale(void *arg)
+{
+  or_options_t options;
+  int *eager = tor_calloc(N_EWMA_STEPS, sizeof(int));
+  int *lazy = tor_calloc(N_EWMA_STEPS, sizeof(int));
+  int *sometimes = tor_calloc(N_EWMA_STEPS, sizeof(int));
+  const double default_max_scale = ewma_max_scale;
+  int step;
+  (void)arg;
+
+  memset(&options, 0, sizeof(options));
+  options.CircuitPriorityHalflife = 30.0;
+  cell_ewma_set_scale_factor(&options, NULL);
+  tt_assert(cell_ewma_enabled());
+
+  /* Eager: rescale on every new tick, as we used to. */
+  tt_int_op(run_ewma_sequence(1.0, eager), OP_LT, N_EWMA_STEPS / 2);
+  /* Lazy, with a threshold low enough that we rescale now and then. */
+  run_ewma_sequence(1.0e3, sometimes);
+  /* Lazy, as in production. */
+  run_ewma_sequence(default_max_scale, lazy);
+
+  for (step = 0; step < N_EWMA_STEPS; ++step) {
+    tt_int_op(lazy[step], OP_EQ, eager[step]);
+    tt_int_op(sometimes[step], OP_EQ, eager[step]);
+  }
+
+ done:
+  ewma_max_scale = default_max_scale;
+  cell_ewma_set_scale_factor(NULL, NULL);
+  tor_free(eager);
+  tor_free(lazy);
+  tor_free(sometimes);
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
+  { "ewma_lazy_rescale", test_cmux_ewma_lazy_rescale, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -0,0 +1,245 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define CONNECTION_PRIVATE
+#include "or.h"
+#include "config.h"
+#include "connection.h"
+#include "test.h"
+
+/** Options that the tests below hand to the code they test. */
+static or_options_t mock_options;
+
+static const or_options_t *
+mock_get_options(void)
+{
+  return &mock_options;
+}
+
+/** How many times has mock_connection_accept_one() been called? */
+static int n_accept_calls = 0;
+/** How many connections are waiting to be accepted, or -1 if accepting
+ * should fail. */
+static int n_waiting_to_accept = 0;
+
+static int
+mock_connection_accept_one(connection_t *conn, int new_type)
+{
+  (void)conn;
+  (void)new_type;
+  ++n_accept_calls;
+  if (n_waiting_to_accept < 0)
+    return -1;
+  if (n_waiting_to_accept == 0)
+    return 0;
+  --n_waiting_to_accept;
+  return 1;
+}
+
+/* A readable listener accepts what's waiting, but no more than
+ * MAX_ACCEPTS_PER_LISTENER_READ connections at a time. */
+static void
+test_conn_listener_read_limit(void *arg)
+{
+  connection_t *listener = NULL;
+  (void)arg;
+
+  MOCK(connection_accept_one, mock_connection_accept_one);
+  listener = connection_new(CONN_TYPE_OR_LISTENER, AF_INET);
+
+  /* Lots waiting: we stop at the limit, and leave the rest for next time. */
+  n_waiting_to_accept = MAX_ACCEPTS_PER_LISTENER_READ * 3 + 10;
+  n_accept_calls = 0;
+  tt_int_op(connection_handle_listener_read(listener, CONN_TYPE_OR), OP_EQ,
+            0);
+  tt_int_op(n_accept_calls, OP_EQ, MAX_ACCEPTS_PER_LISTENER_READ);
+  tt_int_op(n_waiting_to_accept, OP_EQ,
+            MAX_ACCEPTS_PER_LISTENER_READ * 2 + 10);
+
+  /* A few waiting: we take them all, and stop when the queue is empty. */
+  n_waiting_to_accept = 5;
+  n_accept_calls = 0;
+  tt_int_op(connection_handle_listener_read(listener, CONN_TYPE_OR), OP_EQ,
+            0);
+  tt_int_op(n_accept_calls, OP_EQ, 6);
+  tt_int_op(n_waiting_to_accept, OP_EQ, 0);
+
+  /* The listener broke: we stop at once and say so. */
+  n_waiting_to_accept = -1;
+  n_accept_calls = 0;
+  tt_int_op(connection_handle_listener_read(listener, CONN_TYPE_OR), OP_EQ,
+            -1);
+  tt_int_op(n_accept_calls, OP_EQ, 1);
+
+ done:
+  UNMOCK(connection_accept_one);
+  if (listener)
+    connection_free_(listener);
+}
+
+/** How many listeners has mock_connection_listener_new() made? */
+static int n_listeners_made = 0;
+
+static connection_t *
+mock_connection_listener_new(const struct sockaddr *listensockaddr,
+                             socklen_t socklen, int type,
+                             const char *address, const port_cfg_t *port_cfg)
+{
+  connection_t *conn;
+  (void)listensockaddr;
+  (void)socklen;
+
+  conn = connection_new(type, AF_INET);
+  tor_addr_copy(&conn->addr, &port_cfg->addr);
+  /* Pretend that the kernel picked a port for us, if we asked. */
+  conn->port = port_cfg->port == CFG_AUTO_PORT ? 50000 : port_cfg->port;
+  conn->address = tor_strdup(address);
+  ++n_listeners_made;
+  return conn;
+}
+
+/** Return a new port_cfg_t for a <b>type</b> listener on
+ * <b>addr</b>:<b>port</b>. */
+static port_cfg_t *
+test_port_cfg_new(int type, const char *addr, int port)
+{
+  port_cfg_t *cfg = tor_malloc_zero(sizeof(port_cfg_t));
+  cfg->type = type;
+  tor_addr_parse(&cfg->addr, addr);
+  cfg->port = port;
+  return cfg;
+}
+
+/** Return how many connections in <b>conns</b> are <b>type</b> listeners
+ * on port <b>port</b>. */
+static int
+count_listeners(const smartlist_t *conns, int type, uint16_t port)
+{
+  int n = 0;
+  SMARTLIST_FOREACH(conns, const connection_t *, conn,
+                    n += (conn->type == type && conn->port == port));
+  return n;
+}
+
+/* Opening, keeping, adding, and closing listeners as NumORPortListeners
+ * changes. */
+static void
+test_conn_retry_listener_ports(void *arg)
+{
+  smartlist_t *ports = smartlist_new();
+  smartlist_t *all_conns = smartlist_new();
+  smartlist_t *old_conns = smartlist_new();
+  smartlist_t *new_conns = smartlist_new();
+  (void)arg;
+
+  MOCK(get_options, mock_get_options);
+  MOCK(connection_listener_new, mock_connection_listener_new);
+  memset(&mock_options, 0, sizeof(mock_options));
+
+  smartlist_add(ports, test_port_cfg_new(CONN_TYPE_OR_LISTENER,
+                                         "127.0.0.1", 9001));
+  smartlist_add(ports, test_port_cfg_new(CONN_TYPE_OR_LISTENER,
+                                         "127.0.0.2", CFG_AUTO_PORT));
+  smartlist_add(ports, test_port_cfg_new(CONN_TYPE_DIR_LISTENER,
+                                         "127.0.0.1", 9030));
+
+  /* From nothing: three sockets on the fixed ORPort, but only one on the
+   * automatic one, and only one on the DirPort. */
+  mock_options.NumORPortListeners = 3;
+  tt_int_op(0, OP_EQ, retry_listener_ports(old_conns, ports, new_conns, 0));
+  tt_int_op(n_listeners_made, OP_EQ, 5);
+  tt_int_op(smartlist_len(new_conns), OP_EQ, 5);
+  tt_int_op(count_listeners(new_conns, CONN_TYPE_OR_LISTENER, 9001), OP_EQ, 3);
+  tt_int_op(count_listeners(new_conns, CONN_TYPE_OR_LISTENER, 50000), OP_EQ,
+            1);
+  tt_int_op(count_listeners(new_conns, CONN_TYPE_DIR_LISTENER, 9030), OP_EQ,
+            1);
+  smartlist_add_all(all_conns, new_conns);
+  smartlist_clear(new_conns);
+
+  /* Same number again: we keep every listener and open nothing. */
+  smartlist_add_all(old_conns, all_conns);
+  tt_int_op(0, OP_EQ, retry_listener_ports(old_conns, ports, new_conns, 0));
+  tt_int_op(n_listeners_made, OP_EQ, 5);
+  tt_int_op(smartlist_len(new_conns), OP_EQ, 0);
+  tt_int_op(smartlist_len(old_conns), OP_EQ, 0);
+
+  /* More: we keep every listener, and open the extra ORPort sockets. */
+  mock_options.NumORPortListeners = 5;
+  smartlist_add_all(old_conns, all_conns);
+  tt_int_op(0, OP_EQ, retry_listener_ports(old_conns, ports, new_conns, 0));
+  tt_int_op(n_listeners_made, OP_EQ, 7);
+  tt_int_op(smartlist_len(new_conns), OP_EQ, 2);
+  tt_int_op(count_listeners(new_conns, CONN_TYPE_OR_LISTENER, 9001), OP_EQ, 2);
+  tt_int_op(smartlist_len(old_conns), OP_EQ, 0);
+  smartlist_add_all(all_conns, new_conns);
+  smartlist_clear(new_conns);
+
+  /* Fewer: we open nothing, and leave the surplus ORPort sockets in
+   * old_conns for our caller to close. */
+  mock_options.NumORPortListeners = 2;
+  smartlist_add_all(old_conns, all_conns);
+  tt_int_op(0, OP_EQ, retry_listener_ports(old_conns, ports, new_conns, 0));
+  tt_int_op(n_listeners_made, OP_EQ, 7);
+  tt_int_op(smartlist_len(new_conns), OP_EQ, 0);
+  tt_int_op(smartlist_len(old_conns), OP_EQ, 3);
+  tt_int_op(count_listeners(old_conns, CONN_TYPE_OR_LISTENER, 9001), OP_EQ, 3);
+
+ done:
+  UNMOCK(get_options);
+  UNMOCK(connection_listener_new);
+  SMARTLIST_FOREACH(all_conns, connection_t *, conn, connection_free_(conn));
+  SMARTLIST_FOREACH(ports, port_cfg_t *, cfg, tor_free(cfg));
+  smartlist_free(all_conns);
+  smartlist_free(old_conns);
+  smartlist_free(new_conns);
+  smartlist_free(ports);
+}
+
+#ifdef SO_REUSEPORT
+/* Sockets with make_socket_reuseport() can share a port; others can't. */
+static void
+test_conn_reuseport(void *arg)
+{
+  tor_socket_t s[3] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET,
+                        TOR_INVALID_SOCKET };
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 3; ++i) {
+    s[i] = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    tt_assert(SOCKET_OK(s[i]));
+  }
+  tt_int_op(0, OP_EQ, make_socket_reuseport(s[0]));
+  tt_int_op(0, OP_EQ, make_socket_reuseport(s[1]));
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  tt_int_op(0, OP_EQ, bind(s[0], (struct sockaddr *)&sin, sizeof(sin)));
+  tt_int_op(0, OP_EQ, getsockname(s[0], (struct sockaddr *)&sin, &len));
+  tt_int_op(0, OP_NE, sin.sin_port);
+
+  tt_int_op(0, OP_EQ, bind(s[1], (struct sockaddr *)&sin, sizeof(sin)));
+  tt_int_op(0, OP_NE, bind(s[2], (struct sockaddr *)&sin, sizeof(sin)));
+
+ done:
+  for (i = 0; i < 3; ++i) {
+    if (SOCKET_OK(s[i]))
+      tor_close_socket(s[i]);
+  }
+}
+#endif
+
+struct testcase_t connection_tests[] = {
+  { "listener_read_limit", test_conn_listener_read_limit, TT_FORK,
+    NULL, NULL },
+  { "retry_listener_ports", test_conn_retry_listener_ports, TT_FORK,
+    NULL, NULL },
+#ifdef SO_REUSEPORT
+  { "reuseport", test_conn_reuseport, TT_FORK, NULL, NULL },
+#endif
+  END_OF_TESTCASES
+};
@@ -84,6 +84,55 @@ test_cntev_bucket_millis_empty(void *arg)
   ;
 }
 
+#ifndef USE_BUFFEREVENTS
+static void
+test_cntev_bucket_catch_up(void *arg)
+{
+  or_connection_t *or_conn = NULL;
+  (void)arg;
+
+  or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  or_conn->base_.state = OR_CONN_STATE_OPEN;
+  or_conn->bandwidthrate = 1000;
+  or_conn->bandwidthburst = 3000;
+  connection_bucket_catch_up(or_conn);
+  or_conn->read_bucket = 0;
+  or_conn->write_bucket = -500;
+
+  /* Refilling leaves the connection alone until we look at it. */
+  connection_bucket_refill(500, time(NULL));
+  tt_int_op(or_conn->read_bucket, OP_EQ, 0);
+  tt_int_op(or_conn->write_bucket, OP_EQ, -500);
+  connection_bucket_catch_up(or_conn);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 500);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 0);
+  connection_bucket_catch_up(or_conn);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 500);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 0);
+
+  /* Several refills get settled at once, but never past the burst. */
+  connection_bucket_refill(1000, time(NULL));
+  connection_bucket_refill(1000, time(NULL));
+  connection_bucket_catch_up(or_conn);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 2500);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 2000);
+  connection_bucket_refill(5000, time(NULL));
+  connection_bucket_catch_up(or_conn);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 3000);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 3000);
+
+  /* Connections that aren't open don't earn tokens. */
+  or_conn->base_.state = OR_CONN_STATE_OR_HANDSHAKING_V3;
+  or_conn->read_bucket = 0;
+  connection_bucket_refill(1000, time(NULL));
+  connection_bucket_catch_up(or_conn);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 0);
+
+ done:
+  connection_free_(TO_CONN(or_conn));
+}
+#endif
+
 static void
 add_testing_cell_stats_entry(circuit_t *circ, uint8_t command,
                              unsigned int waiting_time,
@@ -299,6 +348,9 @@ test_cntev_format_cell_stats(void *arg)
 struct testcase_t controller_event_tests[] = {
   TEST(bucket_note_empty, 0),
   TEST(bucket_millis_empty, 0),
+#ifndef USE_BUFFEREVENTS
+  TEST(bucket_catch_up, 0),
+#endif
   TEST(sum_up_cell_stats, 0),
   TEST(append_cell_stats, 0),
   TEST(format_cell_stats, 0),
@@ -15,6 +15,7 @@
 #include "crypto_ed25519.h"
 #include "ed25519_vectors.inc"
 #include "crypto_s2k.h"
+#include "crypto_sha1_multi.h"
 #include "crypto_pwbox.h"
 
 extern const char AUTHORITY_SIGNKEY_3[];
@@ -1198,6 +1199,216 @@ test_crypto_aes_iv(void *arg)
   tor_free(decrypted2);
 }
 
+/** Test crypting several buffers with one call. */
+static void
+test_crypto_aes_multi(void *arg)
+{
+  char key[CIPHER_KEY_LEN];
+  char *bufs[20], *bufs2[20];
+  crypto_cipher_t *c1 = NULL, *c2 = NULL;
+  const size_t lens[] = { 1, 16, 509, 4096, 5000 };
+  int i, j, use_evp = !strcmp(arg,"evp");
+
+  evaluate_evp_for_aes(use_evp);
+  memset(bufs, 0, sizeof(bufs));
+  memset(bufs2, 0, sizeof(bufs2));
+  crypto_rand(key, sizeof(key));
+
+  for (j = 0; j < (int)(ARRAY_LENGTH(lens)); ++j) {
+    c1 = crypto_cipher_new(key);
+    c2 = crypto_cipher_new(key);
+    for (i = 0; i < 20; ++i) {
+      bufs[i] = tor_malloc(lens[j]);
+      crypto_rand(bufs[i], lens[j]);
+      bufs2[i] = tor_memdup(bufs[i], lens[j]);
+    }
+    /* Start partway through a block, and crypt enough buffers to need more
+     * than one batch of keystream. */
+    crypto_cipher_crypt_inplace(c1, bufs[0], 1);
+    crypto_cipher_crypt_inplace(c2, bufs2[0], 1);
+    tt_int_op(0, OP_EQ, crypto_cipher_crypt_inplace_multi(c1, bufs+1,
+                                                          lens[j], 19));
+    for (i = 1; i < 20; ++i)
+      crypto_cipher_crypt_inplace(c2, bufs2[i], lens[j]);
+    for (i = 0; i < 20; ++i) {
+      tt_mem_op(bufs[i], OP_EQ, bufs2[i], lens[j]);
+      tor_free(bufs[i]);
+      tor_free(bufs2[i]);
+    }
+    crypto_cipher_free(c1);
+    crypto_cipher_free(c2);
+    c1 = c2 = NULL;
+  }
+
+ done:
+  for (i = 0; i < 20; ++i) {
+    tor_free(bufs[i]);
+    tor_free(bufs2[i]);
+  }
+  crypto_cipher_free(c1);
+  crypto_cipher_free(c2);
+}
+
+/** Test updating several digests at once. */
+static void
+test_crypto_digest_multi(void *arg)
+{
+  crypto_digest_t *d1[12], *d2[12];
+  const char *data[12], *expected[12];
+  char *buf = NULL, *joined = NULL, out1[DIGEST_LEN], out2[DIGEST_LEN];
+  char want[12][4];
+  int matched[12];
+  const int lanes[] = { 1, 4, 8 };
+  const size_t len = 509;
+  int i, j;
+  (void)arg;
+
+  memset(d1, 0, sizeof(d1));
+  memset(d2, 0, sizeof(d2));
+  buf = tor_malloc(12 * len + 100);
+  crypto_rand(buf, 12 * len + 100);
+  joined = tor_malloc(12 * 7 + 2 * len);
+
+  for (j = 0; j < (int)(ARRAY_LENGTH(lanes)); ++j) {
+    sha1_multi_set_n_lanes(lanes[j]);
+    for (i = 0; i < 12; ++i) {
+      crypto_digest_free(d1[i]);
+      crypto_digest_free(d2[i]);
+      d1[i] = crypto_digest_new();
+      d2[i] = crypto_digest_new();
+      /* Give each digest a different partial block to start with. */
+      crypto_digest_add_bytes(d1[i], buf, i * 7);
+      crypto_digest_add_bytes(d2[i], buf, i * 7);
+      data[i] = buf + i * len + (i % 5);
+    }
+
+    /* Adding data to each matches adding it one at a time, twice over. */
+    crypto_digest_add_bytes_multi(d1, data, len, 12);
+    crypto_digest_add_bytes_multi(d1, data, len, 12);
+    for (i = 0; i < 12; ++i) {
+      crypto_digest_add_bytes(d2[i], data[i], len);
+      crypto_digest_add_bytes(d2[i], data[i], len);
+      crypto_digest_get_digest(d1[i], out1, DIGEST_LEN);
+      crypto_digest_get_digest(d2[i], out2, DIGEST_LEN);
+      tt_mem_op(out1, OP_EQ, out2, DIGEST_LEN);
+      /* ... and what OpenSSL gets for the same input. */
+      memcpy(joined, buf, i * 7);
+      memcpy(joined + i * 7, data[i], len);
+      memcpy(joined + i * 7 + len, data[i], len);
+      crypto_digest(out2, joined, i * 7 + 2 * len);
+      tt_mem_op(out1, OP_EQ, out2, DIGEST_LEN);
+    }
+
+    /* Checking moves on just the digests that match. */
+    for (i = 0; i < 12; ++i) {
+      crypto_digest_t *tmp = crypto_digest_dup(d2[i]);
+      crypto_digest_add_bytes(tmp, data[i], len);
+      crypto_digest_get_digest(tmp, want[i], 4);
+      if (i % 3 == 0)
+        want[i][0] ^= 1;
+      else
+        crypto_digest_assign(d2[i], tmp);
+      crypto_digest_free(tmp);
+      expected[i] = want[i];
+    }
+    crypto_digest_check_multi(d1, data, len, expected, 4, matched, 12);
+    for (i = 0; i < 12; ++i) {
+      tt_int_op(matched[i], OP_EQ, i % 3 != 0);
+      crypto_digest_get_digest(d1[i], out1, DIGEST_LEN);
+      crypto_digest_get_digest(d2[i], out2, DIGEST_LEN);
+      tt_mem_op(out1, OP_EQ, out2, DIGEST_LEN);
+    }
+  }
+
+ done:
+  sha1_multi_set_n_lanes(-1);
+  for (i = 0; i < 12; ++i) {
+    crypto_digest_free(d1[i]);
+    crypto_digest_free(d2[i]);
+  }
+  tor_free(buf);
+  tor_free(joined);
+}
+
+/** Test crypting and digesting in a single pass. */
+static void
+test_crypto_cipher_digest(void *arg)
+{
+  char key[CIPHER_KEY_LEN], plain[509], buf[509], buf2[509];
+  char prefix[11], d_out1[DIGEST_LEN], d_out2[DIGEST_LEN];
+  crypto_cipher_t *c1 = NULL, *c2 = NULL;
+  crypto_digest_t *d1 = NULL, *d2 = NULL;
+  (void)arg;
+
+  crypto_rand(key, sizeof(key));
+  crypto_rand(plain, sizeof(plain));
+  crypto_rand(prefix, sizeof(prefix));
+  c1 = crypto_cipher_new(key);
+  c2 = crypto_cipher_new(key);
+  d1 = crypto_digest_new();
+  d2 = crypto_digest_new();
+
+  /* Encrypting matches digesting and then encrypting. */
+  memcpy(buf, plain, sizeof(plain));
+  memcpy(buf2, plain, sizeof(plain));
+  tt_int_op(0, OP_EQ,
+            crypto_cipher_crypt_digest_inplace(c1, d1, buf, sizeof(buf), 1));
+  crypto_digest_add_bytes(d2, buf2, sizeof(buf2));
+  crypto_cipher_crypt_inplace(c2, buf2, sizeof(buf2));
+  tt_mem_op(buf, OP_EQ, buf2, sizeof(buf));
+  crypto_digest_get_digest(d1, d_out1, DIGEST_LEN);
+  crypto_digest_get_digest(d2, d_out2, DIGEST_LEN);
+  tt_mem_op(d_out1, OP_EQ, d_out2, DIGEST_LEN);
+
+  /* Decrypting matches decrypting and then digesting. */
+  crypto_cipher_free(c1);
+  crypto_cipher_free(c2);
+  c1 = crypto_cipher_new(key);
+  c2 = crypto_cipher_new(key);
+  tt_int_op(0, OP_EQ,
+            crypto_cipher_crypt_digest_inplace(c1, d1, buf, sizeof(buf), 0));
+  crypto_cipher_crypt_inplace(c2, buf2, sizeof(buf2));
+  crypto_digest_add_bytes(d2, buf2, sizeof(buf2));
+  tt_mem_op(buf, OP_EQ, plain, sizeof(buf));
+  tt_mem_op(buf2, OP_EQ, plain, sizeof(buf));
+  crypto_digest_get_digest(d1, d_out1, DIGEST_LEN);
+  crypto_digest_get_digest(d2, d_out2, DIGEST_LEN);
+  tt_mem_op(d_out1, OP_EQ, d_out2, DIGEST_LEN);
+
+  /* A failed check decrypts, but leaves the digest alone. */
+  crypto_cipher_crypt_inplace(c2, buf2, sizeof(buf2));
+  memcpy(buf, buf2, sizeof(buf));
+  memset(d_out2, 0, sizeof(d_out2));
+  tt_int_op(0, OP_EQ,
+            crypto_cipher_decrypt_digest_check(c1, d1, prefix, sizeof(prefix),
+                                               buf, sizeof(buf),
+                                               d_out2, 4));
+  tt_mem_op(buf, OP_EQ, plain, sizeof(buf));
+  crypto_digest_get_digest(d1, d_out2, DIGEST_LEN);
+  tt_mem_op(d_out1, OP_EQ, d_out2, DIGEST_LEN);
+
+  /* A successful one moves the digest on past the prefix and plaintext. */
+  memcpy(buf2, plain, sizeof(plain));
+  crypto_cipher_crypt_inplace(c2, buf2, sizeof(buf2));
+  memcpy(buf, buf2, sizeof(buf));
+  crypto_digest_add_bytes(d2, prefix, sizeof(prefix));
+  crypto_digest_add_bytes(d2, plain, sizeof(plain));
+  crypto_digest_get_digest(d2, d_out2, DIGEST_LEN);
+  tt_int_op(1, OP_EQ,
+            crypto_cipher_decrypt_digest_check(c1, d1, prefix, sizeof(prefix),
+                                               buf, sizeof(buf),
+                                               d_out2, 4));
+  tt_mem_op(buf, OP_EQ, plain, sizeof(buf));
+  crypto_digest_get_digest(d1, d_out1, DIGEST_LEN);
+  tt_mem_op(d_out1, OP_EQ, d_out2, DIGEST_LEN);
+
+ done:
+  crypto_cipher_free(c1);
+  crypto_cipher_free(c2);
+  crypto_digest_free(d1);
+  crypto_digest_free(d2);
+}
+
 /** Test base32 decoding. */
 static void
 test_crypto_base32_decode(void *arg)
@@ -2023,6 +2234,12 @@ struct testcase_t crypto_tests[] = {
   { "pwbox", test_crypto_pwbox, 0, NULL, NULL },
   { "aes_iv_AES", test_crypto_aes_iv, TT_FORK, &pass_data, (void*)"aes" },
   { "aes_iv_EVP", test_crypto_aes_iv, TT_FORK, &pass_data, (void*)"evp" },
+  { "aes_multi_AES", test_crypto_aes_multi, TT_FORK, &pass_data,
+    (void*)"aes" },
+  { "aes_multi_EVP", test_crypto_aes_multi, TT_FORK, &pass_data,
+    (void*)"evp" },
+  { "cipher_digest", test_crypto_cipher_digest, 0, NULL, NULL },
+  { "digest_multi", test_crypto_digest_multi, TT_FORK, NULL, NULL },
   CRYPTO_LEGACY(base32_decode),
   { "kdf_TAP", test_crypto_kdf_TAP, 0, NULL, NULL },
   { "hkdf_sha256", test_crypto_hkdf_sha256, 0, NULL, NULL },
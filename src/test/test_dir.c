@@ -2363,6 +2363,92 @@ test_dir_random_weighted(void *testdata)
   ;
 }
 
+static void
+test_dir_alias_weighted(void *testdata)
+{
+  int histogram[10];
+  uint64_t vals[10] = {3,1,2,4,6,0,7,5,8,9}, total=0;
+  u64_dbl_t inp[10];
+  alias_table_t *table = NULL;
+  int i, choice;
+  const int n = 50000;
+  double max_sq_error;
+  (void) testdata;
+
+  /* The same ten-element array as in test_dir_random_weighted(). */
+  memset(histogram,0,sizeof(histogram));
+  for (i=0; i<10; ++i) {
+    inp[i].u64 = vals[i];
+    total += vals[i];
+  }
+  tt_ptr_op(alias_table_new(inp, 0), OP_EQ, NULL);
+  table = alias_table_new(inp, 10);
+  tt_assert(table);
+  tt_int_op(table->n, OP_EQ, 10);
+  for (i=0; i<n; ++i) {
+    choice = alias_table_choose(table);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 10);
+    histogram[choice]++;
+  }
+  alias_table_free(table);
+  table = NULL;
+
+  max_sq_error = 0;
+  for (i=0; i<10; ++i) {
+    int expected = (int)(n*vals[i]/total);
+    double frac_diff = 0, sq;
+    TT_BLATHER(("  %d : %5d vs %5d\n", (int)vals[i], histogram[i], expected));
+    if (expected)
+      frac_diff = (histogram[i] - expected) / ((double)expected);
+    else
+      tt_int_op(histogram[i], OP_EQ, 0);
+
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+
+  /* A singleton is always chosen. */
+  table = alias_table_new(inp, 1);
+  for (i = 0; i < 100; ++i)
+    tt_int_op(alias_table_choose(table), OP_EQ, 0);
+  alias_table_free(table);
+  table = NULL;
+
+  /* With one heavy element, the others are still chosen in proportion. */
+  memset(histogram,0,sizeof(histogram));
+  for (i = 0; i < 4; ++i)
+    inp[i].u64 = 1;
+  inp[4].u64 = 96;
+  table = alias_table_new(inp, 5);
+  for (i = 0; i < n; ++i)
+    histogram[alias_table_choose(table)]++;
+  alias_table_free(table);
+  table = NULL;
+  tt_int_op(histogram[4], OP_GT, n*9/10);
+  for (i = 0; i < 4; ++i) {
+    tt_int_op(histogram[i], OP_GT, 0);
+    tt_int_op(histogram[i], OP_LT, n/20);
+  }
+
+  /* An array of zeros is chosen from uniformly. */
+  memset(histogram,0,sizeof(histogram));
+  for (i = 0; i < 5; ++i)
+    inp[i].u64 = 0;
+  table = alias_table_new(inp, 5);
+  for (i = 0; i < n; ++i)
+    histogram[alias_table_choose(table)]++;
+  for (i = 0; i < 5; ++i) {
+    tt_int_op(histogram[i], OP_GT, n/5 - n/25);
+    tt_int_op(histogram[i], OP_LT, n/5 + n/25);
+  }
+
+ done:
+  alias_table_free(table);
+}
+
 /* Function pointers for test_dir_clip_unmeasured_bw_kb() */
 
 static uint32_t alternate_clip_bw = 0;
@@ -2915,6 +3001,7 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(param_voting),
   DIR_LEGACY(v3_networkstatus),
   DIR(random_weighted, 0),
+  DIR(alias_weighted, 0),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
   DIR_LEGACY(clip_unmeasured_bw_kb_alt),
@@ -8,6 +8,9 @@
 
 #include "or.h"
 #include "nodelist.h"
+#include "policies.h"
+#include "routerlist.h"
+#include "routerparse.h"
 #include "test.h"
 
 /** Tese the case when node_get_by_id() returns NULL,
@@ -60,12 +63,184 @@ test_nodelist_node_get_verbose_nickname_not_named(void *arg)
   return;
 }
 
+/** Make a routerinfo with identity digest full of <b>id</b>, whose exit
+ * policy is the comma-separated list of entries in <b>policy</b>. */
+static routerinfo_t *
+make_ri_with_exit_policy(char id, const char *policy)
+{
+  routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+  smartlist_t *items = smartlist_new();
+  memset(ri->cache_info.identity_digest, id, DIGEST_LEN);
+  ri->purpose = ROUTER_PURPOSE_GENERAL;
+  ri->exit_policy = smartlist_new();
+  smartlist_split_string(items, policy, ",", 0, 0);
+  SMARTLIST_FOREACH(items, char *, item, {
+    addr_policy_t *p = router_parse_addr_policy_item_from_string(item, -1);
+    tor_assert(p);
+    smartlist_add(ri->exit_policy, p);
+    tor_free(item);
+  });
+  smartlist_free(items);
+  return ri;
+}
+
+/** Make sure the exit port index agrees with the nodes' exit policies, and
+ * that it notices when the nodelist changes. */
+static void
+test_nodelist_exit_port_index(void *arg)
+{
+  routerinfo_t *ri1 = NULL, *ri2 = NULL, *ri3 = NULL;
+  const node_t *n1, *n2, *n3;
+  const bitarray_t *ba;
+  (void) arg;
+
+  ri1 = make_ri_with_exit_policy('\x01', "accept *:80,reject *:*");
+  ri2 = make_ri_with_exit_policy('\x02', "reject *:*");
+  ri3 = make_ri_with_exit_policy('\x03',
+                       "reject 10.0.0.0/8:*,accept *:80-443,reject *:*");
+  n1 = nodelist_set_routerinfo(ri1, NULL);
+  n2 = nodelist_set_routerinfo(ri2, NULL);
+  n3 = nodelist_set_routerinfo(ri3, NULL);
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 3);
+
+  ba = nodelist_get_exit_port_bitarray(80);
+  tt_assert(bitarray_is_set(ba, n1->nodelist_idx));
+  tt_assert(!bitarray_is_set(ba, n2->nodelist_idx));
+  tt_assert(bitarray_is_set(ba, n3->nodelist_idx));
+
+  tt_assert(node_exit_policy_might_accept_port(n1, 80));
+  tt_assert(!node_exit_policy_might_accept_port(n1, 443));
+  tt_assert(!node_exit_policy_might_accept_port(n2, 80));
+  tt_assert(!node_exit_policy_might_accept_port(n2, 443));
+  tt_assert(node_exit_policy_might_accept_port(n3, 443));
+  tt_assert(!node_exit_policy_might_accept_port(n3, 22));
+
+  /* Lots of ports at once still give the right answers. */
+  {
+    uint16_t port;
+    for (port = 1; port < 200; ++port) {
+      tt_int_op(node_exit_policy_might_accept_port(n1, port), OP_EQ,
+                port == 80);
+      tt_int_op(node_exit_policy_might_accept_port(n3, port), OP_EQ,
+                port >= 80);
+    }
+  }
+
+  /* Dropping a node moves another into its slot; the index must follow. */
+  nodelist_remove_routerinfo(ri1);
+  routerinfo_free(ri1);
+  ri1 = NULL;
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 2);
+  ba = nodelist_get_exit_port_bitarray(80);
+  tt_assert(!bitarray_is_set(ba, n2->nodelist_idx));
+  tt_assert(bitarray_is_set(ba, n3->nodelist_idx));
+
+  /* So must a new policy for a node we already have. */
+  ri1 = make_ri_with_exit_policy('\x02', "accept *:80,reject *:*");
+  tt_ptr_op(nodelist_set_routerinfo(ri1, &ri2), OP_EQ, n2);
+  routerinfo_free(ri2);
+  ri2 = ri1;
+  ri1 = NULL;
+  tt_assert(node_exit_policy_might_accept_port(n2, 80));
+  tt_assert(!node_exit_policy_might_accept_port(n2, 443));
+
+ done:
+  nodelist_free_all();
+  routerinfo_free(ri1);
+  routerinfo_free(ri2);
+  routerinfo_free(ri3);
+}
+
+/** Make a routerinfo named <b>nickname</b> with identity digest full of
+ * <b>id</b> and IPv4 address <b>addr</b>, which declares the
+ * comma-separated list <b>family</b> as its family. */
+static routerinfo_t *
+make_ri_with_family(char id, const char *nickname, uint32_t addr,
+                    const char *family)
+{
+  routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+  memset(ri->cache_info.identity_digest, id, DIGEST_LEN);
+  ri->nickname = tor_strdup(nickname);
+  ri->addr = addr;
+  ri->or_port = 9001;
+  ri->purpose = ROUTER_PURPOSE_GENERAL;
+  ri->declared_family = smartlist_new();
+  smartlist_split_string(ri->declared_family, family, ",", 0, 0);
+  return ri;
+}
+
+/** Make sure that the resolved family graph agrees with the families that
+ * the nodes declare, and notices when they change. */
+static void
+test_nodelist_family_graph(void *arg)
+{
+  routerinfo_t *ri_a = NULL, *ri_b = NULL, *ri_c = NULL, *ri_d = NULL;
+  routerinfo_t *ri_old = NULL;
+  const node_t *a, *b, *c, *d;
+  smartlist_t *sl = smartlist_new();
+  (void) arg;
+
+  /* a and b name each other by ID and nickname; a and c by nickname and
+   * by ID-plus-nickname.  d claims a, but a doesn't claim d. */
+  ri_a = make_ri_with_family('\x0a', "alpha", 0x01010001,
+                        "$BBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBB,gamma");
+  ri_b = make_ri_with_family('\xbb', "beta", 0x02020001, "alpha");
+  ri_c = make_ri_with_family('\xcc', "gamma", 0x03030001,
+                        "$0A0A0A0A0A0A0A0A0A0A0A0A0A0A0A0A0A0A0A0A~alpha");
+  ri_d = make_ri_with_family('\xdd', "delta", 0x04040001, "alpha");
+  a = nodelist_set_routerinfo(ri_a, NULL);
+  b = nodelist_set_routerinfo(ri_b, NULL);
+  c = nodelist_set_routerinfo(ri_c, NULL);
+  d = nodelist_set_routerinfo(ri_d, NULL);
+
+  tt_assert(nodes_in_same_family(a, b));
+  tt_assert(nodes_in_same_family(b, a));
+  tt_assert(nodes_in_same_family(a, c));
+  tt_assert(nodes_in_same_family(c, a));
+  tt_assert(!nodes_in_same_family(b, c));
+  tt_assert(!nodes_in_same_family(a, d));
+  tt_assert(!nodes_in_same_family(d, a));
+
+  nodelist_add_node_and_family(sl, a);
+  tt_assert(smartlist_contains(sl, a));
+  tt_assert(smartlist_contains(sl, b));
+  tt_assert(smartlist_contains(sl, c));
+  tt_assert(!smartlist_contains(sl, d));
+  smartlist_clear(sl);
+  nodelist_add_node_and_family(sl, d);
+  tt_assert(smartlist_contains(sl, d));
+  tt_assert(!smartlist_contains(sl, a));
+  smartlist_clear(sl);
+
+  /* When b stops declaring a, they aren't family any more. */
+  ri_old = ri_b;
+  ri_b = make_ri_with_family('\xbb', "beta", 0x02020001, "gamma");
+  tt_ptr_op(nodelist_set_routerinfo(ri_b, &ri_old), OP_EQ, b);
+  tt_assert(!nodes_in_same_family(a, b));
+  tt_assert(!nodes_in_same_family(b, c));
+  tt_assert(nodes_in_same_family(a, c));
+  nodelist_add_node_and_family(sl, a);
+  tt_assert(!smartlist_contains(sl, b));
+  tt_assert(smartlist_contains(sl, c));
+
+ done:
+  nodelist_free_all();
+  smartlist_free(sl);
+  routerinfo_free(ri_old);
+  routerinfo_free(ri_a);
+  routerinfo_free(ri_b);
+  routerinfo_free(ri_c);
+  routerinfo_free(ri_d);
+}
+
 #define NODE(name, flags) \
   { #name, test_nodelist_##name, (flags), NULL, NULL }
 
 struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_by_id_null_node, TT_FORK),
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
+  NODE(exit_port_index, TT_FORK),
+  NODE(family_graph, TT_FORK),
   END_OF_TESTCASES
 };
 
@@ -0,0 +1,253 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/* Unit tests for the onion queues */
+
+#define CIRCUITLIST_PRIVATE
+#define ONION_PRIVATE
+#include "or.h"
+#include "channel.h"
+#include "circuitlist.h"
+#include "onion.h"
+#include "onion_tap.h"
+#include "onion_ntor.h"
+#include "test.h"
+
+/** Fake clock for the onion queue tests, in msec. */
+static uint64_t onion_test_now_msec = 0;
+/** Number of circuits that the onion queue has closed during a test. */
+static int onion_test_n_marked = 0;
+
+static uint64_t
+mock_onion_queue_now_msec(void)
+{
+  return onion_test_now_msec;
+}
+
+static void
+mock_circuit_mark_for_close(circuit_t *circ, int reason, int line,
+                            const char *file)
+{
+  (void)circ;
+  (void)line;
+  (void)file;
+  tt_int_op(reason, OP_EQ, END_CIRC_REASON_RESOURCELIMIT);
+  ++onion_test_n_marked;
+ done:
+  ;
+}
+
+/** Helper: queue a new ntor create request for a new circuit from
+ * <b>chan</b>, and return the circuit. */
+static or_circuit_t *
+onion_test_queue_ntor(channel_t *chan)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  or_circuit_t *circ = or_circuit_new(0, NULL);
+  create_cell_t *create = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(create, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf);
+  /* We only set p_chan while queueing, so that circuit_free won't go
+   * looking for our fake channels. */
+  circ->p_chan = chan;
+  tt_int_op(0,OP_EQ, onion_pending_add(circ, create));
+  circ->p_chan = NULL;
+ done:
+  return circ;
+}
+
+/** Helper: take the next task from the onion queues, free its onionskin,
+ * and return its circuit. */
+static or_circuit_t *
+onion_test_next_task(void)
+{
+  create_cell_t *onionskin = NULL;
+  or_circuit_t *circ = onion_next_task(&onionskin);
+  tor_free(onionskin);
+  return circ;
+}
+
+/** Make sure that the onion queues take turns among inbound channels. */
+static void
+test_onion_fairness(void *arg)
+{
+  channel_t chan1, chan2;
+  or_circuit_t *circs[6];
+  int i;
+  (void)arg;
+
+  memset(circs, 0, sizeof(circs));
+  memset(&chan1, 0, sizeof(chan1));
+  memset(&chan2, 0, sizeof(chan2));
+  chan1.global_identifier = 1;
+  chan2.global_identifier = 2;
+  onion_test_now_msec = 1000;
+  MOCK(onion_queue_now_msec, mock_onion_queue_now_msec);
+
+  /* chan1 is noisy; chan2 shows up later. */
+  for (i = 0; i < 4; ++i)
+    circs[i] = onion_test_queue_ntor(&chan1);
+  circs[4] = onion_test_queue_ntor(&chan2);
+  circs[5] = onion_test_queue_ntor(&chan2);
+  tt_int_op(6,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  tt_ptr_op(circs[0],OP_EQ, onion_test_next_task());
+  tt_ptr_op(circs[4],OP_EQ, onion_test_next_task());
+  tt_ptr_op(circs[1],OP_EQ, onion_test_next_task());
+  tt_ptr_op(circs[5],OP_EQ, onion_test_next_task());
+  tt_ptr_op(circs[2],OP_EQ, onion_test_next_task());
+  tt_ptr_op(circs[3],OP_EQ, onion_test_next_task());
+  tt_ptr_op(NULL,OP_EQ, onion_test_next_task());
+  tt_int_op(0,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+ done:
+  clear_pending_onions();
+  UNMOCK(onion_queue_now_msec);
+  for (i = 0; i < 6; ++i) {
+    if (circs[i])
+      circuit_free(TO_CIRCUIT(circs[i]));
+  }
+}
+
+/** Make sure that the onion queues shed requests once they have been
+ * waiting for too long. */
+static void
+test_onion_codel(void *arg)
+{
+  channel_t chan;
+  or_circuit_t *circs[10];
+  int i;
+  (void)arg;
+
+  memset(circs, 0, sizeof(circs));
+  memset(&chan, 0, sizeof(chan));
+  chan.global_identifier = 1;
+  onion_test_now_msec = 1000;
+  onion_test_n_marked = 0;
+  MOCK(onion_queue_now_msec, mock_onion_queue_now_msec);
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close);
+
+  for (i = 0; i < 10; ++i)
+    circs[i] = onion_test_queue_ntor(&chan);
+
+  /* Above target, but not for a whole interval yet: nothing dropped. */
+  onion_test_now_msec = 1200;
+  tt_ptr_op(circs[0],OP_EQ, onion_test_next_task());
+  tt_int_op(0,OP_EQ, onion_test_n_marked);
+
+  /* Above target for an interval: drop one, then start dropping. */
+  onion_test_now_msec = 2300;
+  tt_ptr_op(circs[2],OP_EQ, onion_test_next_task());
+  tt_int_op(1,OP_EQ, onion_test_n_marked);
+  tt_ptr_op(NULL,OP_EQ, circs[1]->onionqueue_entry);
+
+  /* Not time for the next drop yet. */
+  onion_test_now_msec = 2400;
+  tt_ptr_op(circs[3],OP_EQ, onion_test_next_task());
+  tt_int_op(1,OP_EQ, onion_test_n_marked);
+
+  /* Next drop. */
+  onion_test_now_msec = 3300;
+  tt_ptr_op(circs[5],OP_EQ, onion_test_next_task());
+  tt_int_op(2,OP_EQ, onion_test_n_marked);
+  tt_int_op(4,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  /* Past the hard cutoff, everything goes. */
+  onion_test_now_msec = 6000;
+  tt_ptr_op(NULL,OP_EQ, onion_test_next_task());
+  tt_int_op(6,OP_EQ, onion_test_n_marked);
+  tt_int_op(0,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+ done:
+  clear_pending_onions();
+  UNMOCK(onion_queue_now_msec);
+  UNMOCK(circuit_mark_for_close_);
+  for (i = 0; i < 10; ++i) {
+    if (circs[i])
+      circuit_free(TO_CIRCUIT(circs[i]));
+  }
+}
+
+/** Value for the have_room_for_onionskin() mock to return. */
+static int onion_test_have_room = 1;
+
+static int
+mock_have_room_for_onionskin(uint16_t type)
+{
+  (void)type;
+  return onion_test_have_room;
+}
+
+/** Make sure that a full onion queue makes room by dropping the oldest
+ * request of the busiest flow, and turns away requests of a type that has
+ * nothing queued to drop. */
+static void
+test_onion_overflow(void *arg)
+{
+  channel_t chan1, chan2;
+  or_circuit_t *circs[5], *tap_circ = NULL;
+  create_cell_t *tap_create = NULL;
+  uint8_t buf[TAP_ONIONSKIN_CHALLENGE_LEN] = {0};
+  int i;
+  (void)arg;
+
+  memset(circs, 0, sizeof(circs));
+  memset(&chan1, 0, sizeof(chan1));
+  memset(&chan2, 0, sizeof(chan2));
+  chan1.global_identifier = 1;
+  chan2.global_identifier = 2;
+  onion_test_now_msec = 1000;
+  onion_test_n_marked = 0;
+  onion_test_have_room = 1;
+  MOCK(onion_queue_now_msec, mock_onion_queue_now_msec);
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close);
+  MOCK(have_room_for_onionskin, mock_have_room_for_onionskin);
+
+  for (i = 0; i < 3; ++i)
+    circs[i] = onion_test_queue_ntor(&chan1);
+  circs[3] = onion_test_queue_ntor(&chan2);
+
+  /* Now we're full: chan1 has the most queued, so its oldest goes. */
+  onion_test_have_room = 0;
+  circs[4] = onion_test_queue_ntor(&chan2);
+  tt_int_op(1,OP_EQ, onion_test_n_marked);
+  tt_ptr_op(NULL,OP_EQ, circs[0]->onionqueue_entry);
+  tt_int_op(4,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  /* There are no TAP requests to drop, so a new one is turned away, and
+   * the ntor requests are left alone. */
+  tap_circ = or_circuit_new(0, NULL);
+  tap_create = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(tap_create, CELL_CREATE, ONION_HANDSHAKE_TYPE_TAP,
+                   TAP_ONIONSKIN_CHALLENGE_LEN, buf);
+  tap_circ->p_chan = &chan1;
+  tt_int_op(-1,OP_EQ, onion_pending_add(tap_circ, tap_create));
+  tap_circ->p_chan = NULL;
+  tt_ptr_op(NULL,OP_EQ, tap_circ->onionqueue_entry);
+  tt_int_op(0,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_TAP));
+  tt_int_op(4,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_int_op(1,OP_EQ, onion_test_n_marked);
+
+  tt_ptr_op(circs[1],OP_EQ, onion_test_next_task());
+  tt_ptr_op(circs[3],OP_EQ, onion_test_next_task());
+
+ done:
+  clear_pending_onions();
+  UNMOCK(onion_queue_now_msec);
+  UNMOCK(circuit_mark_for_close_);
+  UNMOCK(have_room_for_onionskin);
+  for (i = 0; i < 5; ++i) {
+    if (circs[i])
+      circuit_free(TO_CIRCUIT(circs[i]));
+  }
+  if (tap_circ)
+    circuit_free(TO_CIRCUIT(tap_circ));
+  tor_free(tap_create);
+}
+
+struct testcase_t onion_tests[] = {
+  { "fairness", test_onion_fairness, 0, NULL, NULL },
+  { "codel", test_onion_codel, 0, NULL, NULL },
+  { "overflow", test_onion_overflow, 0, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -119,9 +119,7 @@ dummy_edge_conn_new(circuit_t *circ,
 
   conn->on_circuit = circ;
   if (type == CONN_TYPE_EXIT) {
-    or_circuit_t *oc  = TO_OR_CIRCUIT(circ);
-    conn->next_stream = oc->n_streams;
-    oc->n_streams = conn;
+    or_circuit_add_n_stream(TO_OR_CIRCUIT(circ), conn);
   } else {
     origin_circuit_t *oc = TO_ORIGIN_CIRCUIT(circ);
     conn->next_stream = oc->p_streams;
@@ -138,6 +136,7 @@ test_oom_circbuf(void *arg)
   or_options_t *options = get_options_mutable();
   circuit_t *c1 = NULL, *c2 = NULL, *c3 = NULL, *c4 = NULL;
   struct timeval tv = { 1389631048, 0 };
+  size_t c1_alloc, total;
 
   (void) arg;
 
@@ -147,8 +146,8 @@ test_oom_circbuf(void *arg)
   init_cell_pool();
 #endif /* ENABLE_MEMPOOLS */
 
-  /* Far too low for real life. */
-  options->MaxMemInQueues = 256*packed_cell_mem_cost();
+  /* Large enough for now; we lower it once the queues are full. */
+  options->MaxMemInQueues = 1024*packed_cell_mem_cost();
   options->CellStatistics = 0;
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We don't start out OOM. */
@@ -159,7 +158,7 @@ test_oom_circbuf(void *arg)
      circuit list. */
   tv.tv_usec = 0;
   tor_gettimeofday_cache_set(&tv);
-  c1 = dummy_origin_circuit_new(30);
+  c1 = dummy_origin_circuit_new(60);
   tv.tv_usec = 10*1000;
   tor_gettimeofday_cache_set(&tv);
   c2 = dummy_or_circuit_new(20, 20);
@@ -171,24 +170,32 @@ test_oom_circbuf(void *arg)
   tt_int_op(packed_cell_mem_cost(), OP_EQ,
             sizeof(packed_cell_t));
 #endif /* ENABLE_MEMPOOLS */
+  /* We count the chunks that hold the cells, not just the cells. */
+  c1_alloc = cell_queue_get_allocation(&c1->n_chan_cells);
+  tt_int_op(c1_alloc, OP_GE, packed_cell_mem_cost() * 60);
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 70);
+            c1_alloc +
+            cell_queue_get_allocation(&c2->n_chan_cells) +
+            cell_queue_get_allocation(&TO_OR_CIRCUIT(c2)->p_chan_cells));
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We are still not OOM */
 
   tv.tv_usec = 20*1000;
   tor_gettimeofday_cache_set(&tv);
   c3 = dummy_or_circuit_new(100, 85);
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We are still not OOM */
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 255);
+
+  /* Far too low for real life: room for one more cell. */
+  options->MaxMemInQueues = cell_queues_get_total_allocation() +
+    CELL_CHUNK_ALLOC_SIZE(1);
+  tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We are still not OOM */
 
   tv.tv_usec = 30*1000;
   tor_gettimeofday_cache_set(&tv);
-  /* Adding this cell will trigger our OOM handler. */
+  /* Adding these cells will trigger our OOM handler. */
   c4 = dummy_or_circuit_new(2, 0);
 
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 257);
+  total = cell_queues_get_total_allocation();
+  tt_int_op(total, OP_GT, options->MaxMemInQueues);
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 1); /* We are now OOM */
 
@@ -197,8 +204,9 @@ test_oom_circbuf(void *arg)
   tt_assert(! c3->marked_for_close);
   tt_assert(! c4->marked_for_close);
 
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * (257 - 30));
+  /* c1's chunks went back to the allocator, not just to a freelist. */
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, total - c1_alloc);
+  total -= c1_alloc;
 
   circuit_free(c1);
   tv.tv_usec = 0;
@@ -215,8 +223,7 @@ test_oom_circbuf(void *arg)
   tt_assert(! c3->marked_for_close);
   tt_assert(! c4->marked_for_close);
 
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * (257 - 30));
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, total);
 
  done:
   circuit_free(c1);
@@ -236,6 +243,7 @@ test_oom_streambuf(void *arg)
   struct timeval tv = { 1389641159, 0 };
   uint32_t tvms;
   int i;
+  size_t cells_alloc;
   smartlist_t *edgeconns = smartlist_new();
 
   (void) arg;
@@ -246,8 +254,8 @@ test_oom_streambuf(void *arg)
   init_cell_pool();
 #endif /* ENABLE_MEMPOOLS */
 
-  /* Far too low for real life. */
-  options->MaxMemInQueues = 81*packed_cell_mem_cost() + 4096 * 34;
+  /* Large enough for now; we lower it once the queues are full. */
+  options->MaxMemInQueues = 1024*packed_cell_mem_cost() + 4096 * 34;
   options->CellStatistics = 0;
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We don't start out OOM. */
@@ -267,8 +275,8 @@ test_oom_streambuf(void *arg)
   tv.tv_usec = 530*1000;
   tor_gettimeofday_cache_set(&tv);
   c4 = dummy_or_circuit_new(0,0);
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 80);
+  cells_alloc = cell_queues_get_total_allocation();
+  tt_int_op(cells_alloc, OP_GE, packed_cell_mem_cost() * 80);
 
   tv.tv_usec = 600*1000;
   tor_gettimeofday_cache_set(&tv);
@@ -318,8 +326,7 @@ test_oom_streambuf(void *arg)
   tt_int_op(circuit_max_queued_item_age(c3, tvms), OP_EQ, 480);
   tt_int_op(circuit_max_queued_item_age(c4, tvms), OP_EQ, 370);
 
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 80);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, cells_alloc);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 4096*16*2);
 
   /* Now give c4 a very old buffer of modest size */
@@ -335,6 +342,9 @@ test_oom_streambuf(void *arg)
   tt_int_op(buf_get_total_allocation(), OP_EQ, 4096*17*2);
   tt_int_op(circuit_max_queued_item_age(c4, tvms), OP_EQ, 1000);
 
+  /* Far too low for real life: room for one more cell. */
+  options->MaxMemInQueues = cells_alloc + packed_cell_mem_cost() +
+    4096 * 34;
   tt_int_op(cell_queues_check_size(), OP_EQ, 0);
 
   /* And run over the limit. */
@@ -342,8 +352,8 @@ test_oom_streambuf(void *arg)
   tor_gettimeofday_cache_set(&tv);
   c5 = dummy_or_circuit_new(0,5);
 
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 85);
+  cells_alloc += cell_queue_get_allocation(&c5->n_chan_cells);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, cells_alloc);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 4096*17*2);
 
   tt_int_op(cell_queues_check_size(), OP_EQ, 1); /* We are now OOM */
@@ -355,8 +365,7 @@ test_oom_streambuf(void *arg)
   tt_assert(c4->marked_for_close);
   tt_assert(! c5->marked_for_close);
 
-  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
-            packed_cell_mem_cost() * 85);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, cells_alloc);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 4096*8*2);
 
  done:
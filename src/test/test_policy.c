@@ -438,10 +438,115 @@ test_dump_exit_policy_to_string(void *arg)
  tor_free(ep);
 }
 
+/** Make sure that compiled policies give the same answers as the policies
+ * that they came from. */
+static void
+test_policies_compiled(void *arg)
+{
+  static const char *entries[] = {
+    "reject 18.0.0.0/8:25",
+    "accept 18.244.0.0/16:20-30",
+    "reject 18.244.1.0/24:*",
+    "accept 18.244.1.7:22",
+    "reject *:6660-6667",
+    "accept 128.31.0.34:1-65535",
+    "reject 0.0.0.0/1:80-443",
+    "accept *:20-23",
+    "accept *:80",
+    "accept *:443",
+    "reject6 [fc00::]/7:*",
+    "accept6 [2001:db8::]/32:22-80",
+    "reject6 [2001:db8:1::]/48:70-90",
+    "accept6 [2001:db8:1::5]:*",
+    "reject *:1024-2048",
+    "accept *:*",
+  };
+  static const char *addrs[] = {
+    "18.0.0.1", "18.244.0.1", "18.244.1.7", "18.244.1.8", "18.1.2.3",
+    "128.31.0.34", "128.31.0.35", "127.0.0.1", "1.2.3.4", "200.1.2.3",
+    "[fc00::1]", "[fe00::1]", "[2001:db8::1]", "[2001:db8:1::5]",
+    "[2001:db8:1::6]", "[2001:db8:2::1]", "[::1]",
+  };
+  static const uint16_t ports[] = {
+    1, 19, 20, 22, 23, 25, 26, 30, 31, 69, 70, 80, 81, 90, 91, 443, 444,
+    1023, 1024, 1500, 2048, 2049, 6660, 6667, 6668, 65535,
+  };
+  smartlist_t *policy = smartlist_new();
+  compiled_addr_policy_t *compiled = NULL;
+  addr_policy_t *p;
+  tor_addr_t tar;
+  int i, j, n_entries;
+  (void)arg;
+
+  /* With no policy, everything is accepted. */
+  compiled = addr_policy_compile(NULL);
+  tor_addr_from_ipv4h(&tar, 0x01020304u);
+  tt_int_op(ADDR_POLICY_ACCEPTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&tar, 80, compiled));
+  tt_int_op(ADDR_POLICY_ACCEPTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&tar, 80, NULL));
+  compiled_addr_policy_free(compiled);
+  compiled = NULL;
+
+  /* Try each prefix of the list of entries. */
+  for (n_entries = 1; n_entries <= (int)(ARRAY_LENGTH(entries)); ++n_entries) {
+    p = router_parse_addr_policy_item_from_string(entries[n_entries-1], -1);
+    tt_assert(p);
+    smartlist_add(policy, p);
+    compiled = addr_policy_compile(policy);
+
+    for (i = 0; i < (int)(ARRAY_LENGTH(addrs)); ++i) {
+      tt_int_op(tor_addr_parse(&tar, addrs[i]), OP_GE, 0);
+      for (j = 0; j < (int)(ARRAY_LENGTH(ports)); ++j) {
+        tt_int_op(compare_tor_addr_to_addr_policy(&tar, ports[j], policy),
+                  OP_EQ,
+                  compare_tor_addr_to_compiled_policy(&tar, ports[j],
+                                                      compiled));
+      }
+      /* With no port, we fall back to the list. */
+      tt_int_op(compare_tor_addr_to_addr_policy(&tar, 0, policy), OP_EQ,
+                compare_tor_addr_to_compiled_policy(&tar, 0, compiled));
+    }
+    /* Likewise with no address. */
+    tor_addr_make_unspec(&tar);
+    for (j = 0; j < (int)(ARRAY_LENGTH(ports)); ++j) {
+      tt_int_op(compare_tor_addr_to_addr_policy(&tar, ports[j], policy),
+                OP_EQ,
+                compare_tor_addr_to_compiled_policy(&tar, ports[j],
+                                                    compiled));
+    }
+
+    compiled_addr_policy_free(compiled);
+    compiled = NULL;
+  }
+
+  /* Spot-check a few answers from the whole list. */
+  compiled = addr_policy_compile(policy);
+  tor_addr_parse(&tar, "18.244.1.7");
+  tt_int_op(ADDR_POLICY_REJECTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&tar, 25, compiled));
+  tt_int_op(ADDR_POLICY_ACCEPTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&tar, 22, compiled));
+  tt_int_op(ADDR_POLICY_REJECTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&tar, 31, compiled));
+  tor_addr_parse(&tar, "[2001:db8:1::5]");
+  tt_int_op(ADDR_POLICY_ACCEPTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&tar, 80, compiled));
+  tt_int_op(ADDR_POLICY_REJECTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&tar, 85, compiled));
+  tt_int_op(ADDR_POLICY_ACCEPTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&tar, 91, compiled));
+
+ done:
+  compiled_addr_policy_free(compiled);
+  addr_policy_list_free(policy);
+}
+
 struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
   { "general", test_policies_general, 0, NULL, NULL },
+  { "compiled", test_policies_compiled, 0, NULL, NULL },
   END_OF_TESTCASES
 };
 
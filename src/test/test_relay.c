@@ -126,9 +126,205 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+static void
+test_relay_crypt_cells(void *arg)
+{
+  or_circuit_t *circs[3];
+  crypto_cipher_t *client_ciphers[3];
+  crypto_digest_t *client_digests[3];
+  relay_crypt_item_t items[24];
+  cell_t plain[24];
+  char key[CIPHER_KEY_LEN], d1[DIGEST_LEN], d2[DIGEST_LEN];
+  int i;
+  (void)arg;
+
+  memset(circs, 0, sizeof(circs));
+  memset(client_ciphers, 0, sizeof(client_ciphers));
+  memset(client_digests, 0, sizeof(client_digests));
+  memset(items, 0, sizeof(items));
+
+  for (i = 0; i < 3; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(or_circuit_t));
+    circs[i]->base_.magic = OR_CIRCUIT_MAGIC;
+    circs[i]->base_.purpose = CIRCUIT_PURPOSE_OR;
+    crypto_rand(key, sizeof(key));
+    circs[i]->n_crypto = crypto_cipher_new(key);
+    client_ciphers[i] = crypto_cipher_new(key);
+    circs[i]->p_crypto = crypto_cipher_new(NULL);
+    circs[i]->n_digest = crypto_digest_new();
+    circs[i]->p_digest = crypto_digest_new();
+    client_digests[i] = crypto_digest_new();
+  }
+
+  /* Interleave exitward cells for the three circuits.  Two out of three are
+   * meant for us; the rest just pass through. */
+  for (i = 0; i < 24; ++i) {
+    int c = (i * 7) % 3;
+    cell_t *cell = tor_malloc_zero(sizeof(cell_t));
+    crypto_rand((char*)cell->payload, CELL_PAYLOAD_SIZE);
+    if (i % 3) {
+      char integrity[4];
+      memset(cell->payload+1, 0, 2);
+      memset(cell->payload+5, 0, 4);
+      crypto_digest_add_bytes(client_digests[c], (char*)cell->payload,
+                              CELL_PAYLOAD_SIZE);
+      crypto_digest_get_digest(client_digests[c], integrity, 4);
+      memcpy(&plain[i], cell, sizeof(cell_t));
+      memcpy(cell->payload+5, integrity, 4);
+    } else {
+      cell->payload[1] = 1;
+      memcpy(&plain[i], cell, sizeof(cell_t));
+    }
+    crypto_cipher_crypt_inplace(client_ciphers[c], (char*)cell->payload,
+                                CELL_PAYLOAD_SIZE);
+    items[i].circ = TO_CIRCUIT(circs[c]);
+    items[i].cell = cell;
+    items[i].cell_direction = CELL_DIRECTION_OUT;
+  }
+
+  relay_crypt_cells(items, 24);
+
+  for (i = 0; i < 24; ++i) {
+    tt_int_op(items[i].result, OP_EQ, 0);
+    tt_int_op(items[i].recognized, OP_EQ, (i % 3) != 0);
+    tt_ptr_op(items[i].layer_hint, OP_EQ, NULL);
+    tt_mem_op(items[i].cell->payload, OP_EQ, plain[i].payload,
+              CELL_PAYLOAD_SIZE);
+  }
+  for (i = 0; i < 3; ++i) {
+    crypto_digest_get_digest(circs[i]->n_digest, d1, DIGEST_LEN);
+    crypto_digest_get_digest(client_digests[i], d2, DIGEST_LEN);
+    tt_mem_op(d1, OP_EQ, d2, DIGEST_LEN);
+  }
+
+ done:
+  for (i = 0; i < 24; ++i)
+    tor_free(items[i].cell);
+  for (i = 0; i < 3; ++i) {
+    if (circs[i]) {
+      crypto_cipher_free(circs[i]->n_crypto);
+      crypto_cipher_free(circs[i]->p_crypto);
+      crypto_digest_free(circs[i]->n_digest);
+      crypto_digest_free(circs[i]->p_digest);
+      tor_free(circs[i]);
+    }
+    crypto_cipher_free(client_ciphers[i]);
+    crypto_digest_free(client_digests[i]);
+  }
+}
+
+static void
+test_relay_receive_relay_cells(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *circs[3];
+  crypto_cipher_t *client_ciphers[2];
+  relay_crypt_item_t items[7];
+  cell_t plain[7];
+  char key[CIPHER_KEY_LEN];
+  int i;
+  (void)arg;
+
+  memset(circs, 0, sizeof(circs));
+  memset(client_ciphers, 0, sizeof(client_ciphers));
+  memset(items, 0, sizeof(items));
+
+#ifdef ENABLE_MEMPOOLS
+  init_cell_pool();
+#endif /* ENABLE_MEMPOOLS */
+
+  nchan = new_fake_channel();
+  tt_assert(nchan);
+  pchan = new_fake_channel();
+  tt_assert(pchan);
+  nchan->cmux = circuitmux_alloc();
+  pchan->cmux = circuitmux_alloc();
+
+  for (i = 0; i < 3; ++i) {
+    circs[i] = new_fake_orcirc(nchan, pchan);
+    crypto_rand(key, sizeof(key));
+    circs[i]->n_crypto = crypto_cipher_new(key);
+    if (i < 2)
+      client_ciphers[i] = crypto_cipher_new(key);
+    circs[i]->p_crypto = crypto_cipher_new(NULL);
+    circs[i]->n_digest = crypto_digest_new();
+    circs[i]->p_digest = crypto_digest_new();
+  }
+  /* Nothing on the last circuit gets handled. */
+  circs[2]->base_.marked_for_close = 1;
+
+  /* Exitward cells, none of them for us, interleaved across circuits. */
+  for (i = 0; i < 7; ++i) {
+    int c = (i == 6) ? 2 : (i % 2);
+    cell_t *cell = tor_malloc_zero(sizeof(cell_t));
+    cell->command = CELL_RELAY;
+    cell->circ_id = circs[c]->p_circ_id;
+    crypto_rand((char*)cell->payload, CELL_PAYLOAD_SIZE);
+    cell->payload[1] = 1;
+    memcpy(&plain[i], cell, sizeof(cell_t));
+    if (c < 2)
+      crypto_cipher_crypt_inplace(client_ciphers[c], (char*)cell->payload,
+                                  CELL_PAYLOAD_SIZE);
+    items[i].circ = TO_CIRCUIT(circs[c]);
+    items[i].cell = cell;
+    items[i].cell_direction = CELL_DIRECTION_OUT;
+  }
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+  circuit_receive_relay_cells(items, 7);
+  UNMOCK(scheduler_channel_has_waiting_cells);
+
+  for (i = 0; i < 7; ++i) {
+    int c = (i == 6) ? 2 : (i % 2);
+    tt_int_op(items[i].result, OP_EQ, 0);
+    tt_mem_op(items[i].cell->payload, OP_EQ, plain[i].payload,
+              CELL_PAYLOAD_SIZE);
+    if (c < 2)
+      tt_int_op(items[i].cell->circ_id, OP_EQ, circs[c]->base_.n_circ_id);
+    else
+      tt_int_op(items[i].cell->circ_id, OP_EQ, circs[c]->p_circ_id);
+  }
+  tt_int_op(circs[0]->base_.n_chan_cells.n, OP_EQ, 3);
+  tt_int_op(circs[1]->base_.n_chan_cells.n, OP_EQ, 3);
+  tt_int_op(circs[2]->base_.n_chan_cells.n, OP_EQ, 0);
+
+  MOCK(scheduler_release_channel, scheduler_release_channel_mock);
+  channel_mark_for_close(nchan);
+  channel_mark_for_close(pchan);
+  UNMOCK(scheduler_release_channel);
+
+  channel_free_all();
+
+ done:
+  for (i = 0; i < 7; ++i)
+    tor_free(items[i].cell);
+  for (i = 0; i < 3; ++i) {
+    if (!circs[i])
+      continue;
+    cell_queue_clear(&circs[i]->base_.n_chan_cells);
+    cell_queue_clear(&circs[i]->p_chan_cells);
+    crypto_cipher_free(circs[i]->n_crypto);
+    crypto_cipher_free(circs[i]->p_crypto);
+    crypto_digest_free(circs[i]->n_digest);
+    crypto_digest_free(circs[i]->p_digest);
+    tor_free(circs[i]);
+  }
+  for (i = 0; i < 2; ++i)
+    crypto_cipher_free(client_ciphers[i]);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+#ifdef ENABLE_MEMPOOLS
+  free_cell_pool();
+#endif /* ENABLE_MEMPOOLS */
+}
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
+  { "crypt_cells", test_relay_crypt_cells, TT_FORK, NULL, NULL },
+  { "receive_relay_cells", test_relay_receive_relay_cells, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -29,6 +29,7 @@ extern smartlist_t *channels_pending;
 extern struct event *run_sched_ev;
 extern uint64_t queue_heuristic;
 extern time_t queue_heuristic_timestamp;
+extern int kist_channels_blocked;
 
 /* Event base for scheduelr tests */
 static struct event_base *mock_event_base = NULL;
@@ -43,6 +44,7 @@ static circuitmux_t *mock_cgp_tgt_2 = NULL;
 static const circuitmux_policy_t *mock_cgp_val_2 = NULL;
 static int scheduler_compare_channels_mock_ctr = 0;
 static int scheduler_run_mock_ctr = 0;
+static int scheduler_kist_cells_writeable_mock_val = -1;
 
 static void channel_flush_some_cells_mock_free_all(void);
 static void channel_flush_some_cells_mock_set(channel_t *chan,
@@ -62,12 +64,14 @@ static const circuitmux_policy_t * circuitmux_get_policy_mock(
 static int scheduler_compare_channels_mock(const void *c1_v,
                                            const void *c2_v);
 static void scheduler_run_noop_mock(void);
+static int scheduler_kist_cells_writeable_mock(channel_t *chan);
 static struct event_base * tor_libevent_get_base_mock(void);
 
 /* Scheduler test cases */
 static void test_scheduler_channel_states(void *arg);
 static void test_scheduler_compare_channels(void *arg);
 static void test_scheduler_initfree(void *arg);
+static void test_scheduler_kist(void *arg);
 static void test_scheduler_loop(void *arg);
 static void test_scheduler_queue_heuristic(void *arg);
 
@@ -310,6 +314,14 @@ scheduler_run_noop_mock(void)
   ++scheduler_run_mock_ctr;
 }
 
+static int
+scheduler_kist_cells_writeable_mock(channel_t *chan)
+{
+  (void)chan;
+
+  return scheduler_kist_cells_writeable_mock_val;
+}
+
 static struct event_base *
 tor_libevent_get_base_mock(void)
 {
@@ -535,6 +547,85 @@ test_scheduler_initfree(void *arg)
   return;
 }
 
+static void
+test_scheduler_kist(void *arg)
+{
+  channel_t *ch1 = NULL;
+
+  (void)arg;
+
+  if (!scheduler_can_use_kist())
+    tt_skip();
+
+  /* Set up libevent and scheduler */
+
+  mock_event_init();
+  MOCK(tor_libevent_get_base, tor_libevent_get_base_mock);
+  scheduler_init();
+  MOCK(scheduler_compare_channels, scheduler_compare_channels_mock);
+  MOCK(scheduler_run, scheduler_run_noop_mock);
+  MOCK(scheduler_kist_cells_writeable, scheduler_kist_cells_writeable_mock);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock);
+  scheduler_set_kist(1, 10, 1.0);
+
+  /* Get an open channel with 48 cells to send into pending */
+  ch1 = new_fake_channel();
+  tt_assert(ch1);
+  ch1->state = CHANNEL_STATE_OPENING;
+  ch1->cmux = circuitmux_alloc();
+  channel_register(ch1);
+  tt_assert(ch1->registered);
+  channel_change_state(ch1, CHANNEL_STATE_OPEN);
+  scheduler_channel_wants_writes(ch1);
+  scheduler_channel_has_waiting_cells(ch1);
+  tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_PENDING);
+  channel_flush_some_cells_mock_set(ch1, 48);
+
+  UNMOCK(scheduler_run);
+
+  /*
+   * The socket is full: nothing gets flushed, and the channel stays
+   * pending until the scheduler runs again.
+   */
+  scheduler_kist_cells_writeable_mock_val = 0;
+  scheduler_run();
+  tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_PENDING);
+  tt_int_op(smartlist_len(channels_pending), ==, 1);
+  tt_int_op(kist_channels_blocked, ==, 1);
+
+  /* The socket has room for 8 cells, so that's all we flush */
+  scheduler_kist_cells_writeable_mock_val = 8;
+  scheduler_run();
+  tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_WAITING_FOR_CELLS);
+  tt_int_op(smartlist_len(channels_pending), ==, 0);
+  tt_int_op(kist_channels_blocked, ==, 0);
+  tt_int_op(channel_flush_some_cells_mock(ch1, -1), ==, 40);
+
+  MOCK(scheduler_run, scheduler_run_noop_mock);
+
+  /* Close */
+  channel_mark_for_close(ch1);
+  channel_closed(ch1);
+  tt_int_op(ch1->state, ==, CHANNEL_STATE_CLOSED);
+  ch1 = NULL;
+
+  /* Shut things down */
+  scheduler_set_kist(0, 10, 1.0);
+  channel_flush_some_cells_mock_free_all();
+  channel_free_all();
+  scheduler_free_all();
+  mock_event_free_all();
+
+ done:
+  tor_free(ch1);
+
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(scheduler_kist_cells_writeable);
+  UNMOCK(scheduler_compare_channels);
+  UNMOCK(scheduler_run);
+  UNMOCK(tor_libevent_get_base);
+}
+
 static void
 test_scheduler_loop(void *arg)
 {
@@ -755,6 +846,7 @@ struct testcase_t scheduler_tests[] = {
   { "compare_channels", test_scheduler_compare_channels,
     TT_FORK, NULL, NULL },
   { "initfree", test_scheduler_initfree, TT_FORK, NULL, NULL },
+  { "kist", test_scheduler_kist, TT_FORK, NULL, NULL },
   { "loop", test_scheduler_loop, TT_FORK, NULL, NULL },
   { "queue_heuristic", test_scheduler_queue_heuristic,
     TT_FORK, NULL, NULL },
@@ -0,0 +1,205 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+#include "or.h"
+#include "timers.h"
+#include "test.h"
+
+/** A timer for these tests, and what happened to it. */
+typedef struct test_timer_t {
+  wheel_timer_t timer;
+  /** The tick at which we scheduled this timer. */
+  uint64_t when;
+  /** How many times has this timer fired? */
+  int n_fired;
+  /** The clock of the wheel when this timer last fired. */
+  uint64_t fired_at;
+} test_timer_t;
+
+/** The wheel that test_timer_cb() works on. */
+static timer_wheel_t *cb_wheel = NULL;
+/** If set, test_timer_cb() cancels whichever of these two timers did not
+ * fire. */
+static test_timer_t *cb_pair[2] = { NULL, NULL };
+/** If positive, test_timer_cb() reschedules each timer this far ahead. */
+static int cb_reschedule = 0;
+
+static void
+test_timer_cb(wheel_timer_t *timer, void *arg)
+{
+  test_timer_t *t = SUBTYPE_P(timer, test_timer_t, timer);
+  (void)arg;
+  ++t->n_fired;
+  t->fired_at = timer_wheel_get_now(cb_wheel);
+  if (t == cb_pair[0])
+    timer_wheel_cancel(cb_wheel, &cb_pair[1]->timer);
+  else if (t == cb_pair[1])
+    timer_wheel_cancel(cb_wheel, &cb_pair[0]->timer);
+  if (cb_reschedule > 0)
+    timer_wheel_schedule(cb_wheel, timer,
+                         timer_wheel_get_now(cb_wheel) + cb_reschedule);
+}
+
+static void
+test_timers_basic(void *arg)
+{
+  timer_wheel_t *wheel = NULL;
+  test_timer_t *timers = NULL;
+  /* Distances that land on every level, on slot boundaries, and beyond the
+   * span of the wheel. */
+  static const uint64_t delays[] = {
+    1, 2, 63, 64, 65, 100, 4095, 4096, 4097, 5000, 70000, 262143, 262144,
+    300000, 16777215, 16777216, 20000000, 40000000,
+  };
+  const int n = (int)ARRAY_LENGTH(delays);
+  const uint64_t start = 1000003;
+  uint64_t now;
+  int i, n_fired = 0;
+  (void)arg;
+
+  wheel = cb_wheel = timer_wheel_new(start);
+  cb_pair[0] = cb_pair[1] = NULL;
+  cb_reschedule = 0;
+  timers = tor_calloc(n, sizeof(test_timer_t));
+  for (i = 0; i < n; ++i) {
+    timers[i].when = start + delays[i];
+    timer_wheel_schedule(wheel, &timers[i].timer, timers[i].when);
+    tt_assert(wheel_timer_is_scheduled(&timers[i].timer));
+  }
+  tt_int_op(timer_wheel_get_n_timers(wheel), OP_EQ, n);
+
+  /* Step one tick at a time through the first part, then in larger
+   * strides; each timer must fire exactly once, and never early. */
+  for (now = start; now < start + 40000001; ) {
+    now += (now < start + 300000) ? 1 : 977;
+    n_fired += timer_wheel_advance(wheel, now, test_timer_cb, NULL);
+    for (i = 0; i < n; ++i) {
+      if (timers[i].when <= now) {
+        tt_int_op(timers[i].n_fired, OP_EQ, 1);
+        tt_u64_op(timers[i].fired_at, OP_GE, timers[i].when);
+        tt_u64_op(timers[i].fired_at, OP_LT, timers[i].when + 977);
+        if (timers[i].when <= start + 300000) {
+          tt_u64_op(timers[i].fired_at, OP_EQ, timers[i].when);
+        }
+      } else {
+        tt_int_op(timers[i].n_fired, OP_EQ, 0);
+      }
+    }
+    /* A timer that has fired is no longer scheduled. */
+    for (i = 0; i < n && timers[i].when <= now; ++i)
+      tt_assert(!wheel_timer_is_scheduled(&timers[i].timer));
+  }
+  tt_int_op(n_fired, OP_EQ, n);
+  tt_int_op(timer_wheel_get_n_timers(wheel), OP_EQ, 0);
+
+ done:
+  timer_wheel_free(wheel);
+  tor_free(timers);
+}
+
+static void
+test_timers_cancel(void *arg)
+{
+  timer_wheel_t *wheel = NULL;
+  test_timer_t t[4];
+  (void)arg;
+
+  memset(t, 0, sizeof(t));
+  wheel = cb_wheel = timer_wheel_new(10);
+  cb_pair[0] = cb_pair[1] = NULL;
+  cb_reschedule = 0;
+
+  timer_wheel_schedule(wheel, &t[0].timer, 20);
+  timer_wheel_schedule(wheel, &t[1].timer, 20);
+  timer_wheel_schedule(wheel, &t[2].timer, 5000);
+  /* A deadline in the past means "the next tick". */
+  timer_wheel_schedule(wheel, &t[3].timer, 3);
+  tt_int_op(timer_wheel_get_n_timers(wheel), OP_EQ, 4);
+
+  /* Cancelling and moving. */
+  timer_wheel_cancel(wheel, &t[2].timer);
+  tt_assert(!wheel_timer_is_scheduled(&t[2].timer));
+  timer_wheel_cancel(wheel, &t[2].timer);
+  tt_int_op(timer_wheel_get_n_timers(wheel), OP_EQ, 3);
+  timer_wheel_schedule(wheel, &t[2].timer, 15);
+  timer_wheel_schedule(wheel, &t[2].timer, 16);
+  tt_int_op(timer_wheel_get_n_timers(wheel), OP_EQ, 4);
+
+  tt_int_op(timer_wheel_advance(wheel, 11, test_timer_cb, NULL), OP_EQ, 1);
+  tt_int_op(t[3].n_fired, OP_EQ, 1);
+  tt_int_op(timer_wheel_advance(wheel, 15, test_timer_cb, NULL), OP_EQ, 0);
+  tt_int_op(timer_wheel_advance(wheel, 16, test_timer_cb, NULL), OP_EQ, 1);
+  tt_int_op(t[2].n_fired, OP_EQ, 1);
+
+  tt_int_op(timer_wheel_advance(wheel, 20, test_timer_cb, NULL), OP_EQ, 2);
+  tt_int_op(t[0].n_fired + t[1].n_fired, OP_EQ, 2);
+
+  /* A callback can cancel a timer that is due at the same time. */
+  timer_wheel_schedule(wheel, &t[0].timer, 30);
+  timer_wheel_schedule(wheel, &t[1].timer, 30);
+  cb_pair[0] = &t[0];
+  cb_pair[1] = &t[1];
+  tt_int_op(timer_wheel_advance(wheel, 30, test_timer_cb, NULL), OP_EQ, 1);
+  tt_int_op(t[0].n_fired + t[1].n_fired, OP_EQ, 3);
+  tt_int_op(timer_wheel_get_n_timers(wheel), OP_EQ, 0);
+  cb_pair[0] = cb_pair[1] = NULL;
+
+  /* A callback can reschedule its own timer. */
+  cb_reschedule = 100;
+  timer_wheel_schedule(wheel, &t[3].timer, 40);
+  tt_int_op(timer_wheel_advance(wheel, 40, test_timer_cb, NULL), OP_EQ, 1);
+  tt_assert(wheel_timer_is_scheduled(&t[3].timer));
+  tt_int_op(timer_wheel_advance(wheel, 139, test_timer_cb, NULL), OP_EQ, 0);
+  tt_int_op(timer_wheel_advance(wheel, 140, test_timer_cb, NULL), OP_EQ, 1);
+  tt_int_op(t[3].n_fired, OP_EQ, 3);
+  tt_u64_op(t[3].fired_at, OP_EQ, 140);
+
+ done:
+  cb_pair[0] = cb_pair[1] = NULL;
+  cb_reschedule = 0;
+  timer_wheel_free(wheel);
+}
+
+static void
+test_timers_clock_jump(void *arg)
+{
+  timer_wheel_t *wheel = NULL;
+  test_timer_t t[2];
+  (void)arg;
+
+  memset(t, 0, sizeof(t));
+  wheel = cb_wheel = timer_wheel_new(100000);
+  cb_pair[0] = cb_pair[1] = NULL;
+  cb_reschedule = 0;
+
+  timer_wheel_schedule(wheel, &t[0].timer, 100010);
+  timer_wheel_schedule(wheel, &t[1].timer, 190000);
+
+  /* Going backwards keeps each timer as far away as it was. */
+  tt_int_op(timer_wheel_advance(wheel, 5000, test_timer_cb, NULL), OP_EQ, 0);
+  tt_u64_op(timer_wheel_get_now(wheel), OP_EQ, 5000);
+  tt_int_op(timer_wheel_advance(wheel, 5009, test_timer_cb, NULL), OP_EQ, 0);
+  tt_int_op(timer_wheel_advance(wheel, 5010, test_timer_cb, NULL), OP_EQ, 1);
+  tt_int_op(t[0].n_fired, OP_EQ, 1);
+
+  /* A long jump forward fires everything that is due. */
+  tt_int_op(timer_wheel_advance(wheel, 1000000000, test_timer_cb, NULL),
+            OP_EQ, 1);
+  tt_int_op(t[1].n_fired, OP_EQ, 1);
+  tt_int_op(timer_wheel_get_n_timers(wheel), OP_EQ, 0);
+
+ done:
+  timer_wheel_free(wheel);
+}
+
+#define TIMERS_TEST(name)                                         \
+  { #name, test_timers_ ## name, 0, NULL, NULL }
+
+struct testcase_t timers_tests[] = {
+  TIMERS_TEST(basic),
+  TIMERS_TEST(cancel),
+  TIMERS_TEST(clock_jump),
+  END_OF_TESTCASES
+};
+
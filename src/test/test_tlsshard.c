@@ -0,0 +1,265 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define CONNECTION_PRIVATE
+#define TLSSHARD_PRIVATE
+#include "orconfig.h"
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+#include "or.h"
+#include "buffers.h"
+#include "config.h"
+#include "compat_libevent.h"
+#include "connection.h"
+#include "main.h"
+#include "tlsshard.h"
+#include "test.h"
+
+/** How many connections the tests below use. */
+#define N_TEST_CONNS 12
+
+/** The connections that the tests below use. */
+static or_connection_t *test_conns[N_TEST_CONNS];
+/** For each of test_conns, the thread that last ran a job for it. */
+static unsigned long job_thread[N_TEST_CONNS];
+/** For each of test_conns, how many jobs have been run for it. */
+static int n_jobs_run[N_TEST_CONNS];
+/** For each of test_conns, how many replies we've had for it. */
+static int n_replies[N_TEST_CONNS];
+/** For each of test_conns, whether we'd stopped watching it for events when
+ * its last reply came. */
+static int suspended_at_reply[N_TEST_CONNS];
+
+/** Return the index of <b>or_conn</b> in test_conns. */
+static int
+test_conn_idx(const or_connection_t *or_conn)
+{
+  int i;
+  for (i = 0; i < N_TEST_CONNS; ++i) {
+    if (test_conns[i] == or_conn)
+      return i;
+  }
+  tor_assert(0);
+  return -1;
+}
+
+/** Mock for tls_shard_run_job(): pretend to read a few bytes and to write
+ * everything that we may, noting which thread we're on. */
+static void
+mock_tls_shard_run_job(tls_shard_job_t *job)
+{
+  const int i = test_conn_idx(job->conn);
+  job_thread[i] = tor_get_thread_id();
+  ++n_jobs_run[i];
+
+  if (job->read_mem) {
+    tor_assert(job->read_max >= 10);
+    memset(job->read_mem, 'a' + i, 10);
+    job->n_read = 10;
+    job->read_result = 10;
+  }
+  if (job->n_write_chunks) {
+    job->n_written = MIN(job->write_max, job->write_len);
+    job->n_records_written = 1;
+    job->write_result = (int)job->n_written;
+  }
+}
+
+/** Reply function for tls_shards_run_batch(): note the reply. */
+static void
+test_tlsshard_reply(connection_t *conn)
+{
+  const int i = test_conn_idx(TO_OR_CONN(conn));
+  ++n_replies[i];
+  suspended_at_reply[i] = TO_OR_CONN(conn)->tls_shard_suspended;
+  tor_assert(!TO_OR_CONN(conn)->tls_shard_job);
+}
+
+/** Mock for connection_{start,stop}_{reading,writing}(): our connections
+ * have no events to watch. */
+static void
+mock_connection_events(connection_t *conn)
+{
+  (void)conn;
+}
+
+static void
+test_tlsshard_batch(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  const int old_n_threads = options->NumTLSThreads;
+  smartlist_t *conns = smartlist_new();
+  unsigned long shard_thread[4];
+  char data[10], expected[10];
+  int i, round, n_threads_seen = 0;
+  tor_libevent_cfg cfg;
+  (void)arg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  MOCK(tls_shard_run_job, mock_tls_shard_run_job);
+  MOCK(connection_start_reading, mock_connection_events);
+  MOCK(connection_stop_reading, mock_connection_events);
+  MOCK(connection_start_writing, mock_connection_events);
+  MOCK(connection_stop_writing, mock_connection_events);
+  options->NumTLSThreads = 3;
+  memset(test_conns, 0, sizeof(test_conns));
+  memset(n_jobs_run, 0, sizeof(n_jobs_run));
+  memset(n_replies, 0, sizeof(n_replies));
+
+  for (i = 0; i < N_TEST_CONNS; ++i) {
+    or_connection_t *or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+    or_conn->base_.state = OR_CONN_STATE_OPEN;
+    /* The mock never looks at this. */
+    or_conn->tls = (tor_tls_t *)or_conn;
+    connection_bucket_catch_up(or_conn);
+    or_conn->read_bucket = or_conn->write_bucket = 1<<20;
+    test_conns[i] = or_conn;
+  }
+
+  tt_int_op(tls_shards_get_n(), OP_EQ, 4);
+
+  /* Each connection stays on the same thread from one batch to the next. */
+  memset(shard_thread, 0, sizeof(shard_thread));
+  for (round = 0; round < 2; ++round) {
+    smartlist_clear(conns);
+    for (i = 0; i < N_TEST_CONNS; ++i) {
+      connection_t *conn = TO_CONN(test_conns[i]);
+      test_conns[i]->tls_shard_wants_read = (i % 3 != 1);
+      test_conns[i]->tls_shard_wants_write = (i % 3 != 0);
+      if (test_conns[i]->tls_shard_wants_write) {
+        write_to_buf("0123456789", 10, conn->outbuf);
+        conn->outbuf_flushlen += 10;
+      }
+      smartlist_add(conns, conn);
+    }
+    /* A connection that is marked for close gets nothing done. */
+    TO_CONN(test_conns[5])->marked_for_close = 1;
+
+    tls_shards_run_batch(conns, test_tlsshard_reply);
+
+    /* The main thread's own shard is done, and so is every connection
+     * that had nothing to do.  The others are still in flight, and nothing
+     * is on their inbufs yet. */
+    for (i = 0; i < N_TEST_CONNS; ++i) {
+      connection_t *conn = TO_CONN(test_conns[i]);
+      const int shard = (int)(conn->global_identifier % 4);
+      if (shard == 0 || i == 5) {
+        tt_int_op(n_replies[i], OP_EQ, round + 1);
+        tt_assert(!test_conns[i]->tls_shard_job);
+      } else {
+        tt_int_op(n_replies[i], OP_EQ, round);
+        tt_assert(test_conns[i]->tls_shard_job);
+        tt_assert(test_conns[i]->tls_shard_suspended);
+      }
+    }
+
+    if (round == 0) {
+      /* Wait for the shard threads, and take their replies as the main
+       * loop would. */
+      for (i = 0; i < N_TEST_CONNS; ++i)
+        tls_shards_wait_for_conn(test_conns[i]);
+      tls_shards_handle_replies();
+    } else {
+      /* Let the shard threads wake up the main loop. */
+      int n_loops = 0, n_waiting = N_TEST_CONNS;
+      while (n_waiting && n_loops++ < 100) {
+        event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE);
+        n_waiting = 0;
+        for (i = 0; i < N_TEST_CONNS; ++i)
+          n_waiting += (n_replies[i] == round);
+      }
+      tt_int_op(n_waiting, OP_EQ, 0);
+    }
+
+    for (i = 0; i < N_TEST_CONNS; ++i) {
+      or_connection_t *or_conn = test_conns[i];
+      connection_t *conn = TO_CONN(or_conn);
+      const int shard = (int)(conn->global_identifier % 4);
+      tt_int_op(n_replies[i], OP_EQ, round + 1);
+      tt_assert(!or_conn->tls_shard_job);
+      tt_assert(!suspended_at_reply[i]);
+      if (i == 5) {
+        tt_int_op(n_jobs_run[i], OP_EQ, 0);
+        tt_assert(!or_conn->has_tls_shard_read_result);
+        tt_assert(!or_conn->has_tls_shard_write_result);
+        tt_int_op(buf_datalen(conn->outbuf), OP_EQ, 10);
+        continue;
+      }
+      tt_int_op(n_jobs_run[i], OP_EQ, round + 1);
+
+      /* Every connection in a shard is handled by the same thread, and
+       * shard 0 is handled by the main thread. */
+      if (!shard_thread[shard])
+        shard_thread[shard] = job_thread[i];
+      tt_assert(shard_thread[shard] == job_thread[i]);
+      if (shard == 0)
+        tt_assert(job_thread[i] == tor_get_thread_id());
+
+      tt_int_op(or_conn->has_tls_shard_read_result, OP_EQ,
+                or_conn->tls_shard_wants_read);
+      if (or_conn->tls_shard_wants_read) {
+        tt_int_op(or_conn->tls_shard_read_result, OP_EQ, 10);
+        tt_int_op(or_conn->tls_shard_n_read, OP_EQ, 10);
+        tt_int_op(buf_datalen(conn->inbuf), OP_EQ, 10);
+        fetch_from_buf(data, 10, conn->inbuf);
+        memset(expected, 'a' + i, 10);
+        tt_mem_op(data, OP_EQ, expected, 10);
+      } else {
+        tt_int_op(buf_datalen(conn->inbuf), OP_EQ, 0);
+      }
+
+      tt_int_op(or_conn->has_tls_shard_write_result, OP_EQ,
+                or_conn->tls_shard_wants_write);
+      if (or_conn->tls_shard_wants_write) {
+        tt_int_op(or_conn->tls_shard_write_result, OP_EQ, 10);
+        tt_int_op(or_conn->tls_shard_n_written, OP_EQ, 10);
+      }
+      tt_int_op(buf_datalen(conn->outbuf), OP_EQ, 0);
+      tt_int_op(conn->outbuf_flushlen, OP_EQ, 0);
+
+      or_conn->has_tls_shard_read_result = 0;
+      or_conn->has_tls_shard_write_result = 0;
+    }
+    TO_CONN(test_conns[5])->marked_for_close = 0;
+    buf_clear(TO_CONN(test_conns[5])->outbuf);
+    TO_CONN(test_conns[5])->outbuf_flushlen = 0;
+
+    if (round == 0) {
+      for (i = 0; i < 4; ++i) {
+        int j, seen = 0;
+        for (j = 0; j < i; ++j)
+          seen |= (shard_thread[j] == shard_thread[i]);
+        if (shard_thread[i] && !seen)
+          ++n_threads_seen;
+      }
+      tt_int_op(n_threads_seen, OP_EQ, 4);
+    }
+  }
+
+ done:
+  UNMOCK(tls_shard_run_job);
+  UNMOCK(connection_start_reading);
+  UNMOCK(connection_stop_reading);
+  UNMOCK(connection_start_writing);
+  UNMOCK(connection_stop_writing);
+  options->NumTLSThreads = old_n_threads;
+  smartlist_free(conns);
+  for (i = 0; i < N_TEST_CONNS; ++i) {
+    if (test_conns[i]) {
+      test_conns[i]->tls = NULL;
+      TO_CONN(test_conns[i])->marked_for_close = 0;
+      connection_free_(TO_CONN(test_conns[i]));
+      test_conns[i] = NULL;
+    }
+  }
+}
+
+struct testcase_t tlsshard_tests[] = {
+  { "batch", test_tlsshard_batch, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
@@ -0,0 +1,236 @@
+/* Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+#include "or.h"
+#include "workqueue.h"
+#include "test.h"
+
+/** State for each worker thread in these tests. */
+typedef struct wq_test_state_t {
+  int generation;
+} wq_test_state_t;
+
+/** A single item of work for these tests. */
+typedef struct wq_test_job_t {
+  int input;
+  int output;
+  int generation_seen;
+} wq_test_job_t;
+
+/** Number of replies handled in the main thread. */
+static int wq_n_replies = 0;
+/** Sum of the outputs of every reply handled in the main thread. */
+static int wq_sum = 0;
+/** Generation reported by the last reply handled in the main thread. */
+static int wq_last_generation = -1;
+/** Lock held by the main thread to keep a worker busy in a blocking job. */
+static tor_mutex_t *wq_block_lock = NULL;
+
+static void *
+wq_new_state(void *arg)
+{
+  (void)arg;
+  return tor_malloc_zero(sizeof(wq_test_state_t));
+}
+
+static void
+wq_free_state(void *arg)
+{
+  tor_free(arg);
+}
+
+static int
+wq_square_threadfn(void *state_, void *job_)
+{
+  wq_test_state_t *state = state_;
+  wq_test_job_t *job = job_;
+  job->output = job->input * job->input;
+  job->generation_seen = state->generation;
+  return WQ_RPL_REPLY;
+}
+
+static int
+wq_block_threadfn(void *state_, void *job_)
+{
+  (void)state_;
+  (void)job_;
+  tor_mutex_acquire(wq_block_lock);
+  tor_mutex_release(wq_block_lock);
+  return WQ_RPL_REPLY;
+}
+
+static void
+wq_replyfn(void *job_)
+{
+  wq_test_job_t *job = job_;
+  ++wq_n_replies;
+  wq_sum += job->output;
+  wq_last_generation = job->generation_seen;
+  tor_free(job);
+}
+
+static void *
+wq_dup_update(void *arg)
+{
+  int *generation = tor_malloc(sizeof(int));
+  *generation = *(int*)arg;
+  return generation;
+}
+
+static int
+wq_update_threadfn(void *state_, void *arg)
+{
+  wq_test_state_t *state = state_;
+  state->generation = *(int*)arg;
+  tor_free(arg);
+  return WQ_RPL_REPLY;
+}
+
+static void
+wq_free_update(void *arg)
+{
+  tor_free(arg);
+}
+
+/** Helper: call replyqueue_process() on <b>rq</b> until we've seen
+ * <b>n</b> replies in total, or until we give up. */
+static void
+wq_wait_for_replies(replyqueue_t *rq, int n)
+{
+  int tries;
+  for (tries = 0; tries < 1000 && wq_n_replies < n; ++tries) {
+    tor_sleep_msec(5);
+    replyqueue_process(rq);
+  }
+}
+
+static void
+wq_reset(void)
+{
+  wq_n_replies = wq_sum = 0;
+  wq_last_generation = -1;
+}
+
+static void
+test_workqueue_basic(void *arg)
+{
+  replyqueue_t *rq = NULL;
+  threadpool_t *tp = NULL;
+  int i, expected = 0;
+  (void)arg;
+
+  wq_reset();
+  rq = replyqueue_new(0);
+  tt_assert(rq);
+  tt_assert(SOCKET_OK(replyqueue_get_socket(rq)));
+  tp = threadpool_new(4, rq, wq_new_state, wq_free_state, NULL);
+  tt_assert(tp);
+  tt_int_op(threadpool_get_n_threads(tp), OP_EQ, 4);
+  tt_ptr_op(threadpool_get_replyqueue(tp), OP_EQ, rq);
+
+  for (i = 0; i < 200; ++i) {
+    wq_test_job_t *job = tor_malloc_zero(sizeof(wq_test_job_t));
+    job->input = i;
+    expected += i*i;
+    tt_assert(threadpool_queue_work(tp, wq_square_threadfn, wq_replyfn,
+                                    job));
+  }
+
+  wq_wait_for_replies(rq, 200);
+  tt_int_op(wq_n_replies, OP_EQ, 200);
+  tt_int_op(wq_sum, OP_EQ, expected);
+
+ done:
+  /* The threads keep running for the rest of the test process. */
+  ;
+}
+
+static void
+test_workqueue_cancel(void *arg)
+{
+  replyqueue_t *rq = NULL;
+  threadpool_t *tp = NULL;
+  workqueue_entry_t *ent;
+  wq_test_job_t *job, *cancelled;
+  int i;
+  (void)arg;
+
+  wq_reset();
+  wq_block_lock = tor_mutex_new();
+  rq = replyqueue_new(0);
+  tt_assert(rq);
+  tp = threadpool_new(1, rq, wq_new_state, wq_free_state, NULL);
+  tt_assert(tp);
+
+  /* Keep the only worker busy so that the next job stays pending. */
+  tor_mutex_acquire(wq_block_lock);
+  job = tor_malloc_zero(sizeof(wq_test_job_t));
+  tt_assert(threadpool_queue_work(tp, wq_block_threadfn, wq_replyfn, job));
+  for (i = 0; i < 10; ++i) {
+    job = tor_malloc_zero(sizeof(wq_test_job_t));
+    job->input = 3;
+    ent = threadpool_queue_work(tp, wq_square_threadfn, wq_replyfn, job);
+    tt_assert(ent);
+    tt_ptr_op(workqueue_entry_get_arg(ent), OP_EQ, job);
+    if (i % 2 == 0) {
+      cancelled = workqueue_entry_cancel(ent);
+      tt_ptr_op(cancelled, OP_EQ, job);
+      tor_free(cancelled);
+    }
+  }
+  tor_mutex_release(wq_block_lock);
+
+  wq_wait_for_replies(rq, 6);
+  tt_int_op(wq_n_replies, OP_EQ, 6);
+  tt_int_op(wq_sum, OP_EQ, 5*9);
+
+ done:
+  ;
+}
+
+static void
+test_workqueue_update(void *arg)
+{
+  replyqueue_t *rq = NULL;
+  threadpool_t *tp = NULL;
+  wq_test_job_t *job;
+  int generation = 7;
+  int i;
+  (void)arg;
+
+  wq_reset();
+  rq = replyqueue_new(0);
+  tt_assert(rq);
+  tp = threadpool_new(3, rq, wq_new_state, wq_free_state, NULL);
+  tt_assert(tp);
+
+  tt_int_op(0, OP_EQ, threadpool_queue_update(tp, wq_dup_update,
+                                              wq_update_threadfn,
+                                              wq_free_update, &generation));
+  /* Every thread runs its update before taking any later work. */
+  for (i = 0; i < 30; ++i) {
+    job = tor_malloc_zero(sizeof(wq_test_job_t));
+    tt_assert(threadpool_queue_work(tp, wq_square_threadfn, wq_replyfn,
+                                    job));
+  }
+  wq_wait_for_replies(rq, 30);
+  tt_int_op(wq_n_replies, OP_EQ, 30);
+  tt_int_op(wq_last_generation, OP_EQ, 7);
+
+ done:
+  ;
+}
+
+#define WQ_TEST(name)                                         \
+  { #name, test_workqueue_ ## name, TT_FORK, NULL, NULL }
+
+struct testcase_t workqueue_tests[] = {
+  WQ_TEST(basic),
+  WQ_TEST(cancel),
+  WQ_TEST(update),
+  END_OF_TESTCASES
+};
+